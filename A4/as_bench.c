@@ -0,0 +1,908 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_library.h"
+#include "as_crc.h"
+#include "as_pcm.h"
+
+#include <signal.h>
+#include <time.h>
+
+/*
+** Benchmarks for the audio stream server
+** --------------------------------------
+** list: LIST latency under mixed load. A number of streaming clients (each
+**       its own process) request the same file over and over, while one more
+**       client sends LIST requests back to back and times each response.
+**       Run it against the same library with each server mode, e.g.
+**           as_server -m fork       vs.     as_server -m threads
+**       and compare the printed percentiles.
+** scan: library walk time. Builds a synthetic library of -n empty .wav
+**       files (BENCH_SCAN_FILES_PER_DIR per directory, two levels deep)
+**       under -l, unless it is there from an earlier run, and times
+**       walk_library on it with one thread and with -t threads: cold (the
+**       kernel's caches dropped first, which needs root) and warm.
+**           as_bench -n 100000 scan          as_bench -n 1000000 scan
+** tcp:  effect of the server's TCP profile. Times STREAM requests for file
+**       -f back to back (time to the first byte of the body, and throughput),
+**       then pairs of pipelined LIST requests, on one connection. Compare
+**           as_server -T default     vs.     as_server -T tuned
+** crc:  cost of the integrity trailer. Two connections, one of which agreed
+**       to PROTOCOL_FEATURE_TRAILER, take turns asking for file -f: whole
+**       (its checksum is known once it has been sent), then from byte 1 on
+**       (hashed as it is sent), and the throughputs are compared. Only the
+**       first response of each kind is checked against its trailer, so the
+**       numbers are the server's cost. Try it with every -t of as_server.
+** pcm:  cost and gain of the lossless transport encoding, on its own (no
+**       server). Encodes WAV file -w (or BENCH_PCM_SECONDS of a synthetic
+**       16-bit stereo one) block by block as the server would, decodes it
+**       again as the client would, checks the result is the very same file,
+**       and prints the bandwidth saved and how fast each side goes. The
+**       encoding pays off on any link slower than the slower side.
+**           as_bench -w library/wav/ac-guitar.wav pcm
+*/
+
+#define BENCH_DEFAULT_STREAMERS 8
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_WARMUP_USEC 500000
+#define BENCH_BUFFER_SIZE 65536
+#define BENCH_SCAN_DIR "/tmp/as_bench_library"
+#define BENCH_SCAN_FILES 100000
+#define BENCH_SCAN_FILES_PER_DIR 100
+#define BENCH_SCAN_WARM_RUNS 3
+#define BENCH_HELLO_TRAILER REQUEST_HELLO " 2 " PROTOCOL_FEATURE_TRAILER END_OF_MESSAGE_TOKEN
+#define BENCH_HELLO_PLAIN REQUEST_HELLO " 2" END_OF_MESSAGE_TOKEN
+#define BENCH_PCM_SECONDS 60
+#define BENCH_PCM_RATE 44100
+
+
+static double _now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+static int _connect(const char *hostname, int port) {
+    struct hostent *hp = gethostbyname(hostname);
+    if (hp == NULL) {
+        ERR_PRINT("Unknown host: %s\n", hostname);
+        return -1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("as_bench: socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = *((struct in_addr *) hp->h_addr);
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("as_bench: connect");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+/*
+** Send one STREAM request and throw the response away.
+** returns the number of body bytes received, -1 on error
+*/
+static int64_t _stream_once(int sockfd, uint32_t file_index) {
+    static uint8_t buffer[BENCH_BUFFER_SIZE];
+
+    char *request = REQUEST_STREAM END_OF_MESSAGE_TOKEN;
+    uint32_t file_index_nbo = htonl(file_index);
+    if (write_precisely(sockfd, request, strlen(request)) < 0 ||
+        write_precisely(sockfd, &file_index_nbo, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+
+    uint32_t file_size_nbo;
+    if (read_precisely(sockfd, &file_size_nbo, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    int64_t remaining = ntohl(file_size_nbo);
+    int64_t total = remaining;
+    while (remaining > 0) {
+        ssize_t num = read(sockfd, buffer, MIN(remaining, BENCH_BUFFER_SIZE));
+        if (num <= 0) {
+            return -1;
+        }
+        remaining -= num;
+    }
+    return total;
+}
+
+
+/*
+** Read the whole response to a LIST request.
+** returns the number of files listed, -1 on error
+*/
+static int _read_list(int sockfd) {
+    static char buf[RESPONSE_BUFFER_SIZE];
+    static int bytes_in_buf = 0;
+
+    int num_files = -1;
+    int lines_read = 0;
+    while (num_files < 0 || lines_read < num_files) {
+        char *line = find_network_newline(buf, &bytes_in_buf);
+        if (line == NULL) {
+            int num = read(sockfd, buf + bytes_in_buf, RESPONSE_BUFFER_SIZE - bytes_in_buf);
+            if (num <= 0) {
+                ERR_PRINT("as_bench: LIST response ended early\n");
+                return -1;
+            }
+            bytes_in_buf += num;
+            continue;
+        }
+        // The first entry has the highest index
+        if (num_files < 0) {
+            num_files = strtol(line, NULL, 10) + 1;
+        }
+        lines_read++;
+        free(line);
+    }
+    return num_files;
+}
+
+
+/*
+** Send count (1 or 2) LIST requests at once and read their responses.
+** returns 0 on success, -1 on error
+*/
+static int _list_once(int sockfd, int count) {
+    char requests[2 * sizeof(REQUEST_LIST END_OF_MESSAGE_TOKEN)];
+    size_t len = strlen(REQUEST_LIST END_OF_MESSAGE_TOKEN);
+    for (int i = 0; i < count; i++) {
+        memcpy(requests + i * len, REQUEST_LIST END_OF_MESSAGE_TOKEN, len);
+    }
+    if (write_precisely(sockfd, requests, count * len) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (_read_list(sockfd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void _run_streamer(const char *hostname, int port, uint32_t file_index) {
+    int sockfd = _connect(hostname, port);
+    if (sockfd < 0) {
+        exit(1);
+    }
+    while (_stream_once(sockfd, file_index) >= 0);
+    exit(0);
+}
+
+
+static int _compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double _percentile(const double *sorted, int count, double p) {
+    int i = (int)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+
+/*
+** Sort the count values and print their mean and percentiles.
+*/
+static void _print_percentiles(double *values, int count) {
+    qsort(values, count, sizeof(double), _compare_doubles);
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    printf("  mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+           sum / count, _percentile(values, count, 50),
+           _percentile(values, count, 90), _percentile(values, count, 99),
+           values[count - 1]);
+}
+
+
+static int bench_list_latency(const char *hostname, int port, int num_streamers,
+                              uint32_t file_index, int seconds) {
+    pid_t *streamers = (pid_t *)malloc(num_streamers * sizeof(pid_t));
+    if (streamers == NULL) {
+        perror("as_bench: malloc");
+        return -1;
+    }
+    fflush(stdout);
+    for (int i = 0; i < num_streamers; i++) {
+        streamers[i] = fork();
+        if (streamers[i] == -1) {
+            perror("as_bench: fork");
+            num_streamers = i;
+            break;
+        }
+        if (streamers[i] == 0) {
+            _run_streamer(hostname, port, file_index);
+        }
+    }
+    usleep(BENCH_WARMUP_USEC);
+
+    int result = 0;
+    int sockfd = _connect(hostname, port);
+    int capacity = 1024;
+    int count = 0;
+    double *latencies = (double *)malloc(capacity * sizeof(double));
+    if (sockfd < 0 || latencies == NULL) {
+        result = -1;
+        goto stop_streamers;
+    }
+
+    double end = _now_ms() + seconds * 1000.0;
+    while (_now_ms() < end) {
+        double start = _now_ms();
+        if (_list_once(sockfd, 1) < 0) {
+            result = -1;
+            break;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            latencies = (double *)realloc(latencies, capacity * sizeof(double));
+            if (latencies == NULL) {
+                perror("as_bench: realloc");
+                result = -1;
+                goto stop_streamers;
+            }
+        }
+        latencies[count++] = _now_ms() - start;
+    }
+    close(sockfd);
+
+    if (count > 0) {
+        printf("LIST latency with %d streamers on file %u, %d requests (ms):\n",
+               num_streamers, file_index, count);
+        _print_percentiles(latencies, count);
+    }
+
+stop_streamers:
+    free(latencies);
+    for (int i = 0; i < num_streamers; i++) {
+        kill(streamers[i], SIGTERM);
+        waitpid(streamers[i], NULL, 0);
+    }
+    free(streamers);
+    return result;
+}
+
+
+/*
+** Helper for: bench_tcp
+** Send one STREAM request and time the response: *first_ms until the first
+** byte of the body, *total_ms until the last.
+** returns the number of body bytes received, -1 on error
+*/
+static int64_t _time_stream(int sockfd, uint32_t file_index, double *first_ms,
+                            double *total_ms) {
+    static uint8_t buffer[BENCH_BUFFER_SIZE];
+
+    char request[sizeof(REQUEST_STREAM END_OF_MESSAGE_TOKEN) + sizeof(uint32_t)];
+    size_t len = strlen(REQUEST_STREAM END_OF_MESSAGE_TOKEN);
+    uint32_t file_index_nbo = htonl(file_index);
+    memcpy(request, REQUEST_STREAM END_OF_MESSAGE_TOKEN, len);
+    memcpy(request + len, &file_index_nbo, sizeof(uint32_t));
+
+    double start = _now_ms();
+    if (write_precisely(sockfd, request, len + sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    uint32_t file_size_nbo;
+    if (read_precisely(sockfd, &file_size_nbo, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    int64_t remaining = ntohl(file_size_nbo);
+    int64_t total = remaining;
+    *first_ms = 0;
+    while (remaining > 0) {
+        ssize_t num = read(sockfd, buffer, MIN(remaining, BENCH_BUFFER_SIZE));
+        if (num <= 0) {
+            return -1;
+        }
+        if (remaining == total) {
+            *first_ms = _now_ms() - start;
+        }
+        remaining -= num;
+    }
+    *total_ms = _now_ms() - start;
+    return total;
+}
+
+
+static int bench_tcp(const char *hostname, int port, uint32_t file_index, int seconds) {
+    int sockfd = _connect(hostname, port);
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    int capacity = 1024;
+    int count = 0;
+    double *first_byte = (double *)malloc(capacity * sizeof(double));
+    double *pairs = (double *)malloc(capacity * sizeof(double));
+    if (first_byte == NULL || pairs == NULL) {
+        perror("as_bench: malloc");
+        result = -1;
+        goto close_socket;
+    }
+
+    // 1. Time to first byte and throughput of STREAM
+    double bytes = 0, busy_ms = 0;
+    double end = _now_ms() + seconds * 1000.0 / 2;
+    while (_now_ms() < end && count < capacity) {
+        double total_ms;
+        int64_t received = _time_stream(sockfd, file_index, &first_byte[count], &total_ms);
+        if (received < 0) {
+            result = -1;
+            goto close_socket;
+        }
+        bytes += received;
+        busy_ms += total_ms;
+        count++;
+    }
+    if (count > 0) {
+        printf("STREAM of file %u, %d requests, time to first byte (ms):\n", file_index, count);
+        _print_percentiles(first_byte, count);
+        printf("  throughput %.1f MB/s\n", busy_ms > 0 ? bytes / 1000.0 / busy_ms : 0.0);
+    }
+
+    // 2. Two LIST requests at once, the second response is small and comes
+    //    right behind the first
+    int num_pairs = 0;
+    end = _now_ms() + seconds * 1000.0 / 2;
+    while (_now_ms() < end && num_pairs < capacity) {
+        double start = _now_ms();
+        if (_list_once(sockfd, 2) < 0) {
+            result = -1;
+            goto close_socket;
+        }
+        pairs[num_pairs++] = _now_ms() - start;
+    }
+    if (num_pairs > 0) {
+        printf("Two pipelined LIST requests, %d pairs (ms):\n", num_pairs);
+        _print_percentiles(pairs, num_pairs);
+    }
+
+close_socket:
+    free(first_byte);
+    free(pairs);
+    close(sockfd);
+    return result;
+}
+
+
+/*
+** Helper for: bench_crc
+** Open a connection speaking protocol version 2 (64-bit sizes), with or
+** without the integrity trailer.
+** returns the socket, -1 on error
+*/
+static int _connect_v2(const char *hostname, int port, int trailer) {
+    int sockfd = _connect(hostname, port);
+    if (sockfd < 0) {
+        return -1;
+    }
+    const char *hello = trailer ? BENCH_HELLO_TRAILER : BENCH_HELLO_PLAIN;
+    if (write_precisely(sockfd, hello, strlen(hello)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    char reply[HELLO_MESSAGE_SIZE];
+    int reply_len = 0;
+    while (reply_len < 2 || memcmp(reply + reply_len - 2, END_OF_MESSAGE_TOKEN, 2) != 0) {
+        if (reply_len == HELLO_MESSAGE_SIZE - 1 || read(sockfd, reply + reply_len, 1) != 1) {
+            ERR_PRINT("as_bench: no HELLO reply\n");
+            close(sockfd);
+            return -1;
+        }
+        reply_len++;
+    }
+    reply[reply_len] = '\0';
+    if (strncmp(reply, REQUEST_HELLO " 2", strlen(REQUEST_HELLO " 2")) != 0 ||
+        (trailer && strstr(reply, " " PROTOCOL_FEATURE_TRAILER) == NULL)) {
+        ERR_PRINT("as_bench: the server does not know the trailer\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+/*
+** Helper for: bench_crc
+** Send one STREAMRANGE request for file_index from offset to its end, and
+** receive the body, then its trailer if trailer is set. The body is hashed
+** and checked against the trailer if check is set.
+** returns the number of body bytes received, -1 on error or mismatch
+*/
+static int64_t _range_once(int sockfd, uint32_t file_index, uint64_t offset, int trailer,
+                           int check) {
+    static uint8_t buffer[BENCH_BUFFER_SIZE];
+
+    size_t len = strlen(REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN);
+    uint8_t request[sizeof(REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN) + STREAM_RANGE_ARGS_SIZE];
+    uint32_t file_index_nbo = htonl(file_index);
+    uint64_t offset_nbo = htobe64(offset);
+    uint64_t length_nbo = htobe64(STREAM_RANGE_TO_END);
+    memcpy(request, REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN, len);
+    memcpy(request + len, &file_index_nbo, sizeof(uint32_t));
+    memcpy(request + len + sizeof(uint32_t), &offset_nbo, sizeof(uint64_t));
+    memcpy(request + len + sizeof(uint32_t) + sizeof(uint64_t), &length_nbo, sizeof(uint64_t));
+    if (write_precisely(sockfd, request, len + STREAM_RANGE_ARGS_SIZE) < 0) {
+        return -1;
+    }
+
+    uint64_t size_nbo;
+    if (read_precisely(sockfd, &size_nbo, sizeof(uint64_t)) < 0) {
+        return -1;
+    }
+    int64_t remaining = be64toh(size_nbo);
+    int64_t total = remaining;
+    uint32_t crc = 0;
+    while (remaining > 0) {
+        ssize_t num = read(sockfd, buffer, MIN(remaining, BENCH_BUFFER_SIZE));
+        if (num <= 0) {
+            return -1;
+        }
+        if (check) {
+            crc = crc32c(crc, buffer, num);
+        }
+        remaining -= num;
+    }
+
+    uint32_t trailer_nbo;
+    if (trailer && read_precisely(sockfd, &trailer_nbo, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    if (trailer && check && ntohl(trailer_nbo) != crc) {
+        ERR_PRINT("as_bench: trailer %08x, body hashes to %08x\n", ntohl(trailer_nbo), crc);
+        return -1;
+    }
+    return total;
+}
+
+
+static int bench_crc(const char *hostname, int port, uint32_t file_index, int seconds) {
+    int sockfds[2] = {_connect_v2(hostname, port, 0), _connect_v2(hostname, port, 1)};
+    int result = 0;
+    if (sockfds[0] < 0 || sockfds[1] < 0) {
+        result = -1;
+        goto close_sockets;
+    }
+    printf("CRC32C kernel on this host: %s\n", crc32c_kernel());
+
+    // Whole file first, then a range that is not
+    const uint64_t offsets[2] = {0, 1};
+    for (int kind = 0; kind < 2; kind++) {
+        double bytes[2] = {0, 0};
+        double busy_ms[2] = {0, 0};
+        int count = 0;
+        double end = _now_ms() + seconds * 1000.0 / 2;
+        // Taking turns, so both see the same page cache and load
+        while (_now_ms() < end) {
+            for (int trailer = 0; trailer < 2; trailer++) {
+                double start = _now_ms();
+                int64_t received = _range_once(sockfds[trailer], file_index, offsets[kind],
+                                               trailer, count == 0);
+                if (received < 0) {
+                    result = -1;
+                    goto close_sockets;
+                }
+                // The first round warms the page cache (and the checksum table)
+                if (count > 0) {
+                    busy_ms[trailer] += _now_ms() - start;
+                    bytes[trailer] += received;
+                }
+            }
+            count++;
+        }
+
+        double plain = busy_ms[0] > 0 ? bytes[0] / 1000.0 / busy_ms[0] : 0.0;
+        double trailed = busy_ms[1] > 0 ? bytes[1] / 1000.0 / busy_ms[1] : 0.0;
+        printf("STREAMRANGE of file %u from byte %lu, %d requests each:\n", file_index,
+               (unsigned long)offsets[kind], count);
+        printf("  without trailer %.1f MB/s  with trailer %.1f MB/s  overhead %.1f%%\n",
+               plain, trailed, plain > 0 ? (plain - trailed) * 100.0 / plain : 0.0);
+    }
+
+close_sockets:
+    for (int i = 0; i < 2; i++) {
+        if (sockfds[i] >= 0) {
+            close(sockfds[i]);
+        }
+    }
+    return result;
+}
+
+
+/*
+** Helper for: bench_pcm
+** returns a temporary 16-bit stereo WAV file of BENCH_PCM_SECONDS of two
+** tones and a little noise, NULL on error
+*/
+static FILE *_synthetic_wav(void) {
+    uint32_t frames = BENCH_PCM_SECONDS * BENCH_PCM_RATE;
+    uint32_t data_len = frames * 2 * sizeof(int16_t);
+    uint8_t header[44] = "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x02\0"
+                         "\x44\xAC\0\0\x10\xB1\x02\0\x04\0\x10\0data";
+    uint32_t riff_len = htole32(sizeof(header) - 8 + data_len);
+    uint32_t data_len_le = htole32(data_len);
+    memcpy(header + 4, &riff_len, sizeof(uint32_t));
+    memcpy(header + 40, &data_len_le, sizeof(uint32_t));
+
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        perror("as_bench: tmpfile");
+        return NULL;
+    }
+    fwrite(header, sizeof(header), 1, file);
+
+    // Two sine oscillators (440 Hz and 1250 Hz), stepped by rotation
+    const double steps[2] = {2 * 3.14159265358979 * 440 / BENCH_PCM_RATE,
+                             2 * 3.14159265358979 * 1250 / BENCH_PCM_RATE};
+    double cosines[2], sines[2], x[2] = {1, 1}, y[2] = {0, 0};
+    for (int k = 0; k < 2; k++) {
+        double w = steps[k];
+        cosines[k] = 1 - w * w / 2 + w * w * w * w / 24;
+        sines[k] = w - w * w * w / 6 + w * w * w * w * w / 120;
+    }
+    uint32_t noise = 1;
+    for (uint32_t i = 0; i < frames; i++) {
+        for (int k = 0; k < 2; k++) {
+            double next_x = x[k] * cosines[k] - y[k] * sines[k];
+            y[k] = x[k] * sines[k] + y[k] * cosines[k];
+            x[k] = next_x;
+        }
+        int16_t samples[2];
+        for (int channel = 0; channel < 2; channel++) {
+            noise = noise * 1664525 + 1013904223;
+            int32_t dither = (int32_t)(noise >> 24) - 128;
+            samples[channel] = htole16((int16_t)(9000 * y[0] + 4000 * (channel ? x[1] : y[1]) +
+                                                 dither / 4));
+        }
+        fwrite(samples, sizeof(samples), 1, file);
+    }
+    if (fflush(file) != 0) {
+        perror("as_bench: fwrite");
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+
+static int bench_pcm(const char *path, int seconds) {
+    FILE *file = path != NULL ? fopen(path, "r") : _synthetic_wav();
+    if (file == NULL) {
+        if (path != NULL) {
+            perror("as_bench: fopen");
+        }
+        return -1;
+    }
+    struct stat st;
+    PcmFormat format;
+    if (fstat(fileno(file), &st) < 0 || pcm_probe(fileno(file), st.st_size, &format) < 0) {
+        ERR_PRINT("as_bench: %s is not a WAV file the encoding knows\n",
+                  path != NULL ? path : "the synthetic file");
+        fclose(file);
+        return -1;
+    }
+
+    // The file, its frames (each behind its length), and the file decoded
+    // again
+    uint64_t num_blocks = 0;
+    for (uint64_t offset = 0; offset < format.size; num_blocks++) {
+        int samples;
+        offset += pcm_block(&format, offset, &samples);
+    }
+    uint64_t encoded_max = format.size + num_blocks * (sizeof(uint32_t) + 1);
+    uint8_t *data = (uint8_t *)malloc(format.size);
+    uint8_t *encoded = (uint8_t *)malloc(encoded_max);
+    uint8_t *decoded = (uint8_t *)malloc(format.size + PCM_BLOCK_MAX);
+    int result = -1;
+    if (data == NULL || encoded == NULL || decoded == NULL) {
+        perror("as_bench: malloc");
+        goto free_buffers;
+    }
+    if (pread(fileno(file), data, format.size, 0) != (ssize_t)format.size) {
+        perror("as_bench: pread");
+        goto free_buffers;
+    }
+
+    double encode_ms = 0, decode_ms = 0;
+    uint64_t encoded_len = 0;
+    int rounds = 0;
+    double end = _now_ms() + seconds * 1000.0;
+    do {
+        double start = _now_ms();
+        encoded_len = 0;
+        for (uint64_t offset = 0; offset < format.size;) {
+            int samples;
+            size_t len = pcm_block(&format, offset, &samples);
+            uint32_t frame_len = pcm_encode(&format, data + offset, len, samples,
+                                            encoded + encoded_len + sizeof(uint32_t));
+            memcpy(encoded + encoded_len, &frame_len, sizeof(uint32_t));
+            encoded_len += sizeof(uint32_t) + frame_len;
+            offset += len;
+        }
+        double middle = _now_ms();
+        uint64_t decoded_len = 0;
+        for (uint64_t pos = 0; pos < encoded_len;) {
+            uint32_t frame_len;
+            memcpy(&frame_len, encoded + pos, sizeof(uint32_t));
+            ssize_t len = pcm_decode(encoded + pos + sizeof(uint32_t), frame_len,
+                                     decoded + decoded_len);
+            if (len < 0 || decoded_len + len > format.size) {
+                ERR_PRINT("as_bench: a frame did not decode\n");
+                goto free_buffers;
+            }
+            decoded_len += len;
+            pos += sizeof(uint32_t) + frame_len;
+        }
+        encode_ms += middle - start;
+        decode_ms += _now_ms() - middle;
+        if (rounds == 0 && (decoded_len != format.size ||
+                            memcmp(decoded, data, format.size) != 0)) {
+            ERR_PRINT("as_bench: the decoded file differs from the original\n");
+            goto free_buffers;
+        }
+        rounds++;
+    } while (_now_ms() < end);
+
+    // With the size marker, the file's size and the closing empty frame
+    uint64_t wire = 2 * sizeof(uint64_t) + encoded_len + sizeof(uint32_t);
+    double encode_rate = format.size * rounds / 1000.0 / encode_ms;
+    double decode_rate = format.size * rounds / 1000.0 / decode_ms;
+    double codec_rate = MIN(encode_rate, decode_rate);
+    printf("%s: %d channels, %d-bit, %lu bytes\n", path != NULL ? path : "Synthetic tones",
+           format.channels, 8 * format.bytes_per_sample, (unsigned long)format.size);
+    printf("  encoded to %lu bytes (%.1f%%), %.1f%% of the bandwidth saved\n",
+           (unsigned long)wire, wire * 100.0 / format.size, 100.0 - wire * 100.0 / format.size);
+    printf("  encode %.1f MB/s  decode %.1f MB/s  (%d rounds, identical)\n",
+           encode_rate, decode_rate, rounds);
+    printf("  pays off on links slower than %.0f MB/s (%.0f Mbit/s)\n",
+           codec_rate, codec_rate * 8);
+    result = 0;
+
+free_buffers:
+    free(data);
+    free(encoded);
+    free(decoded);
+    fclose(file);
+    return result;
+}
+
+
+/*
+** Helpers for: bench_scan
+** Create count empty files under root, as "<top>/<dir>/<index>.wav".
+** returns 0 on success, -1 on error
+*/
+static int _make_tree(const char *root, uint32_t count) {
+    char path[MAX_PATH];
+    if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+        perror("as_bench: mkdir");
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t dir = i / BENCH_SCAN_FILES_PER_DIR;
+        if (i % BENCH_SCAN_FILES_PER_DIR == 0) {
+            if (snprintf(path, sizeof(path), "%s/%03u", root, dir / 100) >= sizeof(path)) {
+                goto too_long;
+            }
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                perror("as_bench: mkdir");
+                return -1;
+            }
+            if (snprintf(path, sizeof(path), "%s/%03u/%03u", root, dir / 100,
+                         dir % 100) >= sizeof(path)) {
+                goto too_long;
+            }
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                perror("as_bench: mkdir");
+                return -1;
+            }
+        }
+        if (snprintf(path, sizeof(path), "%s/%03u/%03u/%07u.wav", root, dir / 100,
+                     dir % 100, i) >= sizeof(path)) {
+            goto too_long;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            perror("as_bench: open");
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+
+too_long:
+    ERR_PRINT("as_bench: %s is too long for the scan tree's paths\n", root);
+    return -1;
+}
+
+
+static int _drop_caches(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = write(fd, "3", 1) == 1 ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+
+/*
+** returns the time one walk of root with num_threads took in ms, or -1
+*/
+static double _time_walk(const char *root, int num_threads, uint32_t *num_files) {
+    Library library = {"bench", root, NULL, 0};
+    double start = _now_ms();
+    int result = walk_library(&library, num_threads);
+    double elapsed = _now_ms() - start;
+    *num_files = library.num_files;
+    free_scanned_library(&library);
+    return result < 0 ? -1 : elapsed;
+}
+
+
+static int bench_scan(const char *directory, uint32_t num_files, int num_threads) {
+    char root[MAX_PATH];
+    snprintf(root, sizeof(root), "%s/%u", directory, num_files);
+    struct stat st;
+    if (stat(root, &st) < 0) {
+        if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+            perror("as_bench: mkdir");
+            return -1;
+        }
+        printf("Creating %u files in %s\n", num_files, root);
+        fflush(stdout);
+        if (_make_tree(root, num_files) < 0) {
+            return -1;
+        }
+    }
+
+    int can_drop = _drop_caches() == 0;
+    if (!can_drop) {
+        printf("Cannot drop the kernel's caches (not root?), cold is the first walk\n");
+    }
+    int thread_counts[] = {1, num_threads};
+    for (int k = 0; k < (num_threads > 1 ? 2 : 1); k++) {
+        uint32_t found;
+        if (can_drop) {
+            _drop_caches();
+        }
+        double cold = _time_walk(root, thread_counts[k], &found);
+        double best = cold, sum = 0;
+        for (int i = 0; i < BENCH_SCAN_WARM_RUNS && cold >= 0; i++) {
+            double warm = _time_walk(root, thread_counts[k], &found);
+            if (warm < 0) {
+                cold = -1;
+                break;
+            }
+            best = MIN(best, warm);
+            sum += warm;
+        }
+        if (cold < 0) {
+            ERR_PRINT("as_bench: could not walk %s\n", root);
+            return -1;
+        }
+        printf("walk of %u files with %d thread(s) (ms): cold %.1f  warm mean %.1f  best %.1f\n",
+               found, thread_counts[k], cold, sum / BENCH_SCAN_WARM_RUNS, best);
+    }
+    return 0;
+}
+
+
+static void print_usage() {
+    printf("Usage: as_bench [-h] [-a NETWORK_ADDRESS] [-p PORT] [-s STREAMERS]\n");
+    printf("                [-f FILE_INDEX] [-d SECONDS] [-l DIRECTORY] [-n FILES]\n");
+    printf("                [-t THREADS] [-w WAV_FILE] [list|scan|tcp|crc|pcm]\n");
+    printf("  -h: Print this help message\n");
+    printf("  -a NETWORK_ADDRESS: Server address (default 'localhost')\n");
+    printf("  -p  Server port (default: " XSTR(DEFAULT_PORT) ")\n");
+    printf("  -s  Number of streaming clients (default: " XSTR(BENCH_DEFAULT_STREAMERS) ")\n");
+    printf("  -f  Library index STREAM requests ask for (default: 0)\n");
+    printf("  -d  Seconds to measure for (default: " XSTR(BENCH_DEFAULT_SECONDS) ")\n");
+    printf("  -l  Where scan builds its libraries (default: " BENCH_SCAN_DIR ")\n");
+    printf("  -n  Number of files in the scan library (default: " XSTR(BENCH_SCAN_FILES) ")\n");
+    printf("  -t  Number of scan threads (default: " XSTR(LIBRARY_SCAN_THREADS) ")\n");
+    printf("  -w  WAV file pcm encodes (default: a synthetic one)\n");
+    printf("  list: LIST latency under streaming load (default)\n");
+    printf("  scan: cold and warm library walk times\n");
+    printf("  tcp:  STREAM time to first byte and throughput, pipelined LIST latency\n");
+    printf("  crc:  STREAMRANGE throughput with and without the integrity trailer\n");
+    printf("  pcm:  bandwidth saved by the transport encoding, and its speed\n");
+}
+
+
+int main(int argc, char * const *argv) {
+    int opt;
+    int port = DEFAULT_PORT;
+    const char *hostname = "localhost";
+    int num_streamers = BENCH_DEFAULT_STREAMERS;
+    uint32_t file_index = 0;
+    int seconds = BENCH_DEFAULT_SECONDS;
+    const char *scan_directory = BENCH_SCAN_DIR;
+    uint32_t scan_files = BENCH_SCAN_FILES;
+    int scan_threads = LIBRARY_SCAN_THREADS;
+    const char *wav_path = NULL;
+
+    while ((opt = getopt(argc, argv, "ha:p:s:f:d:l:n:t:w:")) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage();
+                return 0;
+            case 'a':
+                hostname = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                num_streamers = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                file_index = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                seconds = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                scan_directory = optarg;
+                break;
+            case 'n':
+                scan_files = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                scan_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                wav_path = optarg;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    const char *benchmark = optind < argc ? argv[optind] : "list";
+    if (strcmp(benchmark, "list") == 0) {
+        return bench_list_latency(hostname, port, num_streamers, file_index, seconds) < 0;
+    }
+    if (strcmp(benchmark, "tcp") == 0) {
+        return bench_tcp(hostname, port, file_index, seconds) < 0;
+    }
+    if (strcmp(benchmark, "crc") == 0) {
+        return bench_crc(hostname, port, file_index, seconds) < 0;
+    }
+    if (strcmp(benchmark, "pcm") == 0) {
+        return bench_pcm(wav_path, seconds) < 0;
+    }
+    if (strcmp(benchmark, "scan") == 0) {
+        return bench_scan(scan_directory, scan_files, scan_threads) < 0;
+    }
+
+    ERR_PRINT("Unknown benchmark: %s\n", benchmark);
+    print_usage();
+    return 1;
+}
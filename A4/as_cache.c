@@ -0,0 +1,634 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_cache.h"
+
+
+#define CACHE_NO_BLOCK -1
+
+typedef enum cache_entry_state {
+    CACHE_ENTRY_EMPTY,
+    CACHE_ENTRY_LOADING,
+    CACHE_ENTRY_READY,
+} CacheEntryState;
+
+
+/*
+** path, dev, ino, size, mtime_*: the key, a file is only a hit if all of
+** them match, so a file replaced under the same name is not one.
+** first_block: head of the entry's block chain.
+** refs: number of streams currently reading the entry, see CacheHold.
+** loader: the process reading a LOADING entry in.
+** hits, last_used: eviction statistics (last_used is a tick of cache->clock).
+*/
+typedef struct cache_entry {
+    char path[MAX_PATH];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    int32_t first_block;
+    uint32_t refs;
+    uint64_t hits;
+    uint64_t last_used;
+    pid_t loader;
+    CacheEntryState state;
+} CacheEntry;
+
+
+/*
+** The references one process holds on one entry, so that those of a process
+** that died can be dropped by cache_detach. A free hold has pid 0.
+*/
+typedef struct cache_hold {
+    pid_t pid;
+    int32_t entry;
+    uint32_t refs;
+} CacheHold;
+
+
+/*
+** Start of the shared mapping. It is followed by next_block[num_blocks]
+** (the chains and the free list) at next_offset, and the block data at
+** data_offset.
+*/
+typedef struct cache_header {
+    pthread_mutex_t lock;
+    CachePolicy policy;
+    size_t budget;
+    int32_t num_blocks;
+    int32_t free_list;
+    int32_t free_blocks;
+    uint64_t clock;
+    size_t next_offset;
+    size_t data_offset;
+    CacheEntry entries[CACHE_MAX_ENTRIES];
+    CacheHold holds[CACHE_MAX_HOLDS];
+} CacheHeader;
+
+
+/*
+** A LOADING entry for the loader thread to read in from fd, a duplicate of
+** the descriptor the miss was for.
+*/
+typedef struct cache_load {
+    int entry;
+    int fd;
+} CacheLoad;
+
+
+static CacheHeader *cache = NULL;
+static size_t cache_map_size = 0;
+
+// The loader thread of this process (if loader_pid is getpid()) and its queue
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_ready = PTHREAD_COND_INITIALIZER;
+static CacheLoad load_queue[CACHE_MAX_ENTRIES];
+static int load_head = 0;
+static int load_count = 0;
+static uint8_t load_stopping = 0;
+static pid_t loader_pid = 0;
+static pthread_t loader;
+static uint8_t loader_exit_hook = 0;
+
+
+static int32_t *_next_block(void) {
+    return (int32_t *)((uint8_t *)cache + cache->next_offset);
+}
+
+
+static uint8_t *_block_data(int32_t block) {
+    return (uint8_t *)cache + cache->data_offset + (size_t)block * CACHE_BLOCK_SIZE;
+}
+
+
+static void _lock(void) {
+    // A client handler may die while holding the lock, the bookkeeping it
+    // was doing is short enough that the state is still usable
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+
+static void _unlock(void) {
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+int cache_init(size_t budget_bytes, CachePolicy policy) {
+    int32_t num_blocks = budget_bytes / CACHE_BLOCK_SIZE;
+    if (num_blocks <= 0) {
+        ERR_PRINT("cache_init: budget must be at least %d bytes\n", CACHE_BLOCK_SIZE);
+        return -1;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t next_offset = sizeof(CacheHeader);
+    size_t data_offset = next_offset + num_blocks * sizeof(int32_t);
+    data_offset = (data_offset + page_size - 1) / page_size * page_size;
+    cache_map_size = data_offset + (size_t)num_blocks * CACHE_BLOCK_SIZE;
+
+    // Shared with every process forked after this point
+    cache = mmap(NULL, cache_map_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cache == MAP_FAILED) {
+        perror("cache_init: mmap");
+        cache = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache->policy = policy;
+    cache->budget = (size_t)num_blocks * CACHE_BLOCK_SIZE;
+    cache->num_blocks = num_blocks;
+    cache->next_offset = next_offset;
+    cache->data_offset = data_offset;
+    cache->clock = 0;
+
+    int32_t *next_block = _next_block();
+    for (int32_t i = 0; i < num_blocks; i++) {
+        next_block[i] = i + 1 < num_blocks ? i + 1 : CACHE_NO_BLOCK;
+    }
+    cache->free_list = 0;
+    cache->free_blocks = num_blocks;
+
+    printf("Hot-file cache of %zu bytes (%s eviction)\n", cache->budget,
+           policy == CACHE_LFU ? "LFU" : "LRU");
+    return 0;
+}
+
+
+/*
+** Helper for: cache_destroy, at exit
+** Let this process's loader thread finish the loads queued so far, so a
+** handler that is done does not leave them LOADING behind it.
+*/
+static void _stop_loader(void) {
+    if (loader_pid != getpid()) {
+        return;
+    }
+    pthread_mutex_lock(&load_lock);
+    load_stopping = 1;
+    pthread_cond_signal(&load_ready);
+    pthread_mutex_unlock(&load_lock);
+    pthread_join(loader, NULL);
+    loader_pid = 0;
+}
+
+
+void cache_destroy(void) {
+    _stop_loader();
+    if (cache != NULL) {
+        munmap(cache, cache_map_size);
+        cache = NULL;
+    }
+}
+
+
+int cache_enabled(void) {
+    return cache != NULL;
+}
+
+
+/*
+** Helpers for: cache_acquire
+** All of them expect the lock to be held.
+*/
+static void _free_entry(CacheEntry *entry) {
+    int32_t *next_block = _next_block();
+    int32_t block = entry->first_block;
+    while (block != CACHE_NO_BLOCK) {
+        int32_t next = next_block[block];
+        next_block[block] = cache->free_list;
+        cache->free_list = block;
+        cache->free_blocks++;
+        block = next;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->first_block = CACHE_NO_BLOCK;
+    entry->state = CACHE_ENTRY_EMPTY;
+}
+
+
+static int _is_victim_better(const CacheEntry *candidate, const CacheEntry *victim) {
+    if (victim == NULL) {
+        return 1;
+    }
+    if (cache->policy == CACHE_LFU && candidate->hits != victim->hits) {
+        return candidate->hits < victim->hits;
+    }
+    return candidate->last_used < victim->last_used;
+}
+
+
+/*
+** Free the unreferenced entry the policy likes least.
+** returns 0 if one was evicted, -1 if every entry is in use
+*/
+static int _evict_one(void) {
+    CacheEntry *victim = NULL;
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->state == CACHE_ENTRY_READY && entry->refs == 0 &&
+            _is_victim_better(entry, victim)) {
+            victim = entry;
+        }
+    }
+    if (victim == NULL) {
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Cache evicting %s\n", victim->path);
+    #endif
+    _free_entry(victim);
+    return 0;
+}
+
+
+static int _matches(const CacheEntry *entry, const struct stat *st) {
+    return entry->dev == st->st_dev &&
+           entry->ino == st->st_ino &&
+           entry->size == st->st_size &&
+           entry->mtime_sec == st->st_mtim.tv_sec &&
+           entry->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/*
+** Claim an entry for path and enough blocks for its data, evicting as needed.
+** returns the entry index (LOADING, by this process), or -1
+*/
+static int _reserve_entry(const char *path, const struct stat *st) {
+    int32_t blocks_needed = (st->st_size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    while (cache->free_blocks < blocks_needed) {
+        if (_evict_one() < 0) {
+            return -1;
+        }
+    }
+
+    int index = -1;
+    for (int i = 0; i < CACHE_MAX_ENTRIES && index < 0; i++) {
+        if (cache->entries[i].state == CACHE_ENTRY_EMPTY) {
+            index = i;
+        }
+    }
+    if (index < 0) {
+        if (_evict_one() < 0) {
+            return -1;
+        }
+        return _reserve_entry(path, st);
+    }
+
+    CacheEntry *entry = &cache->entries[index];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->path, path, MAX_PATH - 1);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->loader = getpid();
+    entry->state = CACHE_ENTRY_LOADING;
+
+    // Take the blocks off the free list, keeping their order
+    int32_t *next_block = _next_block();
+    entry->first_block = CACHE_NO_BLOCK;
+    int32_t *link = &entry->first_block;
+    for (int32_t i = 0; i < blocks_needed; i++) {
+        int32_t block = cache->free_list;
+        cache->free_list = next_block[block];
+        cache->free_blocks--;
+        next_block[block] = CACHE_NO_BLOCK;
+        *link = block;
+        link = &next_block[block];
+    }
+    return index;
+}
+
+
+/*
+** Find the hold of pid on entry, or a free one for it.
+** returns the hold, or NULL if the table is full
+*/
+static CacheHold *_find_hold(pid_t pid, int entry) {
+    CacheHold *free_hold = NULL;
+    for (int i = 0; i < CACHE_MAX_HOLDS; i++) {
+        CacheHold *hold = &cache->holds[i];
+        if (hold->pid == pid && hold->entry == entry) {
+            return hold;
+        }
+        if (hold->pid == 0 && free_hold == NULL) {
+            free_hold = hold;
+        }
+    }
+    if (free_hold != NULL) {
+        free_hold->pid = pid;
+        free_hold->entry = entry;
+        free_hold->refs = 0;
+    }
+    return free_hold;
+}
+
+
+/*
+** Read the file open as fd into a LOADING entry's blocks, without holding the
+** lock. A file that changed while it was read is not loaded.
+** returns 0 on success, -1 on error
+*/
+static int _load_entry(CacheEntry *entry, int fd) {
+    int32_t *next_block = _next_block();
+    uint64_t offset = 0;
+    for (int32_t block = entry->first_block; block != CACHE_NO_BLOCK;
+         block = next_block[block]) {
+        size_t len = MIN(CACHE_BLOCK_SIZE, entry->size - offset);
+        size_t filled = 0;
+        while (filled < len) {
+            ssize_t num = pread(fd, _block_data(block) + filled, len - filled,
+                                offset + filled);
+            if (num <= 0) {
+                if (num < 0 && errno == EINTR) {
+                    continue;
+                }
+                ERR_PRINT("cache_acquire: could not read %s\n", entry->path);
+                return -1;
+            }
+            filled += num;
+        }
+        offset += len;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !_matches(entry, &st)) {
+        ERR_PRINT("cache_acquire: %s changed while it was read\n", entry->path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _loader_main
+** Read in the LOADING entry index from fd, and make it READY.
+*/
+static void _finish_load(int index, int fd) {
+    CacheEntry *entry = &cache->entries[index];
+    int loaded = _load_entry(entry, fd);
+
+    _lock();
+    if (loaded < 0) {
+        _free_entry(entry);
+    } else {
+        entry->loader = 0;
+        entry->state = CACHE_ENTRY_READY;
+        entry->hits = 1;
+        entry->last_used = ++cache->clock;
+        #ifdef DEBUG
+        printf("Cached %s\n", entry->path);
+        #endif
+    }
+    _unlock();
+}
+
+
+static void *_loader_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&load_lock);
+    while (1) {
+        while (load_count == 0 && !load_stopping) {
+            pthread_cond_wait(&load_ready, &load_lock);
+        }
+        if (load_count == 0) {
+            break;
+        }
+        CacheLoad load = load_queue[load_head];
+        load_head = (load_head + 1) % CACHE_MAX_ENTRIES;
+        load_count--;
+        pthread_mutex_unlock(&load_lock);
+
+        _finish_load(load.entry, load.fd);
+        close(load.fd);
+        pthread_mutex_lock(&load_lock);
+    }
+    pthread_mutex_unlock(&load_lock);
+    return NULL;
+}
+
+
+/*
+** Helper for: cache_acquire
+** Start the loader thread of this process, unless it is running. A forked
+** process does not have its parent's, nor may it trust its queue's lock.
+** returns 0 on success, -1 on error
+*/
+static int _start_loader(void) {
+    if (loader_pid == getpid()) {
+        return 0;
+    }
+    pthread_mutex_init(&load_lock, NULL);
+    pthread_cond_init(&load_ready, NULL);
+    for (int i = 0; i < load_count; i++) {
+        close(load_queue[(load_head + i) % CACHE_MAX_ENTRIES].fd);
+    }
+    load_head = 0;
+    load_count = 0;
+    load_stopping = 0;
+
+    // Signals are for the thread serving clients
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int error = pthread_create(&loader, NULL, _loader_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error != 0) {
+        ERR_PRINT("cache_acquire: pthread_create: %s\n", strerror(error));
+        return -1;
+    }
+    loader_pid = getpid();
+    if (!loader_exit_hook) {
+        atexit(_stop_loader);
+        loader_exit_hook = 1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: cache_acquire
+** Hand the LOADING entry index, to be read from fd, to the loader thread.
+** returns 0 on success, -1 on error
+*/
+static int _queue_load(int index, int fd) {
+    int load_fd = dup(fd);
+    if (load_fd < 0) {
+        perror("cache_acquire: dup");
+        return -1;
+    }
+    // The threads engine may miss from several threads at once
+    static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&start_lock);
+    int started = _start_loader();
+    pthread_mutex_unlock(&start_lock);
+    if (started < 0) {
+        close(load_fd);
+        return -1;
+    }
+    pthread_mutex_lock(&load_lock);
+    // There is never more than one load per entry
+    load_queue[(load_head + load_count) % CACHE_MAX_ENTRIES] = (CacheLoad){index, load_fd};
+    load_count++;
+    pthread_cond_signal(&load_ready);
+    pthread_mutex_unlock(&load_lock);
+    return 0;
+}
+
+
+int cache_acquire(const char *path, int fd, const struct stat *st) {
+    if (cache == NULL || strlen(path) >= MAX_PATH) {
+        return -1;
+    }
+
+    _lock();
+    int index = -1;
+    for (int i = 0; i < CACHE_MAX_ENTRIES && index < 0; i++) {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->state == CACHE_ENTRY_EMPTY || strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        if (!_matches(entry, st)) {
+            // The file changed, nobody will ask for this version again
+            if (entry->state == CACHE_ENTRY_READY && entry->refs == 0) {
+                _free_entry(entry);
+            }
+            continue;
+        }
+        index = i;
+    }
+
+    if (index >= 0) {
+        CacheEntry *entry = &cache->entries[index];
+        // Someone else is still reading it in, use the disk this time
+        CacheHold *hold = NULL;
+        if (entry->state != CACHE_ENTRY_READY ||
+            (hold = _find_hold(getpid(), index)) == NULL) {
+            _unlock();
+            return -1;
+        }
+        hold->refs++;
+        entry->refs++;
+        entry->hits++;
+        entry->last_used = ++cache->clock;
+        _unlock();
+        #ifdef DEBUG
+        printf("Cache hit for %s\n", path);
+        #endif
+        return index;
+    }
+
+    // Big files would push everything else out
+    if (st->st_size > cache->budget / 4) {
+        _unlock();
+        return -1;
+    }
+    index = _reserve_entry(path, st);
+    _unlock();
+
+    // Read in behind this request, which is served from disk
+    if (index >= 0 && _queue_load(index, fd) < 0) {
+        _lock();
+        _free_entry(&cache->entries[index]);
+        _unlock();
+    }
+    return -1;
+}
+
+
+void cache_release(int entry) {
+    _lock();
+    CacheHold *hold = _find_hold(getpid(), entry);
+    if (hold != NULL && hold->refs > 0 && --hold->refs == 0) {
+        hold->pid = 0;
+    }
+    cache->entries[entry].refs--;
+    _unlock();
+}
+
+
+void cache_detach(pid_t pid) {
+    if (cache == NULL) {
+        return;
+    }
+    _lock();
+    for (int i = 0; i < CACHE_MAX_HOLDS; i++) {
+        CacheHold *hold = &cache->holds[i];
+        if (hold->pid == pid) {
+            cache->entries[hold->entry].refs -= hold->refs;
+            memset(hold, 0, sizeof(*hold));
+        }
+    }
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->state == CACHE_ENTRY_LOADING && entry->loader == pid) {
+            #ifdef DEBUG
+            printf("Cache dropping %s, its loader died\n", entry->path);
+            #endif
+            _free_entry(entry);
+        }
+    }
+    _unlock();
+}
+
+
+void cache_cursor_start(CacheCursor *cursor, int entry) {
+    cursor->entry = entry;
+    cursor->block = cache->entries[entry].first_block;
+    cursor->block_offset = 0;
+}
+
+
+const uint8_t *cache_data(CacheCursor *cursor, uint64_t offset, size_t *len) {
+    // The chain of a referenced entry never changes, no lock needed
+    const CacheEntry *e = &cache->entries[cursor->entry];
+    if (offset >= e->size) {
+        return NULL;
+    }
+    if (offset < cursor->block_offset) {
+        cache_cursor_start(cursor, cursor->entry);
+    }
+    int32_t *next_block = _next_block();
+    while (offset - cursor->block_offset >= CACHE_BLOCK_SIZE) {
+        cursor->block = next_block[cursor->block];
+        cursor->block_offset += CACHE_BLOCK_SIZE;
+    }
+    size_t in_block = offset - cursor->block_offset;
+    *len = MIN(CACHE_BLOCK_SIZE - in_block, e->size - offset);
+    return _block_data(cursor->block) + in_block;
+}
+
+
+int cache_write(int entry, int fd, uint64_t offset, uint64_t count) {
+    CacheCursor cursor;
+    cache_cursor_start(&cursor, entry);
+    while (count > 0) {
+        size_t len;
+        const uint8_t *data = cache_data(&cursor, offset, &len);
+        if (data == NULL) {
+            ERR_PRINT("cache_write: past the end of the entry\n");
+            return -1;
+        }
+        len = MIN(len, count);
+        if (write_precisely(fd, data, len) < 0) {
+            return -1;
+        }
+        offset += len;
+        count -= len;
+    }
+    return 0;
+}
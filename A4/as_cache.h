@@ -0,0 +1,129 @@
+#ifndef AS_CACHE_H_
+#define AS_CACHE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+** Design
+** ------
+** A few popular tracks make up most of the STREAM traffic, but every request
+** opens and reads the file again, and forked client handlers cannot share
+** anything they read. The hot-file cache is one shared anonymous mapping,
+** created by run_server before any process or thread is started, so every
+** server process (and thread) sees the same cached files.
+**
+** The mapping holds:
+**   - a header with a process-shared (robust) mutex guarding everything,
+**   - CACHE_MAX_ENTRIES entries, each a file keyed by its path, device,
+**     inode, size and modification time, so an edited or replaced file is
+**     never served stale,
+**   - CACHE_MAX_HOLDS holds, the references each process has on each
+**     entry, so those of a handler that dies mid-stream are not leaked,
+**   - the data area: the byte budget cut into CACHE_BLOCK_SIZE blocks. A
+**     file is a chain of blocks, unused blocks form a free list.
+**
+** On a miss the request is served from disk, and the file is read into the
+** cache behind it (if it is no bigger than a quarter of the budget) by a
+** loader thread of the process, so a miss never holds up the event loop.
+** Room is made by evicting unused entries by the configured policy:
+**   CACHE_LRU: least recently streamed first,
+**   CACHE_LFU: least often streamed first (ties: least recently).
+** An entry being streamed holds a reference and is never evicted. If a file
+** is not cached yet, the caller simply streams it from disk. Whoever reaps a
+** handler process calls cache_detach, which drops its references and the
+** entries it was still reading in.
+*/
+
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_MAX_ENTRIES 256
+#define CACHE_MAX_HOLDS 1024
+
+
+typedef enum cache_policy {
+    CACHE_LRU,
+    CACHE_LFU,
+} CachePolicy;
+
+
+/*
+** A position in a referenced entry, so that reading it in order does not walk
+** its block chain from the start every time.
+** entry: the entry.
+** block, block_offset: the block the cursor is at, and the offset it starts
+** at in the file.
+*/
+typedef struct cache_cursor {
+    int entry;
+    int32_t block;
+    uint64_t block_offset;
+} CacheCursor;
+
+
+/*
+** Create the shared cache with a budget of budget_bytes for file data.
+** Must be called before forking for the cache to be shared.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_init(size_t budget_bytes, CachePolicy policy);
+
+/*
+** Wait for this process's loads, then unmap the cache. Entries still
+** referenced by other processes stay valid for them.
+*/
+void cache_destroy(void);
+
+/*
+** returns 1 if cache_init has been called successfully, 0 otherwise
+*/
+int cache_enabled(void);
+
+/*
+** Find the file at path, open as fd and whose stat is st, in the cache. On a
+** miss it is read in from (a duplicate of) fd in the background, if it fits
+** the budget. A returned entry
+** holds a reference and must be released with cache_release, by the same
+** process.
+**
+** returns the entry index, or -1 if the file must be read from disk
+*/
+int cache_acquire(const char *path, int fd, const struct stat *st);
+
+/*
+** Drop a reference obtained from cache_acquire.
+*/
+void cache_release(int entry);
+
+/*
+** Drop every reference of the reaped process pid, and free the entries it
+** was reading in.
+*/
+void cache_detach(pid_t pid);
+
+/*
+** Point cursor at the start of the referenced entry.
+*/
+void cache_cursor_start(CacheCursor *cursor, int entry);
+
+/*
+** Find the data at offset in the entry of cursor, moving the cursor there.
+**
+** returns a pointer to the data, with *len set to the number of bytes that
+** are contiguous from there (the rest of the block), or NULL past the end
+*/
+const uint8_t *cache_data(CacheCursor *cursor, uint64_t offset, size_t *len);
+
+/*
+** Write count bytes of a referenced entry, from offset, to fd (blocking).
+**
+** returns 0 on success, -1 on error
+*/
+int cache_write(int entry, int fd, uint64_t offset, uint64_t count);
+
+#endif // AS_CACHE_H_
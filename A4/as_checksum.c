@@ -0,0 +1,349 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_checksum.h"
+
+
+/*
+** key: the file's size, modification time, inode and device, its id is unused.
+** crc: the file's CRC32C, valid if used is set.
+*/
+typedef struct checksum_entry {
+    FileInfo key;
+    uint32_t crc;
+    uint8_t used;
+} ChecksumEntry;
+
+
+typedef struct checksum_table {
+    pthread_mutex_t lock;
+    uint64_t stored;
+    ChecksumEntry entries[CHECKSUM_TABLE_SIZE];
+} ChecksumTable;
+
+
+static ChecksumTable *table = NULL;
+
+
+/*
+** A file for the hash thread: a descriptor of its own, and its stat.
+*/
+typedef struct hash_job {
+    int fd;
+    struct stat st;
+    struct hash_job *next;
+} HashJob;
+
+
+// The hash thread of this process (if hasher_pid is getpid()) and its queue,
+// whose head is the file being hashed
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_ready = PTHREAD_COND_INITIALIZER;
+static HashJob *hash_queue = NULL;
+static uint8_t hash_stopping = 0;
+static pid_t hasher_pid = 0;
+static pthread_t hasher;
+static uint8_t hasher_exit_hook = 0;
+
+
+static void _lock(void) {
+    // A client handler may die while holding the lock, it never leaves an
+    // entry half written
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&table->lock);
+    }
+}
+
+
+static void _unlock(void) {
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+int checksum_init(void) {
+    // Shared with every process forked after this point
+    table = mmap(NULL, sizeof(ChecksumTable), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("checksum_init: mmap");
+        table = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    table->stored = 0;
+    return 0;
+}
+
+
+void checksum_destroy(void) {
+    if (table != NULL) {
+        munmap(table, sizeof(ChecksumTable));
+        table = NULL;
+    }
+}
+
+
+/*
+** Helper for: checksum_lookup, checksum_store
+** returns the home entry of the file of key
+*/
+static uint32_t _home(const FileInfo *key) {
+    // Fibonacci hashing, inodes are often close together
+    uint64_t file = key->inode ^ key->device << 40;
+    return (file * 0x9E3779B97F4A7C15ULL) >> 32 & (CHECKSUM_TABLE_SIZE - 1);
+}
+
+
+static int _same_file(const FileInfo *a, const FileInfo *b) {
+    return a->inode == b->inode && a->device == b->device && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+
+int checksum_lookup(const FileInfo *key, uint32_t *crc) {
+    if (table == NULL) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t home = _home(key);
+    _lock();
+    for (uint32_t i = 0; i < CHECKSUM_PROBE; i++) {
+        const ChecksumEntry *entry = &table->entries[(home + i) & (CHECKSUM_TABLE_SIZE - 1)];
+        if (entry->used && _same_file(&entry->key, key)) {
+            *crc = entry->crc;
+            result = 0;
+            break;
+        }
+    }
+    _unlock();
+    return result;
+}
+
+
+void checksum_store(const FileInfo *key, uint32_t crc) {
+    if (table == NULL) {
+        return;
+    }
+    _lock();
+    // The file's old checksum if it is there, else a free entry, else the
+    // home entry
+    uint32_t home = _home(key);
+    ChecksumEntry *target = &table->entries[home];
+    ChecksumEntry *free_entry = NULL;
+    for (uint32_t i = 0; i < CHECKSUM_PROBE; i++) {
+        ChecksumEntry *entry = &table->entries[(home + i) & (CHECKSUM_TABLE_SIZE - 1)];
+        if (entry->used && entry->key.inode == key->inode &&
+            entry->key.device == key->device) {
+            free_entry = entry;
+            break;
+        }
+        if (!entry->used && free_entry == NULL) {
+            free_entry = entry;
+        }
+    }
+    if (free_entry != NULL) {
+        target = free_entry;
+    }
+    target->key = *key;
+    target->crc = crc;
+    target->used = 1;
+    table->stored++;
+    _unlock();
+}
+
+
+uint64_t checksum_count(void) {
+    if (table == NULL) {
+        return 0;
+    }
+    _lock();
+    uint64_t stored = table->stored;
+    _unlock();
+    return stored;
+}
+
+
+void checksum_key(const struct stat *st, FileInfo *key) {
+    memset(key, 0, sizeof(*key));
+    key->size = st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->inode = st->st_ino;
+    key->device = st->st_dev;
+}
+
+
+int file_checksum(int fd, const struct stat *st, uint32_t *crc) {
+    FileInfo key;
+    checksum_key(st, &key);
+    if (checksum_lookup(&key, crc) == 0) {
+        return 0;
+    }
+
+    if (crc32c_fd(fd, crc) < 0) {
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Hashed %lu bytes of inode %lu: %08x\n", (unsigned long)key.size,
+           (unsigned long)key.inode, *crc);
+    #endif
+
+    // A file written to while it was read has no single checksum
+    struct stat after;
+    FileInfo after_key;
+    if (fstat(fd, &after) == 0) {
+        checksum_key(&after, &after_key);
+        if (_same_file(&key, &after_key)) {
+            checksum_store(&key, *crc);
+        }
+    }
+    return 0;
+}
+
+
+static void *_hasher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&hash_lock);
+    while (1) {
+        while (hash_queue == NULL && !hash_stopping) {
+            pthread_cond_wait(&hash_ready, &hash_lock);
+        }
+        if (hash_queue == NULL) {
+            break;
+        }
+        // Left at the head while it is hashed, so it is not queued again
+        HashJob *job = hash_queue;
+        pthread_mutex_unlock(&hash_lock);
+
+        uint32_t crc;
+        file_checksum(job->fd, &job->st, &crc);
+
+        pthread_mutex_lock(&hash_lock);
+        hash_queue = job->next;
+        close(job->fd);
+        free(job);
+    }
+    pthread_mutex_unlock(&hash_lock);
+    return NULL;
+}
+
+
+/*
+** Helper for: exit
+** Let this process's hash thread finish the files queued so far, so a
+** handler that is done does not drop them.
+*/
+static void _stop_hasher(void) {
+    if (hasher_pid != getpid()) {
+        return;
+    }
+    pthread_mutex_lock(&hash_lock);
+    hash_stopping = 1;
+    pthread_cond_signal(&hash_ready);
+    pthread_mutex_unlock(&hash_lock);
+    pthread_join(hasher, NULL);
+    hasher_pid = 0;
+}
+
+
+/*
+** Helper for: _queue_hash
+** Start the hash thread of this process, unless it is running. A forked
+** process does not have its parent's, nor may it trust its queue's lock.
+** returns 0 on success, -1 on error
+*/
+static int _start_hasher(void) {
+    if (hasher_pid == getpid()) {
+        return 0;
+    }
+    pthread_mutex_init(&hash_lock, NULL);
+    pthread_cond_init(&hash_ready, NULL);
+    while (hash_queue != NULL) {
+        HashJob *job = hash_queue;
+        hash_queue = job->next;
+        close(job->fd);
+        free(job);
+    }
+    hash_stopping = 0;
+
+    // Signals are for the thread serving clients
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int error = pthread_create(&hasher, NULL, _hasher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error != 0) {
+        ERR_PRINT("file_checksum_nowait: pthread_create: %s\n", strerror(error));
+        return -1;
+    }
+    hasher_pid = getpid();
+    if (!hasher_exit_hook) {
+        atexit(_stop_hasher);
+        hasher_exit_hook = 1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: file_checksum_nowait
+** Queue the file open as fd, whose stat is st, for the hash thread, unless it
+** already is.
+*/
+static void _queue_hash(int fd, const struct stat *st) {
+    // The threads engine may miss from several threads at once
+    static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&start_lock);
+    int started = _start_hasher();
+    pthread_mutex_unlock(&start_lock);
+    if (started < 0) {
+        return;
+    }
+
+    FileInfo key, queued_key;
+    checksum_key(st, &key);
+    pthread_mutex_lock(&hash_lock);
+    HashJob **link = &hash_queue;
+    for (; *link != NULL; link = &(*link)->next) {
+        checksum_key(&(*link)->st, &queued_key);
+        if (_same_file(&key, &queued_key)) {
+            pthread_mutex_unlock(&hash_lock);
+            return;
+        }
+    }
+    HashJob *job = (HashJob *)malloc(sizeof(HashJob));
+    int job_fd = job != NULL ? dup(fd) : -1;
+    if (job_fd < 0) {
+        perror("file_checksum_nowait: dup");
+        pthread_mutex_unlock(&hash_lock);
+        free(job);
+        return;
+    }
+    job->fd = job_fd;
+    job->st = *st;
+    job->next = NULL;
+    *link = job;
+    pthread_cond_signal(&hash_ready);
+    pthread_mutex_unlock(&hash_lock);
+    #ifdef DEBUG
+    printf("Queued inode %lu to be hashed\n", (unsigned long)st->st_ino);
+    #endif
+}
+
+
+int file_checksum_nowait(int fd, const struct stat *st, uint32_t *crc) {
+    FileInfo key;
+    checksum_key(st, &key);
+    if (checksum_lookup(&key, crc) == 0) {
+        return 0;
+    }
+    _queue_hash(fd, st);
+    return -1;
+}
@@ -0,0 +1,101 @@
+#ifndef AS_CHECKSUM_H_
+#define AS_CHECKSUM_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_crc.h"
+#include "as_index.h"
+
+#include <sys/mman.h>
+
+/*
+** Design
+** ------
+** A client that already has a file asks for it with STREAMIF and the CRC32C
+** of its copy (see as_server.h), and the server only sends it if its own
+** checksum differs. Hashing a file means reading all of it, so each file is
+** only hashed the first time a STREAMIF asks for it, and the checksum is
+** kept for as long as the file's size, modification time, inode and device
+** stay the same. The event-driven engines cannot stop every connection of a
+** process while a file is read through: there, a checksum that is not known
+** yet is computed by a hash thread of the process, started on first use, and
+** the request it was for is simply sent the file.
+**
+** The checksums are kept in one shared anonymous mapping, created by
+** run_server before any process or thread is started (like the hot-file
+** cache, see as_cache.h), so whichever engine hashes a file, every server
+** process sees the result. It is a hash table of CHECKSUM_TABLE_SIZE entries
+** keyed by inode and device, guarded by a process-shared (robust) mutex. A file is
+** looked for in the CHECKSUM_PROBE entries from its home entry on, and when
+** none of them is free the home entry is overwritten: it only costs hashing
+** that file again.
+**
+** The checksums also outlive the server: the index (see as_index.h) stores,
+** for every file, the checksum the table holds for it, and library_load
+** fills the table from the index on startup.
+*/
+
+#define CHECKSUM_TABLE_SIZE 16384   // a power of two
+#define CHECKSUM_PROBE 8
+
+
+/*
+** Create the shared checksum table. Must be called before forking for the
+** table to be shared.
+**
+** returns 0 on success, -1 on error
+*/
+int checksum_init(void);
+
+/*
+** Unmap the table.
+*/
+void checksum_destroy(void);
+
+/*
+** Find the checksum of the file whose size, modification time, inode and
+** device are those of key (its ID is ignored).
+**
+** returns 0 if it was found (in *crc), -1 otherwise
+*/
+int checksum_lookup(const FileInfo *key, uint32_t *crc);
+
+/*
+** Remember crc as the checksum of the file described by key, if the table
+** exists.
+*/
+void checksum_store(const FileInfo *key, uint32_t crc);
+
+/*
+** returns how many checksums have been stored since checksum_init, so the
+** index can tell when it has new ones to save
+*/
+uint64_t checksum_count(void);
+
+/*
+** Fill key with what tells the version of a file whose stat is st apart.
+*/
+void checksum_key(const struct stat *st, FileInfo *key);
+
+/*
+** Get the CRC32C of the open file fd, whose stat is st: from the table if it
+** is known, by reading the file otherwise (remembered if the file did not
+** change meanwhile).
+**
+** returns 0 on success, -1 on error
+*/
+int file_checksum(int fd, const struct stat *st, uint32_t *crc);
+
+/*
+** Get the CRC32C of the open file fd, whose stat is st, from the table. If it
+** is not there, the file is hashed in the background (from a duplicate of
+** fd), for the requests that come after this one. A process that exits
+** first finishes the files it queued.
+**
+** returns 0 if it was known (in *crc), -1 otherwise
+*/
+int file_checksum_nowait(int fd, const struct stat *st, uint32_t *crc);
+
+#endif // AS_CHECKSUM_H_
@@ -5,6 +5,25 @@
 #include "as_client.h"
 
 
+// What the server agreed to in hello_request, see the Design in as_server.h
+static uint8_t protocol_version = PROTOCOL_VERSION_1;
+static uint8_t chunked_framing = 0;
+static uint8_t file_ids_agreed = 0;
+// Whether requests may be sent before the previous responses arrive
+static uint8_t pipelining_agreed = 0;
+static uint8_t batches_agreed = 0;
+static uint8_t checksums_agreed = 0;
+static uint8_t trailer_agreed = 0;
+static uint8_t pcm_agreed = 0;
+static uint8_t tiers_agreed = 0;
+// The server's LIST_TIERS line, from its last LISTSINCE response
+static char tier_list[RESPONSE_BUFFER_SIZE] = "";
+// Downloads in progress, by the descriptor they are written through
+static Download downloads[FD_SETSIZE];
+// With file IDs, file_ids[i] is the ID of library->files[i]
+static uint32_t *file_ids = NULL;
+
+
 static int connect_to_server(int port, const char *hostname) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
@@ -42,29 +61,96 @@ static int connect_to_server(int port, const char *hostname) {
 }
 
 
+int hello_request(int sockfd) {
+    // 1. Offer the highest version and every feature this client knows
+    char *hello = REQUEST_HELLO " " XSTR(PROTOCOL_VERSION) " "
+                  PROTOCOL_FEATURE_CHUNKED " " PROTOCOL_FEATURE_IDS " "
+                  PROTOCOL_FEATURE_PIPELINE " " PROTOCOL_FEATURE_BATCH " "
+                  PROTOCOL_FEATURE_CHECKSUM " " PROTOCOL_FEATURE_TRAILER " "
+                  PROTOCOL_FEATURE_PCM " " PROTOCOL_FEATURE_TIERS END_OF_MESSAGE_TOKEN;
+    if (write_precisely(sockfd, hello, strlen(hello)) == -1) {
+        ERR_PRINT("hello_request: write_precisely");
+        return -1;
+    }
+
+    // 2. Read the reply a byte at a time, nothing after it may be consumed.
+    //    Servers that predate HELLO never answer it.
+    char reply[HELLO_MESSAGE_SIZE];
+    int reply_len = 0;
+    while (reply_len < 2 || memcmp(reply + reply_len - 2, END_OF_MESSAGE_TOKEN, 2) != 0) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
+        struct timeval timeout = {HELLO_TIMEOUT_SEC, 0};
+        int ready = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
+        if (ready == -1) {
+            perror("hello_request: select");
+            return -1;
+        }
+        if (ready == 0 || reply_len == HELLO_MESSAGE_SIZE - 1) {
+            printf("Server did not answer HELLO, using protocol version %d\n",
+                   PROTOCOL_VERSION_1);
+            return protocol_version;
+        }
+        if (read(sockfd, reply + reply_len, 1) != 1) {
+            ERR_PRINT("hello_request: read\n");
+            return -1;
+        }
+        reply_len++;
+    }
+    reply[reply_len - 2] = '\0';
+
+    // 3. HELLO <version>[ <feature>...]
+    char *version = strchr(reply, ' ');
+    if (strncmp(reply, REQUEST_HELLO, strlen(REQUEST_HELLO)) != 0 || version == NULL) {
+        ERR_PRINT("hello_request: unexpected reply %s\n", reply);
+        return -1;
+    }
+    protocol_version = MIN(strtol(version + 1, NULL, 10), PROTOCOL_VERSION);
+    chunked_framing = strstr(version, " " PROTOCOL_FEATURE_CHUNKED) != NULL;
+    file_ids_agreed = strstr(version, " " PROTOCOL_FEATURE_IDS) != NULL;
+    pipelining_agreed = strstr(version, " " PROTOCOL_FEATURE_PIPELINE) != NULL;
+    batches_agreed = strstr(version, " " PROTOCOL_FEATURE_BATCH) != NULL;
+    checksums_agreed = strstr(version, " " PROTOCOL_FEATURE_CHECKSUM) != NULL;
+    trailer_agreed = strstr(version, " " PROTOCOL_FEATURE_TRAILER) != NULL;
+    pcm_agreed = strstr(version, " " PROTOCOL_FEATURE_PCM) != NULL;
+    tiers_agreed = strstr(version, " " PROTOCOL_FEATURE_TIERS) != NULL;
+    #ifdef DEBUG
+    printf("Using protocol version %d%s%s%s%s%s%s%s%s\n", protocol_version,
+           chunked_framing ? " with chunked framing" : "",
+           file_ids_agreed ? " with file IDs" : "",
+           pipelining_agreed ? " with pipelining" : "",
+           batches_agreed ? " with batches" : "",
+           checksums_agreed ? " with checksums" : "",
+           trailer_agreed ? " with trailers" : "",
+           pcm_agreed ? " with PCM encoding" : "",
+           tiers_agreed ? " with tiers" : "");
+    #endif
+
+    return protocol_version;
+}
+
+
 /*
-** Helper for: list_request
+** Helper for: get_next_filename, list_since_request
 ** This function reads from the socket until it finds a network newline.
-** This is processed as a list response for a single library file,
-** of the form:
-**                   <index>:<filename>\r\n
 **
-** returns index on success, -1 on error
-** filename is a heap allocated string pointing to the parsed filename
+** returns the line without the network newline (heap-allocated), NULL on error
 */
-static int get_next_filename(int sockfd, char **filename) {
+static char *get_next_line(int sockfd) {
     static int bytes_in_buffer = 0;
     static char buf[RESPONSE_BUFFER_SIZE];
 
-    while((*filename = find_network_newline(buf, &bytes_in_buffer)) == NULL) {
+    char *line;
+    while((line = find_network_newline(buf, &bytes_in_buffer)) == NULL) {
         int num = read(sockfd, buf + bytes_in_buffer,
                        RESPONSE_BUFFER_SIZE - bytes_in_buffer);
-        if (num < 0) {
+        if (num <= 0) {
             perror("list_request");
             #ifdef DEBUG
             printf("Error reading from socket\n");
             #endif
-            return -1;
+            return NULL;
         }
         bytes_in_buffer += num;
         if (bytes_in_buffer == RESPONSE_BUFFER_SIZE) {
@@ -73,6 +159,24 @@ static int get_next_filename(int sockfd, char **filename) {
             memmove(buf, buf + BUFFER_BLEED_OFF, RESPONSE_BUFFER_SIZE - BUFFER_BLEED_OFF);
         }
     }
+    return line;
+}
+
+
+/*
+** Helper for: list_request
+** This function reads from the socket until it finds a network newline.
+** This is processed as a list response for a single library file,
+** of the form:
+**                   <index>:<filename>\r\n
+**
+** returns index on success, -1 on error
+** filename is a heap allocated string pointing to the parsed filename
+*/
+static int get_next_filename(int sockfd, char **filename) {
+    if ((*filename = get_next_line(sockfd)) == NULL) {
+        return -1;
+    }
 
     char *parse_ptr = strtok(*filename, ":");
     int index = strtol(parse_ptr, NULL, 10);
@@ -83,6 +187,241 @@ static int get_next_filename(int sockfd, char **filename) {
     return index;
 }
 
+/*
+** Helper for: list_since_request
+** Parse "<index>:<filename>" into index and a copy of filename.
+**
+** returns 0 on success, -1 if line is malformed
+*/
+static int _parse_list_entry(const char *line, uint32_t *index, char **filename) {
+    char *colon;
+    *index = strtoul(line, &colon, 10);
+    if (colon == line || *colon != ':') {
+        ERR_PRINT("list_request: malformed entry %s\n", line);
+        return -1;
+    }
+    *filename = strdup(colon + 1);
+    if (*filename == NULL) {
+        perror("list_request: strdup");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: list_since_request
+** Apply one line of a LISTSINCE response to library. Resync lines are whole
+** list entries, the others are changes (see list_since_request_response in
+** as_server.h).
+**
+** returns 0 on success, -1 on error
+*/
+static int _apply_list_line(Library *library, const char *line, uint8_t resync) {
+    uint32_t index;
+    char *filename;
+
+    if (resync) {
+        if (_parse_list_entry(line, &index, &filename) < 0) {
+            return -1;
+        }
+        // Entries come from the last index down, the first one sizes the list
+        if (library->files == NULL) {
+            library->num_files = index + 1;
+            library->files = calloc(library->num_files, sizeof(char *));
+            if (library->files == NULL) {
+                perror("list_request: calloc");
+                free(filename);
+                return -1;
+            }
+        }
+        if (index >= library->num_files || library->files[index] != NULL) {
+            ERR_PRINT("list_request: unexpected index %u\n", index);
+            free(filename);
+            return -1;
+        }
+        library->files[index] = filename;
+        return 0;
+    }
+
+    if (strncmp(line, LIST_DELTA_REMOVE, strlen(LIST_DELTA_REMOVE)) == 0) {
+        index = strtoul(line + strlen(LIST_DELTA_REMOVE), NULL, 10);
+        if (index >= library->num_files) {
+            ERR_PRINT("list_request: no file %u to remove\n", index);
+            return -1;
+        }
+        // The last file takes its place
+        free(library->files[index]);
+        library->files[index] = library->files[library->num_files - 1];
+        library->num_files--;
+        return 0;
+    }
+
+    if (strncmp(line, LIST_DELTA_ADD, strlen(LIST_DELTA_ADD)) == 0) {
+        if (_parse_list_entry(line + strlen(LIST_DELTA_ADD), &index, &filename) < 0) {
+            return -1;
+        }
+        char **files = realloc(library->files, (library->num_files + 1) * sizeof(char *));
+        if (index != library->num_files || files == NULL) {
+            ERR_PRINT("list_request: cannot add file at %u\n", index);
+            free(filename);
+            if (files != NULL) {
+                library->files = files;
+            }
+            return -1;
+        }
+        library->files = files;
+        library->files[library->num_files++] = filename;
+        return 0;
+    }
+
+    ERR_PRINT("list_request: unexpected line %s\n", line);
+    return -1;
+}
+
+
+/*
+** Helper for: list_since_request
+** Apply one line of a LISTSINCE response to library when files are named by
+** ID: resync lines are additions too, and a removed file is found by its ID.
+** The list changes the same way as with indexes, so the server's and ours
+** stay in the same order.
+**
+** returns 0 on success, -1 on error
+*/
+static int _apply_id_line(Library *library, const char *line) {
+    uint32_t id;
+    char *filename;
+
+    if (strncmp(line, LIST_DELTA_REMOVE, strlen(LIST_DELTA_REMOVE)) == 0) {
+        id = strtoul(line + strlen(LIST_DELTA_REMOVE), NULL, 10);
+        int index = 0;
+        while (index < library->num_files && file_ids[index] != id) {
+            index++;
+        }
+        if (index == library->num_files) {
+            ERR_PRINT("list_request: no file with ID %u to remove\n", id);
+            return -1;
+        }
+        // The last file takes its place
+        free(library->files[index]);
+        library->num_files--;
+        library->files[index] = library->files[library->num_files];
+        file_ids[index] = file_ids[library->num_files];
+        return 0;
+    }
+
+    if (strncmp(line, LIST_DELTA_ADD, strlen(LIST_DELTA_ADD)) == 0) {
+        if (_parse_list_entry(line + strlen(LIST_DELTA_ADD), &id, &filename) < 0) {
+            return -1;
+        }
+        char **files = realloc(library->files, (library->num_files + 1) * sizeof(char *));
+        if (files != NULL) {
+            library->files = files;
+        }
+        uint32_t *ids = realloc(file_ids, (library->num_files + 1) * sizeof(uint32_t));
+        if (ids != NULL) {
+            file_ids = ids;
+        }
+        if (files == NULL || ids == NULL) {
+            perror("list_request: realloc");
+            free(filename);
+            return -1;
+        }
+        file_ids[library->num_files] = id;
+        library->files[library->num_files++] = filename;
+        return 0;
+    }
+
+    ERR_PRINT("list_request: unexpected line %s\n", line);
+    return -1;
+}
+
+
+/*
+** Helper for: send_and_process_stream_request,
+**             send_and_process_stream_range_request
+** returns what the server knows the file at file_index by: its ID, if the
+** server agreed to file IDs, or the index itself
+*/
+static uint32_t _file_number(uint32_t file_index) {
+    return file_ids_agreed && file_ids != NULL ? file_ids[file_index] : file_index;
+}
+
+
+/*
+** Helper for: list_request
+** Bring library up to date with a LISTSINCE request: only the changes since
+** library->generation are received and applied in place, unless the server
+** sends the whole list again.
+**
+** returns 0 on success, -1 on error
+*/
+static int list_since_request(int sockfd, Library *library) {
+    // 1. Send the list since request with the generation we have
+    char request[REQUEST_BUFFER_SIZE];
+    int request_len = snprintf(request, REQUEST_BUFFER_SIZE,
+                               REQUEST_LIST_SINCE " %lu" END_OF_MESSAGE_TOKEN,
+                               (unsigned long)library->generation);
+    if (write_precisely(sockfd, request, request_len) == -1) {
+        ERR_PRINT("list_request: write_precisely");
+        return -1;
+    }
+
+    // 2. Find out whether we get changes or the whole list
+    char *line = get_next_line(sockfd);
+    if (line == NULL) {
+        return -1;
+    }
+    uint8_t resync;
+    const char *generation_str;
+    if (strncmp(line, LIST_RESYNC " ", strlen(LIST_RESYNC) + 1) == 0) {
+        resync = 1;
+        generation_str = line + strlen(LIST_RESYNC) + 1;
+    } else if (strncmp(line, LIST_DELTA " ", strlen(LIST_DELTA) + 1) == 0) {
+        resync = 0;
+        generation_str = line + strlen(LIST_DELTA) + 1;
+    } else {
+        ERR_PRINT("list_request: unexpected response %s\n", line);
+        free(line);
+        return -1;
+    }
+    uint64_t generation = strtoull(generation_str, NULL, 10);
+    free(line);
+    #ifdef DEBUG
+    printf("Library generation %lu -> %lu (%s)\n", (unsigned long)library->generation,
+           (unsigned long)generation, resync ? "resync" : "delta");
+    #endif
+    if (resync) {
+        _free_library(library);
+        free(file_ids);
+        file_ids = NULL;
+    }
+
+    // 3. Apply every line up to the end of the response
+    int result = 0;
+    while ((line = get_next_line(sockfd)) != NULL && strcmp(line, LIST_END) != 0) {
+        if (tiers_agreed && strncmp(line, LIST_TIERS " ", strlen(LIST_TIERS) + 1) == 0) {
+            strncpy(tier_list, line, RESPONSE_BUFFER_SIZE - 1);
+            tier_list[RESPONSE_BUFFER_SIZE - 1] = '\0';
+        // Keep reading to the end, so the next response starts in the right place
+        } else if (result == 0 && (file_ids_agreed ? _apply_id_line(library, line)
+                                                   : _apply_list_line(library, line, resync)) < 0) {
+            result = -1;
+        }
+        free(line);
+    }
+    if (line == NULL) {
+        return -1;
+    }
+    free(line);
+
+    // A list we failed to follow is fetched whole next time
+    library->generation = result == 0 ? generation : 0;
+    return result;
+}
+
+
 /*
 ** Sends a list request to the server and prints the list of files in the
 ** library. Also parses the list of files and stores it in the list parameter.
@@ -98,6 +437,21 @@ static int get_next_filename(int sockfd, char **filename) {
 
 int list_request(int sockfd, Library *library) {
 
+    // Servers that speak version 2 can send only what changed
+    if (protocol_version >= PROTOCOL_VERSION_2) {
+        if (list_since_request(sockfd, library) == -1) {
+            return -1;
+        }
+        for(int i = 0; i < library->num_files; i++){
+            fprintf(stdout, "%d: %s\n", i, library->files[i]);
+        }
+        if (tier_list[0] != '\0') {
+            fprintf(stdout, "Tiers (rate/bits/channels): %s\n",
+                    tier_list + strlen(LIST_TIERS) + 1);
+        }
+        return library->num_files;
+    }
+
     // 1. Send the list request to the server
     char *list_request = REQUEST_LIST END_OF_MESSAGE_TOKEN;
     if (write(sockfd, list_request, strlen(list_request)) == -1) {
@@ -134,14 +488,14 @@ int list_request(int sockfd, Library *library) {
     if(library->files[library->num_files - 1] == NULL){
         free(library->files[library->num_files - 1]);
     }
-    library->files[library->num_files - 1] = malloc(strlen(filename) * sizeof(char));
+    library->files[library->num_files - 1] = malloc((strlen(filename) + 1) * sizeof(char));
     if (library->files[library->num_files - 1] == NULL) {
         ERR_PRINT("list_request: malloc");
         return -1;
     }
 
     //5. Copy the first filename into the library files
-    strncpy(library->files[library->num_files - 1], filename, strlen(filename));
+    strncpy(library->files[library->num_files - 1], filename, strlen(filename) + 1);
 
     //6. Get the rest of the filenames
     int file_counter = 0;
@@ -155,7 +509,7 @@ int list_request(int sockfd, Library *library) {
         if(library->files[pi] == NULL){
             free(library->files[pi]);
         }
-        library->files[pi] = malloc(strlen(filename) * sizeof(char));
+        library->files[pi] = malloc((strlen(filename) + 1) * sizeof(char));
         if (library->files[pi] == NULL) {
             ERR_PRINT("list_request: malloc");
             return -1;
@@ -203,6 +557,8 @@ static int get_library_dir_permission(const char *library_dir, mode_t * perpt) {
             return 0;
         }
         
+    } else {
+        closedir(dir);
     }
 
     //create_missing_directories(library_dir, library_dir);
@@ -289,36 +645,140 @@ free_tokville:
 
 
 /*
-** Helper for: get_file_request
+** Helper for: get_file_request, get_files_request, resume_file_request,
+**             stream_and_get_request
+** Open the download of a file (see Download): flags are added to
+** O_WRONLY | O_CREAT, O_TRUNC to start over, O_APPEND to continue a download
+** cut short.
+**
+** returns the file descriptor to write it through, -1 on error
 */
-static int file_index_to_fd(uint32_t file_index, const Library * library){
+static int _open_download(uint32_t file_index, const Library * library, int flags){
     create_missing_directories(library->files[file_index], library->path);
 
-    char *filepath = _join_path(library->path, library->files[file_index]);
-    if (filepath == NULL) {
+    char *path = _join_path(library->path, library->files[file_index]);
+    if (path == NULL) {
+        return -1;
+    }
+    char *part_path = (char *)malloc(strlen(path) + strlen(DOWNLOAD_SUFFIX) + 1);
+    if (part_path == NULL) {
+        perror("_open_download: malloc");
+        free(path);
         return -1;
     }
+    sprintf(part_path, "%s" DOWNLOAD_SUFFIX, path);
 
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    // Only an older client leaves a local copy cut short, continue it there
+    uint8_t in_place = (flags & O_APPEND) && access(part_path, F_OK) == -1 &&
+                       access(path, F_OK) == 0;
+    int fd = open(in_place ? path : part_path, O_WRONLY | O_CREAT | flags, 0666);
     #ifdef DEBUG
-    printf("Opened file %s\n", filepath);
+    printf("Opened file %s\n", in_place ? path : part_path);
     #endif
-    free(filepath);
-    if (fd < 0 ) {
-        perror("file_index_to_fd");
+    free(part_path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1 || fd >= FD_SETSIZE) {
+        perror("_open_download");
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
         return -1;
     }
 
+    downloads[fd].path = path;
+    downloads[fd].in_place = in_place;
+    downloads[fd].start = st.st_size;
     return fd;
 }
 
 
+/*
+** Helper for: _process_stream_response, get_files_request, pipeline_abort
+** Close the file_dest_fd of a response, and if it is a download: rename it
+** into place if complete, throw it away if unchanged (the local copy was up
+** to date) or corrupt, or leave it for resume_file_request if cut short.
+** Corrupt data appended to a download cut short is cut off again.
+*/
+static void _finish_download(int fd, DownloadOutcome outcome){
+    Download *download = &downloads[fd];
+    if (download->path == NULL) {
+        close(fd);
+        return;
+    }
+    if (outcome == DOWNLOAD_CORRUPT && ftruncate(fd, download->start) == -1) {
+        perror("_finish_download: ftruncate");
+    }
+    close(fd);
+
+    char *part_path = (char *)malloc(strlen(download->path) + strlen(DOWNLOAD_SUFFIX) + 1);
+    if (part_path == NULL) {
+        perror("_finish_download: malloc");
+    } else if (!download->in_place) {
+        sprintf(part_path, "%s" DOWNLOAD_SUFFIX, download->path);
+        if (outcome == DOWNLOAD_COMPLETE && rename(part_path, download->path) == -1) {
+            perror("_finish_download: rename");
+        }
+        if (outcome == DOWNLOAD_UNCHANGED ||
+            (outcome == DOWNLOAD_CORRUPT && download->start == 0)) {
+            unlink(part_path);
+        }
+    }
+    free(part_path);
+    free(download->path);
+    download->path = NULL;
+}
+
+
+/*
+** Helper for: get_file_request, get_files_request
+** Hash the local copy of the file, if there is one and the server can be
+** asked whether it is up to date.
+**
+** returns 0 if *checksum is the CRC32C of the local copy, -1 otherwise
+*/
+static int _local_checksum(uint32_t file_index, const Library * library, uint32_t *checksum){
+    if(!checksums_agreed){
+        return -1;
+    }
+    char *filepath = _join_path(library->path, library->files[file_index]);
+    if(filepath == NULL){
+        return -1;
+    }
+    int fd = open(filepath, O_RDONLY);
+    free(filepath);
+    if(fd < 0){
+        return -1;
+    }
+    int result = crc32c_fd(fd, checksum);
+    close(fd);
+    return result;
+}
+
+
 int get_file_request(int sockfd, uint32_t file_index, const Library * library){
     #ifdef DEBUG
     printf("Getting file %s\n", library->files[file_index]);
     #endif
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
+    // Left alone unless the server has a different version
+    uint32_t checksum;
+    if(_local_checksum(file_index, library, &checksum) == 0){
+        int file_dest_fd = _open_download(file_index, library, O_TRUNC);
+        if(file_dest_fd == -1){
+            return -1;
+        }
+        RequestPipeline pipeline;
+        pipeline_init(&pipeline, sockfd);
+        if(pipeline_stream_if_request(&pipeline, file_index, checksum, file_dest_fd,
+                                      library->files[file_index]) == -1){
+            _finish_download(file_dest_fd, DOWNLOAD_CUT);
+            return -1;
+        }
+        return pipeline_drain(&pipeline);
+    }
+
+    int file_dest_fd = _open_download(file_index, library, O_TRUNC);
     if (file_dest_fd == -1) {
         return -1;
     }
@@ -331,6 +791,104 @@ int get_file_request(int sockfd, uint32_t file_index, const Library * library){
     return 0;
 }
 
+
+int get_files_request(int sockfd, const uint32_t *file_indexes, int num_files,
+                      const Library * library){
+    RequestPipeline pipeline;
+    pipeline_init(&pipeline, sockfd);
+
+    // 1. Files with a local copy are only sent if it is out of date
+    uint32_t *missing = (uint32_t *)malloc(num_files * sizeof(uint32_t));
+    if (missing == NULL) {
+        perror("get_files_request: malloc");
+        return -1;
+    }
+    int num_missing = 0;
+    for (int i = 0; i < num_files; i++) {
+        uint32_t checksum;
+        if (_local_checksum(file_indexes[i], library, &checksum) < 0) {
+            missing[num_missing++] = file_indexes[i];
+            continue;
+        }
+        int file_dest_fd = _open_download(file_indexes[i], library, O_TRUNC);
+        if (file_dest_fd == -1 ||
+            pipeline_stream_if_request(&pipeline, file_indexes[i], checksum, file_dest_fd,
+                                       library->files[file_indexes[i]]) == -1) {
+            if (file_dest_fd != -1) {
+                _finish_download(file_dest_fd, DOWNLOAD_CUT);
+            }
+            free(missing);
+            pipeline_abort(&pipeline);
+            return -1;
+        }
+    }
+    file_indexes = missing;
+    num_files = num_missing;
+
+    // 2. The others up to STREAM_BATCH_MAX files per request, or one if the
+    //    server does not know STREAMBATCH
+    int batch_size = batches_agreed ? STREAM_BATCH_MAX : 1;
+    for (int first = 0; first < num_files; first += batch_size) {
+        int num_batched = MIN(batch_size, num_files - first);
+        int file_dest_fds[STREAM_BATCH_MAX];
+        int num_open = 0;
+        for (; num_open < num_batched; num_open++) {
+            #ifdef DEBUG
+            printf("Getting file %s\n", library->files[file_indexes[first + num_open]]);
+            #endif
+            file_dest_fds[num_open] = _open_download(file_indexes[first + num_open],
+                                                     library, O_TRUNC);
+            if (file_dest_fds[num_open] == -1) {
+                break;
+            }
+        }
+
+        int result = -1;
+        if (num_open < num_batched) {
+            result = -1;
+        } else if (batches_agreed) {
+            result = pipeline_stream_batch_request(&pipeline, file_indexes + first,
+                                                   file_dest_fds, num_batched);
+        } else {
+            result = pipeline_stream_request(&pipeline, file_indexes[first],
+                                             -1, file_dest_fds[0]);
+        }
+        if (result == -1) {
+            for (int i = 0; i < num_open; i++) {
+                _finish_download(file_dest_fds[i], DOWNLOAD_CUT);
+            }
+            free(missing);
+            pipeline_abort(&pipeline);
+            return -1;
+        }
+    }
+
+    free(missing);
+    return pipeline_drain(&pipeline);
+}
+
+
+int resume_file_request(int sockfd, uint32_t file_index, const Library * library){
+    int file_dest_fd = _open_download(file_index, library, O_APPEND);
+    if (file_dest_fd == -1) {
+        return -1;
+    }
+
+    // Whatever is already saved does not need to be sent again
+    off_t start = downloads[file_dest_fd].start;
+    #ifdef DEBUG
+    printf("Resuming file %s at byte %ld\n", library->files[file_index], (long)start);
+    #endif
+
+    int result = send_and_process_stream_range_request(sockfd, file_index, start,
+                                                       STREAM_RANGE_TO_END, -1, file_dest_fd);
+    if (result == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
 ** Starts the audio player process and returns the file descriptor of
 ** the write end of a pipe connected to the audio player's stdin.
@@ -421,6 +979,49 @@ int stream_request(int sockfd, uint32_t file_index) {
 }
 
 
+int stream_tier_request(int sockfd, uint32_t file_index, uint32_t tier) {
+    // Tiers are numbered from 1, one per entry of the LIST_TIERS line
+    uint32_t num_tiers = 0;
+    for (const char *c = tier_list; *c != '\0'; c++) {
+        num_tiers += *c == ' ';
+    }
+    if (!tiers_agreed || tier > num_tiers) {
+        printf("Tier %u is not offered by the server\n", tier);
+        return 0;
+    }
+
+    int audio_out_fd;
+    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+
+    int result = send_and_process_stream_tier_request(sockfd, file_index, tier, audio_out_fd, -1);
+    if (result == -1) {
+        ERR_PRINT("stream_tier_request: send_and_process_stream_tier_request failed\n");
+        return -1;
+    }
+
+    _wait_on_audio_player(audio_player_pid);
+
+    return 0;
+}
+
+
+int seek_stream_request(int sockfd, uint32_t file_index, uint64_t offset) {
+    int audio_out_fd;
+    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+
+    int result = send_and_process_stream_range_request(sockfd, file_index, offset,
+                                                       STREAM_RANGE_TO_END, audio_out_fd, -1);
+    if (result == -1) {
+        ERR_PRINT("seek_stream_request: send_and_process_stream_range_request failed\n");
+        return -1;
+    }
+
+    _wait_on_audio_player(audio_player_pid);
+
+    return 0;
+}
+
+
 int stream_and_get_request(int sockfd, uint32_t file_index, const Library * library) {
     int audio_out_fd;
     int audio_player_pid = start_audio_player_process(&audio_out_fd);
@@ -429,9 +1030,9 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
     printf("Getting file %s\n", library->files[file_index]);
     #endif
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
+    int file_dest_fd = _open_download(file_index, library, O_TRUNC);
     if (file_dest_fd == -1) {
-        ERR_PRINT("stream_and_get_request: file_index_to_fd failed\n");
+        ERR_PRINT("stream_and_get_request: _open_download failed\n");
         return -1;
     }
 
@@ -448,60 +1049,16 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
 }
 
 /*
-** Sends a stream request for the particular file_index to the server and sends the audio
-** stream to the audio_out_fd and file_dest_fd file descriptors
-** -- provided that they are not < 0.
-**
-** The select system call should be used to simultaneously wait for data to be available
-** to read from the server connection/socket, as well as for when audio_out_fd and file_dest_fd
-** (if applicable) are ready to be written to. Differing numbers of bytes may be written to
-** at each time (do no use write_precisely for this purpose -- you will nor receive full marks)
-** audio_out_fd and file_dest_fd, and this must be handled.
-**
-** One of audio_out_fd or file_dest_fd can be -1, but not both. File descriptors >= 0
-** should be closed before the function returns.
-**
-** This function will leverage a dynamic circular buffer with two output streams
-** and one input stream. The input stream is the server connection/socket, and the output
-** streams are audio_out_fd and file_dest_fd. The buffer should be dynamically sized using
-** realloc. See the assignment handout for more information, and notice how realloc is used
-** to manage the library.files in this client and the server.
-**
-** Phrased differently, this uses a FIFO with two independent out streams and one in stream,
-** but because it is as long as needed, we call it circular, and just point to three different
-** parts of it.
+** Helper for: _process_stream_response
+** Relay exactly bytes_to_read bytes of stream data from the server to
+** audio_out_fd and file_dest_fd (where they are not < 0), hashing them into
+** *crc.
 **
 ** returns 0 on success, -1 on error
 */
-
-int send_and_process_stream_request(int sockfd, uint32_t file_index,
-                                    int audio_out_fd, int file_dest_fd) {
-    // 1. Send the stream request to the server
-    char *stream_request = REQUEST_STREAM END_OF_MESSAGE_TOKEN;
-    if(write_precisely(sockfd, stream_request, strlen(stream_request)) == -1){
-        ERR_PRINT("send_and_process_stream_request: write_precisely");
-        return -1;
-    }
-    
-    // 2. Send the file index to the server
-    uint32_t file_index_nbo = htonl(file_index);
-    if(write_precisely(sockfd, &file_index_nbo, sizeof(uint32_t)) == -1){
-        ERR_PRINT("send_and_process_stream_request: write_precisely");
-        return -1;
-    }
-
-    // 3. Get the file size
-    uint8_t file_size[4];
-    if(read(sockfd, &file_size, sizeof(uint32_t)) == -1){
-        ERR_PRINT("send_and_process_stream_request: read");
-        return -1;
-    }
-    
-    #ifdef DEBUG
-    printf("File size: %d\n", ntohl(*(uint32_t *)file_size));
-    #endif
-
-    // 4. Read the file from the server and write it to the audio_out_fd and file_dest_fd using select system call to wait for data to be available to read from the server connection/socket, as well as for when audio_out_fd and file_dest_fd (if applicable) are ready to be written to.
+static int _relay_stream_bytes(int sockfd, uint64_t bytes_to_read,
+                               int audio_out_fd, int file_dest_fd, uint32_t *crc) {
+    // Read the file from the server and write it to the audio_out_fd and file_dest_fd using select system call to wait for data to be available to read from the server connection/socket, as well as for when audio_out_fd and file_dest_fd (if applicable) are ready to be written to.
 
     int continue_reading = 1;
     int continue_writing_stdout = 1;
@@ -512,9 +1069,12 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
     if(file_dest_fd < 0){
         continue_writing_file = 0;
     }
-    int bytes_read = 0;
-    int bytes_written = 0;
-    int bytes_to_read = ntohl(*(uint32_t *)file_size);
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    // An empty range has nothing to wait for
+    if(bytes_to_read == 0){
+        continue_reading = 0;
+    }
 
     char buffer[1024];
     fd_set read_fds;
@@ -541,17 +1101,22 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
 
         //Read from the server
         if(FD_ISSET(sockfd, &read_fds)){
-            int num = read(sockfd, buffer, MIN(bytes_to_read, 1024));
+            int num = read(sockfd, buffer, MIN(bytes_to_read, sizeof(buffer)));
             if(num == -1){
                 ERR_PRINT("send_and_process_stream_request: read");
                 return -1;
             }
             else if(num == 0){
-                continue_reading = 0;
+                // The server went away before sending everything
+                ERR_PRINT("send_and_process_stream_request: connection closed early\n");
+                return -1;
             }
             else{
                 bytes_read += num;
                 bytes_to_read -= num;
+                if(trailer_agreed){
+                    *crc = crc32c(*crc, buffer, num);
+                }
                 if(audio_out_fd >= 0){
                     if(write(audio_out_fd, buffer, num) == -1){
                         ERR_PRINT("send_and_process_stream_request: write");
@@ -569,7 +1134,7 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
 
         //Write to the audio_out_fd
         if(continue_writing_stdout && audio_out_fd && FD_ISSET(audio_out_fd, &write_fds)){
-            int num = read(audio_out_fd, buffer, MIN(bytes_to_read, 1024));
+            int num = read(audio_out_fd, buffer, MIN(bytes_to_read, sizeof(buffer)));
             if(num == -1){
                 ERR_PRINT("send_and_process_stream_request: read");
                 return -1;
@@ -598,7 +1163,7 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
 
         //Write to the file_dest_fd
         if(continue_writing_file && file_dest_fd && FD_ISSET(file_dest_fd, &write_fds)){
-            int num = read(file_dest_fd, buffer, MIN(bytes_to_read, 1024));
+            int num = read(file_dest_fd, buffer, MIN(bytes_to_read, sizeof(buffer)));
             if(num == -1){
                 ERR_PRINT("send_and_process_stream_request: read");
                 return -1;
@@ -631,29 +1196,514 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
         }
     }
 
-    // 5. Close the file descriptors
+    return 0;
+}
+
+
+/*
+** Helper for: _process_stream_response
+** Receive a file in transport encoding (see as_server.h), after its size
+** marker, and write it out decoded to audio_out_fd and file_dest_fd (where
+** they are not < 0), hashing it into *crc.
+**
+** returns 0 on success, -1 on error
+*/
+static int _receive_encoded(int sockfd, int audio_out_fd, int file_dest_fd, uint32_t *crc) {
+    uint64_t file_size_nbo;
+    if(read_precisely(sockfd, &file_size_nbo, sizeof(uint64_t)) != sizeof(uint64_t)){
+        ERR_PRINT("send_and_process_stream_request: read");
+        return -1;
+    }
+    uint64_t file_size = be64toh(file_size_nbo);
+    #ifdef DEBUG
+    printf("File size: %lu, receiving encoded\n", (unsigned long)file_size);
+    #endif
+
+    // A frame, then the block it decodes to
+    uint8_t *frame = (uint8_t *)malloc(PCM_FRAME_MAX + PCM_BLOCK_MAX);
+    if(frame == NULL){
+        perror("send_and_process_stream_request: malloc");
+        return -1;
+    }
+    uint8_t *block = frame + PCM_FRAME_MAX;
+    uint64_t decoded = 0;
+    int result = 0;
+    while(result == 0){
+        uint32_t frame_len_nbo;
+        if(read_precisely(sockfd, &frame_len_nbo, sizeof(uint32_t)) != sizeof(uint32_t)){
+            ERR_PRINT("send_and_process_stream_request: read");
+            result = -1;
+            break;
+        }
+        uint32_t frame_len = ntohl(frame_len_nbo);
+        if(frame_len == 0){
+            break;
+        }
+        if(frame_len > PCM_FRAME_MAX){
+            ERR_PRINT("send_and_process_stream_request: frame of %u bytes\n", frame_len);
+            result = -1;
+            break;
+        }
+        if(read_precisely(sockfd, frame, frame_len) != (int)frame_len){
+            ERR_PRINT("send_and_process_stream_request: read");
+            result = -1;
+            break;
+        }
+
+        ssize_t len = pcm_decode(frame, frame_len, block);
+        if(len < 0 || decoded + len > file_size){
+            ERR_PRINT("send_and_process_stream_request: malformed frame\n");
+            result = -1;
+            break;
+        }
+        if(trailer_agreed){
+            *crc = crc32c(*crc, block, len);
+        }
+        if((audio_out_fd >= 0 && write_precisely(audio_out_fd, block, len) < 0) ||
+           (file_dest_fd >= 0 && write_precisely(file_dest_fd, block, len) < 0)){
+            ERR_PRINT("send_and_process_stream_request: write");
+            result = -1;
+            break;
+        }
+        decoded += len;
+    }
+    free(frame);
+
+    if(result == 0 && decoded != file_size){
+        ERR_PRINT("send_and_process_stream_request: %lu of %lu bytes decoded\n",
+                  (unsigned long)decoded, (unsigned long)file_size);
+        result = -1;
+    }
+    return result;
+}
+
+
+/*
+** Helper for: send_and_process_stream_request, send_and_process_stream_range_request,
+**             pipeline_receive
+** Receive the size header and the data of a stream response, see
+** send_and_process_stream_request for how it is written out. For a STREAMIF
+** response, if_file is the local copy: it is kept if the server says it is up
+** to date, else the download replaces it.
+*/
+static int _process_stream_response(int sockfd, int audio_out_fd, int file_dest_fd,
+                                    const char *if_file) {
+    // 1. Get the file size, its width depends on the protocol version
+    uint64_t file_size;
+    if(protocol_version >= PROTOCOL_VERSION_2){
+        uint64_t file_size_nbo;
+        if(read_precisely(sockfd, &file_size_nbo, sizeof(uint64_t)) != sizeof(uint64_t)){
+            ERR_PRINT("send_and_process_stream_request: read");
+            return -1;
+        }
+        file_size = be64toh(file_size_nbo);
+    } else {
+        uint32_t file_size_nbo;
+        if(read_precisely(sockfd, &file_size_nbo, sizeof(uint32_t)) != sizeof(uint32_t)){
+            ERR_PRINT("send_and_process_stream_request: read");
+            return -1;
+        }
+        file_size = ntohl(file_size_nbo);
+    }
+
+    // 2. Relay the data, frame by frame if the server does not know its size yet
+    //    or encoded it
+    int result = 0;
+    uint32_t crc = 0;
+    DownloadOutcome outcome = DOWNLOAD_COMPLETE;
+    if(if_file != NULL && file_size == STREAM_SIZE_NOT_MODIFIED){
+        printf("%s is up to date\n", if_file);
+        outcome = DOWNLOAD_UNCHANGED;
+    } else if(pcm_agreed && file_size == STREAM_SIZE_ENCODED){
+        result = _receive_encoded(sockfd, audio_out_fd, file_dest_fd, &crc);
+    } else if(chunked_framing && file_size == STREAM_SIZE_CHUNKED){
+        #ifdef DEBUG
+        printf("File size: unknown, receiving chunked\n");
+        #endif
+        uint32_t frame_len_nbo;
+        while(result == 0){
+            if(read_precisely(sockfd, &frame_len_nbo, sizeof(uint32_t)) != sizeof(uint32_t)){
+                ERR_PRINT("send_and_process_stream_request: read");
+                result = -1;
+            } else if(frame_len_nbo == 0){
+                break;
+            } else {
+                result = _relay_stream_bytes(sockfd, ntohl(frame_len_nbo),
+                                             audio_out_fd, file_dest_fd, &crc);
+            }
+        }
+    } else {
+        #ifdef DEBUG
+        printf("File size: %lu\n", (unsigned long)file_size);
+        #endif
+        result = _relay_stream_bytes(sockfd, file_size, audio_out_fd, file_dest_fd, &crc);
+    }
+    if(result == -1){
+        outcome = DOWNLOAD_CUT;
+    }
+
+    // 3. Check the data against the trailer
+    if(result == 0 && outcome == DOWNLOAD_COMPLETE && trailer_agreed){
+        uint32_t trailer_nbo;
+        if(read_precisely(sockfd, &trailer_nbo, sizeof(uint32_t)) != sizeof(uint32_t)){
+            ERR_PRINT("send_and_process_stream_request: read");
+            result = -1;
+            outcome = DOWNLOAD_CUT;
+        } else if(ntohl(trailer_nbo) != crc){
+            ERR_PRINT("Data damaged on the way (CRC32C %08x, expected %08x)\n",
+                      crc, ntohl(trailer_nbo));
+            result = -1;
+            outcome = DOWNLOAD_CORRUPT;
+        }
+    }
+
+    // 4. Close the file descriptors
     if(audio_out_fd >= 0){
         close(audio_out_fd);
     }
     if(file_dest_fd >= 0){
-        close(file_dest_fd);
+        _finish_download(file_dest_fd, outcome);
     }
-    // close(audio_out_fd);
-    // close(file_dest_fd);
 
+    return result;
+}
+
+
+/*
+** Sends a stream request for the particular file_index to the server and sends the audio
+** stream to the audio_out_fd and file_dest_fd file descriptors
+** -- provided that they are not < 0.
+**
+** The select system call should be used to simultaneously wait for data to be available
+** to read from the server connection/socket, as well as for when audio_out_fd and file_dest_fd
+** (if applicable) are ready to be written to. Differing numbers of bytes may be written to
+** at each time (do no use write_precisely for this purpose -- you will nor receive full marks)
+** audio_out_fd and file_dest_fd, and this must be handled.
+**
+** One of audio_out_fd or file_dest_fd can be -1, but not both. File descriptors >= 0
+** should be closed before the function returns.
+**
+** This function will leverage a dynamic circular buffer with two output streams
+** and one input stream. The input stream is the server connection/socket, and the output
+** streams are audio_out_fd and file_dest_fd. The buffer should be dynamically sized using
+** realloc. See the assignment handout for more information, and notice how realloc is used
+** to manage the library.files in this client and the server.
+**
+** Phrased differently, this uses a FIFO with two independent out streams and one in stream,
+** but because it is as long as needed, we call it circular, and just point to three different
+** parts of it.
+**
+** returns 0 on success, -1 on error
+*/
+
+/*
+** Helper for: send_and_process_stream_request, pipeline_stream_request
+** Send a STREAM request for file_index, the request line and its argument in
+** one write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_request(int sockfd, uint32_t file_index) {
+    char *stream_request = REQUEST_STREAM END_OF_MESSAGE_TOKEN;
+    size_t request_len = strlen(stream_request);
+    uint8_t request[sizeof(REQUEST_STREAM END_OF_MESSAGE_TOKEN) - 1 + sizeof(uint32_t)];
+    uint32_t file_index_nbo = htonl(_file_number(file_index));
+    memcpy(request, stream_request, request_len);
+    memcpy(request + request_len, &file_index_nbo, sizeof(uint32_t));
+    if(write_precisely(sockfd, request, sizeof(request)) == -1){
+        ERR_PRINT("send_and_process_stream_request: write_precisely");
+        return -1;
+    }
     return 0;
+}
+
 
-return - 1;
+/*
+** Helper for: pipeline_stream_batch_request
+** Send a STREAMBATCH request for num_files (at most STREAM_BATCH_MAX) files,
+** the request line and its arguments in one write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_batch_request(int sockfd, const uint32_t *file_indexes,
+                                      int num_files) {
+    char *batch_request = REQUEST_STREAM_BATCH END_OF_MESSAGE_TOKEN;
+    size_t request_len = strlen(batch_request);
+    uint8_t request[sizeof(REQUEST_STREAM_BATCH END_OF_MESSAGE_TOKEN) - 1
+                    + (1 + STREAM_BATCH_MAX) * sizeof(uint32_t)];
+    uint32_t num_files_nbo = htonl(num_files);
+    memcpy(request, batch_request, request_len);
+    memcpy(request + request_len, &num_files_nbo, sizeof(uint32_t));
+    for(int i = 0; i < num_files; i++){
+        uint32_t file_index_nbo = htonl(_file_number(file_indexes[i]));
+        memcpy(request + request_len + (1 + i) * sizeof(uint32_t),
+               &file_index_nbo, sizeof(uint32_t));
+    }
+    if(write_precisely(sockfd, request, request_len + (1 + num_files) * sizeof(uint32_t)) == -1){
+        ERR_PRINT("pipeline_stream_batch_request: write_precisely");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: pipeline_stream_if_request
+** Send a STREAMIF request for file_index with the checksum of the local copy,
+** the request line and its arguments in one write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_if_request(int sockfd, uint32_t file_index, uint32_t checksum) {
+    char *if_request = REQUEST_STREAM_IF END_OF_MESSAGE_TOKEN;
+    size_t request_len = strlen(if_request);
+    uint8_t request[sizeof(REQUEST_STREAM_IF END_OF_MESSAGE_TOKEN) - 1 + STREAM_IF_ARGS_SIZE];
+    uint32_t file_index_nbo = htonl(_file_number(file_index));
+    uint32_t checksum_nbo = htonl(checksum);
+    memcpy(request, if_request, request_len);
+    memcpy(request + request_len, &file_index_nbo, sizeof(uint32_t));
+    memcpy(request + request_len + sizeof(uint32_t), &checksum_nbo, sizeof(uint32_t));
+    if(write_precisely(sockfd, request, sizeof(request)) == -1){
+        ERR_PRINT("pipeline_stream_if_request: write_precisely");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: send_and_process_stream_tier_request
+** Send a STREAMTIER request for file_index at tier, the request line and its
+** arguments in one write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_tier_request(int sockfd, uint32_t file_index, uint32_t tier) {
+    char *tier_request = REQUEST_STREAM_TIER END_OF_MESSAGE_TOKEN;
+    size_t request_len = strlen(tier_request);
+    uint8_t request[sizeof(REQUEST_STREAM_TIER END_OF_MESSAGE_TOKEN) - 1 + STREAM_TIER_ARGS_SIZE];
+    uint32_t file_index_nbo = htonl(_file_number(file_index));
+    uint32_t tier_nbo = htonl(tier);
+    memcpy(request, tier_request, request_len);
+    memcpy(request + request_len, &file_index_nbo, sizeof(uint32_t));
+    memcpy(request + request_len + sizeof(uint32_t), &tier_nbo, sizeof(uint32_t));
+    if(write_precisely(sockfd, request, sizeof(request)) == -1){
+        ERR_PRINT("send_and_process_stream_tier_request: write_precisely");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: send_and_process_stream_range_request, pipeline_stream_range_request
+** Send a STREAMRANGE request, the request line and its arguments in one write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_range_request(int sockfd, uint32_t file_index,
+                                      uint64_t offset, uint64_t length) {
+    char *range_request = REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN;
+    size_t request_len = strlen(range_request);
+    uint8_t request[sizeof(REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN) - 1 + STREAM_RANGE_ARGS_SIZE];
+    uint32_t file_index_nbo = htonl(_file_number(file_index));
+    uint64_t offset_nbo = htobe64(offset);
+    uint64_t length_nbo = htobe64(length);
+    memcpy(request, range_request, request_len);
+    memcpy(request + request_len, &file_index_nbo, sizeof(uint32_t));
+    memcpy(request + request_len + sizeof(uint32_t), &offset_nbo, sizeof(uint64_t));
+    memcpy(request + request_len + sizeof(uint32_t) + sizeof(uint64_t),
+           &length_nbo, sizeof(uint64_t));
+    if(write_precisely(sockfd, request, sizeof(request)) == -1){
+        ERR_PRINT("send_and_process_stream_range_request: write_precisely");
+        return -1;
+    }
+    return 0;
+}
+
+
+int send_and_process_stream_request(int sockfd, uint32_t file_index,
+                                    int audio_out_fd, int file_dest_fd) {
+    // 1. Send the stream request and the file index to the server
+    if(_send_stream_request(sockfd, file_index) == -1){
+        return -1;
+    }
+
+    // 2. Receive the file
+    return _process_stream_response(sockfd, audio_out_fd, file_dest_fd, NULL);
+}
+
+
+int send_and_process_stream_range_request(int sockfd, uint32_t file_index,
+                                          uint64_t offset, uint64_t length,
+                                          int audio_out_fd, int file_dest_fd) {
+    // 1. Send the request line and its arguments
+    if(_send_stream_range_request(sockfd, file_index, offset, length) == -1){
+        return -1;
+    }
+
+    // 2. Receive the range
+    return _process_stream_response(sockfd, audio_out_fd, file_dest_fd, NULL);
+}
+
+
+int send_and_process_stream_tier_request(int sockfd, uint32_t file_index, uint32_t tier,
+                                         int audio_out_fd, int file_dest_fd) {
+    // 1. Send the request line and its arguments
+    if(_send_stream_tier_request(sockfd, file_index, tier) == -1){
+        return -1;
+    }
+
+    // 2. Receive the rendition
+    return _process_stream_response(sockfd, audio_out_fd, file_dest_fd, NULL);
+}
+
+
+void pipeline_init(RequestPipeline *pipeline, int sockfd) {
+    pipeline->sockfd = sockfd;
+    // A server that did not agree to pipelining gets one request at a time
+    pipeline->depth = pipelining_agreed ? PIPELINE_DEPTH : 1;
+    pipeline->first = 0;
+    pipeline->num_pending = 0;
+}
+
+
+/*
+** Helper for: pipeline_stream_request, pipeline_stream_range_request,
+**             pipeline_stream_if_request, pipeline_stream_batch_request
+** Make room for num_responses more responses, waiting on the oldest ones
+** while that would put more than the pipeline's depth in flight.
+**
+** returns 0 on success, -1 on error
+*/
+static int _pipeline_reserve(RequestPipeline *pipeline, int num_responses) {
+    while(pipeline->num_pending > 0 &&
+          pipeline->num_pending + num_responses > pipeline->depth){
+        if(pipeline_receive(pipeline) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: pipeline_stream_request, pipeline_stream_range_request,
+**             pipeline_stream_if_request, pipeline_stream_batch_request
+** Remember where the response to the request just sent goes.
+*/
+static void _pipeline_push(RequestPipeline *pipeline, int audio_out_fd, int file_dest_fd,
+                           const char *if_file) {
+    int last = (pipeline->first + pipeline->num_pending) % PIPELINE_DEPTH;
+    pipeline->pending[last].audio_out_fd = audio_out_fd;
+    pipeline->pending[last].file_dest_fd = file_dest_fd;
+    pipeline->pending[last].if_file = if_file;
+    pipeline->num_pending++;
+}
+
+
+int pipeline_stream_request(RequestPipeline *pipeline, uint32_t file_index,
+                            int audio_out_fd, int file_dest_fd) {
+    if(_pipeline_reserve(pipeline, 1) == -1 ||
+       _send_stream_request(pipeline->sockfd, file_index) == -1){
+        return -1;
+    }
+    _pipeline_push(pipeline, audio_out_fd, file_dest_fd, NULL);
+    return 0;
+}
+
+
+int pipeline_stream_range_request(RequestPipeline *pipeline, uint32_t file_index,
+                                  uint64_t offset, uint64_t length,
+                                  int audio_out_fd, int file_dest_fd) {
+    if(_pipeline_reserve(pipeline, 1) == -1 ||
+       _send_stream_range_request(pipeline->sockfd, file_index, offset, length) == -1){
+        return -1;
+    }
+    _pipeline_push(pipeline, audio_out_fd, file_dest_fd, NULL);
+    return 0;
+}
+
+
+int pipeline_stream_if_request(RequestPipeline *pipeline, uint32_t file_index,
+                               uint32_t checksum, int file_dest_fd, const char *if_file) {
+    if(_pipeline_reserve(pipeline, 1) == -1 ||
+       _send_stream_if_request(pipeline->sockfd, file_index, checksum) == -1){
+        return -1;
+    }
+    _pipeline_push(pipeline, -1, file_dest_fd, if_file);
+    return 0;
+}
+
+
+int pipeline_stream_batch_request(RequestPipeline *pipeline, const uint32_t *file_indexes,
+                                  const int *file_dest_fds, int num_files) {
+    if(num_files < 1 || num_files > STREAM_BATCH_MAX){
+        ERR_PRINT("pipeline_stream_batch_request: %d files in a batch\n", num_files);
+        return -1;
+    }
+    if(_pipeline_reserve(pipeline, num_files) == -1 ||
+       _send_stream_batch_request(pipeline->sockfd, file_indexes, num_files) == -1){
+        return -1;
+    }
+    // One response per file, back to back
+    for(int i = 0; i < num_files; i++){
+        _pipeline_push(pipeline, -1, file_dest_fds[i], NULL);
+    }
+    return 0;
+}
+
+
+int pipeline_receive(RequestPipeline *pipeline) {
+    if(pipeline->num_pending == 0){
+        return 0;
+    }
+    PendingStream oldest = pipeline->pending[pipeline->first];
+    pipeline->first = (pipeline->first + 1) % PIPELINE_DEPTH;
+    pipeline->num_pending--;
+    return _process_stream_response(pipeline->sockfd, oldest.audio_out_fd,
+                                    oldest.file_dest_fd, oldest.if_file);
+}
+
+
+int pipeline_drain(RequestPipeline *pipeline) {
+    while(pipeline->num_pending > 0){
+        if(pipeline_receive(pipeline) == -1){
+            // The connection is out of step, the other responses are lost
+            pipeline_abort(pipeline);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void pipeline_abort(RequestPipeline *pipeline) {
+    while(pipeline->num_pending > 0){
+        PendingStream *oldest = &pipeline->pending[pipeline->first];
+        if(oldest->audio_out_fd >= 0){
+            close(oldest->audio_out_fd);
+        }
+        if(oldest->file_dest_fd >= 0){
+            _finish_download(oldest->file_dest_fd, DOWNLOAD_CUT);
+        }
+        pipeline->first = (pipeline->first + 1) % PIPELINE_DEPTH;
+        pipeline->num_pending--;
+    }
 }
 
 
 static void _print_shell_help(){
     printf("Commands:\n");
     printf("  list: List the files in the library\n");
-    printf("  get <file_index>: Get a file from the library\n");
-    printf("  stream <file_index>: Stream a file from the library (without saving it)\n");
+    printf("  get <file_index> [<file_index> ...]: Get files from the library\n");
+    printf("  stream <file_index> [tier]: Stream a file from the library (without saving it),\n");
+    printf("                              at a lower quality tier if one is given\n");
     printf("  stream+ <file_index>: Stream a file from the library\n");
     printf("                        and save it to the local library\n");
+    printf("  seek <file_index> <offset>: Stream a file from the library,\n");
+    printf("                              starting at byte offset\n");
+    printf("  resume <file_index>: Finish getting a partially saved file\n");
     printf("  help: Display this help message\n");
     printf("  quit: Quit the client\n");
 }
@@ -666,9 +1716,12 @@ static void _print_shell_help(){
 ** user for a command and then calls the appropriate function to handle the
 ** command. The user can enter the following commands:
 ** - "list" to list the files in the library
-** - "get <file_index>" to get a file from the library
-** - "stream <file_index>" to stream a file from the library (without saving it)
+** - "get <file_index> [<file_index> ...]" to get files from the library
+** - "stream <file_index> [tier]" to stream a file from the library (without saving it), at
+**   one of the tiers the server lists if tier is given
 ** - "stream+ <file_index>" to stream a file from the library and save it to the local library
+** - "seek <file_index> <offset>" to stream a file from the library starting at byte offset
+** - "resume <file_index>" to get the rest of a partially saved file
 ** - "help" to display the help message
 ** - "quit" to quit the client
 */
@@ -702,28 +1755,46 @@ static int client_shell(int sockfd, const char *library_directory) {
             }
 
 
-        // Get Request -- get a file from the library
+        // Get Request -- get files from the library, all requested at once
         } else if (strcmp(command, CMD_GET) == 0) {
-            char *file_index_str = strtok(NULL, " \n");
-            if (file_index_str == NULL) {
-                printf("Usage: get <file_index>\n");
-                continue;
+            // Each index takes at least two characters of the command
+            uint32_t file_indexes[REQUEST_BUFFER_SIZE / 2];
+            int num_files = 0;
+            int valid = 1;
+            char *file_index_str;
+            while ((file_index_str = strtok(NULL, " \n")) != NULL) {
+                file_index = strtol(file_index_str, NULL, 10);
+                if (file_index < 0 || file_index >= library.num_files) {
+                    valid = 0;
+                    break;
+                }
+                file_indexes[num_files++] = file_index;
             }
-            file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
+            if (!valid) {
                 printf("Invalid file index\n");
                 continue;
             }
+            if (num_files == 0) {
+                printf("Usage: get <file_index> [<file_index> ...]\n");
+                continue;
+            }
 
-            if (get_file_request(sockfd, file_index, &library) == -1) {
+            int result;
+            if (num_files == 1) {
+                result = get_file_request(sockfd, file_indexes[0], &library);
+            } else {
+                result = get_files_request(sockfd, file_indexes, num_files, &library);
+            }
+            if (result == -1) {
                 goto error;
             }
 
         // Stream Request -- stream a file from the library (without saving it)
         } else if (strcmp(command, CMD_STREAM) == 0) {
             char *file_index_str = strtok(NULL, " \n");
+            char *tier_str = strtok(NULL, " \n");
             if (file_index_str == NULL) {
-                printf("Usage: stream <file_index>\n");
+                printf("Usage: stream <file_index> [tier]\n");
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
@@ -732,7 +1803,9 @@ static int client_shell(int sockfd, const char *library_directory) {
                 continue;
             }
 
-            if (stream_request(sockfd, file_index) == -1) {
+            uint32_t tier = tier_str == NULL ? 0 : strtoul(tier_str, NULL, 10);
+            if ((tier == 0 ? stream_request(sockfd, file_index)
+                           : stream_tier_request(sockfd, file_index, tier)) == -1) {
                 goto error;
             }
 
@@ -753,6 +1826,41 @@ static int client_shell(int sockfd, const char *library_directory) {
                 goto error;
             }
 
+        // Seek Request -- stream a file from the library starting at an offset
+        } else if (strcmp(command, CMD_SEEK) == 0) {
+            char *file_index_str = strtok(NULL, " \n");
+            char *offset_str = strtok(NULL, " \n");
+            if (file_index_str == NULL || offset_str == NULL) {
+                printf("Usage: seek <file_index> <offset>\n");
+                continue;
+            }
+            file_index = strtol(file_index_str, NULL, 10);
+            if (file_index < 0 || file_index >= library.num_files) {
+                printf("Invalid file index\n");
+                continue;
+            }
+
+            if (seek_stream_request(sockfd, file_index, strtoull(offset_str, NULL, 10)) == -1) {
+                goto error;
+            }
+
+        // Resume Request -- get the rest of a partially saved file
+        } else if (strcmp(command, CMD_RESUME) == 0) {
+            char *file_index_str = strtok(NULL, " \n");
+            if (file_index_str == NULL) {
+                printf("Usage: resume <file_index>\n");
+                continue;
+            }
+            file_index = strtol(file_index_str, NULL, 10);
+            if (file_index < 0 || file_index >= library.num_files) {
+                printf("Invalid file index\n");
+                continue;
+            }
+
+            if (resume_file_request(sockfd, file_index, &library) == -1) {
+                goto error;
+            }
+
         } else if (strcmp(command, CMD_HELP) == 0) {
             _print_shell_help();
 
@@ -820,6 +1928,11 @@ int main(int argc, char * const *argv) {
         return -1;
     }
 
+    if (hello_request(sockfd) == -1) {
+        close(sockfd);
+        return -1;
+    }
+
     int result = client_shell(sockfd, library_directory);
     if (result == -1) {
         close(sockfd);
@@ -5,6 +5,8 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "libas.h"
+#include "as_crc.h"
+#include "as_pcm.h"
 
 /*
 ** The following constants are used to define a separate process that
@@ -27,6 +29,10 @@
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 
+// How long to wait for the server to answer HELLO before assuming it is
+// too old to know the request
+#define HELLO_TIMEOUT_SEC 1
+
 // Buffer size to receive network data
 // before the dynamically changing one
 #define NETWORK_PRE_DYNAMIC_BUFF_SIZE 8192
@@ -34,6 +40,34 @@
 // Student's don't need to change this
 #define BUFFER_BLEED_OFF 1
 
+// A download is written next to the local copy under this suffix, and only
+// renamed into place once it is complete (and its trailer matched, if the
+// server agreed to PROTOCOL_FEATURE_TRAILER)
+#define DOWNLOAD_SUFFIX ".part"
+
+/*
+** A file being downloaded: path is the local copy, written through
+** path DOWNLOAD_SUFFIX unless in_place (a copy cut short by an older client
+** is continued where it is), start is the size it had before the response.
+*/
+typedef struct download {
+    char *path;
+    uint8_t in_place;
+    off_t start;
+} Download;
+
+// How a response left the download it was written to, see Download
+typedef enum download_outcome {
+    DOWNLOAD_COMPLETE,
+    DOWNLOAD_UNCHANGED,     // the local copy was up to date
+    DOWNLOAD_CORRUPT,       // the trailer did not match
+    DOWNLOAD_CUT,           // the response did not arrive
+} DownloadOutcome;
+
+// How many responses a RequestPipeline awaits before it waits on the oldest
+// one, at least STREAM_BATCH_MAX for a whole batch to fit
+#define PIPELINE_DEPTH 16
+
 /*
 ** Client shell commands and constants**
 ** -----------------------------------
@@ -42,10 +76,28 @@
 #define CMD_GET "get"
 #define CMD_STREAM "stream"
 #define CMD_STREAM_AND_GET "stream+"
+#define CMD_SEEK "seek"
+#define CMD_RESUME "resume"
 #define CMD_QUIT "quit"
 #define CMD_HELP "help"
 
 
+/*
+** Sends a HELLO request to the server to negotiate the protocol version
+** (see the Design in as_server.h): the highest version this client speaks,
+** with chunked framing. Every later request uses the version agreed on, and
+** WAV files the server sends in transport encoding are decoded back to the
+** same bytes as they arrive (see as_pcm.h). The tiers the server offers for
+** STREAMTIER are kept from its LISTSINCE responses. A
+** server that does not answer within HELLO_TIMEOUT_SEC is assumed to only
+** speak PROTOCOL_VERSION_1.
+**
+** Must be the first request sent on the connection.
+**
+** returns the protocol version in use on success, -1 on error
+*/
+int hello_request(int sockfd);
+
 /*
 ** Sends a list request to the server and prints the list of files in the
 ** library. Also parses the list of files and stores it in the list parameter.
@@ -56,6 +108,11 @@
 **
 ** You may free and malloc or realloc the library->files array as preferred.
 **
+** If the server speaks PROTOCOL_VERSION_2, a LISTSINCE request is sent instead
+** of LIST, and only the changes since library->generation are applied to the
+** library in place (the whole list the first time, or when the server no
+** longer has the changes).
+**
 ** returns the length of the new library on success, -1 on error
 */
 int list_request(int sockfd, Library *library);
@@ -69,10 +126,45 @@ int list_request(int sockfd, Library *library);
 ** should invoke send_and_process_stream_request such that the file data
 ** received is saved to an identical file in the local library_directory.
 **
+** If the server agreed to PROTOCOL_FEATURE_CHECKSUM and the file is already
+** in the local library directory, a STREAMIF request with the CRC32C of the
+** local copy is sent instead, and the copy is only replaced if the server's
+** file differs.
+**
+** The file is received into its DOWNLOAD_SUFFIX file, renamed over the local
+** copy once complete. A download whose trailer does not match is discarded,
+** one cut short is left for resume_file_request.
+**
 ** returns 0 on success, -1 on error
 */
 int get_file_request(int sockfd, uint32_t file_index, const Library * library);
 
+/*
+** Like get_file_request, for num_files files at once: the files are asked for
+** in STREAMBATCH requests of up to STREAM_BATCH_MAX files (or one STREAM
+** request each if the server does not know STREAMBATCH), sent through a
+** RequestPipeline, so the files arrive back-to-back instead of one round trip
+** apart. Files already in the local library directory are asked for with a
+** STREAMIF request each, like in get_file_request.
+**
+** returns 0 on success, -1 on error
+*/
+int get_files_request(int sockfd, const uint32_t *file_indexes, int num_files,
+                      const Library * library);
+
+/*
+** Sends a stream range request to the server for the bytes of the file that
+** are not in the local library directory yet, and appends them to the
+** download cut short (or to the local copy if there is none, creating it if
+** it does not exist). The AUDIO_PLAYER is not started. If the trailer of the
+** range does not match, the range is cut off again.
+**
+** See send_and_process_stream_range_request for more information.
+**
+** returns 0 on success, -1 on error
+*/
+int resume_file_request(int sockfd, uint32_t file_index, const Library * library);
+
 /*
 ** Starts the audio player process and returns the file descriptor of
 ** the write end of a pipe connected to the audio player's stdin.
@@ -98,6 +190,23 @@ int start_audio_player_process(int *audio_out_fd);
 */
 int stream_request(int sockfd, uint32_t file_index);
 
+/*
+** Sends a STREAMTIER request to the server for the file at tier (one of those
+** list_request printed), and starts the audio player process, like
+** stream_request. A tier the server does not offer is not asked for.
+**
+** returns 0 on success, -1 on error
+*/
+int stream_tier_request(int sockfd, uint32_t file_index, uint32_t tier);
+
+/*
+** Sends a stream range request to the server for the file from byte offset on,
+** and starts the audio player process, like stream_request.
+**
+** returns 0 on success, -1 on error
+*/
+int seek_stream_request(int sockfd, uint32_t file_index, uint64_t offset);
+
 /*
 ** Sends a stream request to the server, starts the audio player process and creates
 ** a file to store the incoming audio stream.
@@ -124,6 +233,11 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
 **
 ** One of audio_out_fd or file_dest_fd can be -1, but not both. File descriptors >= 0
 ** should be closed before the function returns.
+** A file_dest_fd opened for a download (see get_file_request) is renamed into
+** place if the whole file arrived.
+**
+** If the server agreed to PROTOCOL_FEATURE_TRAILER, the data is checked against
+** the CRC32C that follows it, and a mismatch is an error.
 **
 ** This function will leverage a dynamic circular buffer with two output streams
 ** and one input stream. The input stream is the server connection/socket, and the output
@@ -140,4 +254,132 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
 int send_and_process_stream_request(int sockfd, uint32_t file_index,
                                     int audio_out_fd, int file_dest_fd);
 
+/*
+** Like send_and_process_stream_request, but only for the length bytes of the
+** file starting at offset (STREAM_RANGE_TO_END for the rest of the file). The
+** server cuts the range short at the end of the file, and the data received is
+** handled exactly as in send_and_process_stream_request.
+**
+** returns 0 on success, -1 on error
+*/
+int send_and_process_stream_range_request(int sockfd, uint32_t file_index,
+                                          uint64_t offset, uint64_t length,
+                                          int audio_out_fd, int file_dest_fd);
+
+/*
+** Like send_and_process_stream_request, but for the file's rendition at tier
+** (see as_tier.h), which the server may have to render first. The data
+** received is handled exactly as in send_and_process_stream_request.
+**
+** returns 0 on success, -1 on error
+*/
+int send_and_process_stream_tier_request(int sockfd, uint32_t file_index, uint32_t tier,
+                                         int audio_out_fd, int file_dest_fd);
+
+
+/*
+** Pipelining
+** ----------
+** The server answers requests in the order they were sent, and reads the next
+** one as soon as it is done with the last, so a client does not have to wait
+** for a response before sending its next request. A RequestPipeline sends
+** STREAM, STREAMRANGE, STREAMIF and STREAMBATCH requests as they are queued, and
+** remembers where each response goes until it is received:
+**
+**     RequestPipeline pipeline;
+**     pipeline_init(&pipeline, sockfd);
+**     for (...) pipeline_stream_request(&pipeline, file_index, -1, fd);
+**     pipeline_drain(&pipeline);
+**
+** At most PIPELINE_DEPTH responses are awaited (one, unless the server agreed
+** to PROTOCOL_FEATURE_PIPELINE in HELLO), each file of a STREAMBATCH counting
+** as one: queueing more first receives the oldest ones. Responses to LIST,
+** LISTSINCE and HELLO are read line by line, so they must not be sent while
+** requests are in flight.
+*/
+// if_file: the local file a STREAMIF response may leave as it is, NULL for
+// other requests
+typedef struct pending_stream {
+    int audio_out_fd;
+    int file_dest_fd;
+    const char *if_file;
+} PendingStream;
+
+typedef struct request_pipeline {
+    int sockfd;
+    int depth;          // How many requests may be in flight
+    PendingStream pending[PIPELINE_DEPTH];
+    int first;          // The oldest request still waiting on its response
+    int num_pending;
+} RequestPipeline;
+
+/*
+** Start an empty pipeline of requests on the connection sockfd.
+*/
+void pipeline_init(RequestPipeline *pipeline, int sockfd);
+
+/*
+** Send a stream request for file_index, whose data will go to audio_out_fd
+** and file_dest_fd like in send_and_process_stream_request (which closes them
+** once it is received), without waiting for the response.
+**
+** returns 0 on success, -1 on error (the file descriptors are left open)
+*/
+int pipeline_stream_request(RequestPipeline *pipeline, uint32_t file_index,
+                            int audio_out_fd, int file_dest_fd);
+
+/*
+** Like pipeline_stream_request, for a stream range request (see
+** send_and_process_stream_range_request).
+**
+** returns 0 on success, -1 on error (the file descriptors are left open)
+*/
+int pipeline_stream_range_request(RequestPipeline *pipeline, uint32_t file_index,
+                                  uint64_t offset, uint64_t length,
+                                  int audio_out_fd, int file_dest_fd);
+
+/*
+** Send a STREAMIF request for file_index, whose local copy at if_file has the
+** CRC32C checksum (the server must have agreed to PROTOCOL_FEATURE_CHECKSUM),
+** without waiting for the response. file_dest_fd must be open for writing at
+** the start of the local copy without truncating it: it is only truncated
+** and written if the server sends the file.
+**
+** returns 0 on success, -1 on error (the file descriptor is left open)
+*/
+int pipeline_stream_if_request(RequestPipeline *pipeline, uint32_t file_index,
+                               uint32_t checksum, int file_dest_fd, const char *if_file);
+
+/*
+** Send a STREAMBATCH request for num_files files (1 to STREAM_BATCH_MAX, and
+** the server must have agreed to PROTOCOL_FEATURE_BATCH), the data of each
+** going to file_dest_fds[i], without waiting for the responses. Each file is
+** a response of its own in the pipeline.
+**
+** returns 0 on success, -1 on error (the file descriptors are left open)
+*/
+int pipeline_stream_batch_request(RequestPipeline *pipeline, const uint32_t *file_indexes,
+                                  const int *file_dest_fds, int num_files);
+
+/*
+** Receive the response to the oldest request in flight, if any.
+**
+** returns 0 on success, -1 on error
+*/
+int pipeline_receive(RequestPipeline *pipeline);
+
+/*
+** Receive the responses to every request in flight.
+**
+** returns 0 on success, -1 on error (the connection is then out of step
+** with the server)
+*/
+int pipeline_drain(RequestPipeline *pipeline);
+
+/*
+** Give up on the requests in flight, closing their file descriptors. The
+** connection is out of step with the server afterwards.
+*/
+void pipeline_abort(RequestPipeline *pipeline);
+
 #endif // AS_CLIENT_H_
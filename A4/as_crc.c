@@ -0,0 +1,193 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_crc.h"
+
+
+typedef uint32_t (*CrcKernel)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc_tables[8][256];
+// crc_shift_tables[k][b]: byte k of a checksum being b, shifted over
+// CRC_LANE_SIZE zero bytes
+static uint32_t crc_shift_tables[4][256];
+static CrcKernel crc_kernel = NULL;
+static const char *crc_kernel_name = NULL;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+/*
+** Slicing-by-8: crc_tables[0] is the usual byte at a time table, and
+** crc_tables[k][b] is the CRC of byte b followed by k zero bytes, so eight
+** lookups fold in 8 bytes at once.
+*/
+static uint32_t _crc32c_slicing(uint32_t crc, const uint8_t *buf, size_t len) {
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = crc_tables[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t low, high;
+        memcpy(&low, buf, sizeof(uint32_t));
+        memcpy(&high, buf + sizeof(uint32_t), sizeof(uint32_t));
+        low = le32toh(low) ^ crc;
+        high = le32toh(high);
+        crc = crc_tables[7][low & 0xff] ^ crc_tables[6][(low >> 8) & 0xff] ^
+              crc_tables[5][(low >> 16) & 0xff] ^ crc_tables[4][low >> 24] ^
+              crc_tables[3][high & 0xff] ^ crc_tables[2][(high >> 8) & 0xff] ^
+              crc_tables[1][(high >> 16) & 0xff] ^ crc_tables[0][high >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc_tables[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+/*
+** Helper for: _crc32c_sse42
+** returns crc followed by CRC_LANE_SIZE zero bytes
+*/
+static uint32_t _crc_shift(uint32_t crc) {
+    return crc_shift_tables[0][crc & 0xff] ^ crc_shift_tables[1][(crc >> 8) & 0xff] ^
+           crc_shift_tables[2][(crc >> 16) & 0xff] ^ crc_shift_tables[3][crc >> 24];
+}
+
+
+/*
+** The crc32 instruction, 8 bytes at a time once buf is aligned, on three
+** lanes at once while there are three lanes' worth left.
+*/
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len) {
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+        len--;
+    }
+    uint64_t crc64 = crc;
+    while (len >= 3 * CRC_LANE_SIZE) {
+        // The 2nd and 3rd lanes start from 0, their checksums are what the
+        // lanes before them shifted over them adds to
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC_LANE_SIZE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, buf + i, sizeof(uint64_t));
+            memcpy(&word1, buf + CRC_LANE_SIZE + i, sizeof(uint64_t));
+            memcpy(&word2, buf + 2 * CRC_LANE_SIZE + i, sizeof(uint64_t));
+            crc64 = __builtin_ia32_crc32di(crc64, word0);
+            crc1 = __builtin_ia32_crc32di(crc1, word1);
+            crc2 = __builtin_ia32_crc32di(crc2, word2);
+        }
+        crc64 = _crc_shift(_crc_shift(crc64) ^ crc1) ^ crc2;
+        buf += 3 * CRC_LANE_SIZE;
+        len -= 3 * CRC_LANE_SIZE;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(uint64_t));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+
+/*
+** Helper for: crc32c, crc32c_kernel
+** Build the tables and pick the kernel, once.
+*/
+static void _crc_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc_tables[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc_tables[k - 1][b];
+            crc_tables[k][b] = crc_tables[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    // Shifting is linear: shift each bit on its own, one zero byte at a time
+    uint32_t shifted_bits[32];
+    for (int bit = 0; bit < 32; bit++) {
+        uint32_t crc = 1U << bit;
+        for (int i = 0; i < CRC_LANE_SIZE; i++) {
+            crc = crc_tables[0][crc & 0xff] ^ (crc >> 8);
+        }
+        shifted_bits[bit] = crc;
+    }
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t crc = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (b & (1U << bit)) {
+                    crc ^= shifted_bits[8 * k + bit];
+                }
+            }
+            crc_shift_tables[k][b] = crc;
+        }
+    }
+
+    crc_kernel = _crc32c_slicing;
+    crc_kernel_name = "slicing-by-8";
+    #if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_kernel = _crc32c_sse42;
+        crc_kernel_name = "sse4.2";
+    }
+    #endif
+}
+
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, _crc_init);
+    return ~crc_kernel(~crc, (const uint8_t *)buf, len);
+}
+
+
+int crc32c_fd(int fd, uint32_t *crc) {
+    uint8_t *buf = (uint8_t *)malloc(CRC_READ_SIZE);
+    if (buf == NULL) {
+        perror("crc32c_fd: malloc");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint32_t result = 0;
+    off_t offset = 0;
+    ssize_t num;
+    while ((num = pread(fd, buf, CRC_READ_SIZE, offset)) != 0) {
+        if (num < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("crc32c_fd: pread");
+            free(buf);
+            return -1;
+        }
+        result = crc32c(result, buf, num);
+        offset += num;
+    }
+    free(buf);
+    *crc = result;
+    return 0;
+}
+
+
+const char *crc32c_kernel(void) {
+    pthread_once(&crc_once, _crc_init);
+    return crc_kernel_name;
+}
@@ -0,0 +1,53 @@
+#ifndef AS_CRC_H_
+#define AS_CRC_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <pthread.h>
+
+/*
+** Design
+** ------
+** Client and server both hash whole audio files to tell whether a copy is
+** the same as the original, so the hash has to keep up with the disk. It is
+** CRC32C (Castagnoli), which x86-64 computes in hardware: with SSE4.2 the
+** crc32 instruction takes 8 bytes at a time. Each crc32 has to wait for the
+** one before it, but the CPU can start a new one every cycle, so long buffers
+** are hashed as three lanes of CRC_LANE_SIZE bytes at once, and the three
+** results folded together (shifting a checksum over CRC_LANE_SIZE zero bytes
+** is a table lookup, built with the others). Other CPUs use slicing-by-8, a
+** table-driven version also taking 8 bytes per step, through 8 tables of 256
+** entries built on first use. Both give the same result, the one to use is
+** picked once, at run time.
+**
+** crc32c(0, ...) starts a checksum, and passing a previous result instead of
+** 0 continues it: crc32c(crc32c(0, a, n), b, m) is the checksum of a then b.
+*/
+
+#define CRC32C_POLY 0x82F63B78  // reflected
+#define CRC_READ_SIZE (256 * 1024)
+#define CRC_LANE_SIZE 4096
+
+
+/*
+** returns the CRC32C of the len bytes at buf, continuing crc (0 to start)
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+** Compute the CRC32C of everything in fd, from its start to its end, read
+** CRC_READ_SIZE bytes at a time (the file offset is left alone).
+**
+** returns 0 on success, -1 on error
+*/
+int crc32c_fd(int fd, uint32_t *crc);
+
+/*
+** returns the name of the kernel crc32c uses, for the benchmarks
+*/
+const char *crc32c_kernel(void);
+
+#endif // AS_CRC_H_
@@ -0,0 +1,157 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_index.h"
+#include "as_checksum.h"
+
+
+int index_save(const char *library_path, char *const *files, const FileInfo *info,
+               uint32_t num_files) {
+    size_t names_size = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        names_size += strlen(files[i]) + 1;
+    }
+    if (names_size > UINT32_MAX) {
+        ERR_PRINT("index_save: too many names for an index\n");
+        return -1;
+    }
+    IndexEntry *entries = (IndexEntry *)malloc((num_files + 1) * sizeof(IndexEntry));
+    char *names = (char *)malloc(names_size + 1);
+    if (entries == NULL || names == NULL) {
+        perror("index_save: malloc");
+        free(entries);
+        free(names);
+        return -1;
+    }
+
+    IndexHeader header = {INDEX_MAGIC, INDEX_VERSION, num_files, 0};
+    for (uint32_t i = 0; i < num_files; i++) {
+        entries[i].info = info[i];
+        entries[i].name_offset = header.names_size;
+        entries[i].flags = 0;
+        entries[i].checksum = 0;
+        entries[i].reserved = 0;
+        if (checksum_lookup(&info[i], &entries[i].checksum) == 0) {
+            entries[i].flags |= INDEX_HAS_CHECKSUM;
+        }
+        size_t len = strlen(files[i]) + 1;
+        memcpy(names + header.names_size, files[i], len);
+        header.names_size += len;
+    }
+
+    // One temporary file per process, the prefork workers all write one
+    char tmp_name[MAX_PATH];
+    snprintf(tmp_name, sizeof(tmp_name), INDEX_FILENAME ".%d.tmp", getpid());
+    char *tmp_path = _join_path(library_path, tmp_name);
+    char *path = _join_path(library_path, INDEX_FILENAME);
+    int result = -1;
+    int fd = -1;
+    if (tmp_path == NULL || path == NULL) {
+        goto free_index;
+    }
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("index_save: open");
+        goto free_index;
+    }
+    if (write_precisely(fd, &header, sizeof(header)) < 0 ||
+        write_precisely(fd, entries, num_files * sizeof(IndexEntry)) < 0 ||
+        write_precisely(fd, names, header.names_size) < 0) {
+        ERR_PRINT("index_save: could not write %s\n", tmp_path);
+        unlink(tmp_path);
+        goto free_index;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("index_save: rename");
+        unlink(tmp_path);
+        goto free_index;
+    }
+    result = 0;
+    #ifdef DEBUG
+    printf("Wrote the index of %u files to %s\n", num_files, path);
+    #endif
+
+free_index:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmp_path);
+    free(path);
+    free(entries);
+    free(names);
+    return result;
+}
+
+
+/*
+** Helper for: index_open
+** returns 1 if the mapped index of size bytes is one this server can read
+*/
+static int _is_valid_index(const uint8_t *map, size_t size) {
+    const IndexHeader *header = (const IndexHeader *)map;
+    if (size < sizeof(IndexHeader) ||
+        memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION ||
+        sizeof(IndexHeader) + (uint64_t)header->num_files * sizeof(IndexEntry)
+            + header->names_size != size) {
+        return 0;
+    }
+    const IndexEntry *entries = (const IndexEntry *)(map + sizeof(IndexHeader));
+    const char *names = (const char *)(entries + header->num_files);
+    if (header->num_files > 0 &&
+        (header->names_size == 0 || names[header->names_size - 1] != '\0')) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->num_files; i++) {
+        if (entries[i].name_offset >= header->names_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int index_open(const char *library_path, IndexMap *index) {
+    char *path = _join_path(library_path, INDEX_FILENAME);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // No index yet, the library is scanned
+        free(path);
+        return -1;
+    }
+
+    struct stat st;
+    index->map = MAP_FAILED;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        (index->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        ERR_PRINT("index_open: could not map %s\n", path);
+        close(fd);
+        free(path);
+        return -1;
+    }
+    close(fd);
+    index->size = st.st_size;
+    if (!_is_valid_index(index->map, index->size)) {
+        ERR_PRINT("index_open: ignoring %s, it is not a valid index\n", path);
+        index_close(index);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    const IndexHeader *header = (const IndexHeader *)index->map;
+    index->num_files = header->num_files;
+    index->entries = (const IndexEntry *)(index->map + sizeof(IndexHeader));
+    index->names = (const char *)(index->entries + header->num_files);
+    return 0;
+}
+
+
+void index_close(IndexMap *index) {
+    munmap(index->map, index->size);
+    index->map = MAP_FAILED;
+}
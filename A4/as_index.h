@@ -0,0 +1,106 @@
+#ifndef AS_INDEX_H_
+#define AS_INDEX_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <sys/mman.h>
+
+/*
+** Design
+** ------
+** Walking a big library before the server answers anything turns every
+** restart into an outage. So after each full walk the server writes its
+** library to an index file in the library directory, and on startup it maps
+** the index and serves those files straight away, while the first walk
+** reconciles them with the file system in the background (see as_library.h).
+**
+** The index is in host byte order, it never leaves the machine:
+**   - an IndexHeader,
+**   - num_files IndexEntry, one per file in library order: its FileInfo
+**     (so a file keeps its stable ID across restarts), where its name
+**     starts, and its CRC32C if the server has hashed that version of it
+**     (INDEX_HAS_CHECKSUM, see as_checksum.h),
+**   - names_size bytes of names: NUL-terminated paths relative to the library.
+** It is written under a temporary name and renamed over the old one, so a
+** server starting up never sees half an index. The name does not have a
+** SUPPORTED_FILE_EXTS extension, so the index is never part of the library.
+*/
+
+#define INDEX_FILENAME ".as_index"
+#define INDEX_MAGIC "ASINDEX"
+#define INDEX_VERSION 4
+
+// IndexEntry flags
+#define INDEX_HAS_CHECKSUM 0x1
+
+
+/*
+** What the server knows about a file: its stable ID (see as_library.h), and
+** its size, modification time, inode and device when it was last walked (0
+** until then). An inode number alone is only unique within one file system,
+** and a library may span several through mount points.
+*/
+typedef struct file_info {
+    uint32_t id;
+    uint32_t mtime_nsec;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint64_t inode;
+    uint64_t device;
+} FileInfo;
+
+
+typedef struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_files;
+    uint64_t names_size;
+} IndexHeader;
+
+
+typedef struct index_entry {
+    FileInfo info;
+    uint32_t name_offset;
+    uint32_t flags;
+    uint32_t checksum;
+    uint32_t reserved;
+} IndexEntry;
+
+
+/*
+** A mapped index: entries[i] is the file named names + entries[i].name_offset.
+*/
+typedef struct index_map {
+    uint8_t *map;
+    size_t size;
+    uint32_t num_files;
+    const IndexEntry *entries;
+    const char *names;
+} IndexMap;
+
+
+/*
+** Write the index of num_files files, with their info and the checksums
+** known for them, to INDEX_FILENAME in the directory at library_path.
+**
+** returns 0 on success, -1 on error
+*/
+int index_save(const char *library_path, char *const *files, const FileInfo *info,
+               uint32_t num_files);
+
+/*
+** Map the index in the directory at library_path, if there is a valid one.
+**
+** returns 0 on success, -1 if there is no usable index
+*/
+int index_open(const char *library_path, IndexMap *index);
+
+/*
+** Unmap an index opened with index_open.
+*/
+void index_close(IndexMap *index);
+
+#endif // AS_INDEX_H_
@@ -0,0 +1,1795 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_library.h"
+#include "as_checksum.h"
+
+
+static uint8_t _is_file_extension_supported(const char *filename){
+    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
+
+    for (int i = 0; i < sizeof(supported_file_exts)/sizeof(char *); i++) {
+        char *files_ext = strrchr(filename, '.');
+        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+** Helpers for: the library's and the walk's names
+** Reserve len bytes in arena, starting a new chunk if the first one is full.
+** returns the bytes, or NULL on error
+*/
+static char *_arena_alloc(Arena *arena, size_t len) {
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < len) {
+        size_t size = MAX(LIBRARY_ARENA_CHUNK_SIZE, len);
+        chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+        if (chunk == NULL) {
+            perror("library: malloc");
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    char *bytes = chunk->data + chunk->used;
+    chunk->used += len;
+    arena->used += len;
+    return bytes;
+}
+
+
+static char *_arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = _arena_alloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+
+/*
+** Move every chunk of from into arena, from is left empty.
+*/
+static void _arena_merge(Arena *arena, Arena *from) {
+    ArenaChunk *last = from->chunks;
+    if (last == NULL) {
+        return;
+    }
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    // from's chunks go behind the first one, which may still have room
+    if (arena->chunks == NULL) {
+        arena->chunks = from->chunks;
+    } else {
+        last->next = arena->chunks->next;
+        arena->chunks->next = from->chunks;
+    }
+    arena->used += from->used;
+    from->chunks = NULL;
+    from->used = 0;
+}
+
+
+static void _arena_free(Arena *arena) {
+    while (arena->chunks != NULL) {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->used = 0;
+}
+
+
+/*
+** wd: inotify watch descriptor of the directory.
+** path: the directory, relative to the library ("" for the library itself).
+*/
+typedef struct watched_dir {
+    int wd;
+    char *path;
+} WatchedDir;
+
+
+/*
+** What getdents64 fills its buffer with (glibc has no declaration of it
+** before 2.30).
+*/
+typedef struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+
+/*
+** Shared by the threads of walk_library.
+**
+** root_fd: the library directory, every directory is opened relative to it.
+** library_path, inotify_fd: if inotify_fd is not -1, each directory gets a
+**       watch before it is read, so no change to it can go unnoticed.
+** stat_files: each file is stat'ed for its FileInfo.
+** pending, num_pending, capacity: stack of directories (paths relative to the
+**       library) still to be read, grown geometrically.
+** active: number of threads reading a directory, which may push more.
+** failed: a directory could not be read.
+*/
+typedef struct walk_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    int root_fd;
+    const char *library_path;
+    int inotify_fd;
+    uint8_t stat_files;
+    char **pending;
+    uint32_t num_pending;
+    uint32_t capacity;
+    uint32_t active;
+    uint8_t failed;
+} WalkQueue;
+
+
+/*
+** One thread's share of the walk: the files it found, their names and info
+** (and the directories it watched), grown geometrically, merged once every
+** thread is done.
+*/
+typedef struct walk_worker {
+    WalkQueue *queue;
+    pthread_t thread;
+    Arena names;
+    char **files;
+    FileInfo *info;
+    uint32_t num_files;
+    uint32_t capacity;
+    WatchedDir *dirs;
+    uint32_t num_dirs;
+    uint32_t dirs_capacity;
+    int result;
+} WalkWorker;
+
+
+/*
+** Helper for: the walk
+** Append item to a geometrically grown array of strings.
+** returns 0 on success, -1 on error
+*/
+static int _push_string(char ***array, uint32_t *count, uint32_t *capacity, char *item) {
+    if (*count == *capacity) {
+        uint32_t new_capacity = *capacity ? *capacity * 2 : 64;
+        char **grown = (char **)realloc(*array, new_capacity * sizeof(char *));
+        if (grown == NULL) {
+            perror("walk_library: realloc");
+            return -1;
+        }
+        *array = grown;
+        *capacity = new_capacity;
+    }
+    (*array)[(*count)++] = item;
+    return 0;
+}
+
+
+/*
+** Helper for: the walk
+** returns "<dir>/<name>" (or name in the library's root), in arena if it is
+** not NULL, heap-allocated otherwise
+*/
+static char *_entry_path(Arena *arena, const char *dir, size_t dir_len, const char *name) {
+    size_t name_len = strlen(name);
+    size_t size = dir_len + 1 + name_len + 1;
+    char *path = arena != NULL ? _arena_alloc(arena, size) : (char *)malloc(size);
+    if (path == NULL) {
+        perror("walk_library: malloc");
+        return NULL;
+    }
+    size_t len = 0;
+    if (dir_len > 0) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        len = dir_len + 1;
+    }
+    memcpy(path + len, name, name_len + 1);
+    return path;
+}
+
+
+/*
+** Helper for: _walk_directory
+** Put a watch on dir (relative to the library) and note it in worker.
+** returns 0 on success, -1 on error
+*/
+static int _watch_walked_directory(WalkWorker *worker, const char *dir) {
+    WalkQueue *queue = worker->queue;
+    char *path_in_lib = _join_path(queue->library_path, dir);
+    if (path_in_lib == NULL) {
+        return -1;
+    }
+    int wd = inotify_add_watch(queue->inotify_fd, path_in_lib, LIBRARY_WATCH_EVENTS);
+    free(path_in_lib);
+    if (wd < 0) {
+        // Gone before we got to it, nothing to watch
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return 0;
+        }
+        perror("library_watch: inotify_add_watch");
+        return -1;
+    }
+
+    if (worker->num_dirs == worker->dirs_capacity) {
+        uint32_t new_capacity = worker->dirs_capacity ? worker->dirs_capacity * 2 : 16;
+        WatchedDir *grown = (WatchedDir *)realloc(worker->dirs, new_capacity * sizeof(WatchedDir));
+        if (grown == NULL) {
+            perror("library_watch: realloc");
+            return -1;
+        }
+        worker->dirs = grown;
+        worker->dirs_capacity = new_capacity;
+    }
+    char *path = strdup(dir);
+    if (path == NULL) {
+        perror("library_watch: strdup");
+        return -1;
+    }
+    worker->dirs[worker->num_dirs].wd = wd;
+    worker->dirs[worker->num_dirs].path = path;
+    worker->num_dirs++;
+    return 0;
+}
+
+
+/*
+** Helper for: _walk_directory
+** Add the file path, whose stat is st (NULL if not stat'ed), to worker.
+** returns 0 on success, -1 on error
+*/
+static int _push_file(WalkWorker *worker, char *path, const struct stat *st) {
+    if (worker->num_files == worker->capacity) {
+        uint32_t new_capacity = worker->capacity ? worker->capacity * 2 : 64;
+        char **files = (char **)realloc(worker->files, new_capacity * sizeof(char *));
+        if (files == NULL) {
+            perror("walk_library: realloc");
+            return -1;
+        }
+        worker->files = files;
+        if (worker->queue->stat_files) {
+            FileInfo *info = (FileInfo *)realloc(worker->info, new_capacity * sizeof(FileInfo));
+            if (info == NULL) {
+                perror("walk_library: realloc");
+                return -1;
+            }
+            worker->info = info;
+        }
+        worker->capacity = new_capacity;
+    }
+    if (st != NULL) {
+        FileInfo *info = &worker->info[worker->num_files];
+        info->id = LIBRARY_NO_ID;
+        info->size = st->st_size;
+        info->mtime_sec = st->st_mtim.tv_sec;
+        info->mtime_nsec = st->st_mtim.tv_nsec;
+        info->inode = st->st_ino;
+        info->device = st->st_dev;
+    }
+    worker->files[worker->num_files++] = path;
+    return 0;
+}
+
+
+/*
+** Read the directory dir (relative to the library), adding its supported
+** files to worker and its subdirectories to subdirs.
+** returns 0 on success, -1 on error
+*/
+static int _walk_directory(WalkWorker *worker, const char *dir, char *buf,
+                           char ***subdirs, uint32_t *num_subdirs, uint32_t *subdirs_capacity) {
+    if (worker->queue->inotify_fd >= 0 && _watch_walked_directory(worker, dir) < 0) {
+        return -1;
+    }
+    int fd = openat(worker->queue->root_fd, dir[0] ? dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        // Removed since its parent was read, which is no error
+        if (errno == ENOENT && dir[0]) {
+            return 0;
+        }
+        perror("scan_library");
+        return -1;
+    }
+
+    size_t dir_len = strlen(dir);
+    int result = 0;
+    while (result == 0) {
+        long len = syscall(SYS_getdents64, fd, buf, LIBRARY_WALK_BUF_SIZE);
+        if (len <= 0) {
+            if (len < 0) {
+                perror("scan_library: getdents64");
+                result = -1;
+            }
+            break;
+        }
+        for (long pos = 0; result == 0 && pos < len; ) {
+            LinuxDirent64 *entry = (LinuxDirent64 *)(buf + pos);
+            pos += entry->d_reclen;
+
+            unsigned char type = entry->d_type;
+            if (type == DT_DIR &&
+                (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)) {
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                // Some network file systems do not say, ask
+                struct stat st;
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG && !_is_file_extension_supported(entry->d_name)) {
+                continue;
+            }
+            if (type != DT_REG && type != DT_DIR) {
+                continue;
+            }
+
+            if (type == DT_REG) {
+                struct stat st;
+                if (worker->queue->stat_files &&
+                    fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    // Removed since the directory was read
+                    continue;
+                }
+                char *path = _entry_path(&worker->names, dir, dir_len, entry->d_name);
+                if (path == NULL) {
+                    result = -1;
+                    break;
+                }
+                #ifdef DEBUG
+                printf("Found file: %s\n", path);
+                #endif
+                result = _push_file(worker, path, worker->queue->stat_files ? &st : NULL);
+            } else {
+                char *path = _entry_path(NULL, dir, dir_len, entry->d_name);
+                if (path == NULL) {
+                    result = -1;
+                    break;
+                }
+                #ifdef DEBUG
+                printf("Library scan descending into directory: %s\n", path);
+                #endif
+                result = _push_string(subdirs, num_subdirs, subdirs_capacity, path);
+                if (result < 0) {
+                    free(path);
+                }
+            }
+        }
+    }
+    close(fd);
+    return result;
+}
+
+
+static void *_walk_worker(void *arg) {
+    WalkWorker *worker = (WalkWorker *)arg;
+    WalkQueue *queue = worker->queue;
+    char *buf = (char *)malloc(LIBRARY_WALK_BUF_SIZE);
+    char **subdirs = NULL;
+    uint32_t subdirs_capacity = 0;
+    if (buf == NULL) {
+        perror("walk_library: malloc");
+        worker->result = -1;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    while (worker->result == 0) {
+        while (queue->num_pending == 0 && queue->active > 0 && !queue->failed) {
+            pthread_cond_wait(&queue->work_available, &queue->lock);
+        }
+        if (queue->num_pending == 0 || queue->failed) {
+            break;
+        }
+        char *dir = queue->pending[--queue->num_pending];
+        queue->active++;
+        pthread_mutex_unlock(&queue->lock);
+
+        uint32_t num_subdirs = 0;
+        worker->result = _walk_directory(worker, dir, buf, &subdirs, &num_subdirs,
+                                         &subdirs_capacity);
+        free(dir);
+
+        // Hand the subdirectories over in one go
+        pthread_mutex_lock(&queue->lock);
+        for (uint32_t i = 0; i < num_subdirs; i++) {
+            if (worker->result == 0) {
+                worker->result = _push_string(&queue->pending, &queue->num_pending,
+                                              &queue->capacity, subdirs[i]);
+            }
+            if (worker->result < 0) {
+                free(subdirs[i]);
+            }
+        }
+        queue->active--;
+        if (worker->result < 0) {
+            queue->failed = 1;
+        }
+        pthread_cond_broadcast(&queue->work_available);
+    }
+    // Wake the others, there is nothing left (or no point going on)
+    if (worker->result < 0) {
+        queue->failed = 1;
+    }
+    pthread_cond_broadcast(&queue->work_available);
+    pthread_mutex_unlock(&queue->lock);
+
+    free(subdirs);
+    free(buf);
+    return NULL;
+}
+
+
+/*
+** walk_library, watching every directory with inotify_fd if it is not -1.
+** The watched directories are then returned in *dirs, *num_dirs.
+*/
+static int _walk(Library *library, int num_threads, uint8_t stat_files, int inotify_fd,
+                 WatchedDir **dirs, uint32_t *num_dirs) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    WalkQueue queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+    queue.library_path = library->path;
+    queue.inotify_fd = inotify_fd;
+    queue.stat_files = stat_files;
+    queue.root_fd = open(library->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (queue.root_fd < 0) {
+        perror("scan_library");
+        return -1;
+    }
+    WalkWorker *workers = (WalkWorker *)calloc(num_threads, sizeof(WalkWorker));
+    char *root = strdup("");
+    if (workers == NULL || root == NULL ||
+        _push_string(&queue.pending, &queue.num_pending, &queue.capacity, root) < 0) {
+        perror("walk_library");
+        free(root);
+        free(workers);
+        close(queue.root_fd);
+        return -1;
+    }
+
+    // The calling thread is the first worker
+    int num_started;
+    for (num_started = 1; num_started < num_threads; num_started++) {
+        workers[num_started].queue = &queue;
+        if (pthread_create(&workers[num_started].thread, NULL, _walk_worker,
+                           &workers[num_started]) != 0) {
+            break;
+        }
+    }
+    workers[0].queue = &queue;
+    _walk_worker(&workers[0]);
+    for (int i = 1; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    int result = queue.failed ? -1 : 0;
+    if (inotify_fd >= 0) {
+        uint32_t total_dirs = 0;
+        for (int i = 0; i < num_started; i++) {
+            total_dirs += workers[i].num_dirs;
+        }
+        WatchedDir *merged = NULL;
+        if (result == 0 &&
+            (merged = (WatchedDir *)malloc((total_dirs + 1) * sizeof(WatchedDir))) == NULL) {
+            perror("library_watch: malloc");
+            result = -1;
+        }
+        *num_dirs = 0;
+        for (int i = 0; i < num_started; i++) {
+            WalkWorker *worker = &workers[i];
+            for (uint32_t k = 0; k < worker->num_dirs; k++) {
+                if (result == 0) {
+                    merged[(*num_dirs)++] = worker->dirs[k];
+                } else {
+                    free(worker->dirs[k].path);
+                }
+            }
+        }
+        *dirs = merged;
+    }
+    for (int i = 0; i < num_started; i++) {
+        free(workers[i].dirs);
+    }
+
+    // Merge into the (empty) library's own store, allocating its arrays once
+    uint64_t total = 0;
+    for (int i = 0; i < num_started; i++) {
+        total += workers[i].num_files;
+    }
+    LibraryStore *store = NULL;
+    char **files = NULL;
+    FileInfo *info = NULL;
+    if (result == 0 &&
+        ((store = (LibraryStore *)calloc(1, sizeof(LibraryStore))) == NULL ||
+         (files = (char **)malloc((total + 1) * sizeof(char *))) == NULL ||
+         (stat_files && (info = (FileInfo *)malloc((total + 1) * sizeof(FileInfo))) == NULL))) {
+        perror("walk_library: malloc");
+        free(store);
+        free(files);
+        store = NULL;
+        files = NULL;
+        result = -1;
+    }
+    uint32_t num_files = 0;
+    for (int i = 0; i < num_started; i++) {
+        WalkWorker *worker = &workers[i];
+        if (result == 0) {
+            memcpy(files + num_files, worker->files, worker->num_files * sizeof(char *));
+            if (stat_files) {
+                memcpy(info + num_files, worker->info, worker->num_files * sizeof(FileInfo));
+            }
+            num_files += worker->num_files;
+            _arena_merge(&store->names, &worker->names);
+        }
+        _arena_free(&worker->names);
+        free(worker->files);
+        free(worker->info);
+    }
+    if (result == 0) {
+        store->info = info;
+        store->capacity = total + 1;
+        library->store = store;
+        library->files = files;
+        library->num_files = num_files;
+    }
+    if (result < 0 && inotify_fd >= 0 && *dirs != NULL) {
+        for (uint32_t i = 0; i < *num_dirs; i++) {
+            free((*dirs)[i].path);
+        }
+        free(*dirs);
+        *dirs = NULL;
+        *num_dirs = 0;
+    }
+
+    for (uint32_t i = 0; i < queue.num_pending; i++) {
+        free(queue.pending[i]);
+    }
+    free(queue.pending);
+    free(workers);
+    close(queue.root_fd);
+    return result;
+}
+
+
+int walk_library(Library *library, int num_threads) {
+    return _walk(library, num_threads, 0, -1, NULL, NULL);
+}
+
+
+/*
+** Helpers for: scan_library
+** Sort file indexes by the name they point to.
+*/
+static int _compare_file_indexes(const void *a, const void *b, void *files) {
+    return strcmp(((char **)files)[*(const uint32_t *)a],
+                  ((char **)files)[*(const uint32_t *)b]);
+}
+
+
+static int _compare_descending(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x < y) - (x > y);
+}
+
+
+static uint32_t *_sorted_indexes(const Library *library) {
+    uint32_t *indexes = malloc((library->num_files + 1) * sizeof(uint32_t));
+    if (indexes == NULL) {
+        perror("scan_library: malloc");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        indexes[i] = i;
+    }
+    qsort_r(indexes, library->num_files, sizeof(uint32_t), _compare_file_indexes,
+            library->files);
+    return indexes;
+}
+
+
+/*
+** Helpers for: scan_library
+** Record a change leading to library->generation + 1 in the log, dropping
+** the oldest change once it is full. file is NULL for a removal.
+*/
+static void _drop_oldest_change(LibraryLog *log) {
+    LibraryChange *oldest = &log->changes[log->start];
+    // Clients that have not seen this change can no longer be sent a delta
+    log->base_generation = oldest->generation;
+    free(oldest->file);
+    log->start = (log->start + 1) % LIBRARY_LOG_SIZE;
+    log->count--;
+}
+
+
+static void _log_change(Library *library, uint32_t index, uint32_t id, const char *file) {
+    LibraryLog *log = library->changes;
+    if (log->count == LIBRARY_LOG_SIZE) {
+        _drop_oldest_change(log);
+    }
+    LibraryChange *change = &log->changes[(log->start + log->count) % LIBRARY_LOG_SIZE];
+    change->generation = library->generation + 1;
+    change->index = index;
+    change->id = id;
+    change->file = NULL;
+    if (file != NULL && (change->file = strdup(file)) == NULL) {
+        // Without its name the change is useless, nobody gets a delta over it
+        perror("scan_library: strdup");
+        log->base_generation = change->generation;
+    }
+    log->count++;
+}
+
+
+/*
+** Forget every change, deltas start again from the next generation.
+*/
+static void _clear_log(Library *library) {
+    LibraryLog *log = library->changes;
+    while (log->count > 0) {
+        _drop_oldest_change(log);
+    }
+    log->base_generation = library->generation + 1;
+}
+
+
+/*
+** Helpers for: the store's hash tables
+** Slots hold a file's index + 1. A lookup stops at the first empty slot, so
+** a removed file's slot is marked deleted rather than emptied.
+*/
+static uint32_t _hash_name(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+
+static uint32_t _hash_id(uint32_t id) {
+    return (uint32_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+
+/*
+** returns the slot of by_name holding file, or the empty slot ending its
+** probe sequence
+*/
+static uint32_t _find_name_slot(const Library *library, const char *file) {
+    const LibraryStore *store = library->store;
+    uint32_t mask = store->table_size - 1;
+    uint32_t slot = _hash_name(file) & mask;
+    while (store->by_name[slot] != LIBRARY_SLOT_EMPTY &&
+           (store->by_name[slot] == LIBRARY_SLOT_DELETED ||
+            strcmp(library->files[store->by_name[slot] - 1], file) != 0)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+static uint32_t _find_id_slot(const Library *library, uint32_t id) {
+    const LibraryStore *store = library->store;
+    uint32_t mask = store->table_size - 1;
+    uint32_t slot = _hash_id(id) & mask;
+    while (store->by_id[slot] != LIBRARY_SLOT_EMPTY &&
+           (store->by_id[slot] == LIBRARY_SLOT_DELETED ||
+            store->info[store->by_id[slot] - 1].id != id)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+/*
+** returns the index of file (relative to the library), or -1
+*/
+static int64_t _find_file(const Library *library, const char *file) {
+    if (library->store == NULL || library->store->table_size == 0) {
+        return -1;
+    }
+    uint32_t slot = library->store->by_name[_find_name_slot(library, file)];
+    return slot == LIBRARY_SLOT_EMPTY ? -1 : (int64_t)slot - 1;
+}
+
+
+/*
+** returns the index of the file with ID id, or -1
+*/
+static int64_t _find_id(const Library *library, uint32_t id) {
+    if (library->store == NULL || library->store->table_size == 0 || id == LIBRARY_NO_ID) {
+        return -1;
+    }
+    uint32_t slot = library->store->by_id[_find_id_slot(library, id)];
+    return slot == LIBRARY_SLOT_EMPTY ? -1 : (int64_t)slot - 1;
+}
+
+
+/*
+** Put index into the empty slots ending the probe sequences of its name and
+** ID, which must not be in the tables yet. Deleted slots are not reused, so
+** both tables have table_used slots that are not empty.
+*/
+static void _table_insert(Library *library, uint32_t index) {
+    LibraryStore *store = library->store;
+    store->by_name[_find_name_slot(library, library->files[index])] = index + 1;
+    store->by_id[_find_id_slot(library, store->info[index].id)] = index + 1;
+    store->table_used++;
+}
+
+
+/*
+** Rebuild both tables with room for num_files files, dropping deleted slots.
+** returns 0 on success, -1 on error
+*/
+static int _rehash(Library *library, uint32_t num_files) {
+    LibraryStore *store = library->store;
+    uint32_t size = LIBRARY_TABLE_MIN_SIZE;
+    while (size < (uint64_t)num_files * 4) {
+        size *= 2;
+    }
+    uint32_t *by_name = (uint32_t *)calloc(size, sizeof(uint32_t));
+    uint32_t *by_id = (uint32_t *)calloc(size, sizeof(uint32_t));
+    if (by_name == NULL || by_id == NULL) {
+        perror("library: calloc");
+        free(by_name);
+        free(by_id);
+        return -1;
+    }
+    free(store->by_name);
+    free(store->by_id);
+    store->by_name = by_name;
+    store->by_id = by_id;
+    store->table_size = size;
+    store->table_used = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        _table_insert(library, i);
+    }
+    return 0;
+}
+
+
+/*
+** Helpers for: scan_library, the watcher
+** Apply one change to the files array, the same way list_request on the
+** client does: a removed file is replaced by the last file, an added file
+** is appended.
+*/
+static void _remove_file(Library *library, uint32_t index, uint8_t logged) {
+    LibraryStore *store = library->store;
+    uint32_t last = library->num_files - 1;
+    if (logged) {
+        _log_change(library, index, store->info[index].id, NULL);
+    }
+    store->by_name[_find_name_slot(library, library->files[index])] = LIBRARY_SLOT_DELETED;
+    store->by_id[_find_id_slot(library, store->info[index].id)] = LIBRARY_SLOT_DELETED;
+    store->wasted += strlen(library->files[index]) + 1;
+    if (index != last) {
+        store->by_name[_find_name_slot(library, library->files[last])] = index + 1;
+        store->by_id[_find_id_slot(library, store->info[last].id)] = index + 1;
+        library->files[index] = library->files[last];
+        store->info[index] = store->info[last];
+    }
+    library->num_files--;
+}
+
+
+/*
+** Copies file into the store. info is the file's, if known: a file without
+** an ID gets a new one.
+*/
+static int _add_file(Library *library, const char *file, const FileInfo *info, uint8_t logged) {
+    LibraryStore *store = library->store;
+    if (library->num_files == store->capacity) {
+        uint32_t new_capacity = store->capacity ? store->capacity * 2 : 64;
+        char **files = (char **)realloc(library->files, new_capacity * sizeof(char *));
+        if (files == NULL) {
+            perror("scan_library: realloc");
+            return -1;
+        }
+        library->files = files;
+        FileInfo *new_info = (FileInfo *)realloc(store->info, new_capacity * sizeof(FileInfo));
+        if (new_info == NULL) {
+            perror("scan_library: realloc");
+            return -1;
+        }
+        store->info = new_info;
+        store->capacity = new_capacity;
+    }
+    if ((uint64_t)(store->table_used + 1) * 2 > store->table_size &&
+        _rehash(library, library->num_files + 1) < 0) {
+        return -1;
+    }
+    char *name = _arena_strdup(&store->names, file);
+    if (name == NULL) {
+        return -1;
+    }
+
+    uint32_t index = library->num_files;
+    library->files[index] = name;
+    FileInfo *new_info = &store->info[index];
+    if (info != NULL) {
+        *new_info = *info;
+    } else {
+        memset(new_info, 0, sizeof(FileInfo));
+    }
+    if (new_info->id == LIBRARY_NO_ID || _find_id(library, new_info->id) >= 0) {
+        new_info->id = store->next_id++;
+    } else if (new_info->id >= store->next_id) {
+        store->next_id = new_info->id + 1;
+    }
+    _table_insert(library, index);
+    if (logged) {
+        _log_change(library, index, new_info->id, name);
+    }
+    library->num_files++;
+    return 0;
+}
+
+
+/*
+** Helper for: _next_generation
+** Copy the names still in use into a new arena, once most of it is waste.
+*/
+static void _compact_names(Library *library) {
+    LibraryStore *store = library->store;
+    if (store->wasted <= LIBRARY_ARENA_CHUNK_SIZE || store->wasted <= store->names.used / 2) {
+        return;
+    }
+    // One chunk for all of them, so the copy cannot fail half-way
+    size_t size = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        size += strlen(library->files[i]) + 1;
+    }
+    Arena names = {NULL, 0};
+    char *next = _arena_alloc(&names, size);
+    if (next == NULL) {
+        // Keep the old arena, it is tried again next generation
+        return;
+    }
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        size_t len = strlen(library->files[i]) + 1;
+        memcpy(next, library->files[i], len);
+        library->files[i] = next;
+        next += len;
+    }
+    _arena_free(&store->names);
+    store->names = names;
+    store->wasted = 0;
+}
+
+
+/*
+** Helper for: scan_library, library_watch, library_load
+** returns 0 if library has a change log and a store (allocating them if
+** needed), -1 on error
+*/
+static int _ensure_log(Library *library) {
+    if (library->changes == NULL) {
+        library->changes = calloc(1, sizeof(LibraryLog));
+        if (library->changes == NULL) {
+            perror("scan_library: calloc");
+            return -1;
+        }
+    }
+    if (library->store == NULL) {
+        library->store = calloc(1, sizeof(LibraryStore));
+        if (library->store == NULL) {
+            perror("scan_library: calloc");
+            return -1;
+        }
+        library->store->next_id = LIBRARY_NO_ID + 1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: scan_library, library_update
+** Move library to the next generation, with fresh LIST payloads.
+** returns 0 on success, -1 on error
+*/
+static int _next_generation(Library *library) {
+    library->generation++;
+    _compact_names(library);
+
+    ListPayload *payload = list_payload_build(library, 0);
+    ListPayload *id_payload = list_payload_build(library, 1);
+    if (payload == NULL || id_payload == NULL) {
+        if (payload != NULL) {
+            list_payload_release(payload);
+        }
+        return -1;
+    }
+    if (library->list_payload != NULL) {
+        list_payload_release(library->list_payload);
+    }
+    if (library->id_payload != NULL) {
+        list_payload_release(library->id_payload);
+    }
+    library->list_payload = payload;
+    library->id_payload = id_payload;
+    #ifdef DEBUG
+    printf("Library generation %lu, %u files\n",
+           (unsigned long)library->generation, library->num_files);
+    #endif
+    return 0;
+}
+
+
+/*
+** Helper for: _reconcile, the watcher
+** returns 1 if file is (still) a regular file in the library directory, with
+** its info (and no ID yet) in *info if info is not NULL, 0 otherwise
+*/
+static int _stat_file(const Library *library, const char *file, FileInfo *info) {
+    char *path = _join_path(library->path, file);
+    if (path == NULL) {
+        return 0;
+    }
+    struct stat st;
+    int exists = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    free(path);
+    if (exists && info != NULL) {
+        info->id = LIBRARY_NO_ID;
+        info->size = st.st_size;
+        info->mtime_sec = st.st_mtim.tv_sec;
+        info->mtime_nsec = st.st_mtim.tv_nsec;
+        info->inode = st.st_ino;
+        info->device = st.st_dev;
+    }
+    return exists;
+}
+
+
+/*
+** Helper for: scan_library, library_update
+** Change library's files into the ones of scanned, in place and logged (see
+** the Design), without moving to the next generation. The info of the files
+** kept is updated from scanned (if it has any), then scanned is freed.
+**
+** If verify is set, the scan may be older than the changes already applied
+** (by the watcher), so a difference is only applied if the file system still
+** agrees with the scan.
+**
+** returns the number of changes, or -1 on error
+*/
+static int _reconcile(Library *library, Library *scanned, uint8_t verify) {
+    int result = 0;
+    uint32_t *old_sorted = _sorted_indexes(library);
+    uint32_t *new_sorted = _sorted_indexes(scanned);
+    // Removed: old indexes, highest first. Added: new indexes, in scan order
+    uint32_t *removed = malloc((library->num_files + 1) * sizeof(uint32_t));
+    uint32_t *added = malloc((scanned->num_files + 1) * sizeof(uint32_t));
+    if (old_sorted == NULL || new_sorted == NULL || removed == NULL || added == NULL) {
+        perror("scan_library: malloc");
+        result = -1;
+        goto free_scan;
+    }
+
+    uint32_t num_removed = 0, num_added = 0;
+    uint32_t i = 0, j = 0;
+    while (i < library->num_files || j < scanned->num_files) {
+        int order;
+        if (i == library->num_files) {
+            order = 1;
+        } else if (j == scanned->num_files) {
+            order = -1;
+        } else {
+            order = strcmp(library->files[old_sorted[i]], scanned->files[new_sorted[j]]);
+        }
+        if (order < 0) {
+            if (!verify || !_stat_file(library, library->files[old_sorted[i]], NULL)) {
+                removed[num_removed++] = old_sorted[i];
+            }
+            i++;
+        } else if (order > 0) {
+            if (!verify || _stat_file(library, scanned->files[new_sorted[j]], NULL)) {
+                added[num_added++] = new_sorted[j];
+            }
+            j++;
+        } else {
+            if (scanned->store->info != NULL) {
+                FileInfo *info = &library->store->info[old_sorted[i]];
+                uint32_t id = info->id;
+                *info = scanned->store->info[new_sorted[j]];
+                info->id = id;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    // A log too small to hold this generation is no use to anyone
+    uint8_t logged = num_removed + num_added <= LIBRARY_LOG_SIZE;
+    if (!logged) {
+        _clear_log(library);
+    }
+
+    // Highest first, so the last file never is one still to be removed
+    qsort(removed, num_removed, sizeof(uint32_t), _compare_descending);
+    for (uint32_t k = 0; k < num_removed; k++) {
+        _remove_file(library, removed[k], logged);
+    }
+    // Lowest first, keeping the order of the scan
+    qsort(added, num_added, sizeof(uint32_t), _compare_descending);
+    const FileInfo *scanned_info = scanned->store->info;
+    for (uint32_t k = num_added; k > 0; k--) {
+        uint32_t index = added[k - 1];
+        if (_add_file(library, scanned->files[index],
+                      scanned_info != NULL ? &scanned_info[index] : NULL, logged) < 0) {
+            result = -1;
+            goto free_scan;
+        }
+    }
+    result = num_removed + num_added;
+    #ifdef DEBUG
+    printf("Library scan: %u added, %u removed\n", num_added, num_removed);
+    #endif
+
+free_scan:
+    free(old_sorted);
+    free(new_sorted);
+    free(removed);
+    free(added);
+    free_scanned_library(scanned);
+    return result;
+}
+
+
+int library_load(Library *library) {
+    IndexMap index;
+    if (index_open(library->path, &index) < 0) {
+        return -1;
+    }
+    if (_ensure_log(library) < 0) {
+        index_close(&index);
+        return -1;
+    }
+    for (uint32_t i = 0; i < index.num_files; i++) {
+        const IndexEntry *entry = &index.entries[i];
+        if (_add_file(library, index.names + entry->name_offset, &entry->info, 0) < 0) {
+            index_close(&index);
+            free_scanned_library(library);
+            return -1;
+        }
+        // Still good as long as the file is the version that was hashed
+        if (entry->flags & INDEX_HAS_CHECKSUM) {
+            checksum_store(&entry->info, entry->checksum);
+        }
+    }
+    index_close(&index);
+    printf("Loaded %u files from the library index\n", index.num_files);
+    // Clients can only know these files from a LIST, never from a delta
+    _clear_log(library);
+    return _next_generation(library);
+}
+
+
+// It ignores MAX_FILES.
+int scan_library(Library *library) {
+    // Scan into a fresh list and compare it with the old one, sorted by name
+    // A hash table leveraging inode number would be a better way to do this
+    #ifdef DEBUG
+    printf("^^^^ ----------------------------------- ^^^^\n");
+    printf("Scanning library\n");
+    #endif
+    Library scanned = {library->name, library->path, NULL, 0};
+    int result = walk_library(&scanned, LIBRARY_SCAN_THREADS);
+    #ifdef DEBUG
+    printf("vvvv ----------------------------------- vvvv\n");
+    #endif
+    if (result < 0 || _ensure_log(library) < 0) {
+        free_scanned_library(&scanned);
+        return -1;
+    }
+
+    int num_changes = _reconcile(library, &scanned, 0);
+    if (num_changes < 0) {
+        return -1;
+    }
+    // Nothing changed, the LIST payload is still good
+    if (library->list_payload != NULL && num_changes == 0) {
+        return 0;
+    }
+    return _next_generation(library);
+}
+
+
+/*
+** inotify_fd: the inotify instance, with a watch on every directory (-1 if
+**       the library cannot be watched, it is then checked every
+**       LIBRARY_SCAN_INTERVAL).
+** check_fd: eventfd, signalled by the check thread when its walk is done.
+** poll_fd: epoll instance over both, what the server waits on.
+** owner: the process that set the watch up; only it has the check thread.
+** dirs: the watched directories.
+** num_changes: changes applied since the last generation.
+** setting_up: the first walk is putting the watches on, and the events
+**       are left queued until it is done.
+** check_thread, checking: the background walk, if one is running.
+** scanned, check_result: what it found, and _walk's result.
+** walked_dirs: the directories the first walk watched.
+** last_check: when the last walk started.
+** lost_events: the event queue overflowed, walk again as soon as possible.
+** saved_generation: the generation last written to the index, 0 to write
+**       it again once a walk has brought the library up to date.
+** saved_checksums: checksum_count when the index was last written.
+** index_failed: writing the index failed (the library is read-only, most
+**       likely), it is not tried again.
+*/
+typedef struct library_watch {
+    int inotify_fd;
+    int check_fd;
+    int poll_fd;
+    pid_t owner;
+    WatchedDir *dirs;
+    uint32_t num_dirs;
+    uint32_t num_changes;
+    uint8_t setting_up;
+    pthread_t check_thread;
+    uint8_t checking;
+    Library scanned;
+    int check_result;
+    WatchedDir *walked_dirs;
+    uint32_t num_walked_dirs;
+    time_t last_check;
+    uint8_t lost_events;
+    uint64_t saved_generation;
+    uint64_t saved_checksums;
+    uint8_t index_failed;
+} LibraryWatch;
+
+
+static WatchedDir *_find_dir(LibraryWatch *watch, int wd) {
+    for (uint32_t i = 0; i < watch->num_dirs; i++) {
+        if (watch->dirs[i].wd == wd) {
+            return &watch->dirs[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void _forget_dir(LibraryWatch *watch, WatchedDir *dir) {
+    free(dir->path);
+    *dir = watch->dirs[--watch->num_dirs];
+}
+
+
+/*
+** returns 1 if path is dir or inside of it
+*/
+static int _is_in_dir(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+
+/*
+** Watch the directory current_path and everything below it. If add_files is
+** set, the supported files found in there that the library does not have yet
+** are added (a directory that appeared after the library was scanned).
+**
+** returns 0 on success, -1 on error
+*/
+static int _watch_directory(Library *library, const char *current_path, uint8_t add_files) {
+    LibraryWatch *watch = library->watch;
+    char *path_in_lib = _join_path(library->path, current_path);
+    if (path_in_lib == NULL) {
+        return -1;
+    }
+
+    int wd = inotify_add_watch(watch->inotify_fd, path_in_lib, LIBRARY_WATCH_EVENTS);
+    if (wd < 0) {
+        // Gone again before we got to it, its removal will be seen
+        int result = errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+        if (result < 0) {
+            perror("library_watch: inotify_add_watch");
+        }
+        free(path_in_lib);
+        return result;
+    }
+    char *path = strdup(current_path);
+    if (path == NULL) {
+        perror("library_watch: strdup");
+        free(path_in_lib);
+        return -1;
+    }
+    WatchedDir *dir = _find_dir(watch, wd);
+    if (dir == NULL) {
+        WatchedDir *dirs = (WatchedDir *)realloc(watch->dirs,
+                                                 (watch->num_dirs + 1) * sizeof(WatchedDir));
+        if (dirs == NULL) {
+            perror("library_watch: realloc");
+            free(path);
+            free(path_in_lib);
+            return -1;
+        }
+        watch->dirs = dirs;
+        dir = &watch->dirs[watch->num_dirs++];
+    } else {
+        // Moved back in before the watch was dropped
+        free(dir->path);
+    }
+    dir->wd = wd;
+    dir->path = path;
+
+    DIR *d = opendir(path_in_lib);
+    free(path_in_lib);
+    if (d == NULL) {
+        return 0;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(d)) != NULL) {
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            // Some network file systems do not say, ask
+            struct stat st;
+            if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char *new_path = _join_path(current_path, entry->d_name);
+            if (new_path == NULL) {
+                result = -1;
+                break;
+            }
+            result = _watch_directory(library, new_path, add_files);
+            free(new_path);
+        } else if (add_files && type == DT_REG &&
+                   _is_file_extension_supported(entry->d_name)) {
+            char *file = _join_path(current_path, entry->d_name);
+            FileInfo info;
+            if (file == NULL) {
+                result = -1;
+                break;
+            }
+            if (_find_file(library, file) < 0 && _stat_file(library, file, &info) &&
+                (result = _add_file(library, file, &info, 1)) == 0) {
+                watch->num_changes++;
+            }
+            free(file);
+        }
+    }
+    closedir(d);
+    return result;
+}
+
+
+/*
+** Stop watching the directory path, which is no longer in the library, and
+** remove every file that was in it.
+*/
+static void _unwatch_directory(Library *library, const char *path) {
+    LibraryWatch *watch = library->watch;
+    for (uint32_t i = watch->num_dirs; i > 0; i--) {
+        WatchedDir *dir = &watch->dirs[i - 1];
+        if (_is_in_dir(dir->path, path)) {
+            inotify_rm_watch(watch->inotify_fd, dir->wd);
+            _forget_dir(watch, dir);
+        }
+    }
+    for (uint32_t i = library->num_files; i > 0; i--) {
+        // The last file takes the removed one's place, it has been looked at
+        if (_is_in_dir(library->files[i - 1], path)) {
+            _remove_file(library, i - 1, 1);
+            watch->num_changes++;
+        }
+    }
+}
+
+
+/*
+** Apply one inotify event to the library.
+** returns 0 on success, -1 on error
+*/
+static int _apply_event(Library *library, const struct inotify_event *event) {
+    LibraryWatch *watch = library->watch;
+    if (event->mask & IN_Q_OVERFLOW) {
+        watch->lost_events = 1;
+        return 0;
+    }
+    WatchedDir *dir = _find_dir(watch, event->wd);
+    if (dir == NULL) {
+        return 0;
+    }
+    if (event->mask & IN_IGNORED) {
+        _forget_dir(watch, dir);
+        return 0;
+    }
+    if (event->len == 0) {
+        return 0;
+    }
+
+    char *path = _join_path(dir->path, event->name);
+    if (path == NULL) {
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Library event 0x%x on %s\n", event->mask, path);
+    #endif
+
+    int result = 0;
+    uint8_t appeared = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+    if (event->mask & IN_ISDIR) {
+        if (appeared) {
+            result = _watch_directory(library, path, 1);
+        } else {
+            _unwatch_directory(library, path);
+        }
+    } else if (_is_file_extension_supported(event->name)) {
+        int64_t index = _find_file(library, path);
+        FileInfo info;
+        if (appeared && index < 0) {
+            // Gone again if it cannot be stat'ed, its removal is on its way
+            if (_stat_file(library, path, &info) &&
+                (result = _add_file(library, path, &info, 1)) == 0) {
+                watch->num_changes++;
+            }
+        } else if (!appeared && index >= 0) {
+            _remove_file(library, index, 1);
+            watch->num_changes++;
+        }
+    }
+    free(path);
+    return result;
+}
+
+
+/*
+** The background consistency check: walk the library into watch->scanned,
+** stat'ing each file, it is reconciled by library_update. Only reads the
+** library's path.
+*/
+static void *_check_library(void *arg) {
+    Library *library = (Library *)arg;
+    LibraryWatch *watch = library->watch;
+
+    int inotify_fd = watch->setting_up ? watch->inotify_fd : -1;
+    watch->check_result = _walk(&watch->scanned, LIBRARY_SCAN_THREADS, 1, inotify_fd,
+                                &watch->walked_dirs, &watch->num_walked_dirs);
+
+    uint64_t done = 1;
+    if (write(watch->check_fd, &done, sizeof(done)) < 0) {
+        perror("library_check: write");
+    }
+    return NULL;
+}
+
+
+static int _start_check(Library *library) {
+    LibraryWatch *watch = library->watch;
+    if (watch->checking) {
+        return 0;
+    }
+    watch->scanned = (Library){library->name, library->path, NULL, 0};
+    watch->walked_dirs = NULL;
+    watch->num_walked_dirs = 0;
+    watch->last_check = time(NULL);
+    watch->lost_events = 0;
+    if (pthread_create(&watch->check_thread, NULL, _check_library, library) != 0) {
+        ERR_PRINT("library_check: pthread_create failed\n");
+        return -1;
+    }
+    watch->checking = 1;
+    #ifdef DEBUG
+    printf("Library consistency check started\n");
+    #endif
+    return 0;
+}
+
+
+static void _free_dirs(WatchedDir *dirs, uint32_t num_dirs) {
+    for (uint32_t i = 0; i < num_dirs; i++) {
+        free(dirs[i].path);
+    }
+    free(dirs);
+}
+
+
+/*
+** Helper for: _finish_check
+** Take the watches over from the first walk, and start reading the events
+** that came in meanwhile. If it could not watch every directory, fall back
+** to checking the library every LIBRARY_SCAN_INTERVAL.
+*/
+static void _start_watching(LibraryWatch *watch) {
+    watch->setting_up = 0;
+    if (watch->check_result == 0) {
+        struct epoll_event event = {.events = EPOLLIN};
+        event.data.fd = watch->inotify_fd;
+        if (epoll_ctl(watch->poll_fd, EPOLL_CTL_ADD, watch->inotify_fd, &event) == 0) {
+            watch->dirs = watch->walked_dirs;
+            watch->num_dirs = watch->num_walked_dirs;
+            printf("Watching %u library directories\n", watch->num_dirs);
+            return;
+        }
+        perror("library_watch: epoll_ctl");
+    }
+    ERR_PRINT("Could not watch the library, rescanning it periodically instead\n");
+    _free_dirs(watch->walked_dirs, watch->num_walked_dirs);
+    close(watch->inotify_fd);
+    watch->inotify_fd = -1;
+}
+
+
+/*
+** Helper for: library_update, library_check
+** Write the index for the next startup, if the library changed (or files
+** were hashed) since it was last written. Without it the next startup only
+** takes longer, so a library the server cannot write to gets one try.
+*/
+static void _save_index(Library *library) {
+    LibraryWatch *watch = library->watch;
+    uint64_t checksums = checksum_count();
+    if (watch->index_failed || (watch->saved_generation == library->generation &&
+                                watch->saved_checksums == checksums)) {
+        return;
+    }
+    if (index_save(library->path, library->files, library->store->info,
+                   library->num_files) < 0) {
+        fprintf(stderr, "Could not write the library index, giving up on it\n");
+        watch->index_failed = 1;
+        return;
+    }
+    watch->saved_generation = library->generation;
+    watch->saved_checksums = checksums;
+}
+
+
+/*
+** Helper for: library_update
+** Collect a finished consistency check, if there is one.
+** returns 0 on success, -1 on error
+*/
+static int _finish_check(Library *library) {
+    LibraryWatch *watch = library->watch;
+    uint64_t done;
+    if (!watch->checking || read(watch->check_fd, &done, sizeof(done)) < 0) {
+        return 0;
+    }
+    pthread_join(watch->check_thread, NULL);
+    watch->checking = 0;
+    if (watch->setting_up) {
+        _start_watching(watch);
+    }
+    if (watch->check_result < 0) {
+        // A directory vanished mid-walk, try again next time
+        free_scanned_library(&watch->scanned);
+        return 0;
+    }
+    int num_changes = _reconcile(library, &watch->scanned, 1);
+    if (num_changes < 0) {
+        return -1;
+    }
+    watch->num_changes += num_changes;
+    // The walk stat'ed every file, the index is worth writing even unchanged
+    watch->saved_generation = 0;
+    return 0;
+}
+
+
+/*
+** Helper for: library_watch, free_scanned_library
+*/
+static void _close_watch(Library *library) {
+    LibraryWatch *watch = library->watch;
+    // A forked child did not inherit the check thread, or what it is walking
+    if (watch->owner == getpid() && watch->checking) {
+        pthread_join(watch->check_thread, NULL);
+        free_scanned_library(&watch->scanned);
+        _free_dirs(watch->walked_dirs, watch->num_walked_dirs);
+    }
+    _free_dirs(watch->dirs, watch->num_dirs);
+    if (watch->poll_fd >= 0) close(watch->poll_fd);
+    if (watch->check_fd >= 0) close(watch->check_fd);
+    if (watch->inotify_fd >= 0) close(watch->inotify_fd);
+    free(watch);
+    library->watch = NULL;
+}
+
+
+int library_watch(Library *library) {
+    if (library->watch != NULL) {
+        return library->watch->poll_fd;
+    }
+    if (_ensure_log(library) < 0) {
+        return -1;
+    }
+    LibraryWatch *watch = (LibraryWatch *)calloc(1, sizeof(LibraryWatch));
+    if (watch == NULL) {
+        perror("library_watch: calloc");
+        return -1;
+    }
+    library->watch = watch;
+    watch->owner = getpid();
+    watch->last_check = time(NULL);
+    // Written once the first walk is done
+    watch->saved_generation = library->generation;
+    watch->saved_checksums = checksum_count();
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watch->check_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watch->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (watch->inotify_fd < 0 || watch->check_fd < 0 || watch->poll_fd < 0) {
+        perror("library_watch");
+        _close_watch(library);
+        return -1;
+    }
+
+    // The inotify descriptor joins once the first walk has watched everything
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.fd = watch->check_fd;
+    if (epoll_ctl(watch->poll_fd, EPOLL_CTL_ADD, watch->check_fd, &event) < 0) {
+        perror("library_watch: epoll_ctl");
+        _close_watch(library);
+        return -1;
+    }
+
+    // Also brings the library up to date with changes made since it was
+    // scanned, or since its index was written
+    watch->setting_up = 1;
+    if (_start_check(library) < 0) {
+        _close_watch(library);
+        return -1;
+    }
+    return watch->poll_fd;
+}
+
+
+int library_update(Library *library) {
+    LibraryWatch *watch = library->watch;
+    if (watch == NULL) {
+        return 0;
+    }
+
+    int result = 0;
+    char buf[LIBRARY_WATCH_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (result == 0 && watch->inotify_fd >= 0 && !watch->setting_up) {
+        ssize_t len = read(watch->inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("library_update: read");
+                result = -1;
+            }
+            break;
+        }
+        for (char *p = buf; result == 0 && p < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            result = _apply_event(library, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (result == 0) {
+        result = _finish_check(library);
+    }
+    if (result == 0 && watch->lost_events) {
+        result = _start_check(library);
+    }
+
+    if (watch->num_changes > 0 || library->list_payload == NULL) {
+        watch->num_changes = 0;
+        if (_next_generation(library) < 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && watch->saved_generation == 0) {
+        _save_index(library);
+    }
+    return result;
+}
+
+
+int library_check(Library *library) {
+    LibraryWatch *watch = library->watch;
+    if (watch == NULL) {
+        return scan_library(library);
+    }
+    // Changes the watch applied since the last walk reach the index here
+    _save_index(library);
+    if (watch->inotify_fd >= 0 && time(NULL) - watch->last_check < LIBRARY_CHECK_INTERVAL) {
+        return 0;
+    }
+    return _start_check(library);
+}
+
+
+void free_scanned_library(Library *library) {
+    if (library->watch != NULL) {
+        _close_watch(library);
+    }
+    if (library->list_payload != NULL) {
+        list_payload_release(library->list_payload);
+        library->list_payload = NULL;
+    }
+    if (library->id_payload != NULL) {
+        list_payload_release(library->id_payload);
+        library->id_payload = NULL;
+    }
+    if (library->changes != NULL) {
+        _clear_log(library);
+        free(library->changes);
+        library->changes = NULL;
+    }
+    _free_library(library);
+    LibraryStore *store = library->store;
+    if (store != NULL) {
+        _arena_free(&store->names);
+        free(store->info);
+        free(store->by_name);
+        free(store->by_id);
+        free(store);
+        library->store = NULL;
+    }
+}
+
+
+/*
+** Helper for: list_payload_build, list_changes_since, list_payload_with_line
+** Allocate a payload with room for capacity bytes of data.
+*/
+static ListPayload *_new_payload(size_t capacity) {
+    ListPayload *payload = malloc(sizeof(ListPayload) + capacity + 1);
+    if (payload == NULL) {
+        perror("list_payload_build");
+        return NULL;
+    }
+    payload->refs = 1;
+    payload->len = 0;
+    payload->list_offset = 0;
+    payload->list_len = 0;
+    return payload;
+}
+
+
+ListPayload *list_payload_build(const Library *library, uint8_t by_id) {
+    // header line (two 20 digit numbers at most) and end line
+    size_t capacity = strlen(LIST_RESYNC) + 1 + 20 + 2 + strlen(LIST_END) + 2;
+    for (int i = 0; i < library->num_files; i++) {
+        // sign, index or ID (at most 10 digits), colon, name, \r\n
+        capacity += 1 + 10 + 1 + strlen(library->files[i]) + 2;
+    }
+
+    ListPayload *payload = _new_payload(capacity);
+    if (payload == NULL) {
+        return NULL;
+    }
+
+    size_t len = sprintf(payload->data, LIST_RESYNC " %lu" END_OF_MESSAGE_TOKEN,
+                         (unsigned long)library->generation);
+    if (by_id) {
+        // Additions in index order, which the client rebuilds its list in
+        for (uint32_t i = 0; i < library->num_files; i++) {
+            len += sprintf(payload->data + len, LIST_DELTA_ADD "%u:%s" END_OF_MESSAGE_TOKEN,
+                           library->store->info[i].id, library->files[i]);
+        }
+    } else {
+        payload->list_offset = len;
+        for (int i = library->num_files - 1; i > -1; i--) {
+            len += sprintf(payload->data + len, "%d:%s" END_OF_MESSAGE_TOKEN,
+                           i, library->files[i]);
+        }
+        payload->list_len = len - payload->list_offset;
+    }
+    len += sprintf(payload->data + len, LIST_END END_OF_MESSAGE_TOKEN);
+    payload->len = len;
+    return payload;
+}
+
+
+ListPayload *list_changes_since(const Library *library, uint64_t generation, uint8_t by_id) {
+    const LibraryLog *log = library->changes;
+    ListPayload *resync = by_id ? library->id_payload : library->list_payload;
+    if (log == NULL || generation < log->base_generation ||
+        generation > library->generation || resync == NULL) {
+        #ifdef DEBUG
+        printf("No delta from generation %lu, resyncing\n", (unsigned long)generation);
+        #endif
+        return resync == NULL ? NULL : list_payload_acquire(resync);
+    }
+
+    // The changes after generation are the newest ones in the log
+    uint32_t first = log->count;
+    size_t capacity = strlen(LIST_DELTA) + 1 + 20 + 2 + strlen(LIST_END) + 2;
+    while (first > 0 &&
+           log->changes[(log->start + first - 1) % LIBRARY_LOG_SIZE].generation > generation) {
+        first--;
+        const LibraryChange *change = &log->changes[(log->start + first) % LIBRARY_LOG_SIZE];
+        // sign, index or ID (at most 10 digits), colon, name, \r\n
+        capacity += 1 + 10 + 1 + (change->file ? strlen(change->file) : 0) + 2;
+    }
+
+    ListPayload *payload = _new_payload(capacity);
+    if (payload == NULL) {
+        return NULL;
+    }
+    size_t len = sprintf(payload->data, LIST_DELTA " %lu" END_OF_MESSAGE_TOKEN,
+                         (unsigned long)library->generation);
+    for (uint32_t k = first; k < log->count; k++) {
+        const LibraryChange *change = &log->changes[(log->start + k) % LIBRARY_LOG_SIZE];
+        uint32_t number = by_id ? change->id : change->index;
+        if (change->file == NULL) {
+            len += sprintf(payload->data + len, LIST_DELTA_REMOVE "%u" END_OF_MESSAGE_TOKEN,
+                           number);
+        } else {
+            len += sprintf(payload->data + len, LIST_DELTA_ADD "%u:%s" END_OF_MESSAGE_TOKEN,
+                           number, change->file);
+        }
+    }
+    len += sprintf(payload->data + len, LIST_END END_OF_MESSAGE_TOKEN);
+    payload->len = len;
+    return payload;
+}
+
+
+int64_t library_file_index(const Library *library, uint8_t by_id, uint32_t number) {
+    if (by_id) {
+        return _find_id(library, number);
+    }
+    return number < library->num_files ? (int64_t)number : -1;
+}
+
+
+ListPayload *list_payload_with_line(ListPayload *payload, const char *line) {
+    size_t line_len = strlen(line) + strlen(END_OF_MESSAGE_TOKEN);
+    ListPayload *copy = _new_payload(payload->len + line_len);
+    if (copy != NULL) {
+        const char *header_end = strstr(payload->data, END_OF_MESSAGE_TOKEN);
+        size_t header_len = header_end - payload->data + strlen(END_OF_MESSAGE_TOKEN);
+        memcpy(copy->data, payload->data, header_len);
+        sprintf(copy->data + header_len, "%s" END_OF_MESSAGE_TOKEN, line);
+        memcpy(copy->data + header_len + line_len, payload->data + header_len,
+               payload->len - header_len + 1);
+        copy->len = payload->len + line_len;
+    }
+    list_payload_release(payload);
+    return copy;
+}
+
+
+ListPayload *list_payload_acquire(ListPayload *payload) {
+    __atomic_add_fetch(&payload->refs, 1, __ATOMIC_RELAXED);
+    return payload;
+}
+
+
+void list_payload_release(ListPayload *payload) {
+    if (__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(payload);
+    }
+}
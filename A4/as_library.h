@@ -0,0 +1,295 @@
+#ifndef AS_LIBRARY_H_
+#define AS_LIBRARY_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_index.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+/*
+** Design
+** ------
+** The server's view of the library directory. scan_library walks the
+** directory and compares what it found with the files it already knows: only
+** if they differ does the library move on to a new generation.
+**
+** Each generation comes with its LIST response, laid out once in a single
+** buffer (a ListPayload), so a LIST request is answered with one write
+** instead of a few per file. The payload is reference counted: a response
+** still being sent keeps the payload of its generation alive after a rescan
+** has replaced it.
+**
+** Rescans keep the files that are still there at their index, so a client
+** can bring its list up to date from the changes alone (LISTSINCE, see
+** as_server.h). A removed file is replaced by the last file in the list, and
+** new files are appended. The last LIBRARY_LOG_SIZE changes are kept in a
+** log; a client whose generation is older than that gets the whole list.
+**
+** Rescanning a big library (or one on a network file system) takes long
+** enough to stall every client, so library_watch sets up an inotify watch on
+** each of its directories, and files are added and removed as the events
+** come in, a batch of events making one generation. Renames are a removal
+** and an addition. A full walk only runs every LIBRARY_CHECK_INTERVAL
+** seconds (or right away if the kernel dropped events), as a consistency
+** check: it runs in a thread of its own, and only the comparison of what it
+** found with the library is done by the server, in library_update. Each walk
+** also writes the library's index (see as_index.h), so a restarted server
+** can start from library_load instead of a scan.
+**
+** The first walk is the one putting the watches on, each directory before it
+** is read; the events are only read once it is done, so none are missed and
+** the server is never kept waiting. Without a watch (inotify unavailable, or
+** out of watches) the walk runs every LIBRARY_SCAN_INTERVAL instead.
+**
+** Walking the library (walk_library) is spread over LIBRARY_SCAN_THREADS
+** threads sharing a stack of directories still to be read. Directories are
+** opened relative to the library with openat and read with getdents64 in
+** big batches, each thread collects its files in an array of its own, and
+** the arrays are merged at the end, so the files come in no particular
+** order.
+**
+** Storage: the file names of the library (and of a walk) are packed into an
+** Arena, big chunks the names are copied into one after the other, instead
+** of a malloc each. A removed file's name stays in the arena as waste until
+** the waste is half of it, then the names still in use are copied to a new
+** arena. Each file also has a FileInfo (see as_index.h), with a stable ID:
+** a file keeps its ID for as long as it is in the library (and across
+** restarts, through the index), while its index may change when another
+** file is removed; IDs are never reused. Files are found by name or by ID
+** through two open-addressing hash tables of their indexes.
+**
+** Clients that negotiate PROTOCOL_FEATURE_IDS (see as_server.h) are told
+** about, and ask for, files by ID rather than by index, so an ID they cached
+** can never get them a different file; for them the library's resync
+** payload is id_payload, a list of "+<id>:<file>" additions.
+*/
+
+#define LIBRARY_LOG_SIZE 1024
+
+#define LIBRARY_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define LIBRARY_WATCH_BUF_SIZE (64 * 1024)
+#define LIBRARY_CHECK_INTERVAL 600
+
+#define LIBRARY_SCAN_THREADS 8
+#define LIBRARY_WALK_BUF_SIZE (64 * 1024)
+
+#define LIBRARY_ARENA_CHUNK_SIZE (256 * 1024)
+#define LIBRARY_TABLE_MIN_SIZE 64
+#define LIBRARY_NO_ID 0
+
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+
+/*
+** chunks: newest first, names are only ever added to the first one.
+** used: bytes handed out, over all chunks.
+*/
+typedef struct arena {
+    ArenaChunk *chunks;
+    size_t used;
+} Arena;
+
+
+/*
+** The server-side storage of a library's files (library->store).
+**
+** names: the arena library->files point into.
+** wasted: bytes of names in the arena that are no longer in use.
+** info: a FileInfo for each file, in the order of library->files (NULL for
+**       a walk that did not stat the files).
+** capacity: of library->files and info.
+** next_id: the ID the next new file gets.
+** by_name, by_id: hash tables of table_size slots (a power of two) holding
+**       a file's index + 1, LIBRARY_SLOT_EMPTY or LIBRARY_SLOT_DELETED.
+**       table_used counts the slots that are not empty.
+*/
+typedef struct library_store {
+    Arena names;
+    size_t wasted;
+    FileInfo *info;
+    uint32_t capacity;
+    uint32_t next_id;
+    uint32_t *by_name;
+    uint32_t *by_id;
+    uint32_t table_size;
+    uint32_t table_used;
+} LibraryStore;
+
+#define LIBRARY_SLOT_EMPTY 0
+#define LIBRARY_SLOT_DELETED UINT32_MAX
+
+
+/*
+** refs: the library's own reference, plus one per response using it
+**       (atomic, the thread pool shares payloads between threads).
+** len: number of bytes in data.
+** data: a LISTSINCE response. For the library's own payload, that is a full
+**       resync whose list_len bytes from list_offset are the LIST response:
+**       "<index>:<file>\r\n" for each file, from the last index down to 0.
+*/
+typedef struct list_payload {
+    uint32_t refs;
+    size_t len;
+    size_t list_offset;
+    size_t list_len;
+    char data[];
+} ListPayload;
+
+
+/*
+** generation: the generation the change led to.
+** index: index of the removed file, or the index the added file got.
+** id: the file's stable ID.
+** file: name of the added file (heap-allocated), NULL for a removal.
+*/
+typedef struct library_change {
+    uint64_t generation;
+    uint32_t index;
+    uint32_t id;
+    char *file;
+} LibraryChange;
+
+
+/*
+** Ring of the last count changes, from changes[start] on. Clients that know
+** base_generation or a later one can be sent the changes since.
+*/
+typedef struct library_log {
+    LibraryChange changes[LIBRARY_LOG_SIZE];
+    uint32_t start;
+    uint32_t count;
+    uint64_t base_generation;
+} LibraryLog;
+
+
+/*
+** Scan the library directory and (re-)populate the library structure. The library
+** structure will be populated with the name of the library, the path to the library,
+** and a list of files in the library.
+**
+** Only SUPPORTED_FILE_EXTS files will be added to the library.
+**
+** If the files differ from the last scan, they are changed in place (see the
+** Design) and logged, library->generation is incremented and
+** library->list_payload replaced. Otherwise the library is left untouched.
+**
+** If the library is successfully populated, return 0. Otherwise, return -1.
+*/
+int scan_library(Library *library);
+
+/*
+** Find the SUPPORTED_FILE_EXTS files in the library directory and below, with
+** num_threads threads, into library->files, whose names go into a store of
+** its own. library must not have any files yet, and is freed with
+** free_scanned_library.
+**
+** returns 0 on success, -1 if a directory could not be read (library is left
+** empty)
+*/
+int walk_library(Library *library, int num_threads);
+
+/*
+** Watch the library's directories for changes (see the Design), starting
+** with a walk in the background that brings the library up to date. Each
+** process serving the library needs a watch of its own.
+**
+** returns a descriptor that becomes readable when library_update has work to
+** do, or -1 if the library cannot be watched
+*/
+int library_watch(Library *library);
+
+/*
+** Apply the changes seen by the watch, and the result of a finished
+** consistency check, moving to a new generation if anything changed. Does
+** not block.
+**
+** returns 0 on success, -1 on error
+*/
+int library_update(Library *library);
+
+/*
+** Called every LIBRARY_SCAN_INTERVAL: rescan the library if library_watch
+** has not been called, otherwise start a consistency check in the background
+** (if the library is watched, only once the last one is
+** LIBRARY_CHECK_INTERVAL seconds old).
+**
+** returns 0 on success, -1 on error
+*/
+int library_check(Library *library);
+
+/*
+** Populate the library from its index, as the first generation, if there is
+** a usable one, and put the checksums it holds in the checksum table (see
+** as_checksum.h). library_watch then reconciles it with the file system.
+**
+** returns 0 on success, -1 if the library must be scanned instead
+*/
+int library_load(Library *library);
+
+/*
+** Find the file a client asked for: number is its index, or its stable ID
+** for a client that negotiated PROTOCOL_FEATURE_IDS (by_id).
+**
+** returns the file's index, or -1 if there is no such file
+*/
+int64_t library_file_index(const Library *library, uint8_t by_id, uint32_t number);
+
+/*
+** Free the files, the store, the change log and the watch of a scanned
+** library, and drop its references to the LIST payloads.
+*/
+void free_scanned_library(Library *library);
+
+/*
+** Lay out the LIST response for library in a new payload, holding one
+** reference. With by_id, it is the resync for clients using IDs instead.
+**
+** returns the payload, or NULL on error
+*/
+ListPayload *list_payload_build(const Library *library, uint8_t by_id);
+
+/*
+** Find the LISTSINCE response for a client that knows the library as it was
+** at generation: the changes since, or the library's own payload (a full
+** resync) if they are not all in the log anymore. With by_id, files are
+** named by their ID rather than their index.
+**
+** returns a payload reference, or NULL on error
+*/
+ListPayload *list_changes_since(const Library *library, uint64_t generation, uint8_t by_id);
+
+/*
+** Copy the LISTSINCE response payload with line (without its newline)
+** inserted after its header line, and drop the reference to payload.
+**
+** returns the copy, holding one reference, or NULL on error
+*/
+ListPayload *list_payload_with_line(ListPayload *payload, const char *line);
+
+/*
+** Take another reference to payload.
+**
+** returns payload
+*/
+ListPayload *list_payload_acquire(ListPayload *payload);
+
+/*
+** Drop a reference to payload, freeing it with the last one.
+*/
+void list_payload_release(ListPayload *payload);
+
+#endif // AS_LIBRARY_H_
@@ -0,0 +1,144 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_pace.h"
+
+// How far into a WAV file the "fmt " chunk is looked for
+#define PACE_WAV_SCAN 4096
+
+
+typedef struct ext_kbps {
+    const char *ext;
+    uint32_t kbps;
+} ExtKbps;
+
+
+uint64_t pace_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+** Helper for: pace_rate
+** returns the byte rate in the "fmt " chunk of the WAV file fd, 0 if it is
+** not a WAV file the header of which makes sense
+*/
+static uint64_t _wav_byte_rate(int fd) {
+    uint8_t header[PACE_WAV_SCAN];
+    ssize_t len = pread(fd, header, sizeof(header), 0);
+    if (len < 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return 0;
+    }
+
+    // Chunks: a 4 character ID, a 32-bit little-endian size and the data,
+    // padded to an even size
+    ssize_t chunk = 12;
+    while (chunk + 8 <= len) {
+        uint32_t size;
+        memcpy(&size, header + chunk + 4, sizeof(uint32_t));
+        size = le32toh(size);
+        if (memcmp(header + chunk, "fmt ", 4) == 0) {
+            // Format, channels and sample rate come before the byte rate
+            if (size < 16 || chunk + 8 + 12 > len) {
+                return 0;
+            }
+            uint32_t byte_rate;
+            memcpy(&byte_rate, header + chunk + 8 + 8, sizeof(uint32_t));
+            return le32toh(byte_rate);
+        }
+        chunk += 8 + (ssize_t)size + (size & 1);
+    }
+    return 0;
+}
+
+
+uint64_t pace_rate(const char *path, int fd) {
+    static const ExtKbps ext_kbps[] = PACE_EXT_KBPS;
+
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL) {
+        return 0;
+    }
+    uint64_t rate = 0;
+    if (strcmp(ext, ".wav") == 0) {
+        rate = _wav_byte_rate(fd);
+    } else {
+        for (int i = 0; i < sizeof(ext_kbps) / sizeof(ExtKbps); i++) {
+            if (strcmp(ext, ext_kbps[i].ext) == 0) {
+                rate = (uint64_t)ext_kbps[i].kbps * 1000 / 8;
+                break;
+            }
+        }
+    }
+    #ifdef DEBUG
+    printf("Pacing %s at %lu bytes/s\n", path, (unsigned long)rate);
+    #endif
+    return rate * PACE_HEADROOM_PERCENT / 100;
+}
+
+
+void pace_start(TokenBucket *bucket, uint64_t rate) {
+    bucket->rate = rate;
+    bucket->burst = (double)rate * PACE_BURST_SEC;
+    bucket->tokens = bucket->burst;
+    bucket->last = pace_clock_ns();
+}
+
+
+/*
+** Helper for: pace_allowance, pace_delay_ns
+** Add the tokens earned since the bucket was last brought up to date, and
+** returns how many must be in it before wanted bytes start to go
+*/
+static double _refill(TokenBucket *bucket, uint64_t wanted) {
+    uint64_t now = pace_clock_ns();
+    bucket->tokens += (double)bucket->rate * (now - bucket->last) / 1e9;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last = now;
+    return MIN((double)wanted, (double)bucket->rate / PACE_SLICES_PER_SEC);
+}
+
+
+size_t pace_allowance(TokenBucket *bucket, uint64_t wanted) {
+    if (bucket->rate == 0) {
+        return wanted;
+    }
+    if (bucket->tokens < _refill(bucket, wanted)) {
+        return 0;
+    }
+    return MIN(wanted, (uint64_t)bucket->tokens);
+}
+
+
+void pace_consume(TokenBucket *bucket, size_t sent) {
+    if (bucket->rate != 0) {
+        bucket->tokens -= sent;
+    }
+}
+
+
+uint64_t pace_delay_ns(TokenBucket *bucket, uint64_t wanted) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+    double needed = _refill(bucket, wanted) - bucket->tokens;
+    if (needed <= 0) {
+        return 0;
+    }
+    return (uint64_t)(needed * 1e9 / bucket->rate) + 1;
+}
+
+
+size_t pace_wait(TokenBucket *bucket, uint64_t wanted) {
+    uint64_t delay;
+    while ((delay = pace_delay_ns(bucket, wanted)) > 0) {
+        struct timespec sleep = {delay / 1000000000, delay % 1000000000};
+        nanosleep(&sleep, NULL);
+    }
+    return pace_allowance(bucket, wanted);
+}
@@ -0,0 +1,96 @@
+#ifndef AS_PACE_H_
+#define AS_PACE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Design
+** ------
+** A STREAM response normally goes out as fast as TCP allows, so a few clients
+** on a fast network take the whole uplink (and disk) while the listeners
+** further away starve, even though playing a file only takes its bitrate.
+**
+** With pacing on (the -r option), the body of every response is metered by a
+** token bucket:
+**   - the bucket fills at the file's byte rate (PACE_HEADROOM_PERCENT of it,
+**     so a listener whose connection hiccups catches up), read from the
+**     header of a WAV file, or from PACE_EXT_KBPS for the compressed formats.
+**     A file whose rate is unknown is not paced.
+**   - it starts full and holds PACE_BURST_SEC seconds of audio, so playback
+**     starts right away and a client can always buffer that far ahead.
+**   - bytes are sent once the bucket holds a slice (1 / PACE_SLICES_PER_SEC
+**     of a second of audio) or the rest of the body, whichever is smaller,
+**     so a paced connection is woken a few times a second, not per packet.
+** The blocking handler sleeps until a slice is available, the event-driven
+** engines set the connection aside until then (see as_reactor.h).
+*/
+
+#define PACE_BURST_SEC 3
+#define PACE_SLICES_PER_SEC 10
+#define PACE_HEADROOM_PERCENT 125
+
+// Bitrates of the formats whose header is not parsed, in kbit/s. Unlisted
+// extensions are not paced.
+#define PACE_EXT_KBPS {{".mp3", 320}, {".ogg", 320}, {".m4a", 256}, {".flac", 1411}}
+
+
+/*
+** rate: bytes per second the bucket fills at, 0 for an unpaced body.
+** tokens: bytes that may be sent right now, at most burst.
+** last: when tokens was last brought up to date (see pace_clock_ns).
+*/
+typedef struct token_bucket {
+    uint64_t rate;
+    double tokens;
+    double burst;
+    uint64_t last;
+} TokenBucket;
+
+
+/*
+** returns the monotonic clock in nanoseconds
+*/
+uint64_t pace_clock_ns(void);
+
+/*
+** Find the rate to send the library file at path (open as fd) at.
+**
+** returns bytes per second, 0 if the file should not be paced
+*/
+uint64_t pace_rate(const char *path, int fd);
+
+/*
+** Start a full bucket for a body sent at rate bytes per second (0: unpaced).
+*/
+void pace_start(TokenBucket *bucket, uint64_t rate);
+
+/*
+** returns how many of the wanted bytes may be sent right now: wanted if the
+** body is unpaced, 0 until the bucket holds a slice (or wanted, if smaller)
+*/
+size_t pace_allowance(TokenBucket *bucket, uint64_t wanted);
+
+/*
+** Take sent bytes out of the bucket.
+*/
+void pace_consume(TokenBucket *bucket, size_t sent);
+
+/*
+** returns the nanoseconds until pace_allowance lets some of the wanted bytes
+** go, 0 if it does now
+*/
+uint64_t pace_delay_ns(TokenBucket *bucket, uint64_t wanted);
+
+/*
+** Sleep until some of the wanted bytes may be sent, for blocking senders.
+**
+** returns how many may be sent (wanted if the body is unpaced)
+*/
+size_t pace_wait(TokenBucket *bucket, uint64_t wanted);
+
+#endif // AS_PACE_H_
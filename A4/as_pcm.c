@@ -0,0 +1,540 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_pcm.h"
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+// Residuals are summed 4 at a time, in 32-bit lanes that are added up into
+// 64-bit totals every PCM_SUM_RUN steps, before they can overflow
+#define PCM_LANES 4
+#define PCM_SUM_RUN 8
+
+typedef int32_t PcmVector __attribute__((vector_size(PCM_LANES * sizeof(int32_t))));
+
+
+/*
+** out, cap: where the bit stream goes, and how much of it there is room for.
+** len: bytes written so far.
+** acc, bits: the bits not written yet, in the low bits of acc.
+** full: set once a write did not fit.
+*/
+typedef struct bit_writer {
+    uint8_t *out;
+    size_t cap;
+    size_t len;
+    uint64_t acc;
+    int bits;
+    uint8_t full;
+} BitWriter;
+
+/*
+** in, len, pos: the bit stream and how much of it has been loaded.
+** acc, bits: the bits loaded and not read yet, at the top of acc.
+** overrun: set once a read went past the end.
+*/
+typedef struct bit_reader {
+    const uint8_t *in;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+    uint8_t overrun;
+} BitReader;
+
+
+static uint16_t _le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+
+static uint32_t _le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+int pcm_probe(int fd, uint64_t size, PcmFormat *format) {
+    uint8_t riff[12];
+    if (pread(fd, riff, sizeof(riff), 0) != sizeof(riff) || memcmp(riff, "RIFF", 4) != 0 ||
+        memcmp(riff + 8, "WAVE", 4) != 0) {
+        return -1;
+    }
+
+    // Chunks: a 4 character ID, a 32-bit little-endian size and the data,
+    // padded to an even size. "fmt " comes before "data", and padding or
+    // metadata chunks may come between them.
+    uint16_t audio_format = 0, channels = 0, block_align = 0, bits = 0;
+    uint32_t sample_rate = 0;
+    uint64_t chunk = sizeof(riff);
+    for (int i = 0; i < PCM_MAX_CHUNKS && chunk + 8 <= size; i++) {
+        uint8_t header[8];
+        if (pread(fd, header, sizeof(header), chunk) != sizeof(header)) {
+            return -1;
+        }
+        uint32_t chunk_size = _le32(header + 4);
+
+        uint8_t fmt[40];
+        if (memcmp(header, "fmt ", 4) == 0 && chunk_size >= 16 &&
+            pread(fd, fmt, MIN(chunk_size, sizeof(fmt)), chunk + 8) >= 16) {
+            audio_format = _le16(fmt);
+            channels = _le16(fmt + 2);
+            sample_rate = _le32(fmt + 4);
+            block_align = _le16(fmt + 12);
+            bits = _le16(fmt + 14);
+            // The real format is the start of the sub-format GUID
+            if (audio_format == WAVE_FORMAT_EXTENSIBLE && chunk_size >= 40) {
+                audio_format = _le16(fmt + 24);
+            }
+        }
+
+        if (memcmp(header, "data", 4) == 0) {
+            if (audio_format != WAVE_FORMAT_PCM || channels < 1 ||
+                channels > PCM_MAX_CHANNELS || (bits != 8 && bits != 16 && bits != 24) ||
+                block_align != channels * bits / 8) {
+                return -1;
+            }
+            format->channels = channels;
+            format->bytes_per_sample = bits / 8;
+            format->sample_rate = sample_rate;
+            format->data_offset = chunk + 8;
+            format->size = size;
+            // Files still being written often say 0 or 0xFFFFFFFF
+            uint64_t data_end = MIN(format->data_offset + chunk_size, size);
+            if (data_end < format->data_offset) {
+                return -1;
+            }
+            format->data_end = data_end - (data_end - format->data_offset) % block_align;
+            return 0;
+        }
+        chunk += 8 + (uint64_t)chunk_size + (chunk_size & 1);
+    }
+    return -1;
+}
+
+
+size_t pcm_block(const PcmFormat *format, uint64_t offset, int *samples) {
+    size_t frame_bytes = format->channels * format->bytes_per_sample;
+    *samples = 0;
+    if (offset < format->data_offset) {
+        return MIN(format->data_offset - offset, PCM_BLOCK_MAX);
+    }
+    if (offset < format->data_end) {
+        *samples = 1;
+        return MIN(format->data_end - offset, PCM_BLOCK_FRAMES * frame_bytes);
+    }
+    return MIN(format->size - offset, PCM_BLOCK_MAX);
+}
+
+
+/*
+** Helper for: _encode_channel, pcm_encode
+** Append the count (at most 32) low bits of value.
+*/
+static void _put_bits(BitWriter *writer, uint32_t value, int count) {
+    if (count == 0) {
+        return;
+    }
+    writer->acc = writer->acc << count | (value & (0xFFFFFFFFU >> (32 - count)));
+    writer->bits += count;
+    // Written out 32 bits at a time, fewer than that stay in acc
+    if (writer->bits >= 32) {
+        writer->bits -= 32;
+        if (writer->cap - writer->len < sizeof(uint32_t)) {
+            writer->full = 1;
+            writer->bits = 0;
+            return;
+        }
+        uint32_t word = htonl(writer->acc >> writer->bits);
+        memcpy(writer->out + writer->len, &word, sizeof(uint32_t));
+        writer->len += sizeof(uint32_t);
+    }
+}
+
+
+/*
+** Helper for: pcm_encode
+** Pad the bit stream with zeros to a whole byte, and write out what is left.
+*/
+static void _flush_bits(BitWriter *writer) {
+    _put_bits(writer, 0, (8 - writer->bits % 8) % 8);
+    while (writer->bits > 0 && !writer->full) {
+        writer->bits -= 8;
+        if (writer->len == writer->cap) {
+            writer->full = 1;
+            return;
+        }
+        writer->out[writer->len++] = writer->acc >> writer->bits;
+    }
+}
+
+
+/*
+** Helper for: _get_bits, _get_unary
+** Load as many bytes into acc as fit.
+*/
+static void _refill(BitReader *reader) {
+    if (reader->pos + sizeof(uint64_t) <= reader->len) {
+        // A whole word at once: the bytes past the last whole one loaded are
+        // loaded again by the next refill, to the same bits
+        uint64_t word;
+        memcpy(&word, reader->in + reader->pos, sizeof(uint64_t));
+        reader->acc |= __builtin_bswap64(word) >> reader->bits;
+        reader->pos += (63 - reader->bits) >> 3;
+        reader->bits |= 56;
+        return;
+    }
+    while (reader->bits <= 56 && reader->pos < reader->len) {
+        reader->acc |= (uint64_t)reader->in[reader->pos++] << (56 - reader->bits);
+        reader->bits += 8;
+    }
+}
+
+
+/*
+** Helper for: pcm_decode, _decode_channel
+** returns the next count (at most 32) bits
+*/
+static uint32_t _get_bits(BitReader *reader, int count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (reader->bits < count) {
+        _refill(reader);
+        if (reader->bits < count) {
+            reader->overrun = 1;
+            return 0;
+        }
+    }
+    uint32_t value = reader->acc >> (64 - count);
+    reader->acc <<= count;
+    reader->bits -= count;
+    return value;
+}
+
+
+/*
+** Helper for: _decode_channel
+** returns the number of 0 bits before the next 1 (which is consumed), at
+** most PCM_ESCAPE + 1
+*/
+static int _get_unary(BitReader *reader) {
+    int zeros = 0;
+    while (zeros <= PCM_ESCAPE) {
+        if (reader->bits <= PCM_ESCAPE) {
+            _refill(reader);
+        }
+        if (reader->bits == 0) {
+            reader->overrun = 1;
+            return zeros;
+        }
+        int leading = reader->acc == 0 ? 64 : __builtin_clzll(reader->acc);
+        if (leading < reader->bits) {
+            // In two steps, the 1 may be the last of 64 bits
+            reader->acc = reader->acc << leading << 1;
+            reader->bits -= leading + 1;
+            return zeros + leading;
+        }
+        zeros += reader->bits;
+        reader->acc = reader->bits < 64 ? reader->acc << reader->bits : 0;
+        reader->bits = 0;
+    }
+    return zeros;
+}
+
+
+/*
+** Helpers for: pcm_encode, pcm_decode
+** Copy channel of the interleaved little-endian frames of block to or from
+** samples (8-bit samples are unsigned, stored with an offset of 128).
+*/
+static void _load_channel(const PcmFormat *format, const uint8_t *block, uint32_t frames,
+                          int channel, int32_t *samples) {
+    size_t step = format->channels * format->bytes_per_sample;
+    const uint8_t *p = block + channel * format->bytes_per_sample;
+    // One loop per width, the width is the same for every sample
+    if (format->bytes_per_sample == 1) {
+        for (uint32_t i = 0; i < frames; i++, p += step) {
+            samples[i] = (int32_t)p[0] - 128;
+        }
+    } else if (format->bytes_per_sample == 2) {
+        for (uint32_t i = 0; i < frames; i++, p += step) {
+            samples[i] = (int16_t)(p[0] | p[1] << 8);
+        }
+    } else {
+        for (uint32_t i = 0; i < frames; i++, p += step) {
+            samples[i] = (int32_t)((uint32_t)(p[0] | p[1] << 8 | p[2] << 16) << 8) >> 8;
+        }
+    }
+}
+
+
+static void _store_channel(const PcmFormat *format, const int32_t *samples, uint32_t frames,
+                           int channel, uint8_t *block) {
+    size_t step = format->channels * format->bytes_per_sample;
+    uint8_t *p = block + channel * format->bytes_per_sample;
+    for (uint32_t i = 0; i < frames; i++, p += step) {
+        uint32_t sample = format->bytes_per_sample == 1 ? samples[i] + 128 : samples[i];
+        for (int byte = 0; byte < format->bytes_per_sample; byte++) {
+            p[byte] = sample >> (8 * byte);
+        }
+    }
+}
+
+
+/*
+** Helper for: _encode_channel
+** returns the order of the fixed predictor whose residuals over x[0..n)
+** add up to the least
+*/
+static int _best_order(const int32_t *x, uint32_t n) {
+    if (n <= PCM_MAX_ORDER) {
+        return 0;
+    }
+    uint64_t totals[PCM_MAX_ORDER + 1] = {0};
+    uint32_t i = PCM_MAX_ORDER;
+
+    // Residuals of every order at once: each is the difference of the one
+    // below it at this sample and at the one before
+    while (i + PCM_LANES <= n) {
+        PcmVector sums[PCM_MAX_ORDER + 1] = {{0}};
+        for (int run = 0; run < PCM_SUM_RUN && i + PCM_LANES <= n; run++, i += PCM_LANES) {
+            PcmVector x0, x1, x2, x3, x4;
+            memcpy(&x0, x + i, sizeof(PcmVector));
+            memcpy(&x1, x + i - 1, sizeof(PcmVector));
+            memcpy(&x2, x + i - 2, sizeof(PcmVector));
+            memcpy(&x3, x + i - 3, sizeof(PcmVector));
+            memcpy(&x4, x + i - 4, sizeof(PcmVector));
+            PcmVector d1a = x0 - x1, d1b = x1 - x2, d1c = x2 - x3, d1d = x3 - x4;
+            PcmVector d2a = d1a - d1b, d2b = d1b - d1c, d2c = d1c - d1d;
+            PcmVector d3a = d2a - d2b, d3b = d2b - d2c;
+            PcmVector residuals[PCM_MAX_ORDER + 1] = {x0, d1a, d2a, d3a, d3a - d3b};
+            for (int order = 0; order <= PCM_MAX_ORDER; order++) {
+                PcmVector sign = residuals[order] >> 31;
+                sums[order] += (residuals[order] ^ sign) - sign;
+            }
+        }
+        for (int order = 0; order <= PCM_MAX_ORDER; order++) {
+            for (int lane = 0; lane < PCM_LANES; lane++) {
+                totals[order] += (uint32_t)sums[order][lane];
+            }
+        }
+    }
+    for (; i < n; i++) {
+        int32_t d1a = x[i] - x[i - 1], d1b = x[i - 1] - x[i - 2];
+        int32_t d1c = x[i - 2] - x[i - 3], d1d = x[i - 3] - x[i - 4];
+        int32_t d2a = d1a - d1b, d2b = d1b - d1c, d2c = d1c - d1d;
+        int32_t d3a = d2a - d2b, d3b = d2b - d2c;
+        int32_t residuals[PCM_MAX_ORDER + 1] = {x[i], d1a, d2a, d3a, d3a - d3b};
+        for (int order = 0; order <= PCM_MAX_ORDER; order++) {
+            totals[order] += abs(residuals[order]);
+        }
+    }
+
+    int best = 0;
+    for (int order = 1; order <= PCM_MAX_ORDER; order++) {
+        if (totals[order] < totals[best]) {
+            best = order;
+        }
+    }
+    return best;
+}
+
+
+/*
+** Helper for: _decode_channel
+** returns the prediction of x[i] by the fixed predictor of order
+*/
+static int64_t _predict(const int32_t *x, uint32_t i, int order) {
+    switch (order) {
+        case 1: return x[i - 1];
+        case 2: return 2 * (int64_t)x[i - 1] - x[i - 2];
+        case 3: return 3 * ((int64_t)x[i - 1] - x[i - 2]) + x[i - 3];
+        case 4: return 4 * ((int64_t)x[i - 1] + x[i - 3]) - 6 * (int64_t)x[i - 2] - x[i - 4];
+        default: return 0;
+    }
+}
+
+
+/*
+** Helper for: _encode_channel
+** Set residuals[order..n) to the zigzagged residuals of x[order..n) by the
+** predictor of order.
+*/
+static void _residuals(const int32_t *x, uint32_t n, int order, uint32_t *residuals) {
+    // One loop per order, so each is a plain loop the compiler can vectorize
+    #define PCM_ZIGZAG(expression)                                                \
+        for (uint32_t i = order; i < n; i++) {                                    \
+            int32_t residual = (int32_t)(expression);                             \
+            residuals[i] = (uint32_t)residual << 1 ^ (uint32_t)(residual >> 31); \
+        }
+    switch (order) {
+        case 0: PCM_ZIGZAG(x[i]); break;
+        case 1: PCM_ZIGZAG((uint32_t)x[i] - x[i - 1]); break;
+        case 2: PCM_ZIGZAG((uint32_t)x[i] - 2U * x[i - 1] + x[i - 2]); break;
+        case 3: PCM_ZIGZAG((uint32_t)x[i] - 3U * x[i - 1] + 3U * x[i - 2] - x[i - 3]); break;
+        default:
+            PCM_ZIGZAG((uint32_t)x[i] - 4U * x[i - 1] + 6U * x[i - 2] - 4U * x[i - 3] + x[i - 4]);
+    }
+    #undef PCM_ZIGZAG
+}
+
+
+/*
+** Helper for: pcm_encode
+** Append the n samples of one channel, bits wide, to the bit stream.
+*/
+static void _encode_channel(BitWriter *writer, const int32_t *x, uint32_t n, int bits) {
+    uint32_t residuals[PCM_BLOCK_FRAMES];
+    int order = _best_order(x, n);
+    _put_bits(writer, order, 3);
+    for (int i = 0; i < order; i++) {
+        _put_bits(writer, x[i], bits);
+    }
+    _residuals(x, n, order, residuals);
+
+    for (uint32_t start = 0; start < n && !writer->full; start += PCM_PARTITION) {
+        uint32_t first = MAX(start, (uint32_t)order);
+        uint32_t end = MIN(start + PCM_PARTITION, n);
+        if (first >= end) {
+            continue;
+        }
+        // The k for which the codes are about as long as they get: the
+        // mean is about 2^k
+        uint64_t sum = 0;
+        for (uint32_t i = first; i < end; i++) {
+            sum += residuals[i];
+        }
+        int k = 0;
+        while (k < 30 && ((uint64_t)(end - first) << (k + 1)) < sum) {
+            k++;
+        }
+        _put_bits(writer, k, 5);
+        for (uint32_t i = first; i < end; i++) {
+            uint32_t quotient = residuals[i] >> k;
+            if (quotient >= PCM_ESCAPE) {
+                _put_bits(writer, 1, PCM_ESCAPE + 1);
+                _put_bits(writer, residuals[i], 32);
+            } else if (quotient + 1 + k <= 32) {
+                _put_bits(writer, 1U << k | (residuals[i] & ((1U << k) - 1)), quotient + 1 + k);
+            } else {
+                _put_bits(writer, 1, quotient + 1);
+                _put_bits(writer, residuals[i], k);
+            }
+        }
+    }
+}
+
+
+size_t pcm_encode(const PcmFormat *format, const uint8_t *block, size_t len, int samples,
+                  uint8_t *frame) {
+    size_t frame_bytes = format->channels * format->bytes_per_sample;
+    uint32_t frames = len / frame_bytes;
+    if (samples && len > PCM_LPC_HEADER) {
+        frame[0] = PCM_FRAME_LPC;
+        frame[1] = format->channels;
+        frame[2] = format->bytes_per_sample;
+        uint16_t frames_nbo = htons(frames);
+        memcpy(frame + 3, &frames_nbo, sizeof(uint16_t));
+
+        // Only worth it if it ends up smaller than the block
+        BitWriter writer = {frame + PCM_LPC_HEADER, len - PCM_LPC_HEADER, 0, 0, 0, 0};
+        int32_t x[PCM_BLOCK_FRAMES];
+        for (int channel = 0; channel < format->channels && !writer.full; channel++) {
+            _load_channel(format, block, frames, channel, x);
+            _encode_channel(&writer, x, frames, 8 * format->bytes_per_sample);
+        }
+        _flush_bits(&writer);
+        if (!writer.full) {
+            return PCM_LPC_HEADER + writer.len;
+        }
+    }
+
+    frame[0] = PCM_FRAME_RAW;
+    memcpy(frame + 1, block, len);
+    return len + 1;
+}
+
+
+/*
+** Helper for: pcm_decode
+** Read the n samples of one channel, bits wide, from the bit stream.
+**
+** returns 0 on success, -1 if the bit stream is malformed
+*/
+static int _decode_channel(BitReader *reader, int32_t *x, uint32_t n, int bits) {
+    int order = _get_bits(reader, 3);
+    if (order > PCM_MAX_ORDER || (order > 0 && (uint32_t)order >= n)) {
+        return -1;
+    }
+    for (int i = 0; i < order; i++) {
+        x[i] = (int32_t)(_get_bits(reader, bits) << (32 - bits)) >> (32 - bits);
+    }
+
+    int64_t low = -((int64_t)1 << (bits - 1)), high = ((int64_t)1 << (bits - 1)) - 1;
+    for (uint32_t start = 0; start < n; start += PCM_PARTITION) {
+        uint32_t first = MAX(start, (uint32_t)order);
+        uint32_t end = MIN(start + PCM_PARTITION, n);
+        if (first >= end) {
+            continue;
+        }
+        int k = _get_bits(reader, 5);
+        for (uint32_t i = first; i < end; i++) {
+            int quotient = _get_unary(reader);
+            uint32_t zigzag;
+            if (quotient == PCM_ESCAPE) {
+                zigzag = _get_bits(reader, 32);
+            } else if (quotient < PCM_ESCAPE) {
+                zigzag = (uint32_t)quotient << k | _get_bits(reader, k);
+            } else {
+                return -1;
+            }
+            int64_t sample = _predict(x, i, order) + (int32_t)(zigzag >> 1 ^ -(zigzag & 1));
+            if (reader->overrun || sample < low || sample > high) {
+                return -1;
+            }
+            x[i] = sample;
+        }
+    }
+    return reader->overrun ? -1 : 0;
+}
+
+
+ssize_t pcm_decode(const uint8_t *frame, size_t len, uint8_t *block) {
+    if (len < 1 || (frame[0] != PCM_FRAME_RAW && frame[0] != PCM_FRAME_LPC)) {
+        return -1;
+    }
+    if (frame[0] == PCM_FRAME_RAW) {
+        if (len - 1 > PCM_BLOCK_MAX) {
+            return -1;
+        }
+        memcpy(block, frame + 1, len - 1);
+        return len - 1;
+    }
+
+    if (len < PCM_LPC_HEADER) {
+        return -1;
+    }
+    PcmFormat format;
+    format.channels = frame[1];
+    format.bytes_per_sample = frame[2];
+    uint16_t frames_nbo;
+    memcpy(&frames_nbo, frame + 3, sizeof(uint16_t));
+    uint32_t frames = ntohs(frames_nbo);
+    if (format.channels < 1 || format.channels > PCM_MAX_CHANNELS ||
+        format.bytes_per_sample < 1 || format.bytes_per_sample > 3 ||
+        frames > PCM_BLOCK_FRAMES) {
+        return -1;
+    }
+
+    BitReader reader = {frame + PCM_LPC_HEADER, len - PCM_LPC_HEADER, 0, 0, 0, 0};
+    int32_t x[PCM_BLOCK_FRAMES];
+    for (int channel = 0; channel < format.channels; channel++) {
+        if (_decode_channel(&reader, x, frames, 8 * format.bytes_per_sample) < 0) {
+            return -1;
+        }
+        _store_channel(&format, x, frames, channel, block);
+    }
+    return (ssize_t)frames * format.channels * format.bytes_per_sample;
+}
@@ -0,0 +1,113 @@
+#ifndef AS_PCM_H_
+#define AS_PCM_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Design
+** ------
+** Most of a library is uncompressed PCM WAV, which shrinks by half or so
+** without losing a bit. A client that agreed to PROTOCOL_FEATURE_PCM gets
+** whole WAV files in this transport encoding (see as_server.h), and decodes
+** them back to the very same bytes.
+**
+** The file is cut into blocks: the bytes before the samples (the header),
+** then PCM_BLOCK_FRAMES sample frames at a time, then whatever follows the
+** samples (more chunks, a partial frame), and each block is sent as one
+** frame, PCM_FRAME_LPC if its samples could be encoded smaller, else
+** PCM_FRAME_RAW, so nothing ever grows by more than a byte per block.
+**
+** Each channel of a PCM_FRAME_LPC block is encoded on its own, like FLAC's
+** fixed predictors do:
+**   - every sample is predicted from the ones before it by the polynomial
+**     of order 0 to PCM_MAX_ORDER that fits the block best (order 2 is
+**     2 x[i-1] - x[i-2]), and only the residual (sample - prediction) is
+**     kept. Audio changes smoothly, so the residuals are small.
+**   - residuals are zigzagged to unsigned (0, -1, 1, -2... become 0, 1, 2,
+**     3...) and Rice coded in partitions of PCM_PARTITION, each with its own
+**     parameter k: the low k bits as they are, the rest in unary. A value
+**     whose unary part would reach PCM_ESCAPE is escaped and written whole.
+** Choosing the order means summing the residuals of every order over the
+** whole block, which is where the encoder spends its time: it works on four
+** samples at a time with the compiler's vector extensions (SSE2 on x86-64,
+** plain code where there is no SIMD).
+**
+** 8, 16 and 24-bit integer PCM are encoded, other formats (float samples)
+** are sent as they are.
+**
+** Frame payload, in the protocol's network byte order:
+**   PCM_FRAME_RAW: the type byte, then the block as it is.
+**   PCM_FRAME_LPC: the type byte, channels (8-bit), bytes per sample (8-bit),
+**                  frames (16-bit), then a bit stream (most significant bit
+**                  first) holding, for each channel in turn: the order
+**                  (3 bits), the first order samples (8 x bytes per sample
+**                  bits each), then for each partition of the samples after
+**                  them: k (5 bits) and their Rice codes.
+*/
+
+#define PCM_BLOCK_FRAMES 4096
+#define PCM_MAX_CHANNELS 8
+#define PCM_MAX_ORDER 4
+#define PCM_PARTITION 256
+#define PCM_ESCAPE 24
+// How many chunks of a WAV file are looked at for the "data" chunk
+#define PCM_MAX_CHUNKS 64
+// Largest block, and largest frame payload
+#define PCM_BLOCK_MAX (PCM_BLOCK_FRAMES * PCM_MAX_CHANNELS * 3)
+#define PCM_FRAME_MAX (PCM_BLOCK_MAX + 1)
+
+#define PCM_FRAME_RAW 0
+#define PCM_FRAME_LPC 1
+#define PCM_LPC_HEADER 5
+
+
+/*
+** channels, bytes_per_sample, sample_rate: of a WAV file encodable by this
+** codec.
+** data_offset, data_end: where its whole frames of samples are.
+** size: the file's size.
+*/
+typedef struct pcm_format {
+    uint16_t channels;
+    uint16_t bytes_per_sample;
+    uint32_t sample_rate;
+    uint64_t data_offset;
+    uint64_t data_end;
+    uint64_t size;
+} PcmFormat;
+
+
+/*
+** Read the header of the open file fd, of size bytes, into format.
+**
+** returns 0 if it is a WAV file whose samples can be encoded, -1 otherwise
+*/
+int pcm_probe(int fd, uint64_t size, PcmFormat *format);
+
+/*
+** returns the length of the block starting at offset (the end of the
+** previous one), and sets *samples if the block is sample frames
+*/
+size_t pcm_block(const PcmFormat *format, uint64_t offset, int *samples);
+
+/*
+** Encode the block of len bytes (see pcm_block) into frame, which must hold
+** PCM_FRAME_MAX bytes.
+**
+** returns the length of the frame payload, at most len + 1
+*/
+size_t pcm_encode(const PcmFormat *format, const uint8_t *block, size_t len, int samples,
+                  uint8_t *frame);
+
+/*
+** Decode the frame payload of len bytes into block, which must hold
+** PCM_BLOCK_MAX bytes.
+**
+** returns the length of the block, -1 if the frame is malformed
+*/
+ssize_t pcm_decode(const uint8_t *frame, size_t len, uint8_t *block);
+
+#endif // AS_PCM_H_
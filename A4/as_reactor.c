@@ -0,0 +1,496 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_reactor.h"
+
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+// Tags for the epoll entries that are not client connections
+static int listen_tag;
+static int stdin_tag;
+static int library_tag;
+
+
+static int _set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("_set_nonblocking");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int _watch(int epfd, int op, int fd, void *tag, uint32_t events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = tag;
+    if (epoll_ctl(epfd, op, fd, &event) < 0) {
+        perror("run_reactor: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Watch stdin for the quit command. A stdin that cannot be polled (/dev/null
+** or a regular file, e.g. under a service manager) is left alone, the server
+** then only stops on a signal.
+** returns 0 on success, -1 on error
+*/
+static int _watch_stdin(int epfd) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &stdin_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0 && errno != EPERM) {
+        perror("run_reactor: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void _remove_connection(Connection ***connections, int *num_connections,
+                               Connection *conn) {
+    for (int i = 0; i < *num_connections; i++) {
+        if ((*connections)[i] == conn) {
+            for (int j = i; j < *num_connections - 1; j++) {
+                (*connections)[j] = (*connections)[j + 1];
+            }
+            (*num_connections)--;
+            break;
+        }
+    }
+}
+
+
+static void _drop_connection(Scheduler *sched, Connection ***connections,
+                             int *num_connections, Connection *conn) {
+    sched_deactivate(sched, &conn->flow);
+    _remove_connection(connections, num_connections, conn);
+    connection_close(conn);
+}
+
+
+Connection *connection_new(ClientSocket client) {
+    Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+        perror("connection_new");
+        return NULL;
+    }
+    conn->client = client;
+    stream_job_init(&conn->job);
+    sched_flow_init(&conn->flow, &client.addr);
+    return conn;
+}
+
+
+void connection_close(Connection *conn) {
+    // Closing the socket also removes it from any epoll set
+    stream_job_free(&conn->job);
+    close(conn->client.socket);
+    printf("Client on %s:%d disconnected\n",
+           inet_ntoa(conn->client.addr.sin_addr),
+           ntohs(conn->client.addr.sin_port));
+    sched_print_flow(&conn->flow, &conn->client.addr);
+    free(conn);
+}
+
+
+int accept_nonblocking(int listenfd, ClientSocket *client) {
+    socklen_t addr_size = sizeof(client->addr);
+    client->socket = accept4(listenfd, (struct sockaddr *)&client->addr,
+                             &addr_size, SOCK_NONBLOCK);
+    if (client->socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+            errno == ECONNABORTED) {
+            return 0;
+        }
+        perror("accept_nonblocking: accept");
+        // Out of descriptors is not fatal, the client will just wait
+        if (errno == EMFILE || errno == ENFILE) {
+            return 0;
+        }
+        return -1;
+    }
+    client->protocol_version = PROTOCOL_VERSION_1;
+    client->chunked = 0;
+    client->ids = 0;
+    client->checksums = 0;
+    client->trailer = 0;
+    client->pcm = 0;
+    client->tiers = 0;
+    tune_client_socket(client->socket);
+
+    printf("Server got a connection from %s, port %d\n",
+           inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+    return 1;
+}
+
+
+/*
+** Accept every pending connection on the listening socket.
+** returns 0 on success, -1 on error
+*/
+static int _accept_clients(int epfd, int listenfd,
+                           Connection ***connections, int *num_connections) {
+    ClientSocket client;
+    int accepted;
+    while ((accepted = accept_nonblocking(listenfd, &client)) > 0) {
+        Connection *conn = connection_new(client);
+        if (conn == NULL) {
+            close(client.socket);
+            continue;
+        }
+
+        if (_watch(epfd, EPOLL_CTL_ADD, client.socket, conn, EPOLLIN) < 0) {
+            connection_close(conn);
+            continue;
+        }
+        conn->watching = EPOLLIN;
+
+        (*num_connections)++;
+        *connections = (Connection **)realloc(*connections,
+                                              (*num_connections)
+                                              * sizeof(Connection *));
+        if (*connections == NULL) {
+            perror("run_reactor: realloc");
+            return -1;
+        }
+        (*connections)[*num_connections - 1] = conn;
+    }
+    return accepted;
+}
+
+
+/*
+** Parse buffered requests until one of them needs a response to be sent.
+** returns 0 on success, -1 on error
+*/
+static int _next_response(Connection *conn, const Library *library) {
+    Request req;
+    while (!conn->sending &&
+           parse_request(conn->request_buffer, &conn->bytes_in_buf, &req)) {
+        if (req.type == REQUEST_TYPE_UNKNOWN) {
+            continue;
+        }
+        if (prepare_response(&req, &conn->client, library, &conn->job) < 0) {
+            ERR_PRINT("Error preparing response\n");
+            return -1;
+        }
+        conn->sending = 1;
+    }
+    return 0;
+}
+
+
+/*
+** Send up to budget bytes of the pending responses, moving on to the next
+** buffered request whenever a response completes.
+** returns 1 if the budget ran out, 0 if the socket is full or there is
+** nothing left to send, -1 on error
+*/
+static int _on_writable(Connection *conn, const Library *library, size_t budget) {
+    while (conn->sending) {
+        if (budget == 0) {
+            return 1;
+        }
+        ssize_t sent = stream_job_send(&conn->job, conn->client.socket, budget);
+        if (sent < 0) {
+            return -1;
+        }
+        sched_charge(&conn->flow, sent);
+        budget -= sent;
+        if (!stream_job_done(&conn->job)) {
+            if (budget == 0) {
+                return 1;
+            }
+            uint64_t delay = stream_job_pace_delay(&conn->job);
+            if (delay > 0) {
+                conn->resume_at = pace_clock_ns() + delay;
+                return 2;
+            }
+            return 0;
+        }
+        stream_job_free(&conn->job);
+        conn->sending = 0;
+        if (_next_response(conn, library) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Read whatever the client sent and start answering complete requests.
+** returns the same as _on_writable, -1 also when the client disconnected
+*/
+static int _on_readable(Connection *conn, const Library *library, size_t budget) {
+    ssize_t bytes_read = read(conn->client.socket,
+                              conn->request_buffer + conn->bytes_in_buf,
+                              REQUEST_BUFFER_SIZE - conn->bytes_in_buf);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        perror("run_reactor: read");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Read %zd bytes from client\n", bytes_read);
+    #endif
+    conn->bytes_in_buf += bytes_read;
+
+    if (_next_response(conn, library) < 0) {
+        return -1;
+    }
+    if (!conn->sending && conn->bytes_in_buf == REQUEST_BUFFER_SIZE) {
+        ERR_PRINT("Request buffer filled without a complete request\n");
+        return -1;
+    }
+    // Most responses fit in the socket buffer, no need to wait for EPOLLOUT
+    // (with no budget, it only tells the caller there is something to send)
+    if (conn->sending) {
+        return _on_writable(conn, library, budget);
+    }
+    return 0;
+}
+
+
+int connection_process(Connection *conn, uint32_t events, const Library *library,
+                       size_t budget) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+    if (conn->sending) {
+        return _on_writable(conn, library, budget);
+    }
+    return _on_readable(conn, library, budget);
+}
+
+
+int connection_may_resume(const Connection *conn, uint64_t now) {
+    return conn->paced && now >= conn->resume_at;
+}
+
+
+int connection_pace_timeout(const Connection *conn, uint64_t now, int timeout_ms) {
+    if (!conn->paced) {
+        return timeout_ms;
+    }
+    if (now >= conn->resume_at) {
+        return 0;
+    }
+    // Rounded up, waking early would only find it still paced
+    uint64_t wait_ms = (conn->resume_at - now + 999999) / 1000000;
+    return MIN((uint64_t)timeout_ms, wait_ms);
+}
+
+
+/*
+** Helper for: _update_watch
+** returns the events the connection waits for on its socket
+*/
+static uint32_t _waiting_for(const Connection *conn) {
+    // Nothing while it is paced or in the ring (errors and hang-ups are
+    // still reported)
+    if (conn->paced || conn->flow.active) {
+        return 0;
+    }
+    return conn->sending ? EPOLLOUT : EPOLLIN;
+}
+
+
+/*
+** Register the connection's socket for the events it now waits for.
+** returns 0 on success, -1 on error
+*/
+static int _update_watch(int epfd, Connection *conn) {
+    uint32_t events = _waiting_for(conn);
+    if (events == conn->watching) {
+        return 0;
+    }
+    conn->watching = events;
+    return _watch(epfd, EPOLL_CTL_MOD, conn->client.socket, conn, events);
+}
+
+
+static int _handle_connection_event(int epfd, Scheduler *sched, Connection *conn,
+                                    uint32_t events, const Library *library) {
+    // Without a budget: requests are read and parsed, responses wait for
+    // the connection's turn
+    int result = connection_process(conn, events, library, 0);
+    if (result < 0) {
+        return -1;
+    }
+    if (result == 1) {
+        sched_activate(sched, &conn->flow);
+    }
+    return _update_watch(epfd, conn);
+}
+
+
+/*
+** Helper for: run_reactor
+** Give the connection whose flow sched_next picked its turn, and put it back
+** in the ring if it still has something to send right away.
+** returns 0 on success, -1 on error
+*/
+static int _serve_turn(int epfd, Scheduler *sched, Connection *conn,
+                       const Library *library) {
+    int result = connection_process(conn, EPOLLOUT, library, conn->flow.deficit);
+    if (result < 0) {
+        sched_deactivate(sched, &conn->flow);
+        return -1;
+    }
+    conn->paced = result == 2;
+    if (result == 1) {
+        sched_requeue(sched, &conn->flow);
+    } else {
+        sched_deactivate(sched, &conn->flow);
+    }
+    return _update_watch(epfd, conn);
+}
+
+
+/*
+** Helper for: run_reactor
+** Print the throughput of every connection (s + enter).
+*/
+static void _print_flows(Connection **connections, int num_connections) {
+    printf("%d connections\n", num_connections);
+    for (int i = 0; i < num_connections; i++) {
+        sched_print_flow(&connections[i]->flow, &connections[i]->client.addr);
+    }
+}
+
+
+int run_reactor(int listenfd, Library *library, uint8_t watch_stdin) {
+    // A client disconnecting mid-stream must not kill every other client
+    signal(SIGPIPE, SIG_IGN);
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("run_reactor: epoll_create1");
+        return -1;
+    }
+
+    if (_set_nonblocking(listenfd) < 0 ||
+        _watch(epfd, EPOLL_CTL_ADD, listenfd, &listen_tag, EPOLLIN) < 0 ||
+        (watch_stdin && _watch_stdin(epfd) < 0)) {
+        close(epfd);
+        return -1;
+    }
+    int watch_fd = library_watch(library);
+    if (watch_fd >= 0 && _watch(epfd, EPOLL_CTL_ADD, watch_fd, &library_tag, EPOLLIN) < 0) {
+        close(epfd);
+        return -1;
+    }
+
+    Connection **connections = NULL;
+    int num_connections = 0;
+    Scheduler sched;
+    sched_init(&sched);
+    int result = 0;
+    time_t last_scan = time(NULL);
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        if (time(NULL) - last_scan >= LIBRARY_SCAN_INTERVAL * SELECT_TIMEOUT_SEC) {
+            if (library_check(library) < 0) {
+                ERR_PRINT("Error scanning library\n");
+                result = -1;
+                break;
+            }
+            last_scan = time(NULL);
+        }
+
+        // Wake up in time for the first paced connection to go on, and do
+        // not wait at all while some are in the ring
+        int timeout_ms = sched.num_active > 0 ? 0 : SELECT_TIMEOUT_SEC * 1000;
+        uint64_t now = pace_clock_ns();
+        for (int i = 0; i < num_connections; i++) {
+            timeout_ms = connection_pace_timeout(connections[i], now, timeout_ms);
+        }
+
+        int num_events = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("run_reactor: epoll_wait");
+            result = -1;
+            break;
+        }
+
+        uint8_t quit = 0;
+        for (int i = 0; i < num_events; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag) {
+                if (_accept_clients(epfd, listenfd, &connections, &num_connections) < 0) {
+                    result = -1;
+                    quit = 1;
+                }
+            } else if (tag == &stdin_tag) {
+                int c = getchar();
+                if (c == 'q') {
+                    quit = 1;
+                } else if (c == 's') {
+                    _print_flows(connections, num_connections);
+                } else if (c == EOF) {
+                    // Nobody at the terminal, stop watching it
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                }
+            } else if (tag == &library_tag) {
+                if (library_update(library) < 0) {
+                    ERR_PRINT("Error updating library\n");
+                    result = -1;
+                    quit = 1;
+                }
+            } else {
+                Connection *conn = (Connection *)tag;
+                if (_handle_connection_event(epfd, &sched, conn, events[i].events,
+                                             library) < 0) {
+                    _drop_connection(&sched, &connections, &num_connections, conn);
+                }
+            }
+        }
+        if (quit) {
+            break;
+        }
+
+        now = pace_clock_ns();
+        for (int i = 0; i < num_connections; i++) {
+            Connection *conn = connections[i];
+            if (connection_may_resume(conn, now)) {
+                conn->paced = 0;
+                sched_activate(&sched, &conn->flow);
+            }
+        }
+
+        // One turn for each flow in the ring, those requeued wait for the
+        // next pass
+        for (int turns = sched.num_active; turns > 0; turns--) {
+            SchedFlow *flow = sched_next(&sched);
+            Connection *conn = (Connection *)((uint8_t *)flow - offsetof(Connection, flow));
+            if (_serve_turn(epfd, &sched, conn, library) < 0) {
+                _drop_connection(&sched, &connections, &num_connections, conn);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_connections; i++) {
+        connection_close(connections[i]);
+    }
+    free(connections);
+    close(epfd);
+    return result;
+}
@@ -0,0 +1,116 @@
+#ifndef AS_REACTOR_H_
+#define AS_REACTOR_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_stream.h"
+#include "as_sched.h"
+
+#include <sys/epoll.h>
+
+/*
+** Design
+** ------
+** Instead of forking a process per client, a single process waits on every
+** client socket at once with epoll. All sockets are non-blocking, and each
+** client is a small state machine (Connection):
+**   - while no response is being sent, the connection waits for the socket to
+**     be readable and parses whatever complete requests have arrived.
+**   - a parsed request becomes a StreamJob, and the connection waits for the
+**     socket to be writable instead. Once it is, the connection's flow joins
+**     the scheduler's ring (see as_sched.h) and waits for nothing while it is
+**     there: on each of its turns it sends what its deficit allows, until the
+**     socket is full. Once the job is done it goes back to parsing buffered
+**     requests.
+** Responses are always sent in the order the requests arrived.
+**
+** A connection whose response is held back by pacing (see as_pace.h) waits
+** for nothing on its socket: it is set aside (paced) until resume_at, and
+** the event loop wakes up in time to carry on with it.
+**
+** The listening socket and stdin (q + enter quits, s + enter prints the
+** throughput of every connection) are in the same epoll set, and epoll_wait
+** times out every SELECT_TIMEOUT_SEC so the library rescan schedule is the
+** same as in the fork-per-client server. Each pass of the event loop gives
+** every active flow one turn, and epoll_wait does not wait while some are
+** left.
+*/
+
+#define REACTOR_MAX_EVENTS 64
+
+
+typedef struct connection {
+    ClientSocket client;
+    uint8_t request_buffer[REQUEST_BUFFER_SIZE];
+    int bytes_in_buf;
+    StreamJob job;
+    uint8_t sending;
+    uint8_t paced;
+    uint64_t resume_at;     // see pace_clock_ns
+    SchedFlow flow;
+    uint32_t watching;      // events the socket is registered for
+} Connection;
+
+
+/*
+** Allocate the state for a newly accepted, non-blocking client socket.
+** returns the connection, or NULL on error
+*/
+Connection *connection_new(ClientSocket client);
+
+/*
+** Close the client socket and free everything held by the connection, after
+** printing its throughput. Its flow must not be in a ring.
+*/
+void connection_close(Connection *conn);
+
+/*
+** Accept one pending connection on the non-blocking listenfd. The client
+** socket is non-blocking as well.
+**
+** returns 1 if a client was accepted, 0 if none is pending, -1 on error
+*/
+int accept_nonblocking(int listenfd, ClientSocket *client);
+
+/*
+** Advance the connection after epoll reported events for it: read and parse
+** requests while idle, or send at most budget bytes of pending responses,
+** charged to its flow. Afterwards conn->sending tells whether to wait for
+** EPOLLOUT or EPOLLIN.
+**
+** returns 1 if it stopped only because the budget ran out (more can be sent
+**           right away),
+**         0 if it has to wait for the socket,
+**         2 if pacing holds the response back until conn->resume_at (the
+**           caller sets conn->paced, and processes it again with EPOLLOUT
+**           once connection_may_resume),
+**        -1 on error or when the client disconnected (the caller closes it)
+*/
+int connection_process(Connection *conn, uint32_t events, const Library *library,
+                       size_t budget);
+
+/*
+** returns 1 if conn is paced and its time to go on has come, 0 otherwise
+*/
+int connection_may_resume(const Connection *conn, uint64_t now);
+
+/*
+** returns timeout_ms, or the milliseconds until conn may resume if it is
+** paced and that is sooner
+*/
+int connection_pace_timeout(const Connection *conn, uint64_t now, int timeout_ms);
+
+/*
+** Run the event loop on the already listening socket listenfd, serving
+** library until q + enter is typed on stdin. The library is rescanned every
+** LIBRARY_SCAN_INTERVAL * SELECT_TIMEOUT_SEC seconds.
+**
+** If watch_stdin is 0, stdin is left alone and the loop only ends on error
+** or when the process is signalled (pre-forked workers).
+**
+** returns 0 when asked to quit, -1 on error
+*/
+int run_reactor(int listenfd, Library *library, uint8_t watch_stdin);
+
+#endif // AS_REACTOR_H_
@@ -0,0 +1,120 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_readahead.h"
+#include "as_pace.h"
+
+
+/*
+** Helper for: readahead_start
+** returns 1 if fewer than half of the pages of [offset, offset + length) are
+** in the page cache, 0 otherwise (or if it cannot be told)
+*/
+static int _is_cold(int fd, off_t offset, uint64_t length) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start = offset - offset % page_size;
+    size_t len = MIN(length, READAHEAD_PROBE) + (offset - start);
+    if (len == 0) {
+        return 0;
+    }
+
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    size_t num_pages = (len + page_size - 1) / page_size;
+    // Pages are at least 4 KiB
+    unsigned char resident[READAHEAD_PROBE / 4096 + 2];
+    size_t num_resident = 0;
+    if (num_pages <= sizeof(resident) && mincore(map, len, resident) == 0) {
+        for (size_t i = 0; i < num_pages; i++) {
+            num_resident += resident[i] & 1;
+        }
+    } else {
+        num_resident = num_pages;
+    }
+    munmap(map, len);
+    return num_resident * 2 < num_pages;
+}
+
+
+void readahead_start(Readahead *ra, int fd, off_t offset, uint64_t length) {
+    memset(ra, 0, sizeof(*ra));
+    ra->fd = fd;
+    if (fd < 0 || length == 0) {
+        ra->fd = -1;
+        return;
+    }
+    ra->start = offset;
+    ra->end = offset + length;
+    ra->issued = offset;
+    ra->dropped = offset;
+    ra->window = READAHEAD_MIN_WINDOW;
+    ra->sample_offset = offset;
+    ra->sample_ns = pace_clock_ns();
+    ra->cold = _is_cold(fd, offset, length);
+    #ifdef DEBUG
+    printf("Reading ahead a %s file from offset %ld\n", ra->cold ? "cold" : "warm",
+           (long)offset);
+    #endif
+
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    readahead_advance(ra, offset);
+}
+
+
+/*
+** Helper for: readahead_advance
+** Measure how fast the cursor moves, and size the window to match.
+*/
+static void _update_window(Readahead *ra, off_t cursor) {
+    uint64_t now = pace_clock_ns();
+    if (now - ra->sample_ns < READAHEAD_SAMPLE_NS) {
+        return;
+    }
+    uint64_t sample = (uint64_t)(cursor - ra->sample_offset) * 1000000000 / (now - ra->sample_ns);
+    // Smoothed, a single slow write should not shrink the window at once
+    ra->rate = ra->rate == 0 ? sample : (3 * ra->rate + sample) / 4;
+    ra->sample_offset = cursor;
+    ra->sample_ns = now;
+    ra->window = MIN(MAX(ra->rate * READAHEAD_AHEAD_MS / 1000, READAHEAD_MIN_WINDOW),
+                     READAHEAD_MAX_WINDOW);
+}
+
+
+void readahead_advance(Readahead *ra, off_t cursor) {
+    if (ra->fd < 0) {
+        return;
+    }
+    _update_window(ra, cursor);
+
+    // Top up once less than half of the window is left
+    off_t window = ra->window;
+    if (ra->issued < ra->end && ra->issued - cursor < window / 2) {
+        off_t from = MAX(ra->issued, cursor);
+        off_t target = MIN(cursor + window, ra->end);
+        if (target > from) {
+            readahead(ra->fd, from, target - from);
+            ra->issued = target;
+        }
+    }
+
+    off_t behind = cursor - READAHEAD_DROP_LAG;
+    if (ra->cold && behind - ra->dropped >= READAHEAD_DROP_CHUNK) {
+        posix_fadvise(ra->fd, ra->dropped, behind - ra->dropped, POSIX_FADV_DONTNEED);
+        ra->dropped = behind;
+    }
+}
+
+
+void readahead_stop(Readahead *ra, off_t cursor) {
+    if (ra->fd < 0) {
+        return;
+    }
+    // From the start again, for the pages that were still queued
+    if (ra->cold && cursor > ra->start) {
+        posix_fadvise(ra->fd, ra->start, cursor - ra->start, POSIX_FADV_DONTNEED);
+    }
+    ra->fd = -1;
+}
@@ -0,0 +1,91 @@
+#ifndef AS_READAHEAD_H_
+#define AS_READAHEAD_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <sys/mman.h>
+
+/*
+** Design
+** ------
+** A STREAM body is read strictly in order, but the kernel was never told so.
+** It only reads ahead a little past each read, so a cold file on a spinning
+** disk stalls the stream every time the socket catches up with the disk. And
+** every file streamed stays in the page cache, pushing out popular ones.
+**
+** While a body is sent from a library file, a Readahead follows the send
+** cursor:
+**   - the file is marked POSIX_FADV_SEQUENTIAL for the range, which also
+**     doubles the kernel's own readahead.
+**   - a window of the file ahead of the cursor is read in with readahead(2).
+**     The window holds READAHEAD_AHEAD_MS of data at the rate the socket
+**     has been draining (within READAHEAD_MIN_WINDOW and
+**     READAHEAD_MAX_WINDOW), so a fast client gets a large window and a
+**     paced one a small window. It is topped up once half of it has been
+**     sent.
+**   - a file is cold if most of the start of the range was not in the page
+**     cache when the stream started (mincore(2)). Pages of a cold file are
+**     dropped (POSIX_FADV_DONTNEED) behind the cursor, READAHEAD_DROP_CHUNK
+**     bytes at a time, and all of them at the end. Pages still queued in
+**     the socket cannot be dropped, so the pages dropped trail the cursor by
+**     READAHEAD_DROP_LAG bytes. Pages of a warm file are left alone,
+**     somebody else is likely using them.
+** The hints never change what is sent, a failed hint is simply ignored.
+*/
+
+#define READAHEAD_MIN_WINDOW (128 * 1024)
+#define READAHEAD_MAX_WINDOW (8 * 1024 * 1024)
+#define READAHEAD_AHEAD_MS 1000
+#define READAHEAD_DROP_CHUNK (1024 * 1024)
+#define READAHEAD_DROP_LAG (8 * 1024 * 1024)
+// How much of the start of a range is checked to tell a cold file, and how
+// often the drain rate is measured
+#define READAHEAD_PROBE (256 * 1024)
+#define READAHEAD_SAMPLE_NS (100 * 1000 * 1000)
+
+
+/*
+** fd: the library file, -1 if there is nothing to follow.
+** start, end: the range being sent.
+** issued: the file has been read ahead up to there.
+** dropped: the pages of a cold file have been dropped up to there.
+** window: bytes to keep read in ahead of the cursor.
+** rate: bytes per second the socket has been taking, 0 until measured.
+** sample_offset, sample_ns: cursor and time of the last rate measurement.
+*/
+typedef struct readahead {
+    int fd;
+    uint8_t cold;
+    off_t start;
+    off_t end;
+    off_t issued;
+    off_t dropped;
+    uint64_t window;
+    uint64_t rate;
+    off_t sample_offset;
+    uint64_t sample_ns;
+} Readahead;
+
+
+/*
+** Start following a body of length bytes of fd from offset: give the kernel
+** its hints and read in the first window.
+*/
+void readahead_start(Readahead *ra, int fd, off_t offset, uint64_t length);
+
+/*
+** The body has been sent up to cursor: top up the window, and drop the pages
+** behind the cursor if the file is cold.
+*/
+void readahead_advance(Readahead *ra, off_t cursor);
+
+/*
+** The body will not be sent past cursor: drop every page of a cold file sent
+** so far (that is not still queued in the socket), and stop following it.
+*/
+void readahead_stop(Readahead *ra, off_t cursor);
+
+#endif // AS_READAHEAD_H_
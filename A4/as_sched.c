@@ -0,0 +1,176 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_sched.h"
+#include "as_pace.h"
+
+
+/*
+** Clients whose address matches addr on the mask bits get weight.
+*/
+typedef struct weight_rule {
+    uint32_t addr;
+    uint32_t mask;
+    uint32_t weight;
+} WeightRule;
+
+
+static WeightRule weight_rules[SCHED_MAX_WEIGHT_RULES];
+static int num_weight_rules = 0;
+
+
+int sched_add_weight(const char *spec) {
+    if (num_weight_rules == SCHED_MAX_WEIGHT_RULES) {
+        ERR_PRINT("At most %d weight rules are allowed\n", SCHED_MAX_WEIGHT_RULES);
+        return -1;
+    }
+
+    // address[/bits]=weight
+    char address[INET_ADDRSTRLEN];
+    const char *equals = strchr(spec, '=');
+    if (equals == NULL || equals - spec >= INET_ADDRSTRLEN) {
+        ERR_PRINT("Malformed weight rule: %s\n", spec);
+        return -1;
+    }
+    memcpy(address, spec, equals - spec);
+    address[equals - spec] = '\0';
+
+    long bits = 32;
+    char *slash = strchr(address, '/');
+    if (slash != NULL) {
+        char *end;
+        *slash = '\0';
+        bits = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || bits < 0 || bits > 32) {
+            ERR_PRINT("Malformed weight rule: %s\n", spec);
+            return -1;
+        }
+    }
+
+    char *end;
+    long weight = strtol(equals + 1, &end, 10);
+    struct in_addr in;
+    if (inet_pton(AF_INET, address, &in) != 1 || end == equals + 1 || *end != '\0' ||
+        weight < 1 || weight > SCHED_MAX_WEIGHT) {
+        ERR_PRINT("Malformed weight rule: %s (weights go from 1 to %d)\n",
+                  spec, SCHED_MAX_WEIGHT);
+        return -1;
+    }
+
+    WeightRule *rule = &weight_rules[num_weight_rules++];
+    rule->mask = bits == 0 ? 0 : UINT32_MAX << (32 - bits);
+    rule->addr = ntohl(in.s_addr) & rule->mask;
+    rule->weight = weight;
+    return 0;
+}
+
+
+void sched_flow_init(SchedFlow *flow, const struct sockaddr_in *addr) {
+    memset(flow, 0, sizeof(*flow));
+    flow->weight = SCHED_DEFAULT_WEIGHT;
+    flow->started = pace_clock_ns();
+
+    uint32_t client_addr = ntohl(addr->sin_addr.s_addr);
+    for (int i = 0; i < num_weight_rules; i++) {
+        if ((client_addr & weight_rules[i].mask) == weight_rules[i].addr) {
+            flow->weight = weight_rules[i].weight;
+            break;
+        }
+    }
+}
+
+
+void sched_init(Scheduler *sched) {
+    sched->head = NULL;
+    sched->num_active = 0;
+}
+
+
+void sched_activate(Scheduler *sched, SchedFlow *flow) {
+    if (flow->active) {
+        return;
+    }
+    if (sched->head == NULL) {
+        flow->prev = flow->next = flow;
+        sched->head = flow;
+    } else {
+        // The back of the ring is just before its head
+        flow->prev = sched->head->prev;
+        flow->next = sched->head;
+        flow->prev->next = flow;
+        sched->head->prev = flow;
+    }
+    flow->active = 1;
+    sched->num_active++;
+}
+
+
+/*
+** Helper for: sched_deactivate, sched_next
+** Unlink an active flow from the ring.
+*/
+static void _unlink(Scheduler *sched, SchedFlow *flow) {
+    if (flow->next == flow) {
+        sched->head = NULL;
+    } else {
+        flow->prev->next = flow->next;
+        flow->next->prev = flow->prev;
+        if (sched->head == flow) {
+            sched->head = flow->next;
+        }
+    }
+    flow->prev = flow->next = NULL;
+    flow->active = 0;
+    sched->num_active--;
+}
+
+
+void sched_deactivate(Scheduler *sched, SchedFlow *flow) {
+    if (flow->active) {
+        _unlink(sched, flow);
+    }
+    sched_idle(flow);
+}
+
+
+SchedFlow *sched_next(Scheduler *sched) {
+    SchedFlow *flow = sched->head;
+    if (flow == NULL) {
+        return NULL;
+    }
+    _unlink(sched, flow);
+    sched_grant(flow);
+    return flow;
+}
+
+
+void sched_requeue(Scheduler *sched, SchedFlow *flow) {
+    sched_activate(sched, flow);
+}
+
+
+uint64_t sched_grant(SchedFlow *flow) {
+    flow->deficit += (uint64_t)SCHED_QUANTUM * flow->weight;
+    return flow->deficit;
+}
+
+
+void sched_idle(SchedFlow *flow) {
+    flow->deficit = 0;
+}
+
+
+void sched_charge(SchedFlow *flow, size_t sent) {
+    flow->deficit -= MIN(flow->deficit, sent);
+    flow->bytes_sent += sent;
+}
+
+
+void sched_print_flow(const SchedFlow *flow, const struct sockaddr_in *addr) {
+    double seconds = (pace_clock_ns() - flow->started) / 1e9;
+    printf("%s:%d weight %u: %lu bytes in %.1f s, %.1f KiB/s\n",
+           inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), flow->weight,
+           (unsigned long)flow->bytes_sent, seconds,
+           seconds > 0 ? flow->bytes_sent / 1024.0 / seconds : 0.0);
+}
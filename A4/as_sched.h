@@ -0,0 +1,134 @@
+#ifndef AS_SCHED_H_
+#define AS_SCHED_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Design
+** ------
+** The event-driven engines serve many connections from one process, and used
+** to send whatever connection epoll reported first, as much as it took. A
+** client on a fast link streaming a big file could then take most of the
+** disk and uplink from the others.
+**
+** Instead, the bytes sent go through a deficit round robin (DRR) scheduler.
+** Every connection is a flow, and a flow with something to send and room in
+** its socket is active:
+**   - active flows are served in turn from a ring. On its turn a flow's
+**     deficit grows by its quantum, SCHED_QUANTUM bytes times its weight, and
+**     it may send as many bytes as its deficit holds, which are taken out of
+**     it. A flow still active afterwards goes to the back of the ring.
+**   - a flow that stops being active (its socket is full, its responses are
+**     all sent, or pacing holds it back) leaves the ring and its deficit is
+**     reset, so an idle flow cannot save up for a burst later.
+** Over a round every active flow thus gets a share of the bytes sent in
+** proportion to its weight. Weights are given per client address on the
+** command line (see sched_add_weight), 1 by default.
+**
+** The thread pool has no single ring: a flow's turn is its job coming round
+** in a worker's deque, and its deficit is granted and charged the same way.
+**
+** Each flow counts the bytes sent to it, so the shares can be checked (see
+** sched_print_flow).
+*/
+
+#define SCHED_QUANTUM (64 * 1024)
+#define SCHED_DEFAULT_WEIGHT 1
+#define SCHED_MAX_WEIGHT 64
+#define SCHED_MAX_WEIGHT_RULES 32
+
+
+/*
+** weight: its quantum is weight * SCHED_QUANTUM bytes.
+** deficit: bytes it may still send on its current turn.
+** bytes_sent, started: throughput counters, since the flow was created (see
+** pace_clock_ns).
+** prev, next: links in the ring while active.
+*/
+typedef struct sched_flow {
+    uint32_t weight;
+    uint64_t deficit;
+    uint64_t bytes_sent;
+    uint64_t started;
+    uint8_t active;
+    struct sched_flow *prev;
+    struct sched_flow *next;
+} SchedFlow;
+
+
+/*
+** Ring of active flows, head is the next one to be served.
+*/
+typedef struct scheduler {
+    SchedFlow *head;
+    int num_active;
+} Scheduler;
+
+
+/*
+** Add a weight rule from a "address[/bits]=weight" spec, e.g.
+** "10.0.0.0/8=4": clients in 10.0.0.0/8 get four times the default share.
+** The first rule matching a client's address applies.
+**
+** returns 0 on success, -1 if the spec is malformed or there are too many
+*/
+int sched_add_weight(const char *spec);
+
+/*
+** Start the flow of a client connected from addr, inactive.
+*/
+void sched_flow_init(SchedFlow *flow, const struct sockaddr_in *addr);
+
+void sched_init(Scheduler *sched);
+
+/*
+** Put an inactive flow at the back of the ring.
+*/
+void sched_activate(Scheduler *sched, SchedFlow *flow);
+
+/*
+** Take a flow out of the ring if it is in it, and reset its deficit.
+*/
+void sched_deactivate(Scheduler *sched, SchedFlow *flow);
+
+/*
+** Start the turn of the flow at the head of the ring: it leaves the ring and
+** its deficit grows by its quantum. It must be given back with sched_requeue
+** or sched_deactivate once it has sent what it could.
+**
+** returns the flow, NULL if none is active
+*/
+SchedFlow *sched_next(Scheduler *sched);
+
+/*
+** Put a flow whose turn is over back at the back of the ring, still active.
+*/
+void sched_requeue(Scheduler *sched, SchedFlow *flow);
+
+/*
+** Start a turn for a flow outside of any ring (the thread pool).
+**
+** returns its deficit, the most it may send on this turn
+*/
+uint64_t sched_grant(SchedFlow *flow);
+
+/*
+** End the turn of a flow outside of any ring that has stopped being active:
+** its deficit is reset.
+*/
+void sched_idle(SchedFlow *flow);
+
+/*
+** Count sent bytes against the flow's deficit and throughput counters.
+*/
+void sched_charge(SchedFlow *flow, size_t sent);
+
+/*
+** Print the flow's weight and throughput, prefixed with the client's address.
+*/
+void sched_print_flow(const SchedFlow *flow, const struct sockaddr_in *addr);
+
+#endif // AS_SCHED_H_
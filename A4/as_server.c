@@ -3,6 +3,25 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "as_server.h"
+#include "as_reactor.h"
+#include "as_readahead.h"
+#include "as_sched.h"
+#include "as_threads.h"
+#include "as_uring.h"
+
+
+ServerConfig server_config = {
+    .server_mode = SERVER_FORK,
+    .num_workers = 0,
+    .transfer_mode = TRANSFER_COPY,
+    .cache_bytes = 0,
+    .cache_policy = CACHE_LRU,
+    .pace = 0,
+    .tcp_profile = TCP_PROFILE_DEFAULT,
+    .tcp_mbit = TCP_DEFAULT_MBIT,
+    .tcp_rtt_ms = TCP_DEFAULT_RTT_MS,
+    .tier_directory = NULL,
+};
 
 
 int init_server_addr(int port, struct sockaddr_in *addr){
@@ -39,6 +58,37 @@ int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue
         exit(1);
     }
 
+    // Let every pre-forked worker have its own listener on this port,
+    // the kernel balances incoming connections between them
+    if (server_config.server_mode == SERVER_PREFORK) {
+        status = setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+                            (const char *) &on, sizeof(on));
+        if (status < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+    }
+
+    // Room for a bandwidth-delay product of unacked data, inherited by every
+    // accepted socket. The kernel doubles it, and caps it at wmem_max.
+    if (server_config.tcp_profile == TCP_PROFILE_TUNED) {
+        uint64_t bdp = (uint64_t)server_config.tcp_mbit * 1000000 / 8
+                       * server_config.tcp_rtt_ms / 1000;
+        int sndbuf = MIN(MAX(bdp, TCP_MIN_SNDBUF), TCP_MAX_SNDBUF);
+        int granted;
+        socklen_t len = sizeof(granted);
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0 ||
+            getsockopt(soc, SOL_SOCKET, SO_SNDBUF, &granted, &len) < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+        printf("Send buffer %d bytes for %u Mbit/s and %u ms\n", granted / 2,
+               server_config.tcp_mbit, server_config.tcp_rtt_ms);
+        if (granted / 2 < sndbuf) {
+            ERR_PRINT("Send buffer capped below %d bytes, raise net.core.wmem_max\n", sndbuf);
+        }
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)server_options, sizeof(*server_options)) < 0) {
         // bind failed; could be because port is in use.
@@ -70,6 +120,14 @@ ClientSocket accept_connection(int listenfd) {
         perror("accept_connection: accept");
         exit(-1);
     }
+    client.protocol_version = PROTOCOL_VERSION_1;
+    client.chunked = 0;
+    client.ids = 0;
+    client.checksums = 0;
+    client.trailer = 0;
+    client.pcm = 0;
+    client.tiers = 0;
+    tune_client_socket(client.socket);
 
     // print out a message that we got the connection
     printf("Server got a connection from %s, port %d\n",
@@ -79,51 +137,503 @@ ClientSocket accept_connection(int listenfd) {
 }
 
 
+int tune_client_socket(int soc) {
+    if (server_config.tcp_profile != TCP_PROFILE_TUNED) {
+        return 0;
+    }
+    int on = 1;
+    int lowat = TCP_NOTSENT_LOWAT_BYTES;
+    if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0 ||
+        setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+        perror("tune_client_socket: setsockopt");
+        return -1;
+    }
+    return 0;
+}
+
+
 int list_request_response(const ClientSocket * client, const Library *library) {
 
     // Debug print all libary files
     #ifdef DEBUG
-    for(int i = library->num_files; i > -1; i--){
+    for(int i = library->num_files - 1; i > -1; i--){
         printf("S%d:%s\r\n", i, library->files[i]);
     }
     #endif
-    
-    //Send all libary contents to the client
-    for(int i = library->num_files - 1; i > -1; i--){
-        #ifdef DEBUG
-        printf("Sending file %s\n", library->files[i]);
-        #endif
-        char *file = library->files[i];
-        int file_len = strlen(file);
-        char file_index_str[10];
-        sprintf(file_index_str, "%d", i);
-        write_precisely(client->socket, file_index_str, strlen(file_index_str));
-        write_precisely(client->socket, ":", 1);
-        write_precisely(client->socket, file, file_len);
-        write_precisely(client->socket, "\r\n", 2);
+
+    //Send all libary contents to the client, laid out by scan_library
+    const ListPayload *payload = library->list_payload;
+    if(payload == NULL || payload->list_len == 0){
+        return 0;
+    }
+    if(write_precisely(client->socket, payload->data + payload->list_offset,
+                       payload->list_len) < 0){
+        return -1;
     }
 
     return 0;
 }
 
 
-static int _load_file_size_into_buffer(FILE *file, uint8_t *buffer) {
-    if (fseek(file, 0, SEEK_END) < 0) {
-        ERR_PRINT("Error seeking to end of file\n");
+int list_since_request_response(const ClientSocket * client, const Library *library,
+                                const char *request) {
+    // LISTSINCE <generation>
+    const char *generation_str = request + strlen(REQUEST_LIST_SINCE);
+    if(*generation_str != ' '){
+        ERR_PRINT("Malformed LISTSINCE request: %s\n", request);
+        return -1;
+    }
+    uint64_t generation = strtoull(generation_str + 1, NULL, 10);
+
+    ListPayload *payload = list_since_payload(client, library, generation);
+    if(payload == NULL){
+        return -1;
+    }
+    int result = write_precisely(client->socket, payload->data, payload->len) < 0 ? -1 : 0;
+    list_payload_release(payload);
+    return result;
+}
+
+
+ListPayload *list_since_payload(const ClientSocket *client, const Library *library,
+                                uint64_t generation) {
+    ListPayload *payload = list_changes_since(library, generation, client->ids);
+    if(payload == NULL || !client->tiers){
+        return payload;
+    }
+    char tiers[RESPONSE_BUFFER_SIZE];
+    if(tier_list_line(tiers, sizeof(tiers)) < 0){
+        list_payload_release(payload);
+        return NULL;
+    }
+    return list_payload_with_line(payload, tiers);
+}
+
+
+/*
+** Helper for: stream_request_response, stream_range_request_response,
+**             stream_batch_request_response
+** Fill args with the count bytes of binary arguments that follow a request
+** line, using the num_pr_bytes already received in post_req first.
+**
+** returns 0 on success, -1 on error
+*/
+static int _read_request_args(const ClientSocket *client, uint8_t *args, size_t count,
+                              const uint8_t *post_req, int num_pr_bytes) {
+    memcpy(args, post_req, num_pr_bytes);
+    if(num_pr_bytes < count &&
+       read_precisely(client->socket, args + num_pr_bytes, count - num_pr_bytes)
+       != count - num_pr_bytes){
+        ERR_PRINT("Error reading request arguments from client\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** Helper for: _send_file_body
+** Copy count bytes of the file from offset through a STREAM_CHUNK_SIZE buffer,
+** hashing them into crc.
+*/
+static int _copy_file_body(int sockfd, FILE *file, off_t offset, uint64_t count,
+                           BodyCrc *crc) {
+    if (fseeko(file, offset, SEEK_SET) < 0) {
+        ERR_PRINT("Error seeking in file\n");
+        return -1;
+    }
+    uint8_t file_buffer[STREAM_CHUNK_SIZE];
+    int bytes_read;
+    while(count > 0 &&
+          (bytes_read = fread(file_buffer, 1, MIN(STREAM_CHUNK_SIZE, count), file)) > 0){
+        if(write_precisely(sockfd, file_buffer, bytes_read) < 0){
+            return -1;
+        }
+        body_crc_update(crc, file_buffer, bytes_read);
+        count -= bytes_read;
+    }
+    return count == 0 ? 0 : -1;
+}
+
+
+/*
+** Helper for: _send_body
+** Send count bytes of the file from offset using server_config.transfer_mode.
+** The zero-copy modes fall back to the next slower mode when the kernel
+** does not support them for this file/socket pair. Copied bytes are hashed
+** into crc, the others are left to _send_body.
+*/
+static int _send_file_body(int sockfd, FILE *file, off_t offset, uint64_t count,
+                           BodyCrc *crc) {
+    int fd = fileno(file);
+    ssize_t sent;
+
+    switch (server_config.transfer_mode) {
+        case TRANSFER_URING:
+            sent = uring_send_file(sockfd, fd, offset, count);
+            if (sent >= 0) {
+                return sent == count ? 0 : -1;
+            }
+            if (errno != ENOSYS) {
+                return -1;
+            }
+            #ifdef DEBUG
+            printf("io_uring unavailable, falling back to copying\n");
+            #endif
+            return _copy_file_body(sockfd, file, offset, count, crc);
+        case TRANSFER_SENDFILE:
+            sent = sendfile_precisely(sockfd, fd, offset, count);
+            if (sent >= 0) {
+                return sent == count ? 0 : -1;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return -1;
+            }
+            #ifdef DEBUG
+            printf("sendfile unsupported, falling back to splice\n");
+            #endif
+            // fall through
+        case TRANSFER_SPLICE:
+            sent = splice_precisely(sockfd, fd, offset, count);
+            if (sent >= 0) {
+                return sent == count ? 0 : -1;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return -1;
+            }
+            #ifdef DEBUG
+            printf("splice unsupported, falling back to copying\n");
+            #endif
+            // fall through
+        case TRANSFER_COPY:
+        default:
+            return _copy_file_body(sockfd, file, offset, count, crc);
+    }
+}
+
+
+int is_being_written(const struct stat *st) {
+    return time(NULL) - st->st_mtim.tv_sec < STREAM_GROWING_SEC;
+}
+
+
+/*
+** Helper for: _stream_open_file
+** Send count bytes of the file (or of its hot-file cache entry, if
+** cache_entry is not -1) from offset, no faster than bucket allows. The file
+** is read ahead of the cursor (see as_readahead.h), and crc follows what was
+** sent (see as_trailer.h).
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_body(int sockfd, FILE *file, int cache_entry, off_t offset,
+                      uint64_t count, TokenBucket *bucket, BodyCrc *crc) {
+    Readahead ra;
+    readahead_start(&ra, cache_entry >= 0 ? -1 : fileno(file), offset, count);
+    int result = 0;
+    while(count > 0){
+        // Half a window at a time from disk, so the window is topped up in time
+        uint64_t step = cache_entry >= 0 ? count : MIN(count, ra.window / 2);
+        size_t slice = pace_wait(bucket, step);
+        if(cache_entry >= 0){
+            result = cache_write(cache_entry, sockfd, offset, slice);
+        } else {
+            result = _send_file_body(sockfd, file, offset, slice, crc);
+        }
+        if(result < 0){
+            break;
+        }
+        pace_consume(bucket, slice);
+        offset += slice;
+        count -= slice;
+        readahead_advance(&ra, offset);
+        body_crc_advance(crc, offset);
+    }
+    readahead_stop(&ra, offset);
+    return result;
+}
+
+
+/*
+** Helper for: _stream_open_file
+** Send the chunked size marker, then up to length bytes of the file from
+** offset in frames of at most STREAM_FRAME_SIZE bytes. Reaching the end of
+** the file only ends the stream once the file has stopped growing, the
+** closing empty frame follows. Frames are metered by bucket, and hashed into
+** crc.
+*/
+static int _send_file_chunked(int sockfd, int fd, off_t offset, uint64_t length,
+                              TokenBucket *bucket, BodyCrc *crc) {
+    uint8_t frame[sizeof(uint64_t) + STREAM_FRAME_SIZE];
+    size_t marker_len = encode_stream_size(PROTOCOL_VERSION_2, STREAM_SIZE_CHUNKED, frame);
+    if(send_precisely(sockfd, frame, marker_len, MSG_MORE) < 0){
+        return -1;
+    }
+
+    while(length > 0){
+        size_t frame_size = pace_wait(bucket, MIN(STREAM_FRAME_SIZE, length));
+        ssize_t bytes_read = pread(fd, frame + sizeof(uint32_t), frame_size, offset);
+        if(bytes_read < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("_send_file_chunked: pread");
+            return -1;
+        }
+        if(bytes_read == 0){
+            struct stat st;
+            if(fstat(fd, &st) < 0){
+                perror("_send_file_chunked: fstat");
+                return -1;
+            }
+            if(!is_being_written(&st)){
+                break;
+            }
+            usleep(STREAM_GROWING_POLL_USEC);
+            continue;
+        }
+
+        uint32_t frame_len_nbo = htonl(bytes_read);
+        memcpy(frame, &frame_len_nbo, sizeof(uint32_t));
+        if(write_precisely(sockfd, frame, sizeof(uint32_t) + bytes_read) < 0){
+            return -1;
+        }
+        body_crc_update(crc, frame + sizeof(uint32_t), bytes_read);
+        pace_consume(bucket, bytes_read);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+
+    uint32_t end_of_frames = 0;
+    return send_precisely(sockfd, &end_of_frames, sizeof(uint32_t),
+                          crc->done ? 0 : MSG_MORE) < 0 ? -1 : 0;
+}
+
+
+/*
+** Helper for: _stream_open_file
+** Send the file fd, a WAV file of format, in transport encoding (see
+** as_server.h): the encoded size marker and the file's size, then a frame
+** per block of the file, then the closing empty frame. The blocks are metered
+** by bucket at the file's own size, and hashed into crc.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_file_encoded(int sockfd, int fd, const PcmFormat *format,
+                              TokenBucket *bucket, BodyCrc *crc) {
+    uint8_t head[2 * sizeof(uint64_t)];
+    encode_stream_size(PROTOCOL_VERSION_2, STREAM_SIZE_ENCODED, head);
+    encode_stream_size(PROTOCOL_VERSION_2, format->size, head + sizeof(uint64_t));
+    if(send_precisely(sockfd, head, sizeof(head), MSG_MORE) < 0){
         return -1;
     }
-    uint32_t file_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET) < 0) {
-        ERR_PRINT("Error seeking to start of file\n");
+
+    // A block, then its frame behind its length
+    uint8_t *block = (uint8_t *)malloc(PCM_BLOCK_MAX + sizeof(uint32_t) + PCM_FRAME_MAX);
+    if(block == NULL){
+        perror("_send_file_encoded: malloc");
+        return -1;
+    }
+    uint8_t *frame = block + PCM_BLOCK_MAX;
+    Readahead ra;
+    readahead_start(&ra, fd, 0, format->size);
+    int result = 0;
+    uint64_t offset = 0;
+    while(offset < format->size){
+        int samples;
+        size_t len = pcm_block(format, offset, &samples);
+        // Tokens may run short, the bucket makes up for it on the next block
+        pace_wait(bucket, len);
+        ssize_t bytes_read = pread(fd, block, len, offset);
+        if(bytes_read < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytes_read != (ssize_t)len){
+            ERR_PRINT("_send_file_encoded: file ended early\n");
+            result = -1;
+            break;
+        }
+
+        uint32_t frame_len = pcm_encode(format, block, len, samples, frame + sizeof(uint32_t));
+        uint32_t frame_len_nbo = htonl(frame_len);
+        memcpy(frame, &frame_len_nbo, sizeof(uint32_t));
+        if(write_precisely(sockfd, frame, sizeof(uint32_t) + frame_len) < 0){
+            result = -1;
+            break;
+        }
+        body_crc_update(crc, block, len);
+        pace_consume(bucket, len);
+        offset += len;
+        readahead_advance(&ra, offset);
+    }
+    readahead_stop(&ra, offset);
+    free(block);
+    if(result < 0){
+        return -1;
+    }
+
+    uint32_t end_of_frames = 0;
+    return send_precisely(sockfd, &end_of_frames, sizeof(uint32_t),
+                          crc->done ? 0 : MSG_MORE) < 0 ? -1 : 0;
+}
+
+
+/*
+** Helper for: _stream_file_range, stream_batch_request_response
+** Open the library file the client names file_number, and get its path
+** (to be freed) and status.
+**
+** returns 0 on success, -1 on error
+*/
+static int _open_library_file(const ClientSocket *client, const Library *library,
+                              uint32_t file_number, FILE **file, struct stat *st,
+                              char **file_to_open) {
+    #ifdef DEBUG
+    printf("File %s: %u\n", client->ids ? "ID" : "index", file_number);
+    #endif
+
+    int64_t file_index = library_file_index(library, client->ids, file_number);
+    if(file_index < 0){
+        ERR_PRINT("File %s %u out of range\n", client->ids ? "ID" : "index", file_number);
+        return -1;
+    }
+    *file_to_open = _join_path(library->path, library->files[file_index]);
+    if(*file_to_open == NULL){
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Opening file %s\n", *file_to_open);
+    #endif
+    *file = fopen(*file_to_open, "r");
+    if(*file == NULL || fstat(fileno(*file), st) < 0){
+        ERR_PRINT("Error opening file\n");
+        free(*file_to_open);
+        if(*file != NULL){
+            fclose(*file);
+        }
         return -1;
     }
-    buffer[0] = (file_size >> 24) & 0xFF;
-    buffer[1] = (file_size >> 16) & 0xFF;
-    buffer[2] = (file_size >> 8) & 0xFF;
-    buffer[3] = file_size & 0xFF;
     return 0;
 }
 
+
+/*
+** Helper for: _stream_file_range, stream_batch_request_response
+** Send the bytes [offset, offset + length) of a library file opened by
+** _open_library_file, cut short at the end of the file, preceded by their
+** count (see encode_stream_size). Files still being written are sent chunked
+** if the client agreed to it. The file is closed and its path freed.
+** Whole WAV files are sent in transport encoding if the client agreed to it.
+** With pacing on, the data goes out at the file's bitrate (see as_pace.h).
+** The integrity trailer follows if the client agreed to it.
+**
+** returns 0 on success, -1 on error
+*/
+static int _stream_open_file(const ClientSocket *client, FILE *file, const struct stat *st,
+                             char *file_to_open, uint64_t offset, uint64_t length) {
+    TokenBucket bucket;
+    pace_start(&bucket, server_config.pace ? pace_rate(file_to_open, fileno(file)) : 0);
+
+    // 1. A file still being written has no final size to announce yet
+    int result = -1;
+    int cache_entry = -1;
+    BodyCrc crc;
+    body_crc_start(&crc, -1, -1, offset, 0);
+    crc.done = !client->trailer;
+    if(client->chunked && is_being_written(st)){
+        free(file_to_open);
+        #ifdef DEBUG
+        printf("Sending growing file chunked from offset %lu\n", (unsigned long)offset);
+        #endif
+        result = _send_file_chunked(client->socket, fileno(file), offset, length, &bucket, &crc);
+        goto send_trailer;
+    }
+
+    // 2. A whole WAV file goes out encoded if the client takes that
+    PcmFormat format;
+    if(client->pcm && offset == 0 && length == STREAM_RANGE_TO_END &&
+       pcm_probe(fileno(file), st->st_size, &format) == 0){
+        free(file_to_open);
+        #ifdef DEBUG
+        printf("Sending %lu bytes encoded\n", (unsigned long)st->st_size);
+        #endif
+        if(client->trailer){
+            body_crc_start(&crc, -1, -1, 0, st->st_size);
+        }
+        result = _send_file_encoded(client->socket, fileno(file), &format, &bucket, &crc);
+        goto send_trailer;
+    }
+
+    // 3. Serve it from the hot-file cache if possible
+    if(cache_enabled()){
+        cache_entry = cache_acquire(file_to_open, fileno(file), st);
+    }
+    free(file_to_open);
+
+    // 4. Send the size of the range to the client
+    uint64_t count = 0;
+    if(offset < st->st_size){
+        count = MIN(length, st->st_size - offset);
+    }
+    uint8_t size_buffer[sizeof(uint64_t)];
+    size_t size_len = encode_stream_size(client->protocol_version, count, size_buffer);
+    if(size_len == 0){
+        ERR_PRINT("Range too large for protocol version %d\n", client->protocol_version);
+        goto close_file;
+    }
+    #ifdef DEBUG
+    printf("Sending %lu bytes from offset %lu\n", (unsigned long)count, (unsigned long)offset);
+    #endif
+    // Held back to leave with the first bytes of the body (or the trailer)
+    int more = count > 0 || client->trailer ? MSG_MORE : 0;
+    if(send_precisely(client->socket, size_buffer, size_len, more) < 0){
+        goto close_file;
+    }
+
+    // 5. Send the file data to the client
+    if(client->trailer){
+        body_crc_start(&crc, fileno(file), cache_entry, offset, count);
+    }
+    result = _send_body(client->socket, file, cache_entry, offset, count, &bucket, &crc);
+
+send_trailer:
+    // 6. Then the checksum of what was sent
+    if(result == 0 && client->trailer){
+        uint8_t trailer[TRAILER_SIZE];
+        body_crc_finish(&crc, trailer);
+        result = write_precisely(client->socket, trailer, TRAILER_SIZE) < 0 ? -1 : 0;
+    }
+
+close_file:
+    body_crc_stop(&crc);
+    if(cache_entry >= 0){
+        cache_release(cache_entry);
+    }
+    fclose(file);
+    return result;
+}
+
+
+/*
+** Helper for: stream_request_response, stream_range_request_response
+** Send the bytes [offset, offset + length) of a library file, see
+** _stream_open_file.
+**
+** returns 0 on success, -1 on error
+*/
+static int _stream_file_range(const ClientSocket *client, const Library *library,
+                              uint32_t file_number, uint64_t offset, uint64_t length) {
+    FILE *file;
+    struct stat st;
+    char *file_to_open;
+    if(_open_library_file(client, library, file_number, &file, &st, &file_to_open) < 0){
+        return -1;
+    }
+    // The file is open, a forked handler's snapshot can be written over
+    snapshot_release();
+
+    return _stream_open_file(client, file, &st, file_to_open, offset, length);
+}
+
 /*
 ** Stream a file from the library to the client. The file is streamed in chunks
 ** of a maximum of STREAM_CHUNK_SIZE bytes. The client will be able to request
@@ -149,72 +659,271 @@ int stream_request_response(const ClientSocket * client, const Library *library,
     
     ERR_PRINT("Handling stream request\n");
 
-    // 1. Read the file index from the client socket
-    uint32_t file_index;
-    if(num_pr_bytes < sizeof(uint32_t)){
-        uint8_t buffer[sizeof(uint32_t)];
-        memcpy(buffer, post_req, num_pr_bytes);
-        if(read_precisely(client->socket, buffer + num_pr_bytes, sizeof(uint32_t) - num_pr_bytes) < 0){
-            ERR_PRINT("Error reading file index from client\n");
-            return -1;
+    uint32_t file_index_nbo;
+    if(_read_request_args(client, (uint8_t *)&file_index_nbo, sizeof(uint32_t),
+                          post_req, num_pr_bytes) < 0){
+        return -1;
+    }
+
+    return _stream_file_range(client, library, ntohl(file_index_nbo),
+                              0, STREAM_RANGE_TO_END);
+}
+
+
+size_t encode_stream_size(uint8_t protocol_version, uint64_t size, uint8_t *buf) {
+    if(protocol_version >= PROTOCOL_VERSION_2){
+        uint64_t size_nbo = htobe64(size);
+        memcpy(buf, &size_nbo, sizeof(uint64_t));
+        return sizeof(uint64_t);
+    }
+    if(size > UINT32_MAX){
+        return 0;
+    }
+    uint32_t size_nbo = htonl((uint32_t)size);
+    memcpy(buf, &size_nbo, sizeof(uint32_t));
+    return sizeof(uint32_t);
+}
+
+
+int negotiate_protocol(ClientSocket *client, const char *request, char *reply) {
+    // HELLO <version>[ <feature>...]
+    size_t hello_len = strlen(REQUEST_HELLO);
+    if(strncmp(request, REQUEST_HELLO " ", hello_len + 1) != 0){
+        return -1;
+    }
+    char *features;
+    long version = strtol(request + hello_len + 1, &features, 10);
+    if(features == request + hello_len + 1 || version < PROTOCOL_VERSION_1){
+        return -1;
+    }
+    client->protocol_version = MIN(version, PROTOCOL_VERSION);
+    client->chunked = 0;
+    client->ids = 0;
+    client->checksums = 0;
+    client->trailer = 0;
+    client->pcm = 0;
+    client->tiers = 0;
+    int pipeline = 0;
+    int batch = 0;
+
+    // Features the server does not know are simply not acknowledged
+    char feature_list[HELLO_MESSAGE_SIZE];
+    strncpy(feature_list, features, HELLO_MESSAGE_SIZE - 1);
+    feature_list[HELLO_MESSAGE_SIZE - 1] = '\0';
+    char *saveptr;
+    for(char *feature = strtok_r(feature_list, " ", &saveptr); feature != NULL;
+        feature = strtok_r(NULL, " ", &saveptr)){
+        if(strcmp(feature, PROTOCOL_FEATURE_CHUNKED) == 0 &&
+           client->protocol_version >= PROTOCOL_VERSION_2 &&
+           server_config.server_mode == SERVER_FORK){
+            client->chunked = 1;
+        }
+        if(strcmp(feature, PROTOCOL_FEATURE_IDS) == 0 &&
+           client->protocol_version >= PROTOCOL_VERSION_2){
+            client->ids = 1;
+        }
+        // Every engine answers each buffered request before reading again
+        if(strcmp(feature, PROTOCOL_FEATURE_PIPELINE) == 0){
+            pipeline = 1;
+        }
+        if(strcmp(feature, PROTOCOL_FEATURE_BATCH) == 0){
+            batch = 1;
+        }
+        // STREAM_SIZE_NOT_MODIFIED needs 64-bit sizes
+        if(strcmp(feature, PROTOCOL_FEATURE_CHECKSUM) == 0 &&
+           client->protocol_version >= PROTOCOL_VERSION_2){
+            client->checksums = 1;
+        }
+        if(strcmp(feature, PROTOCOL_FEATURE_TRAILER) == 0){
+            client->trailer = 1;
+        }
+        // STREAM_SIZE_ENCODED needs 64-bit sizes
+        if(strcmp(feature, PROTOCOL_FEATURE_PCM) == 0 &&
+           client->protocol_version >= PROTOCOL_VERSION_2){
+            client->pcm = 1;
+        }
+        // LIST_TIERS is only sent in a LISTSINCE response
+        if(strcmp(feature, PROTOCOL_FEATURE_TIERS) == 0 &&
+           client->protocol_version >= PROTOCOL_VERSION_2){
+            client->tiers = 1;
         }
-        file_index = ntohl(*(uint32_t *)buffer);
-    } else {
-        file_index = ntohl(*(uint32_t *)post_req);
     }
 
     #ifdef DEBUG
-    printf("File index: %d\n", file_index);
+    printf("Client speaks protocol version %d%s%s%s%s%s%s%s%s\n", client->protocol_version,
+           client->chunked ? " with chunked framing" : "",
+           client->ids ? " with file IDs" : "",
+           pipeline ? " with pipelining" : "",
+           batch ? " with batches" : "",
+           client->checksums ? " with checksums" : "",
+           client->trailer ? " with trailers" : "",
+           client->pcm ? " with PCM encoding" : "",
+           client->tiers ? " with tiers" : "");
     #endif
+    return snprintf(reply, HELLO_MESSAGE_SIZE, REQUEST_HELLO " %d%s%s%s%s%s%s%s%s" END_OF_MESSAGE_TOKEN,
+                    client->protocol_version,
+                    client->chunked ? " " PROTOCOL_FEATURE_CHUNKED : "",
+                    client->ids ? " " PROTOCOL_FEATURE_IDS : "",
+                    pipeline ? " " PROTOCOL_FEATURE_PIPELINE : "",
+                    batch ? " " PROTOCOL_FEATURE_BATCH : "",
+                    client->checksums ? " " PROTOCOL_FEATURE_CHECKSUM : "",
+                    client->trailer ? " " PROTOCOL_FEATURE_TRAILER : "",
+                    client->pcm ? " " PROTOCOL_FEATURE_PCM : "",
+                    client->tiers ? " " PROTOCOL_FEATURE_TIERS : "");
+}
+
+
+int stream_range_request_response(const ClientSocket * client, const Library *library,
+                                  uint8_t *post_req, int num_pr_bytes) {
+    uint8_t args[STREAM_RANGE_ARGS_SIZE];
+    if(_read_request_args(client, args, STREAM_RANGE_ARGS_SIZE, post_req, num_pr_bytes) < 0){
+        return -1;
+    }
+
+    uint32_t file_index_nbo;
+    uint64_t offset_nbo, length_nbo;
+    memcpy(&file_index_nbo, args, sizeof(uint32_t));
+    memcpy(&offset_nbo, args + sizeof(uint32_t), sizeof(uint64_t));
+    memcpy(&length_nbo, args + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+
+    return _stream_file_range(client, library, ntohl(file_index_nbo),
+                              be64toh(offset_nbo), be64toh(length_nbo));
+}
 
-    // 2. Open the file from the library
+
+int stream_if_request_response(const ClientSocket * client, const Library *library,
+                               uint8_t *post_req, int num_pr_bytes) {
+    uint8_t args[STREAM_IF_ARGS_SIZE];
+    if(_read_request_args(client, args, STREAM_IF_ARGS_SIZE, post_req, num_pr_bytes) < 0){
+        return -1;
+    }
+    uint32_t file_index_nbo, checksum_nbo;
+    memcpy(&file_index_nbo, args, sizeof(uint32_t));
+    memcpy(&checksum_nbo, args + sizeof(uint32_t), sizeof(uint32_t));
+
+    FILE *file;
+    struct stat st;
     char *file_to_open;
-    file_to_open = _join_path(library->path, library->files[file_index]);
-    #ifdef DEBUG
-    printf("Opening file %s\n", file_to_open);
-    #endif
-    FILE *file = fopen(file_to_open, "r");
-    if(file == NULL){
-        ERR_PRINT("Error opening file\n");
+    if(_open_library_file(client, library, ntohl(file_index_nbo), &file, &st,
+                          &file_to_open) < 0){
         return -1;
     }
+    snapshot_release();
 
-    // 3. Send the file size to the client
-    #ifdef DEBUG
-    printf("Sending file size to client\n");
-    #endif
-    uint8_t buffer[4];
-    if(_load_file_size_into_buffer(file, buffer) < 0){
-        ERR_PRINT("Error loading file size into buffer\n");
+    // A file still being written is never up to date, and only a client that
+    // agreed to checksums knows STREAM_SIZE_NOT_MODIFIED
+    uint32_t checksum;
+    if(client->checksums && !is_being_written(&st) && file_checksum(fileno(file), &st, &checksum) == 0 &&
+       checksum == ntohl(checksum_nbo)){
+        #ifdef DEBUG
+        printf("Client's copy of %s is up to date\n", file_to_open);
+        #endif
+        free(file_to_open);
+        fclose(file);
+        uint8_t size_buffer[sizeof(uint64_t)];
+        size_t size_len = encode_stream_size(client->protocol_version,
+                                             STREAM_SIZE_NOT_MODIFIED, size_buffer);
+        return write_precisely(client->socket, size_buffer, size_len) < 0 ? -1 : 0;
+    }
+
+    return _stream_open_file(client, file, &st, file_to_open, 0, STREAM_RANGE_TO_END);
+}
+
+
+int stream_tier_request_response(const ClientSocket * client, const Library *library,
+                                 uint8_t *post_req, int num_pr_bytes) {
+    uint8_t args[STREAM_TIER_ARGS_SIZE];
+    if(_read_request_args(client, args, STREAM_TIER_ARGS_SIZE, post_req, num_pr_bytes) < 0){
+        return -1;
+    }
+    uint32_t file_index_nbo, tier_nbo;
+    memcpy(&file_index_nbo, args, sizeof(uint32_t));
+    memcpy(&tier_nbo, args + sizeof(uint32_t), sizeof(uint32_t));
+    uint32_t tier = ntohl(tier_nbo);
+    if(tier > TIER_COUNT){
+        ERR_PRINT("STREAMTIER of tier %u, there are %d\n", tier, TIER_COUNT);
         return -1;
     }
-    //3.5 Print out the file size
-    #ifdef DEBUG
-    printf("File size: %d\n", ntohl(*(uint32_t *)buffer));
-    #endif
 
-    write_precisely(client->socket, (uint32_t *)buffer, 4);
-        
-    // 4. Send the file data to the client in chunks of STREAM_CHUNK_SIZE
-    #ifdef DEBUG
-    printf("Sending file data to client\n");
-    #endif
-    uint8_t file_buffer[STREAM_CHUNK_SIZE];
-    int bytes_read;
-    while((bytes_read = fread(file_buffer, 1, STREAM_CHUNK_SIZE, file)) > 0){
-        if(bytes_read < STREAM_CHUNK_SIZE){
-            write_precisely(client->socket, file_buffer, bytes_read);
-            break;
+    FILE *file;
+    struct stat st;
+    char *file_to_open;
+    if(_open_library_file(client, library, ntohl(file_index_nbo), &file, &st,
+                          &file_to_open) < 0){
+        return -1;
+    }
+    // Rendering may take a while, the snapshot is not needed for it
+    snapshot_release();
+
+    // The rendition is sent in place of the file, if there is one
+    int rendition_fd = tier_open(fileno(file), &st, &file_to_open, tier);
+    if(rendition_fd >= 0){
+        fclose(file);
+        file = fdopen(rendition_fd, "r");
+        if(file == NULL){
+            perror("stream_tier_request_response: fdopen");
+            close(rendition_fd);
+            free(file_to_open);
+            return -1;
         }
-        write_precisely(client->socket, file_buffer, bytes_read);
     }
 
-    // 5. Close the file
-    fclose(file);
+    return _stream_open_file(client, file, &st, file_to_open, 0, STREAM_RANGE_TO_END);
+}
 
-    // 6. Return 0 on success, -1 on error
-    return 0;
 
+int stream_batch_request_response(const ClientSocket * client, const Library *library,
+                                  uint8_t *post_req, int *num_pr_bytes) {
+    // 1. The number of files, then their indexes
+    int available = *num_pr_bytes;
+    int count_bytes = MIN((int)sizeof(uint32_t), available);
+    uint32_t num_files_nbo;
+    if(_read_request_args(client, (uint8_t *)&num_files_nbo, sizeof(uint32_t),
+                          post_req, count_bytes) < 0){
+        return -1;
+    }
+    uint32_t num_files = ntohl(num_files_nbo);
+    if(num_files > STREAM_BATCH_MAX){
+        ERR_PRINT("STREAMBATCH of %u files, at most %d are allowed\n",
+                  num_files, STREAM_BATCH_MAX);
+        return -1;
+    }
+    uint32_t file_numbers_nbo[STREAM_BATCH_MAX];
+    int index_bytes = MIN((int)(num_files * sizeof(uint32_t)), available - count_bytes);
+    if(_read_request_args(client, (uint8_t *)file_numbers_nbo, num_files * sizeof(uint32_t),
+                          post_req + count_bytes, index_bytes) < 0){
+        return -1;
+    }
+    *num_pr_bytes = count_bytes + index_bytes;
+
+    // 2. Open every file while the library is pinned, so the batch is
+    //    refused as a whole if one of them is missing
+    FILE *files[STREAM_BATCH_MAX];
+    struct stat st[STREAM_BATCH_MAX];
+    char *paths[STREAM_BATCH_MAX];
+    uint32_t num_open = 0;
+    while(num_open < num_files &&
+          _open_library_file(client, library, ntohl(file_numbers_nbo[num_open]),
+                             &files[num_open], &st[num_open], &paths[num_open]) == 0){
+        num_open++;
+    }
+    snapshot_release();
+    int result = num_open == num_files ? 0 : -1;
+
+    // 3. Send them back to back, the next file being read in while the
+    //    current one goes out
+    for(uint32_t i = 0; i < num_open; i++){
+        if(result < 0){
+            fclose(files[i]);
+            free(paths[i]);
+            continue;
+        }
+        if(i + 1 < num_open){
+            posix_fadvise(fileno(files[i + 1]), 0, STREAM_BATCH_READAHEAD, POSIX_FADV_WILLNEED);
+        }
+        result = _stream_open_file(client, files[i], &st[i], paths[i], 0, STREAM_RANGE_TO_END);
+    }
+    return result;
 }
 
 
@@ -224,6 +933,12 @@ static Library make_library(const char *path){
     library.num_files = 0;
     library.files = NULL;
     library.name = "server";
+    library.generation = 0;
+    library.list_payload = NULL;
+    library.id_payload = NULL;
+    library.changes = NULL;
+    library.watch = NULL;
+    library.store = NULL;
 
     printf("Initializing library\n");
     printf("Library path: %s\n", library.path);
@@ -237,6 +952,9 @@ static void _wait_for_children(pid_t **client_conn_pids, int *num_connected_clie
     for (int i = 0; i < *num_connected_clients; i++) {
         int options = immediate ? WNOHANG : 0;
         if (waitpid((*client_conn_pids)[i], &status, options) > 0) {
+            // Even one that died mid-request
+            snapshot_detach((*client_conn_pids)[i]);
+            cache_detach((*client_conn_pids)[i]);
             if (WIFEXITED(status)) {
                 printf("Client process %d terminated\n", (*client_conn_pids)[i]);
                 if (WEXITSTATUS(status) != 0) {
@@ -283,34 +1001,40 @@ static int initialize_server_socket(int port) {
     return incoming_connections;
 }
 
-int run_server(int port, const char *library_directory){
-    Library library = make_library(library_directory);
-    if (scan_library(&library) < 0) {
-        ERR_PRINT("Error scanning library\n");
-        return -1;
-    }
-
+/*
+** Accept each client and fork a child process that runs handle_client for it,
+** until q + enter is typed on stdin. The children serve the library from the
+** snapshots published by the parent (see as_snapshot.h).
+**
+** Child processes return the result of handle_client, the parent returns 0
+** when asked to quit and -1 on error.
+*/
+static int _run_fork_server(int incoming_connections, Library *library){
     int num_connected_clients = 0;
     pid_t *client_conn_pids = NULL;
 
-	int incoming_connections = initialize_server_socket(port);
-	if (incoming_connections == -1) {
-		return -1;	
-	}
-	
-    int maxfd = incoming_connections;
+    // Without snapshots, each child serves the library as it was at fork
+    if (snapshot_init() < 0) {
+        ERR_PRINT("Clients will not see library changes made after they connected\n");
+    }
+    int watch_fd = library_watch(library);
+    int maxfd = MAX(incoming_connections, watch_fd);
     fd_set incoming;
     SET_SERVER_FD_SET(incoming, incoming_connections);
+    if (watch_fd >= 0) FD_SET(watch_fd, &incoming);
     int num_intervals_without_scan = 0;
 
     while(1) {
         if (num_intervals_without_scan >= LIBRARY_SCAN_INTERVAL) {
-            if (scan_library(&library) < 0) {
+            if (library_check(library) < 0) {
                 fprintf(stderr, "Error scanning library\n");
                 return 1;
             }
             num_intervals_without_scan = 0;
         }
+        if (snapshot_publish(library) < 0) {
+            fprintf(stderr, "Error publishing library snapshot\n");
+        }
 
         struct timeval select_timeout = SELECT_TIMEOUT;
         if(select(maxfd + 1, &incoming, NULL, NULL, &select_timeout) < 0){
@@ -318,6 +1042,11 @@ int run_server(int port, const char *library_directory){
             exit(1);
         }
 
+        if (watch_fd >= 0 && FD_ISSET(watch_fd, &incoming) && library_update(library) < 0) {
+            fprintf(stderr, "Error updating library\n");
+            return 1;
+        }
+
         if (FD_ISSET(incoming_connections, &incoming)) {
             ClientSocket client_socket = accept_connection(incoming_connections);
 
@@ -330,8 +1059,13 @@ int run_server(int port, const char *library_directory){
             if(pid == 0){
                 close(incoming_connections);
                 free(client_conn_pids);
-                int result = handle_client(&client_socket, &library);
-                _free_library(&library);
+                // The snapshots stay up to date, the inherited copy does not
+                if (snapshot_attach() == 0) {
+                    free_scanned_library(library);
+                }
+                int result = handle_client(&client_socket, library);
+                free_scanned_library(library);
+                snapshot_destroy();
                 close(client_socket.socket);
                 return result;
             }
@@ -348,114 +1082,195 @@ int run_server(int port, const char *library_directory){
 
         num_intervals_without_scan++;
         SET_SERVER_FD_SET(incoming, incoming_connections);
+        if (watch_fd >= 0) FD_SET(watch_fd, &incoming);
 
         // Immediate return wait for client processes
         _wait_for_children(&client_conn_pids, &num_connected_clients, 1);
     }
 
     printf("Quitting server\n");
-    close(incoming_connections);
     _wait_for_children(&client_conn_pids, &num_connected_clients, 0);
-    _free_library(&library);
+    snapshot_destroy();
     return 0;
 }
 
-
-static uint8_t _is_file_extension_supported(const char *filename){
-    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
-
-    for (int i = 0; i < sizeof(supported_file_exts)/sizeof(char *); i++) {
-        char *files_ext = strrchr(filename, '.');
-        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0) {
-            return 1;
+/*
+** Helper for: _run_prefork_server
+** Fork a worker that binds its own listener and serves clients until it is
+** signalled. Returns the worker's pid in the parent, -1 on error.
+*/
+static pid_t _spawn_worker(int port, Library *library){
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("_spawn_worker: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int listenfd = initialize_server_socket(port);
+        if (listenfd == -1) {
+            exit(1);
         }
+        int result = run_reactor(listenfd, library, 0);
+        close(listenfd);
+        free_scanned_library(library);
+        exit(result == 0 ? 0 : 1);
     }
-
-    return 0;
+    printf("Started worker process %d\n", pid);
+    return pid;
 }
 
 
-static int _depth_scan_library(Library *library, char *current_path){
-
-    char *path_in_lib = _join_path(library->path, current_path);
-    if (path_in_lib == NULL) {
-        return -1;
+/*
+** Fork server_config.num_workers workers (see SERVER_PREFORK) and supervise
+** them: a worker that dies is replaced, and q + enter stops them all.
+**
+** Only returns in the parent, 0 when asked to quit, -1 on error.
+*/
+static int _run_prefork_server(int port, Library *library){
+    int num_workers = server_config.num_workers;
+    if (num_workers <= 0) {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers <= 0) {
+            num_workers = 1;
+        }
     }
 
-    DIR *dir = opendir(path_in_lib);
-    if (dir == NULL) {
-        perror("scan_library");
+    pid_t *worker_pids = (pid_t *)malloc(num_workers * sizeof(pid_t));
+    if (worker_pids == NULL) {
+        perror("_run_prefork_server");
         return -1;
     }
-    free(path_in_lib);
-
-    struct dirent *entry;
-    while((entry = readdir(dir)) != NULL) {
-        if ((entry->d_type == DT_REG) &&
-            _is_file_extension_supported(entry->d_name)) {
-            library->files = (char **)realloc(library->files,
-                                              (library->num_files + 1)
-                                              * sizeof(char *));
-            if (library->files == NULL) {
-                perror("_depth_scan_library");
-                return -1;
-            }
-
-            library->files[library->num_files] = _join_path(current_path, entry->d_name);
-            if (library->files[library->num_files] == NULL) {
-                perror("scan_library");
-                return -1;
-            }
-            #ifdef DEBUG
-            printf("Found file: %s\n", library->files[library->num_files]);
-            #endif
-            library->num_files++;
+    // Nothing to inherit from our stdout buffer
+    fflush(stdout);
+    int result = 0;
+    for (int i = 0; i < num_workers; i++) {
+        worker_pids[i] = _spawn_worker(port, library);
+        if (worker_pids[i] == -1) {
+            num_workers = i;
+            result = -1;
+            goto stop_workers;
+        }
+    }
 
-        } else if (entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    fd_set incoming;
+    uint8_t watch_stdin = 1;
+    while (1) {
+        // Without stdin, this only waits out the timeout to reap workers
+        FD_ZERO(&incoming);
+        if (watch_stdin) {
+            FD_SET(STDIN_FILENO, &incoming);
+        }
+        struct timeval select_timeout = SELECT_TIMEOUT;
+        if (select(STDIN_FILENO + 1, &incoming, NULL, NULL, &select_timeout) < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-
-            char *new_path = _join_path(current_path, entry->d_name);
-            if (new_path == NULL) {
-                return -1;
+            perror("_run_prefork_server");
+            result = -1;
+            break;
+        }
+        if (FD_ISSET(STDIN_FILENO, &incoming)) {
+            int c = getchar();
+            if (c == 'q') {
+                break;
+            } else if (c == EOF) {
+                // Nobody at the terminal, stop watching it
+                watch_stdin = 0;
             }
+        }
 
-            #ifdef DEBUG
-            printf("Library scan descending into directory: %s\n", new_path);
-            #endif
-
-            int ret_code = _depth_scan_library(library, new_path);
-            free(new_path);
-            if (ret_code < 0) {
-                return -1;
+        // Replace any worker that died
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            cache_detach(pid);
+            for (int i = 0; i < num_workers; i++) {
+                if (worker_pids[i] != pid) {
+                    continue;
+                }
+                fprintf(stderr, "Worker process %d terminated, restarting it\n", pid);
+                fflush(stdout);
+                worker_pids[i] = _spawn_worker(port, library);
+                if (worker_pids[i] == -1) {
+                    result = -1;
+                    goto stop_workers;
+                }
             }
         }
     }
 
-    closedir(dir);
-    return 0;
+stop_workers:
+    printf("Quitting server\n");
+    for (int i = 0; i < num_workers; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (worker_pids[i] > 0) {
+            waitpid(worker_pids[i], NULL, 0);
+        }
+    }
+    free(worker_pids);
+    return result;
 }
 
+int run_server(int port, const char *library_directory){
+    // Before anything forks, so every process shares it, and before the
+    // index fills it in
+    if (checksum_init() < 0) {
+        return -1;
+    }
+    Library library = make_library(library_directory);
+    // The index lets clients in right away, the library catches up meanwhile
+    if (library_load(&library) < 0 && scan_library(&library) < 0) {
+        ERR_PRINT("Error scanning library\n");
+        checksum_destroy();
+        return -1;
+    }
 
-// This function is implemented recursively and uses realloc to grow the files array
-// as it finds more files in the library. It ignores MAX_FILES.
-int scan_library(Library *library) {
-    // Maximal flexibility, free the old strings and start again
-    // A hash table leveraging inode number would be a better way to do this
-    #ifdef DEBUG
-    printf("^^^^ ----------------------------------- ^^^^\n");
-    printf("Freeing library\n");
-    #endif
-    _free_library(library);
+    // Before anything forks, so every process shares it
+    if (server_config.cache_bytes > 0 &&
+        cache_init(server_config.cache_bytes, server_config.cache_policy) < 0) {
+        free_scanned_library(&library);
+        checksum_destroy();
+        return -1;
+    }
 
-    #ifdef DEBUG
-    printf("Scanning library\n");
-    #endif
-    int result = _depth_scan_library(library, "");
-    #ifdef DEBUG
-    printf("vvvv ----------------------------------- vvvv\n");
-    #endif
+    // Without it every file is sent as it is
+    tier_init(server_config.tier_directory);
+
+    // Every worker binds its own listener
+    if (server_config.server_mode == SERVER_PREFORK) {
+        int result = _run_prefork_server(port, &library);
+        cache_destroy();
+        checksum_destroy();
+        free_scanned_library(&library);
+        return result;
+    }
+
+	int incoming_connections = initialize_server_socket(port);
+	if (incoming_connections == -1) {
+		cache_destroy();
+		checksum_destroy();
+		return -1;	
+	}
+
+    int result;
+    if (server_config.server_mode == SERVER_EPOLL) {
+        result = run_reactor(incoming_connections, &library, 1);
+        printf("Quitting server\n");
+    } else if (server_config.server_mode == SERVER_THREADS) {
+        result = run_thread_pool(incoming_connections, &library);
+        printf("Quitting server\n");
+    } else {
+        result = _run_fork_server(incoming_connections, &library);
+    }
+
+    close(incoming_connections);
+    cache_destroy();
+    checksum_destroy();
+    free_scanned_library(&library);
     return result;
 }
 
@@ -469,6 +1284,9 @@ int handle_client(const ClientSocket * client, Library *library) {
     }
     uint8_t *buff_end = request_buffer;
 
+    // The protocol version is settled by a HELLO request, if any
+    ClientSocket session = *client;
+
     int bytes_read = 0;
     int bytes_in_buf = 0;
     while((bytes_read = read(client->socket, buff_end, REQUEST_BUFFER_SIZE - bytes_in_buf)) > 0){
@@ -478,28 +1296,88 @@ int handle_client(const ClientSocket * client, Library *library) {
 
         bytes_in_buf += bytes_read;
 
-        request = find_network_newline((char *)request_buffer, &bytes_in_buf);
-
-        if (request && strcmp(request, REQUEST_LIST) == 0) {
-            if (list_request_response(client, library) < 0) {
-                ERR_PRINT("Error handling LIST request\n");
-                goto client_error;
+        // Answer every complete request already buffered before reading
+        // again: a client may send several back-to-back (pipelining)
+        while ((request = find_network_newline((char *)request_buffer, &bytes_in_buf)) != NULL) {
+            // A forked handler answers from the newest snapshot of the library
+            const Library *current = snapshot_acquire();
+            if (current == NULL) {
+                current = library;
             }
-        ERR_PRINT("%s\n", request);
-        } else if (request && strcmp(request, REQUEST_STREAM) == 0) {
-            int num_pr_bytes = MIN(sizeof(uint32_t), (unsigned long)bytes_in_buf);
-            if (stream_request_response(client, library, request_buffer, num_pr_bytes) < 0) {
-                ERR_PRINT("Error handling STREAM request\n");
-                goto client_error;
+
+            if (strcmp(request, REQUEST_LIST) == 0) {
+                if (list_request_response(&session, current) < 0) {
+                    ERR_PRINT("Error handling LIST request\n");
+                    goto client_error;
+                }
+            ERR_PRINT("%s\n", request);
+            } else if (strcmp(request, REQUEST_STREAM) == 0) {
+                int num_pr_bytes = MIN(sizeof(uint32_t), (unsigned long)bytes_in_buf);
+                if (stream_request_response(&session, current, request_buffer, num_pr_bytes) < 0) {
+                    ERR_PRINT("Error handling STREAM request\n");
+                    goto client_error;
+                }
+                bytes_in_buf -= num_pr_bytes;
+                memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+
+            } else if (strcmp(request, REQUEST_STREAM_RANGE) == 0) {
+                int num_pr_bytes = MIN(STREAM_RANGE_ARGS_SIZE, bytes_in_buf);
+                if (stream_range_request_response(&session, current, request_buffer, num_pr_bytes) < 0) {
+                    ERR_PRINT("Error handling STREAMRANGE request\n");
+                    goto client_error;
+                }
+                bytes_in_buf -= num_pr_bytes;
+                memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+
+            } else if (strcmp(request, REQUEST_STREAM_IF) == 0) {
+                int num_pr_bytes = MIN(STREAM_IF_ARGS_SIZE, bytes_in_buf);
+                if (stream_if_request_response(&session, current, request_buffer, num_pr_bytes) < 0) {
+                    ERR_PRINT("Error handling STREAMIF request\n");
+                    goto client_error;
+                }
+                bytes_in_buf -= num_pr_bytes;
+                memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+
+            } else if (strcmp(request, REQUEST_STREAM_TIER) == 0) {
+                int num_pr_bytes = MIN(STREAM_TIER_ARGS_SIZE, bytes_in_buf);
+                if (stream_tier_request_response(&session, current, request_buffer, num_pr_bytes) < 0) {
+                    ERR_PRINT("Error handling STREAMTIER request\n");
+                    goto client_error;
+                }
+                bytes_in_buf -= num_pr_bytes;
+                memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+
+            } else if (strcmp(request, REQUEST_STREAM_BATCH) == 0) {
+                int num_pr_bytes = bytes_in_buf;
+                if (stream_batch_request_response(&session, current, request_buffer, &num_pr_bytes) < 0) {
+                    ERR_PRINT("Error handling STREAMBATCH request\n");
+                    goto client_error;
+                }
+                bytes_in_buf -= num_pr_bytes;
+                memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+
+            } else if (strncmp(request, REQUEST_LIST_SINCE, strlen(REQUEST_LIST_SINCE)) == 0) {
+                if (list_since_request_response(&session, current, request) < 0) {
+                    ERR_PRINT("Error handling LISTSINCE request\n");
+                    goto client_error;
+                }
+
+            } else if (strncmp(request, REQUEST_HELLO, strlen(REQUEST_HELLO)) == 0) {
+                char reply[HELLO_MESSAGE_SIZE];
+                int reply_len = negotiate_protocol(&session, request, reply);
+                if (reply_len < 0) {
+                    ERR_PRINT("Malformed HELLO request: %s\n", request);
+                } else if (write_precisely(client->socket, reply, reply_len) < 0) {
+                    goto client_error;
+                }
+
+            } else {
+                ERR_PRINT("Unknown request: %s\n", request);
             }
-            bytes_in_buf -= num_pr_bytes;
-            memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
 
-        } else if (request) {
-            ERR_PRINT("Unknown request: %s\n", request);
+            snapshot_release();
+            free(request); request = NULL;
         }
-
-        free(request); request = NULL;
         buff_end = request_buffer + bytes_in_buf;
 
     }
@@ -518,6 +1396,7 @@ int handle_client(const ClientSocket * client, Library *library) {
     }
     return 0;
 client_error:
+    snapshot_release();
     free(request_buffer);
     if (request != NULL) {
         free(request);
@@ -527,10 +1406,108 @@ client_error:
 
 
 static void print_usage(){
-    printf("Usage: as_server [-h] [-p port] [-l library_directory]\n");
+    printf("Usage: as_server [-h] [-p port] [-l library_directory] [-m server_mode]\n");
+    printf("                 [-w num_workers] [-t transfer_mode] [-c cache_mib]\n");
+    printf("                 [-e cache_eviction] [-r] [-T tcp_profile]\n");
+    printf("                 [-W address[/bits]=weight]... [-d tier_directory]\n");
     printf("  -h  Print this message\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l  Directory containing the library (default: ./library/)\n");
+    printf("  -m  How clients are served: fork (a process per client), epoll\n");
+    printf("      (one event-driven process), prefork (event-driven workers\n");
+    printf("      sharing the port) or threads (a pool of worker threads)\n");
+    printf("      (default: fork)\n");
+    printf("  -w  Number of prefork or threads workers (default: one per CPU)\n");
+    printf("  -t  How STREAM data is sent: copy, sendfile, splice or uring\n");
+    printf("      (default: copy)\n");
+    printf("  -c  MiB of shared memory to cache popular files in (default: 0, off)\n");
+    printf("  -e  Cache eviction policy: lru or lfu (default: lru)\n");
+    printf("  -r  Send STREAM data at each file's bitrate, after a short\n");
+    printf("      burst (default: as fast as the client takes it)\n");
+    printf("  -T  How client sockets are tuned: default (the kernel's\n");
+    printf("      defaults), tuned (for a " XSTR(TCP_DEFAULT_MBIT) " Mbit/s link with "
+           XSTR(TCP_DEFAULT_RTT_MS) " ms\n");
+    printf("      round trips) or mbit/ms for another link, e.g. 1000/2\n");
+    printf("      (default: default)\n");
+    printf("  -W  Give clients from address (or its network, /bits) weight\n");
+    printf("      times the default share of an epoll, prefork or threads\n");
+    printf("      server's bandwidth, e.g. -W 10.0.0.0/8=4 (default weight: 1)\n");
+    printf("  -d  Directory to keep lower quality renditions of WAV files in\n");
+    printf("      (default: " TIER_DEFAULT_DIR "-<uid>)\n");
+}
+
+
+static int parse_server_mode(const char *mode, ServerMode *server_mode){
+    if (strcmp(mode, "fork") == 0) {
+        *server_mode = SERVER_FORK;
+    } else if (strcmp(mode, "epoll") == 0) {
+        *server_mode = SERVER_EPOLL;
+    } else if (strcmp(mode, "prefork") == 0) {
+        *server_mode = SERVER_PREFORK;
+    } else if (strcmp(mode, "threads") == 0) {
+        *server_mode = SERVER_THREADS;
+    } else {
+        ERR_PRINT("Unknown server mode: %s\n", mode);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int parse_cache_policy(const char *policy, CachePolicy *cache_policy){
+    if (strcmp(policy, "lru") == 0) {
+        *cache_policy = CACHE_LRU;
+    } else if (strcmp(policy, "lfu") == 0) {
+        *cache_policy = CACHE_LFU;
+    } else {
+        ERR_PRINT("Unknown cache eviction policy: %s\n", policy);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int parse_transfer_mode(const char *mode, TransferMode *transfer_mode){
+    if (strcmp(mode, "copy") == 0) {
+        *transfer_mode = TRANSFER_COPY;
+    } else if (strcmp(mode, "sendfile") == 0) {
+        *transfer_mode = TRANSFER_SENDFILE;
+    } else if (strcmp(mode, "splice") == 0) {
+        *transfer_mode = TRANSFER_SPLICE;
+    } else if (strcmp(mode, "uring") == 0) {
+        *transfer_mode = TRANSFER_URING;
+    } else {
+        ERR_PRINT("Unknown transfer mode: %s\n", mode);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int parse_tcp_profile(const char *profile, ServerConfig *config){
+    if (strcmp(profile, "default") == 0) {
+        config->tcp_profile = TCP_PROFILE_DEFAULT;
+        return 0;
+    }
+    config->tcp_profile = TCP_PROFILE_TUNED;
+    if (strcmp(profile, "tuned") == 0) {
+        return 0;
+    }
+    // mbit/ms
+    char *end;
+    unsigned long mbit = strtoul(profile, &end, 10);
+    if (end != profile && *end == '/') {
+        char *rtt = end + 1;
+        unsigned long rtt_ms = strtoul(rtt, &end, 10);
+        if (end != rtt && *end == '\0' && mbit > 0 && rtt_ms > 0 &&
+            mbit <= UINT32_MAX && rtt_ms <= UINT32_MAX) {
+            config->tcp_mbit = mbit;
+            config->tcp_rtt_ms = rtt_ms;
+            return 0;
+        }
+    }
+    ERR_PRINT("Unknown TCP profile: %s\n", profile);
+    return -1;
 }
 
 
@@ -542,7 +1519,7 @@ int main(int argc, char * const *argv){
     // Check out man 3 getopt for how to use this function
     // The short version: it parses command line options
     // Note that optarg is a global variable declared in getopt.h
-    while ((opt = getopt(argc, argv, "hp:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "hp:l:m:w:t:c:e:rT:W:d:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage();
@@ -553,6 +1530,48 @@ int main(int argc, char * const *argv){
             case 'l':
                 library_directory = optarg;
                 break;
+            case 'm':
+                if (parse_server_mode(optarg, &server_config.server_mode) < 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'w':
+                server_config.num_workers = atoi(optarg);
+                break;
+            case 't':
+                if (parse_transfer_mode(optarg, &server_config.transfer_mode) < 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'c':
+                server_config.cache_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'e':
+                if (parse_cache_policy(optarg, &server_config.cache_policy) < 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                server_config.pace = 1;
+                break;
+            case 'T':
+                if (parse_tcp_profile(optarg, &server_config) < 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'W':
+                if (sched_add_weight(optarg) < 0) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'd':
+                server_config.tier_directory = optarg;
+                break;
             default:
                 print_usage();
                 return 1;
@@ -5,6 +5,16 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "libas.h"
+#include "as_cache.h"
+#include "as_checksum.h"
+#include "as_library.h"
+#include "as_pace.h"
+#include "as_pcm.h"
+#include "as_snapshot.h"
+#include "as_tier.h"
+#include "as_trailer.h"
+
+#include <time.h>
 
 /*
 ** Constants
@@ -13,10 +23,27 @@
 #define MAX_PENDING 10
 #define STREAM_CHUNK_SIZE 1024
 
+// Chunked framing (PROTOCOL_VERSION_2): frame size, and how recently a file
+// must have been modified to be considered still being written
+#define STREAM_FRAME_SIZE (64 * 1024)
+#define STREAM_GROWING_SEC 2
+#define STREAM_GROWING_POLL_USEC (100 * 1000)
+
+// How much of the next file of a STREAMBATCH is read in ahead of time
+#define STREAM_BATCH_READAHEAD (1024 * 1024)
+
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 #define SELECT_TIMEOUT {SELECT_TIMEOUT_SEC, SELECT_TIMEOUT_USEC}
 
+// TCP_PROFILE_TUNED: the link assumed unless given, the bounds on the send
+// buffer, and how little must be left unsent for a socket to be writable
+#define TCP_DEFAULT_MBIT 100
+#define TCP_DEFAULT_RTT_MS 20
+#define TCP_MIN_SNDBUF (64 * 1024)
+#define TCP_MAX_SNDBUF (16 * 1024 * 1024)
+#define TCP_NOTSENT_LOWAT_BYTES (128 * 1024)
+
 #define LIBRARY_FILENAME_MAX 256
 #define LIBRARY_SCAN_INTERVAL 60
 
@@ -30,8 +57,10 @@
 ** to handle this client, and will terminate when the client disconnects.
 **
 ** The server will maintain a library of audio files. The library will be a
-** directory on the server's file system. The server will scan the library
-** directory at regular intervals to keep the library up to date.
+** directory on the server's file system. The server will watch the library
+** directory for changes to keep the library up to date, scanning it again at
+** regular intervals (see as_library.h). Child processes read it from the
+** snapshots the server publishes in shared memory (see as_snapshot.h).
 **
 ** Once a client connects, it can make requests.
 ** The server will respond to the following requests:
@@ -50,15 +79,230 @@
 **     - the file's size followed by the file's data.
 **       - see stream_request_response for more information
 **
+** 3) "STREAMRANGE" to stream part of a file, for seeking and resuming
+**   - The string REQUEST_STREAM_RANGE will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the index of the file (32-bit), the offset of
+**     the first byte wanted (64-bit) and the number of bytes wanted (64-bit),
+**     all in network byte order. A length of STREAM_RANGE_TO_END asks for the
+**     rest of the file.
+**   - The server will respond with:
+**     - the number of bytes it sends followed by the bytes themselves.
+**       - see stream_range_request_response for more information
+**
+** 4) "HELLO" to negotiate the protocol version, before any other request
+**   - The string REQUEST_HELLO, a space and the highest version the client
+**     speaks, optionally followed by the features it wants, each after a
+**     space (PROTOCOL_FEATURE_CHUNKED, PROTOCOL_FEATURE_IDS,
+**     PROTOCOL_FEATURE_PIPELINE, PROTOCOL_FEATURE_BATCH,
+**     PROTOCOL_FEATURE_CHECKSUM, PROTOCOL_FEATURE_TRAILER,
+**     PROTOCOL_FEATURE_PCM, PROTOCOL_FEATURE_TIERS), then the network
+**     newline "\r\n" (2 chars).
+**     e.g. "HELLO 2 chunked ids pipeline batch crc32c trailer lpc tiers\r\n"
+**   - The server will respond with a line of the same form: the version both
+**     sides speak, and the features it agreed to.
+**   - A server that agrees to PROTOCOL_FEATURE_PIPELINE answers every request
+**     already received before reading more, so the client may send requests
+**     without waiting for the previous responses (older servers could leave
+**     them unanswered until more bytes arrived).
+**   - A client that never says HELLO speaks PROTOCOL_VERSION_1, and a client
+**     whose HELLO goes unanswered (an older server) should fall back to it.
+**
+** 5) "LISTSINCE" to bring a list obtained earlier up to date
+**   - The string REQUEST_LIST_SINCE, a space and the library generation the
+**     client knows (0 if none), followed by the network newline "\r\n".
+**   - The server will respond with either the changes since that generation
+**     or, if it no longer has them, the whole list.
+**       - see list_since_request_response for more information
+**
+** 6) "STREAMBATCH" to stream several files in one request, e.g. a playlist
+**   - The string REQUEST_STREAM_BATCH will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the number of files (at most
+**     STREAM_BATCH_MAX) and the index of each, all 32-bit integers in network
+**     byte order.
+**   - The server will respond with a STREAM response for each file, in
+**     order, back to back.
+**       - see stream_batch_request_response for more information
+**   - Only sent to servers that agreed to PROTOCOL_FEATURE_BATCH.
+**
+** 7) "STREAMIF" to stream a file unless the client's copy is up to date
+**   - The string REQUEST_STREAM_IF will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - This will be followed by the index of the file and the CRC32C of the
+**     client's copy of it (see as_crc.h), both 32-bit integers in network
+**     byte order.
+**   - The server will respond with:
+**     - STREAM_SIZE_NOT_MODIFIED as the size, and nothing else, if its copy
+**       has the same checksum (see as_checksum.h),
+**     - a STREAM response otherwise.
+**       - see stream_if_request_response for more information
+**   - Only sent to servers that agreed to PROTOCOL_FEATURE_CHECKSUM, which
+**     requires PROTOCOL_VERSION_2.
+**
+** 8) "STREAMTIER" to stream a file at a lower quality, for a thin link
+**   - The string REQUEST_STREAM_TIER will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the index of the file and the tier wanted
+**     (1 to TIER_COUNT, or TIER_ORIGINAL for the file itself), both 32-bit
+**     integers in network byte order.
+**   - The server will respond with a STREAM response of the file's rendition
+**     at that tier, or of the file itself if it has none (see as_tier.h).
+**       - see stream_tier_request_response for more information
+**   - Only sent to servers that agreed to PROTOCOL_FEATURE_TIERS.
+**
+** Protocol versions
+**   PROTOCOL_VERSION_1: STREAM and STREAMRANGE sizes are 32-bit, files of
+**                       4 GiB or more cannot be streamed.
+**   PROTOCOL_VERSION_2: the sizes are 64-bit, in network byte order. If
+**                       chunked framing was agreed on, the server may send
+**                       STREAM_SIZE_CHUNKED as the size instead, and the data
+**                       as frames: a 32-bit length in network byte order and
+**                       that many bytes, until a frame of length 0. The server
+**                       does so for files that are still being written, so it
+**                       can start sending before it knows their final length.
+**                       If stable IDs were agreed on (PROTOCOL_FEATURE_IDS),
+**                       the client names files by ID in STREAM and
+**                       STREAMRANGE, and LISTSINCE names them by ID too, its
+**                       full list being a RESYNC of "+<id>:<file>" additions
+**                       (see as_library.h).
+**
+** Integrity trailer
+**   If the client agreed to PROTOCOL_FEATURE_TRAILER (in any version), the
+**   data of every STREAM, STREAMRANGE, STREAMIF and STREAMBATCH response
+**   (after the frame of length 0, in chunked framing) is followed by the
+**   CRC32C of the data (see as_crc.h), 32-bit in network byte order. A
+**   STREAM_SIZE_NOT_MODIFIED answer has no data and no trailer. The client
+**   should discard data whose trailer does not match (see as_trailer.h).
+**
+** Transport encoding
+**   If the client agreed to PROTOCOL_FEATURE_PCM (PROTOCOL_VERSION_2 only),
+**   a whole file (a STREAM, STREAMIF or STREAMBATCH response, not a range)
+**   that is an integer PCM WAV file, and is not being sent chunked, may be
+**   sent encoded instead (see as_pcm.h): STREAM_SIZE_ENCODED as the size,
+**   then the size of the file (64-bit), then frames: a 32-bit length in
+**   network byte order and that many bytes of frame payload, until a frame of
+**   length 0. The payloads decode to the file, which is paced at its own
+**   bitrate, and its trailer (if agreed) is the CRC32C of the file, not of
+**   the frames.
+**
+** Tiers
+**   If the client agreed to PROTOCOL_FEATURE_TIERS (PROTOCOL_VERSION_2
+**   only), every LISTSINCE response has a LIST_TIERS line after its header
+**   line, listing the tiers a STREAMTIER may ask for: "TIERS" then
+**   " <tier>:<sample rate>/<bits>/<channels>" for each, e.g.
+**   "TIERS 1:44100/16/2 2:22050/16/2 3:22050/16/1 4:11025/8/1\r\n". A
+**   rendition is a WAV file whose rate, bits and channels are each the lower
+**   of the tier's and the file's.
+**
 ** The client-server connection code is nearly identical to T10, so be sure to take a crack
 ** at that lab before starting this assignment.
 */
 
 
+/*
+** Transfer modes
+** --------------
+** How the body of a STREAM response is moved from the library file to the
+** client socket. The wire format is identical in every mode.
+** TRANSFER_COPY:     fread into a STREAM_CHUNK_SIZE buffer, then write it out.
+** TRANSFER_SENDFILE: sendfile(2) straight from the page cache to the socket,
+**                    falling back to splice(2), then to copying, if the kernel
+**                    refuses.
+** TRANSFER_SPLICE:   splice(2) through a pipe, falling back to copying.
+** TRANSFER_URING:    io_uring with several reads in flight and the socket
+**                    writes queued behind them (see as_uring.h), falling back
+**                    to copying if the kernel has no io_uring. Only used by
+**                    handle_client; the event-driven engines copy instead.
+*/
+typedef enum transfer_mode {
+    TRANSFER_COPY,
+    TRANSFER_SENDFILE,
+    TRANSFER_SPLICE,
+    TRANSFER_URING,
+} TransferMode;
+
+
+/*
+** Server modes
+** ------------
+** SERVER_FORK:  fork a child process per client (see Design above).
+** SERVER_EPOLL: serve every client from this process with an epoll event
+**               loop over non-blocking sockets (see as_reactor.h).
+** SERVER_PREFORK: fork num_workers long-lived worker processes up front. Each
+**               worker binds its own SO_REUSEPORT listener on the port, so
+**               the kernel spreads new connections across them, and runs the
+**               epoll event loop. The parent only supervises the workers.
+** SERVER_THREADS: serve every client from this process with a pool of
+**               num_workers threads fed by epoll (see as_threads.h).
+*/
+typedef enum server_mode {
+    SERVER_FORK,
+    SERVER_EPOLL,
+    SERVER_PREFORK,
+    SERVER_THREADS,
+} ServerMode;
+
+
+/*
+** TCP profiles
+** ------------
+** How client sockets are tuned. In every profile the size header of a STREAM
+** response is sent with MSG_MORE, so it leaves in the same segment as the
+** first bytes of the body instead of on its own.
+** TCP_PROFILE_DEFAULT: the kernel's defaults.
+** TCP_PROFILE_TUNED: for a link of tcp_mbit Mbit/s and tcp_rtt_ms of round
+**                    trip time:
+**   - SO_SNDBUF is the bandwidth-delay product (within TCP_MIN_SNDBUF and
+**     TCP_MAX_SNDBUF), so one socket can keep the link busy. It is set on the
+**     listening socket, and accepted sockets inherit it.
+**   - TCP_NODELAY, so small responses (LIST, LISTSINCE, HELLO, pipelined
+**     answers) go out at once instead of after the previous one is acked.
+**   - TCP_NOTSENT_LOWAT, so a socket is only writable again once less than
+**     TCP_NOTSENT_LOWAT_BYTES are waiting to be sent: data does not pile up
+**     in the kernel long before the link can take it.
+*/
+typedef enum tcp_profile {
+    TCP_PROFILE_DEFAULT,
+    TCP_PROFILE_TUNED,
+} TcpProfile;
+
+
+/*
+** Server configuration
+** --------------------
+** Options chosen at startup on the command line. There is a single instance,
+** server_config, filled in by main before run_server is called.
+*/
+typedef struct server_config {
+    ServerMode server_mode;
+    int num_workers;    // SERVER_PREFORK/THREADS workers, 0 for one per online CPU
+    TransferMode transfer_mode;
+    size_t cache_bytes;         // hot-file cache budget, 0 to disable it
+    CachePolicy cache_policy;
+    uint8_t pace;               // send STREAM bodies at the file's bitrate (see as_pace.h)
+    TcpProfile tcp_profile;
+    uint32_t tcp_mbit;          // the link TCP_PROFILE_TUNED is for
+    uint32_t tcp_rtt_ms;
+    const char *tier_directory; // where renditions are kept, NULL for the default
+} ServerConfig;
+
+extern ServerConfig server_config;
+
+
 // Convenience struct for clients
+// protocol_version, chunked, ids, checksums, trailer, pcm and tiers are
+// settled by the client's HELLO, if any
 typedef struct client_socket {
     int socket;
     struct sockaddr_in addr;
+    uint8_t protocol_version;
+    uint8_t chunked;
+    uint8_t ids;
+    uint8_t checksums;
+    uint8_t trailer;
+    uint8_t pcm;
+    uint8_t tiers;
 } ClientSocket;
 
 
@@ -88,6 +332,10 @@ int init_server_addr(int port, struct sockaddr_in *server_options);
 ** bind and listen on the socket. If any of these steps fail, the program will
 ** terminate with an error message.
 **
+** In SERVER_PREFORK mode SO_REUSEPORT is set as well, so every worker can bind
+** its own socket to the same port. With TCP_PROFILE_TUNED, the send buffer is
+** sized for the link (see TCP profiles).
+**
 ** Return the socket file descriptor, -1 on error
 */
 int set_up_server_socket(const struct sockaddr_in *self, int num_queue);
@@ -95,12 +343,19 @@ int set_up_server_socket(const struct sockaddr_in *self, int num_queue);
 
 /*
 ** Wait for and accept a new connection. Return the socket file descriptor for
-** the new connection.
+** the new connection, tuned with tune_client_socket.
 **
 ** If the accept call fails, return -1.
 */
 ClientSocket accept_connection(int listenfd);
 
+/*
+** Apply server_config.tcp_profile to a newly accepted client socket.
+**
+** returns 0 on success, -1 on error (the socket still works, untuned)
+*/
+int tune_client_socket(int soc);
+
 
 // Request response functions
 /*
@@ -117,11 +372,45 @@ ClientSocket accept_connection(int listenfd);
 **
 ** Notes:
 **   -- the null character is not included in the message sent to the client.
+**   -- the message is the library's list_payload, sent with a single write.
 **
 ** return 0 on success, -1 on error
 */
 int list_request_response(const ClientSocket * client, const Library *library);
 
+/*
+** Answer a LISTSINCE request line (without the network newline). Lines are
+** separated by network newlines, and the response is one of:
+**   - LIST_DELTA " <generation>", then the changes since the client's
+**     generation, in order, each either
+**       LIST_DELTA_REMOVE "<index>": the file at index was removed, and the
+**                                    last file in the list moved to index
+**       LIST_DELTA_ADD "<index>:<file>": file was appended to the list, at
+**                                        index
+**     and finally LIST_END.
+**   - LIST_RESYNC " <generation>", then the whole list in the format of
+**     list_request_response, and finally LIST_END.
+** In both cases generation is the one the client's list is at afterwards.
+** A client that agreed to PROTOCOL_FEATURE_TIERS also gets a LIST_TIERS line
+** right after the header line (see Tiers above).
+**
+** For example, "DELTA 7\r\n-1\r\n+2:new.wav\r\n.\r\n" turns the list
+** 0:a.wav, 1:b.wav, 2:c.wav into 0:a.wav, 1:c.wav, 2:new.wav at generation 7.
+**
+** return 0 on success, -1 on error
+*/
+int list_since_request_response(const ClientSocket * client, const Library *library,
+                                const char *request);
+
+/*
+** Find the LISTSINCE response for client (see list_since_request_response)
+** to a LISTSINCE from generation, for any of the server's engines.
+**
+** returns a payload reference, or NULL on error
+*/
+ListPayload *list_since_payload(const ClientSocket *client, const Library *library,
+                                uint64_t generation);
+
 
 /*
 ** Stream a file from the library to the client. The file is streamed in chunks
@@ -132,11 +421,17 @@ int list_request_response(const ClientSocket * client, const Library *library);
 ** from the client_socket, but will consider num_pr_bytes (must be <= uint32_t)
 ** from post_req first, then:
 **   The stream will be sent in the following format:
-**     - the first 4 bytes (32-bits) will be the file size in network byte-order
+**     - the first 4 bytes (32-bits) will be the file size in network byte-order,
+**       8 bytes (64-bits) for clients speaking PROTOCOL_VERSION_2 or later
 **     - the rest of the stream will be the file's data written in chunks of
 **       STREAM_CHUNK_SIZE bytes, or less if write returns less than STREAM_CHUNK_SIZE,
 **       the file is less than STREAM_CHUNK_SIZE bytes, or the last remaining chunk is
 **       less than STREAM_CHUNK_SIZE bytes.
+**       In the zero-copy transfer modes the data is handed to the kernel in one
+**       piece instead (see TransferMode). Files in the hot-file cache are sent
+**       straight from shared memory (see as_cache.h).
+**       A file still being written goes out in chunked framing instead, if the
+**       client agreed to it (see Protocol versions above).
 **
 ** If the file is successfully transported to the client over the client_socket,
 ** return 0. Otherwise, return -1.
@@ -144,18 +439,107 @@ int list_request_response(const ClientSocket * client, const Library *library);
 int stream_request_response(const ClientSocket * client, const Library *library,
                             uint8_t *post_req, int num_pr_bytes);
 
+/*
+** Stream part of a file from the library to the client, without reading or
+** sending anything before it.
+**
+** The STREAM_RANGE_ARGS_SIZE bytes of arguments (file index, offset, length,
+** see the Design above) will be read from the client_socket, but will consider
+** num_pr_bytes (must be <= STREAM_RANGE_ARGS_SIZE) from post_req first, then:
+**   The stream will be sent in the following format:
+**     - the number of bytes sent, sized like stream_request_response's file
+**       size: length, cut short at the end of the file (0 if the offset is at
+**       or past the end)
+**     - the rest of the stream will be the bytes of the file from offset on.
+**
+** If the range is successfully transported to the client over the client_socket,
+** return 0. Otherwise, return -1.
+*/
+int stream_range_request_response(const ClientSocket * client, const Library *library,
+                                  uint8_t *post_req, int num_pr_bytes);
 
-// Library functions
 /*
-** Scan the library directory and (re-)populate the library structure. The library
-** structure will be populated with the name of the library, the path to the library,
-** and a list of files in the library.
+** Stream several files from the library to the client, one after the other.
 **
-** Only SUPPORTED_FILE_EXTS files will be added to the library.
+** The arguments (number of files, then each file index, see the Design above)
+** will be read from the client_socket, but will consider the *num_pr_bytes
+** bytes already received in post_req first. *num_pr_bytes is set to how many
+** of them were arguments.
+**   Every file is opened before anything is sent, so a batch naming a file
+**   that is not in the library is refused as a whole. Then each file is sent
+**   in the format of stream_request_response, while the start of the next
+**   one (STREAM_BATCH_READAHEAD bytes) is read in from disk.
 **
-** If the library is successfully populated, return 0. Otherwise, return -1.
+** If every file is successfully transported to the client over the
+** client_socket, return 0. Otherwise, return -1.
 */
-int scan_library(Library *library);
+int stream_batch_request_response(const ClientSocket * client, const Library *library,
+                                  uint8_t *post_req, int *num_pr_bytes);
+
+/*
+** Stream a file from the library to the client, unless the client's copy of
+** it is up to date.
+**
+** The STREAM_IF_ARGS_SIZE bytes of arguments (file index, the checksum of the
+** client's copy, see the Design above) will be read from the client_socket,
+** but will consider num_pr_bytes (must be <= STREAM_IF_ARGS_SIZE) from
+** post_req first, then:
+**   - if the file's CRC32C (hashed the first time it is asked for, see
+**     as_checksum.h) is the client's, the size STREAM_SIZE_NOT_MODIFIED is
+**     sent, and nothing else.
+**   - otherwise the file is sent like in stream_request_response. A file
+**     still being written is always sent, and so is every file to a client
+**     that did not agree to PROTOCOL_FEATURE_CHECKSUM.
+**
+** If the answer is successfully transported to the client over the
+** client_socket, return 0. Otherwise, return -1.
+*/
+int stream_if_request_response(const ClientSocket * client, const Library *library,
+                               uint8_t *post_req, int num_pr_bytes);
+
+/*
+** Stream a file from the library to the client, at a lower quality.
+**
+** The STREAM_TIER_ARGS_SIZE bytes of arguments (file index, tier, see the
+** Design above) will be read from the client_socket, but will consider
+** num_pr_bytes (must be <= STREAM_TIER_ARGS_SIZE) from post_req first, then
+** the file's rendition at that tier (rendered the first time it is asked
+** for, see as_tier.h) is sent like in stream_request_response. The file
+** itself is sent if it has none, e.g. for TIER_ORIGINAL or a file that is
+** not a WAV file. A tier above TIER_COUNT is an error.
+**
+** If the answer is successfully transported to the client over the
+** client_socket, return 0. Otherwise, return -1.
+*/
+int stream_tier_request_response(const ClientSocket * client, const Library *library,
+                                 uint8_t *post_req, int num_pr_bytes);
+
+/*
+** Settle the client's protocol version and features from its HELLO request
+** line (without the network newline), and write the server's answer, network
+** newline included, to reply (at least HELLO_MESSAGE_SIZE bytes). Chunked
+** framing is only offered by the blocking handler (SERVER_FORK).
+**
+** returns the length of the reply, -1 if request is not a valid HELLO
+*/
+int negotiate_protocol(ClientSocket *client, const char *request, char *reply);
+
+/*
+** Encode the size of a stream for a client speaking protocol_version into buf
+** (at least sizeof(uint64_t) bytes).
+**
+** returns the number of bytes used, 0 if the version cannot express size
+*/
+size_t encode_stream_size(uint8_t protocol_version, uint64_t size, uint8_t *buf);
+
+/*
+** returns 1 if the file whose stat is st was modified in the last
+** STREAM_GROWING_SEC seconds, it is then taken to be still being written
+*/
+int is_being_written(const struct stat *st);
+
+
+// Library functions: see as_library.h
 
 
 // Server operation functions
@@ -179,7 +563,10 @@ int handle_client(const ClientSocket * client, Library *library);
 **
 ** All new connections will be accepted and handled in a child process that will
 ** exclusively run the handle_client function. The server will continue to listen
-** for new connections in the parent process.
+** for new connections in the parent process. In SERVER_EPOLL mode all
+** connections are handled by run_reactor in this process instead, in
+** SERVER_PREFORK mode by run_reactor in each of the pre-forked workers, and in
+** SERVER_THREADS mode by run_thread_pool in this process.
 **
 ** If the server is successfully set up and running, this function will never
 ** return. If any errors occur, the server will terminate with an error message.
@@ -0,0 +1,370 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_snapshot.h"
+
+
+#define SNAPSHOT_NONE 0
+
+/*
+** capacity: bytes the slot's memfd has been grown to.
+** generation: the generation of the library written in it.
+*/
+typedef struct snapshot_slot {
+    size_t capacity;
+    uint64_t generation;
+} SnapshotSlot;
+
+
+/*
+** pid: the handler owning the entry, 0 if it is free.
+** pinned: the slot it is reading + 1, SNAPSHOT_NONE between requests.
+*/
+typedef struct snapshot_reader {
+    pid_t pid;
+    uint32_t pinned;
+} SnapshotReader;
+
+
+/*
+** The shared control block. current is the current slot + 1 (SNAPSHOT_NONE
+** until the first snapshot is published), only ever stored by the parent.
+*/
+typedef struct snapshot_header {
+    uint32_t current;
+    SnapshotSlot slots[SNAPSHOT_SLOTS];
+    SnapshotReader readers[SNAPSHOT_MAX_READERS];
+} SnapshotHeader;
+
+
+static SnapshotHeader *header = NULL;
+// Inherited by every process: the reserved address space and the slots
+static uint8_t *slots_base = NULL;
+static int slot_fds[SNAPSHOT_SLOTS];
+// How much of each slot this process has mapped
+static size_t mapped[SNAPSHOT_SLOTS];
+// This process's entry in the reader table, if it is a handler
+static int reader = -1;
+
+
+static uint8_t *_slot_data(int slot) {
+    return slots_base + (size_t)slot * SNAPSHOT_SLOT_SPAN;
+}
+
+
+/*
+** Map the first capacity bytes of slot over its reserved address space.
+** returns 0 on success, -1 on error
+*/
+static int _map_slot(int slot, size_t capacity) {
+    if (mmap(_slot_data(slot), capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             slot_fds[slot], 0) == MAP_FAILED) {
+        perror("snapshot: mmap");
+        return -1;
+    }
+    mapped[slot] = capacity;
+    return 0;
+}
+
+
+int snapshot_init(void) {
+    header = mmap(NULL, sizeof(SnapshotHeader), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (header == MAP_FAILED) {
+        perror("snapshot_init: mmap");
+        header = NULL;
+        return -1;
+    }
+    // Address space only, the slots are mapped over it as they fill up
+    slots_base = mmap(NULL, SNAPSHOT_SLOTS * SNAPSHOT_SLOT_SPAN, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slots_base == MAP_FAILED) {
+        perror("snapshot_init: mmap");
+        slots_base = NULL;
+        snapshot_destroy();
+        return -1;
+    }
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        slot_fds[i] = -1;
+    }
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        slot_fds[i] = memfd_create("as_snapshot", MFD_CLOEXEC);
+        if (slot_fds[i] < 0) {
+            perror("snapshot_init: memfd_create");
+            snapshot_destroy();
+            return -1;
+        }
+        mapped[i] = 0;
+    }
+    return 0;
+}
+
+
+void snapshot_destroy(void) {
+    if (header == NULL) {
+        return;
+    }
+    if (reader >= 0) {
+        snapshot_detach(getpid());
+        reader = -1;
+    }
+    if (slots_base != NULL) {
+        munmap(slots_base, SNAPSHOT_SLOTS * SNAPSHOT_SLOT_SPAN);
+        slots_base = NULL;
+        for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+            if (slot_fds[i] >= 0) {
+                close(slot_fds[i]);
+            }
+        }
+    }
+    munmap(header, sizeof(SnapshotHeader));
+    header = NULL;
+}
+
+
+/*
+** Helper for: snapshot_publish
+** returns a slot that is neither current nor pinned by any reader, or -1
+*/
+static int _free_slot(uint32_t current) {
+    for (int slot = 0; slot < SNAPSHOT_SLOTS; slot++) {
+        if ((uint32_t)slot + 1 == current) {
+            continue;
+        }
+        int pinned = 0;
+        for (int i = 0; !pinned && i < SNAPSHOT_MAX_READERS; i++) {
+            pinned = __atomic_load_n(&header->readers[i].pinned, __ATOMIC_SEQ_CST)
+                     == (uint32_t)slot + 1;
+        }
+        if (!pinned) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+
+/*
+** Helpers for: snapshot_publish
+** A snapshot is laid out as its Library, store, change log, files, info, ID
+** table and payloads, each aligned, then every string it points to.
+*/
+static size_t _align(size_t size) {
+    return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+
+static void *_take(uint8_t **cursor, size_t size) {
+    void *taken = *cursor;
+    *cursor += _align(size);
+    return taken;
+}
+
+
+static size_t _payload_size(const ListPayload *payload) {
+    return payload == NULL ? 0 : sizeof(ListPayload) + payload->len + 1;
+}
+
+
+static ListPayload *_copy_payload(uint8_t **cursor, const ListPayload *payload) {
+    if (payload == NULL) {
+        return NULL;
+    }
+    ListPayload *copy = _take(cursor, _payload_size(payload));
+    memcpy(copy, payload, _payload_size(payload));
+    // The snapshot's own reference, never dropped
+    copy->refs = 1;
+    return copy;
+}
+
+
+static int _is_logged(const LibraryLog *log, uint32_t i) {
+    return (i + LIBRARY_LOG_SIZE - log->start) % LIBRARY_LOG_SIZE < log->count;
+}
+
+
+static size_t _snapshot_size(const Library *library) {
+    const LibraryStore *store = library->store;
+    const LibraryLog *log = library->changes;
+    size_t size = _align(sizeof(Library)) + _align(sizeof(LibraryStore))
+                  + _align(sizeof(LibraryLog))
+                  + _align(library->num_files * sizeof(char *))
+                  + _align(library->num_files * sizeof(FileInfo))
+                  + _align(store->table_size * sizeof(uint32_t))
+                  + _align(_payload_size(library->list_payload))
+                  + _align(_payload_size(library->id_payload));
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        size += strlen(library->files[i]) + 1;
+    }
+    for (uint32_t i = 0; i < LIBRARY_LOG_SIZE; i++) {
+        if (_is_logged(log, i) && log->changes[i].file != NULL) {
+            size += strlen(log->changes[i].file) + 1;
+        }
+    }
+    return size;
+}
+
+
+static char *_copy_string(char **strings, const char *str) {
+    char *copy = *strings;
+    size_t len = strlen(str) + 1;
+    memcpy(copy, str, len);
+    *strings += len;
+    return copy;
+}
+
+
+/*
+** Lay library out at data, with every pointer into data (which is at the
+** same address in every process). The name and path are not copied, they
+** are never freed.
+*/
+static void _write_snapshot(const Library *library, uint8_t *data) {
+    uint8_t *cursor = data;
+    Library *snapshot = _take(&cursor, sizeof(Library));
+    LibraryStore *store = _take(&cursor, sizeof(LibraryStore));
+    LibraryLog *log = _take(&cursor, sizeof(LibraryLog));
+    char **files = _take(&cursor, library->num_files * sizeof(char *));
+
+    // Readers only look files up by ID, not by name
+    *store = *library->store;
+    memset(&store->names, 0, sizeof(Arena));
+    store->wasted = 0;
+    store->capacity = library->num_files;
+    store->by_name = NULL;
+    store->info = _take(&cursor, library->num_files * sizeof(FileInfo));
+    memcpy(store->info, library->store->info, library->num_files * sizeof(FileInfo));
+    store->by_id = _take(&cursor, store->table_size * sizeof(uint32_t));
+    memcpy(store->by_id, library->store->by_id, store->table_size * sizeof(uint32_t));
+
+    *snapshot = *library;
+    snapshot->files = files;
+    snapshot->store = store;
+    snapshot->changes = log;
+    snapshot->watch = NULL;
+    snapshot->list_payload = _copy_payload(&cursor, library->list_payload);
+    snapshot->id_payload = _copy_payload(&cursor, library->id_payload);
+
+    char *strings = (char *)cursor;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        files[i] = _copy_string(&strings, library->files[i]);
+    }
+    *log = *library->changes;
+    for (uint32_t i = 0; i < LIBRARY_LOG_SIZE; i++) {
+        // Changes that fell out of the log point to freed names
+        const char *file = library->changes->changes[i].file;
+        log->changes[i].file = _is_logged(log, i) && file != NULL
+                               ? _copy_string(&strings, file) : NULL;
+    }
+}
+
+
+int snapshot_publish(const Library *library) {
+    if (header == NULL || library->store == NULL || library->changes == NULL) {
+        return 0;
+    }
+    uint32_t current = header->current;
+    if (current != SNAPSHOT_NONE &&
+        header->slots[current - 1].generation == library->generation) {
+        return 0;
+    }
+    int slot = _free_slot(current);
+    if (slot < 0) {
+        #ifdef DEBUG
+        printf("Every snapshot is being read, generation %lu waits\n",
+               (unsigned long)library->generation);
+        #endif
+        return 0;
+    }
+
+    size_t size = _snapshot_size(library);
+    if (size > SNAPSHOT_SLOT_SPAN) {
+        ERR_PRINT("snapshot_publish: library of %zu bytes does not fit a snapshot\n", size);
+        return -1;
+    }
+    SnapshotSlot *info = &header->slots[slot];
+    if (size > info->capacity) {
+        // Room to grow, so the next generations do not truncate it again
+        size_t capacity = MIN(MAX(size + size / 4, SNAPSHOT_MIN_SIZE), SNAPSHOT_SLOT_SPAN);
+        capacity = (capacity + SNAPSHOT_MIN_SIZE - 1) / SNAPSHOT_MIN_SIZE * SNAPSHOT_MIN_SIZE;
+        if (ftruncate(slot_fds[slot], capacity) < 0) {
+            perror("snapshot_publish: ftruncate");
+            return -1;
+        }
+        info->capacity = capacity;
+    }
+    if (mapped[slot] < info->capacity && _map_slot(slot, info->capacity) < 0) {
+        return -1;
+    }
+
+    _write_snapshot(library, _slot_data(slot));
+    info->generation = library->generation;
+    __atomic_store_n(&header->current, slot + 1, __ATOMIC_SEQ_CST);
+    #ifdef DEBUG
+    printf("Published generation %lu in snapshot slot %d (%zu bytes)\n",
+           (unsigned long)library->generation, slot, size);
+    #endif
+    return 0;
+}
+
+
+int snapshot_attach(void) {
+    if (header == NULL || __atomic_load_n(&header->current, __ATOMIC_SEQ_CST) == SNAPSHOT_NONE) {
+        return -1;
+    }
+    pid_t pid = getpid();
+    for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&header->readers[i].pid, &expected, pid, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            reader = i;
+            return 0;
+        }
+    }
+    ERR_PRINT("snapshot_attach: every reader entry is taken\n");
+    return -1;
+}
+
+
+void snapshot_detach(pid_t pid) {
+    if (header == NULL) {
+        return;
+    }
+    for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+        if (__atomic_load_n(&header->readers[i].pid, __ATOMIC_SEQ_CST) == pid) {
+            __atomic_store_n(&header->readers[i].pinned, SNAPSHOT_NONE, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&header->readers[i].pid, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+
+const Library *snapshot_acquire(void) {
+    if (reader < 0) {
+        return NULL;
+    }
+    // The parent only writes over slots it saw unpinned after they stopped
+    // being current, so a pin that is still current once set is safe
+    SnapshotReader *self = &header->readers[reader];
+    uint32_t current;
+    do {
+        current = __atomic_load_n(&header->current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&self->pinned, current, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&header->current, __ATOMIC_SEQ_CST) != current);
+
+    int slot = current - 1;
+    if (mapped[slot] < header->slots[slot].capacity &&
+        _map_slot(slot, header->slots[slot].capacity) < 0) {
+        snapshot_release();
+        return NULL;
+    }
+    return (const Library *)_slot_data(slot);
+}
+
+
+void snapshot_release(void) {
+    if (reader >= 0) {
+        __atomic_store_n(&header->readers[reader].pinned, SNAPSHOT_NONE, __ATOMIC_SEQ_CST);
+    }
+}
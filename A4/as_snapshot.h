@@ -0,0 +1,100 @@
+#ifndef AS_SNAPSHOT_H_
+#define AS_SNAPSHOT_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_library.h"
+
+#include <sys/mman.h>
+
+/*
+** Design
+** ------
+** A forked client handler used to serve the copy of the library it inherited
+** when it was forked, so a client never saw a file added after it connected,
+** and every handler kept the parent's path table mapped (copy-on-write, so
+** the parent's rescans faulted on pages the children still shared).
+**
+** Instead, the parent publishes each generation of the library as a read-only
+** snapshot in shared memory, and handlers read the newest one on every
+** request, without taking any lock:
+**   - There are SNAPSHOT_SLOTS slots, each a memfd mapped at the same address
+**     in every process (the parent reserves SNAPSHOT_SLOT_SPAN bytes of
+**     address space per slot before forking, and children inherit the
+**     reservation). A snapshot is thus an ordinary Library, with its files,
+**     store, change log and LIST payloads, whose pointers are valid in every
+**     process: the request handlers use it as is.
+**   - The parent writes a new generation into a slot nobody is reading, then
+**     makes it current with one atomic store (read-copy-update).
+**   - A handler pins the current slot in its entry of the reader table before
+**     using it (and checks it is still current afterwards, or tries again),
+**     and unpins it once the response is sent. A slot is only written over
+**     once no reader has it pinned; if none is free, the parent tries again
+**     on its next tick, and handlers keep using the current snapshot meanwhile.
+**   - The reader table is shared too: a handler claims a free entry when it
+**     starts, and the parent clears it when it reaps the handler, so one that
+**     died mid-request does not keep its slot pinned.
+** A slot only grows (the memfd is truncated to a larger size), and a handler
+** maps the rest of a slot when it pins one bigger than what it has mapped.
+**
+** Only the forking server uses snapshots: the other engines serve the
+** library from the process (and memory) that keeps it up to date.
+*/
+
+#define SNAPSHOT_SLOTS 3
+#define SNAPSHOT_SLOT_SPAN ((size_t)4 << 30)
+#define SNAPSHOT_MAX_READERS 1024
+#define SNAPSHOT_MIN_SIZE (1024 * 1024)
+
+
+/*
+** Set up the slots and the reader table. Must be called before forking for
+** the snapshots to be shared.
+**
+** returns 0 on success, -1 on error
+*/
+int snapshot_init(void);
+
+/*
+** Unmap the slots. Snapshots still pinned by other processes stay valid for
+** them.
+*/
+void snapshot_destroy(void);
+
+/*
+** Publish library as the current snapshot, unless its generation already is
+** (or every other slot is still being read, then it is tried again on the
+** next call). Called by the process that keeps library up to date.
+**
+** returns 0 on success, -1 on error
+*/
+int snapshot_publish(const Library *library);
+
+/*
+** Claim an entry in the reader table for this process (a forked handler).
+**
+** returns 0 if requests can be served from snapshots, -1 if they must be
+** served from the library the process inherited
+*/
+int snapshot_attach(void);
+
+/*
+** Free the reader table entry of a reaped handler, pid.
+*/
+void snapshot_detach(pid_t pid);
+
+/*
+** Pin the current snapshot for a request.
+**
+** returns the snapshot, or NULL if the process is not attached
+*/
+const Library *snapshot_acquire(void);
+
+/*
+** Unpin the snapshot returned by snapshot_acquire.
+*/
+void snapshot_release(void);
+
+#endif // AS_SNAPSHOT_H_
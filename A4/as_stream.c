@@ -0,0 +1,802 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_stream.h"
+
+
+/*
+** Returns the offset of the first \r\n in buf, or -1 if there is none.
+*/
+static int _find_end_of_line(const uint8_t *buf, int inbuf) {
+    for (int i = 0; i < inbuf - 1; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void _consume(uint8_t *buf, int *inbuf, int count) {
+    *inbuf -= count;
+    memmove(buf, buf + count, *inbuf);
+}
+
+
+int parse_request(uint8_t *buf, int *inbuf, Request *req) {
+    int eol = _find_end_of_line(buf, *inbuf);
+    if (eol < 0) {
+        return 0;
+    }
+    int line_len = eol + strlen(END_OF_MESSAGE_TOKEN);
+
+    if (eol == strlen(REQUEST_LIST) && memcmp(buf, REQUEST_LIST, eol) == 0) {
+        req->type = REQUEST_TYPE_LIST;
+        _consume(buf, inbuf, line_len);
+        return 1;
+    }
+
+    size_t since_len = strlen(REQUEST_LIST_SINCE);
+    if (eol > since_len && buf[since_len] == ' ' &&
+        memcmp(buf, REQUEST_LIST_SINCE, since_len) == 0) {
+        buf[eol] = '\0';
+        req->type = REQUEST_TYPE_LIST_SINCE;
+        req->generation = strtoull((char *)buf + since_len + 1, NULL, 10);
+        _consume(buf, inbuf, line_len);
+        return 1;
+    }
+
+    if (eol == strlen(REQUEST_STREAM) && memcmp(buf, REQUEST_STREAM, eol) == 0) {
+        // The file index must have arrived too
+        if (*inbuf < line_len + sizeof(uint32_t)) {
+            return 0;
+        }
+        uint32_t file_index_nbo;
+        memcpy(&file_index_nbo, buf + line_len, sizeof(uint32_t));
+        req->type = REQUEST_TYPE_STREAM;
+        req->file_index = ntohl(file_index_nbo);
+        req->offset = 0;
+        req->length = STREAM_RANGE_TO_END;
+        _consume(buf, inbuf, line_len + sizeof(uint32_t));
+        return 1;
+    }
+
+    if (eol == strlen(REQUEST_STREAM_RANGE) && memcmp(buf, REQUEST_STREAM_RANGE, eol) == 0) {
+        if (*inbuf < line_len + STREAM_RANGE_ARGS_SIZE) {
+            return 0;
+        }
+        uint32_t file_index_nbo;
+        uint64_t offset_nbo, length_nbo;
+        uint8_t *args = buf + line_len;
+        memcpy(&file_index_nbo, args, sizeof(uint32_t));
+        memcpy(&offset_nbo, args + sizeof(uint32_t), sizeof(uint64_t));
+        memcpy(&length_nbo, args + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+        req->type = REQUEST_TYPE_STREAM_RANGE;
+        req->file_index = ntohl(file_index_nbo);
+        req->offset = be64toh(offset_nbo);
+        req->length = be64toh(length_nbo);
+        _consume(buf, inbuf, line_len + STREAM_RANGE_ARGS_SIZE);
+        return 1;
+    }
+
+    if (eol == strlen(REQUEST_STREAM_IF) && memcmp(buf, REQUEST_STREAM_IF, eol) == 0) {
+        if (*inbuf < line_len + STREAM_IF_ARGS_SIZE) {
+            return 0;
+        }
+        uint32_t file_index_nbo, checksum_nbo;
+        memcpy(&file_index_nbo, buf + line_len, sizeof(uint32_t));
+        memcpy(&checksum_nbo, buf + line_len + sizeof(uint32_t), sizeof(uint32_t));
+        req->type = REQUEST_TYPE_STREAM_IF;
+        req->file_index = ntohl(file_index_nbo);
+        req->checksum = ntohl(checksum_nbo);
+        req->offset = 0;
+        req->length = STREAM_RANGE_TO_END;
+        _consume(buf, inbuf, line_len + STREAM_IF_ARGS_SIZE);
+        return 1;
+    }
+
+    if (eol == strlen(REQUEST_STREAM_TIER) && memcmp(buf, REQUEST_STREAM_TIER, eol) == 0) {
+        if (*inbuf < line_len + STREAM_TIER_ARGS_SIZE) {
+            return 0;
+        }
+        uint32_t file_index_nbo, tier_nbo;
+        memcpy(&file_index_nbo, buf + line_len, sizeof(uint32_t));
+        memcpy(&tier_nbo, buf + line_len + sizeof(uint32_t), sizeof(uint32_t));
+        req->type = REQUEST_TYPE_STREAM_TIER;
+        req->file_index = ntohl(file_index_nbo);
+        req->tier = ntohl(tier_nbo);
+        req->offset = 0;
+        req->length = STREAM_RANGE_TO_END;
+        _consume(buf, inbuf, line_len + STREAM_TIER_ARGS_SIZE);
+        return 1;
+    }
+
+    if (eol == strlen(REQUEST_STREAM_BATCH) && memcmp(buf, REQUEST_STREAM_BATCH, eol) == 0) {
+        if (*inbuf < line_len + sizeof(uint32_t)) {
+            return 0;
+        }
+        uint32_t num_files_nbo;
+        memcpy(&num_files_nbo, buf + line_len, sizeof(uint32_t));
+        req->type = REQUEST_TYPE_STREAM_BATCH;
+        req->num_files = ntohl(num_files_nbo);
+        // Left for prepare_response to refuse, the indexes would not fit
+        if (req->num_files > STREAM_BATCH_MAX) {
+            _consume(buf, inbuf, line_len + sizeof(uint32_t));
+            return 1;
+        }
+        int args_len = sizeof(uint32_t) * (1 + req->num_files);
+        if (*inbuf < line_len + args_len) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < req->num_files; i++) {
+            uint32_t file_index_nbo;
+            memcpy(&file_index_nbo, buf + line_len + sizeof(uint32_t) * (1 + i),
+                   sizeof(uint32_t));
+            req->batch[i] = ntohl(file_index_nbo);
+        }
+        _consume(buf, inbuf, line_len + args_len);
+        return 1;
+    }
+
+    if (eol >= strlen(REQUEST_HELLO) && eol < HELLO_MESSAGE_SIZE &&
+        memcmp(buf, REQUEST_HELLO, strlen(REQUEST_HELLO)) == 0) {
+        req->type = REQUEST_TYPE_HELLO;
+        memcpy(req->hello, buf, eol);
+        req->hello[eol] = '\0';
+        _consume(buf, inbuf, line_len);
+        return 1;
+    }
+
+    buf[eol] = '\0';
+    ERR_PRINT("Unknown request: %s\n", (char *)buf);
+    req->type = REQUEST_TYPE_UNKNOWN;
+    _consume(buf, inbuf, line_len);
+    return 1;
+}
+
+
+void stream_job_init(StreamJob *job) {
+    memset(job, 0, sizeof(*job));
+    job->fd = -1;
+    job->cache_entry = -1;
+    job->pipefd[0] = job->pipefd[1] = -1;
+    job->ra.fd = -1;
+    job->crc.fd = -1;
+    job->crc.cache_entry = -1;
+    job->crc.done = 1;
+    job->mode = server_config.transfer_mode;
+}
+
+
+/*
+** Helper for: prepare_response, _prepare_batch
+** Open the library file the client names file_number, for the bytes
+** [offset, offset + length) of it, cut short at the end of the file. On a
+** cache hit the body comes from the hot-file cache instead (fd is -1).
+** If if_checksum is not NULL, the client agreed to checksums and the file's
+** checksum is *if_checksum, there is no body at all, only a
+** STREAM_SIZE_NOT_MODIFIED head.
+** Unless tier is TIER_ORIGINAL, the file's rendition at tier is opened
+** instead, if it has one.
+**
+** returns 0 on success, -1 on error
+*/
+static int _open_stream_file(const ClientSocket *client, const Library *library,
+                             uint32_t file_number, uint64_t offset, uint64_t length,
+                             const uint32_t *if_checksum, uint32_t tier, BatchFile *file) {
+    file->fd = -1;
+    file->cache_entry = -1;
+    file->trailer = 0;
+    file->encoded = 0;
+
+    int64_t file_index = library_file_index(library, client->ids, file_number);
+    if (file_index < 0) {
+        ERR_PRINT("File %s %u out of range\n", client->ids ? "ID" : "index", file_number);
+        return -1;
+    }
+
+    char *file_to_open = _join_path(library->path, library->files[file_index]);
+    if (file_to_open == NULL) {
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Opening file %s\n", file_to_open);
+    #endif
+    file->fd = open(file_to_open, O_RDONLY);
+    if (file->fd < 0) {
+        perror("prepare_response: open");
+        free(file_to_open);
+        return -1;
+    }
+
+    struct stat *st = &file->st;
+    if (fstat(file->fd, st) < 0) {
+        perror("prepare_response: fstat");
+        free(file_to_open);
+        close(file->fd);
+        return -1;
+    }
+
+    // The rendition is sent in place of the file, if there is one
+    int rendition_fd = tier_open(file->fd, st, &file_to_open, tier);
+    if (rendition_fd >= 0) {
+        close(file->fd);
+        file->fd = rendition_fd;
+    }
+
+    // Nothing to send if the client's copy is this file (only a client that
+    // agreed to checksums knows STREAM_SIZE_NOT_MODIFIED). A file still being
+    // written is never up to date, one not hashed yet is sent meanwhile.
+    uint32_t checksum;
+    if (if_checksum != NULL && client->checksums && !is_being_written(st) &&
+        file_checksum_nowait(file->fd, st, &checksum) == 0 &&
+        checksum == *if_checksum) {
+        #ifdef DEBUG
+        printf("Client's copy of %s is up to date\n", file_to_open);
+        #endif
+        free(file_to_open);
+        close(file->fd);
+        file->fd = -1;
+        file->size = 0;
+        file->rate = 0;
+        file->head_len = encode_stream_size(client->protocol_version,
+                                            STREAM_SIZE_NOT_MODIFIED, file->head);
+        return 0;
+    }
+
+    // The range is cut short at the end of the file
+    file->size = 0;
+    if (offset < st->st_size) {
+        file->size = MIN(length, st->st_size - offset);
+    }
+    file->trailer = client->trailer;
+    file->rate = server_config.pace ? pace_rate(file_to_open, file->fd) : 0;
+    file->head_len = encode_stream_size(client->protocol_version, file->size, file->head);
+    if (file->head_len == 0) {
+        ERR_PRINT("Range too large for protocol version %d\n", client->protocol_version);
+        free(file_to_open);
+        close(file->fd);
+        return -1;
+    }
+
+    // A whole WAV file goes out encoded if the client takes that
+    if (client->pcm && offset == 0 && length == STREAM_RANGE_TO_END &&
+        pcm_probe(file->fd, st->st_size, &file->pcm) == 0) {
+        file->encoded = 1;
+        file->head_len = encode_stream_size(client->protocol_version, STREAM_SIZE_ENCODED,
+                                            file->head);
+        file->head_len += encode_stream_size(client->protocol_version, file->size,
+                                             file->head + file->head_len);
+    }
+
+    // Served from shared memory on a cache hit, the file is not needed then
+    if (cache_enabled()) {
+        file->cache_entry = cache_acquire(file_to_open, file->fd, st);
+        if (file->cache_entry >= 0) {
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+    free(file_to_open);
+    return 0;
+}
+
+
+/*
+** Helper for: prepare_response, _next_batched_file
+** Follow the body of file the job has just taken over, from offset, if a
+** trailer is to be sent after it.
+*/
+static void _start_trailer(StreamJob *job, const BatchFile *file, off_t offset) {
+    job->tail_len = file->trailer ? TRAILER_SIZE : 0;
+    job->tail_sent = 0;
+    if (file->trailer && file->encoded) {
+        // Hashed from the blocks as they are read
+        body_crc_start(&job->crc, -1, -1, offset, file->size);
+    } else if (file->trailer) {
+        body_crc_start(&job->crc, job->fd, job->cache_entry, offset, file->size);
+    }
+}
+
+
+/*
+** Helper for: prepare_response, _next_batched_file
+** Send the body of file the job has just taken over in transport encoding,
+** if it is to be.
+*/
+static void _start_encoding(StreamJob *job, const BatchFile *file) {
+    job->encoded = file->encoded;
+    job->pcm = file->pcm;
+    job->frame_len = 0;
+    job->frame_sent = 0;
+}
+
+
+/*
+** Helper for: _prepare_batch, stream_job_send
+** Make the next file of a batch the one being sent, and start reading in the
+** one after it.
+*/
+static void _next_batched_file(StreamJob *job) {
+    readahead_stop(&job->ra, job->offset);
+    body_crc_stop(&job->crc);
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    if (job->cache_entry >= 0) {
+        cache_release(job->cache_entry);
+    }
+
+    BatchFile *file = &job->batch[job->next_batched++];
+    memcpy(job->inline_head, file->head, file->head_len);
+    job->head = job->inline_head;
+    job->head_len = file->head_len;
+    job->head_sent = 0;
+    job->fd = file->fd;
+    job->cache_entry = file->cache_entry;
+    if (job->cache_entry >= 0) {
+        cache_cursor_start(&job->cursor, job->cache_entry);
+    }
+    job->offset = 0;
+    job->remaining = file->size;
+    pace_start(&job->bucket, file->rate);
+    readahead_start(&job->ra, job->fd, 0, job->remaining);
+    _start_encoding(job, file);
+    _start_trailer(job, file, 0);
+    // The job owns them now
+    file->fd = -1;
+    file->cache_entry = -1;
+
+    if (job->next_batched < job->num_batched && job->batch[job->next_batched].fd >= 0) {
+        posix_fadvise(job->batch[job->next_batched].fd, 0, STREAM_BATCH_READAHEAD,
+                      POSIX_FADV_WILLNEED);
+    }
+}
+
+
+/*
+** Helper for: prepare_response
+** Open every file of a STREAMBATCH, so the batch is refused as a whole if
+** one of them is missing, and start on the first.
+**
+** returns 0 on success, -1 on error (job is left empty)
+*/
+static int _prepare_batch(const Request *req, ClientSocket *client, const Library *library,
+                          StreamJob *job) {
+    if (req->num_files > STREAM_BATCH_MAX) {
+        ERR_PRINT("STREAMBATCH of %u files, at most %d are allowed\n",
+                  req->num_files, STREAM_BATCH_MAX);
+        return -1;
+    }
+    if (req->num_files == 0) {
+        return 0;
+    }
+    job->batch = (BatchFile *)malloc(req->num_files * sizeof(BatchFile));
+    if (job->batch == NULL) {
+        perror("prepare_response: malloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < req->num_files; i++) {
+        if (_open_stream_file(client, library, req->batch[i], 0, STREAM_RANGE_TO_END,
+                              NULL, TIER_ORIGINAL, &job->batch[i]) < 0) {
+            stream_job_free(job);
+            return -1;
+        }
+        job->num_batched++;
+    }
+
+    _next_batched_file(job);
+    return 0;
+}
+
+
+int prepare_response(const Request *req, ClientSocket *client, const Library *library,
+                     StreamJob *job) {
+    stream_job_init(job);
+
+    if (req->type == REQUEST_TYPE_LIST) {
+        // Still valid once a rescan has moved the library on
+        if (library->list_payload != NULL) {
+            job->payload = list_payload_acquire(library->list_payload);
+            job->head = (uint8_t *)job->payload->data + job->payload->list_offset;
+            job->head_len = job->payload->list_len;
+        }
+        return 0;
+    }
+
+    if (req->type == REQUEST_TYPE_LIST_SINCE) {
+        job->payload = list_since_payload(client, library, req->generation);
+        if (job->payload == NULL) {
+            return -1;
+        }
+        job->head = (uint8_t *)job->payload->data;
+        job->head_len = job->payload->len;
+        return 0;
+    }
+
+    if (req->type == REQUEST_TYPE_HELLO) {
+        int reply_len = negotiate_protocol(client, req->hello, (char *)job->inline_head);
+        if (reply_len < 0) {
+            ERR_PRINT("Malformed HELLO request: %s\n", req->hello);
+            return 0;
+        }
+        job->head = job->inline_head;
+        job->head_len = reply_len;
+        return 0;
+    }
+
+    if (req->type == REQUEST_TYPE_STREAM_BATCH) {
+        return _prepare_batch(req, client, library, job);
+    }
+
+    if (req->type != REQUEST_TYPE_STREAM && req->type != REQUEST_TYPE_STREAM_RANGE &&
+        req->type != REQUEST_TYPE_STREAM_IF && req->type != REQUEST_TYPE_STREAM_TIER) {
+        return 0;
+    }
+
+    BatchFile file;
+    const uint32_t *if_checksum = req->type == REQUEST_TYPE_STREAM_IF ? &req->checksum : NULL;
+    uint32_t tier = req->type == REQUEST_TYPE_STREAM_TIER ? req->tier : TIER_ORIGINAL;
+    if (tier > TIER_COUNT) {
+        ERR_PRINT("STREAMTIER of tier %u, there are %d\n", tier, TIER_COUNT);
+        return -1;
+    }
+    if (_open_stream_file(client, library, req->file_index, req->offset, req->length,
+                          if_checksum, tier, &file) < 0) {
+        return -1;
+    }
+    memcpy(job->inline_head, file.head, file.head_len);
+    job->head = job->inline_head;
+    job->head_len = file.head_len;
+    job->fd = file.fd;
+    job->cache_entry = file.cache_entry;
+    if (job->cache_entry >= 0) {
+        cache_cursor_start(&job->cursor, job->cache_entry);
+    }
+    job->offset = req->offset;
+    job->remaining = file.size;
+    pace_start(&job->bucket, file.rate);
+    readahead_start(&job->ra, job->fd, job->offset, job->remaining);
+    _start_encoding(job, &file);
+    _start_trailer(job, &file, job->offset);
+    return 0;
+}
+
+
+/*
+** Helpers for: stream_job_send
+** Each sends at most max_bytes of the body and returns the number of bytes
+** sent, 0 if the socket would block, or -1 on error. A mode the kernel refuses
+** for this file is downgraded before anything is sent with it.
+*/
+static ssize_t _send_body_copy(StreamJob *job, int sockfd, size_t max_bytes) {
+    uint8_t file_buffer[STREAM_CHUNK_SIZE];
+    size_t to_read = MIN(MIN(max_bytes, job->remaining), STREAM_CHUNK_SIZE);
+
+    ssize_t bytes_read = pread(job->fd, file_buffer, to_read, job->offset);
+    if (bytes_read <= 0) {
+        ERR_PRINT("stream_job_send: file ended early\n");
+        return -1;
+    }
+
+    // Whatever is not accepted now is simply read again next time
+    ssize_t sent = send(sockfd, file_buffer, bytes_read, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    body_crc_update(&job->crc, file_buffer, sent);
+    job->offset += sent;
+    job->remaining -= sent;
+    return sent;
+}
+
+
+static ssize_t _send_body_cache(StreamJob *job, int sockfd, size_t max_bytes) {
+    size_t len;
+    const uint8_t *data = cache_data(&job->cursor, job->offset, &len);
+    if (data == NULL) {
+        ERR_PRINT("stream_job_send: cache entry ended early\n");
+        return -1;
+    }
+
+    ssize_t sent = send(sockfd, data, MIN(MIN(len, max_bytes), job->remaining),
+                        MSG_NOSIGNAL);
+    if (sent < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    job->offset += sent;
+    job->remaining -= sent;
+    return sent;
+}
+
+
+static ssize_t _send_body_sendfile(StreamJob *job, int sockfd, size_t max_bytes) {
+    ssize_t sent = sendfile(sockfd, job->fd, &job->offset, MIN(max_bytes, job->remaining));
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            job->mode = TRANSFER_SPLICE;
+            return 0;
+        }
+        return -1;
+    }
+    if (sent == 0) {
+        ERR_PRINT("stream_job_send: file ended early\n");
+        return -1;
+    }
+    job->remaining -= sent;
+    return sent;
+}
+
+
+static ssize_t _send_body_splice(StreamJob *job, int sockfd, size_t max_bytes) {
+    if (job->pipefd[0] < 0 && pipe(job->pipefd) < 0) {
+        perror("stream_job_send: pipe");
+        return -1;
+    }
+
+    if (job->in_pipe == 0) {
+        ssize_t in_pipe = splice(job->fd, &job->offset, job->pipefd[1], NULL,
+                                 MIN(max_bytes, job->remaining), SPLICE_F_MOVE);
+        if (in_pipe < 0) {
+            if (errno == EINVAL || errno == ENOSYS) {
+                job->mode = TRANSFER_COPY;
+                return 0;
+            }
+            return errno == EINTR ? 0 : -1;
+        }
+        if (in_pipe == 0) {
+            ERR_PRINT("stream_job_send: file ended early\n");
+            return -1;
+        }
+        job->in_pipe = in_pipe;
+        job->remaining -= in_pipe;
+    }
+
+    ssize_t sent = splice(job->pipefd[0], NULL, sockfd, NULL, job->in_pipe,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (sent < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    job->in_pipe -= sent;
+    return sent;
+}
+
+
+/*
+** Helper for: _send_body_encoded
+** Read the len bytes of the body at the job's offset into block.
+**
+** returns 0 on success, -1 on error
+*/
+static int _read_block(StreamJob *job, uint8_t *block, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (job->cache_entry >= 0) {
+            size_t contiguous;
+            const uint8_t *data = cache_data(&job->cursor, job->offset + done, &contiguous);
+            if (data == NULL) {
+                ERR_PRINT("stream_job_send: cache entry ended early\n");
+                return -1;
+            }
+            contiguous = MIN(contiguous, len - done);
+            memcpy(block + done, data, contiguous);
+            done += contiguous;
+            continue;
+        }
+        ssize_t bytes_read = pread(job->fd, block + done, len - done, job->offset + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            ERR_PRINT("stream_job_send: file ended early\n");
+            return -1;
+        }
+        done += bytes_read;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: stream_job_send
+** Send at most max_bytes of the encoded body, encoding the next block first
+** if the last frame has gone and the bucket allows it.
+**
+** returns the number of bytes sent, 0 if the socket would block or pacing
+** holds the body back, -1 on error
+*/
+static ssize_t _send_body_encoded(StreamJob *job, int sockfd, size_t max_bytes) {
+    if (job->frame_sent == job->frame_len) {
+        int samples;
+        size_t len = pcm_block(&job->pcm, job->offset, &samples);
+        // Tokens may run short, the bucket makes up for it on the next block
+        if (pace_allowance(&job->bucket, len) == 0) {
+            return 0;
+        }
+        if (job->block == NULL) {
+            job->block = (uint8_t *)malloc(PCM_BLOCK_MAX + 2 * sizeof(uint32_t) + PCM_FRAME_MAX);
+            if (job->block == NULL) {
+                perror("stream_job_send: malloc");
+                return -1;
+            }
+        }
+        if (_read_block(job, job->block, len) < 0) {
+            return -1;
+        }
+
+        uint8_t *frame = job->block + PCM_BLOCK_MAX;
+        uint32_t frame_len = pcm_encode(&job->pcm, job->block, len, samples,
+                                        frame + sizeof(uint32_t));
+        uint32_t frame_len_nbo = htonl(frame_len);
+        memcpy(frame, &frame_len_nbo, sizeof(uint32_t));
+        job->frame_len = sizeof(uint32_t) + frame_len;
+        job->frame_sent = 0;
+        body_crc_update(&job->crc, job->block, len);
+        pace_consume(&job->bucket, len);
+        job->offset += len;
+        job->remaining -= len;
+        readahead_advance(&job->ra, job->offset);
+        // The closing empty frame goes with the last one
+        if (job->remaining == 0) {
+            memset(frame + job->frame_len, 0, sizeof(uint32_t));
+            job->frame_len += sizeof(uint32_t);
+        }
+    }
+
+    const uint8_t *frame = job->block + PCM_BLOCK_MAX;
+    int more = job->remaining > 0 || job->tail_len > 0;
+    ssize_t sent = send(sockfd, frame + job->frame_sent,
+                        MIN(job->frame_len - job->frame_sent, max_bytes),
+                        MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (sent < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    job->frame_sent += sent;
+    return sent;
+}
+
+
+ssize_t stream_job_send(StreamJob *job, int sockfd, size_t max_bytes) {
+    size_t total = 0;
+
+    while (total < max_bytes && !stream_job_done(job)) {
+        ssize_t sent;
+        int body_sent = job->remaining == 0 && job->in_pipe == 0 &&
+                        job->frame_sent == job->frame_len;
+        if (job->head_sent == job->head_len && body_sent && job->tail_sent == job->tail_len) {
+            _next_batched_file(job);
+            continue;
+        }
+        if (job->head_sent < job->head_len) {
+            // A size header leaves in the same segment as the body
+            int more = job->remaining > 0 || job->tail_len > 0;
+            sent = send(sockfd, job->head + job->head_sent,
+                        MIN(job->head_len - job->head_sent, max_bytes - total),
+                        MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                perror("stream_job_send: send");
+                return -1;
+            }
+            job->head_sent += sent;
+        } else if (body_sent) {
+            // Only the trailer is left
+            if (job->tail_sent == 0) {
+                body_crc_finish(&job->crc, job->tail);
+            }
+            sent = send(sockfd, job->tail + job->tail_sent,
+                        MIN(job->tail_len - job->tail_sent, max_bytes - total), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                perror("stream_job_send: send");
+                return -1;
+            }
+            job->tail_sent += sent;
+        } else if (job->encoded) {
+            sent = _send_body_encoded(job, sockfd, max_bytes - total);
+            if (sent < 0) {
+                perror("stream_job_send");
+                return -1;
+            }
+            // Either the socket is full or pacing holds the next block back
+            if (sent == 0) {
+                break;
+            }
+        } else {
+            TransferMode mode = job->mode;
+            size_t allowed = max_bytes - total;
+            // Bytes already in the pipe have to leave through it, and were
+            // paid for when they went in
+            if (job->in_pipe > 0) {
+                mode = TRANSFER_SPLICE;
+            } else {
+                allowed = pace_allowance(&job->bucket, MIN(allowed, job->remaining));
+                if (allowed == 0) {
+                    break;
+                }
+            }
+            uint64_t remaining = job->remaining;
+            if (job->cache_entry >= 0) {
+                sent = _send_body_cache(job, sockfd, allowed);
+            } else if (mode == TRANSFER_SENDFILE) {
+                sent = _send_body_sendfile(job, sockfd, allowed);
+            } else if (mode == TRANSFER_SPLICE) {
+                sent = _send_body_splice(job, sockfd, allowed);
+            } else {
+                sent = _send_body_copy(job, sockfd, allowed);
+            }
+            if (sent < 0) {
+                perror("stream_job_send");
+                return -1;
+            }
+            pace_consume(&job->bucket, remaining - job->remaining);
+            readahead_advance(&job->ra, job->offset);
+            body_crc_advance(&job->crc, job->offset);
+            // Either the socket is full or the mode was just downgraded
+            if (sent == 0) {
+                if (job->mode != mode) {
+                    continue;
+                }
+                break;
+            }
+        }
+        total += sent;
+    }
+
+    return total;
+}
+
+
+uint64_t stream_job_pace_delay(StreamJob *job) {
+    if (job->head_sent < job->head_len || job->in_pipe > 0 || job->remaining == 0 ||
+        job->frame_sent < job->frame_len) {
+        return 0;
+    }
+    return pace_delay_ns(&job->bucket, job->remaining);
+}
+
+
+int stream_job_done(const StreamJob *job) {
+    return job->head_sent == job->head_len && job->remaining == 0 && job->in_pipe == 0 &&
+           job->frame_sent == job->frame_len && job->tail_sent == job->tail_len &&
+           job->next_batched == job->num_batched;
+}
+
+
+void stream_job_free(StreamJob *job) {
+    if (job->payload != NULL) {
+        list_payload_release(job->payload);
+    }
+    readahead_stop(&job->ra, job->offset);
+    body_crc_stop(&job->crc);
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    if (job->cache_entry >= 0) {
+        cache_release(job->cache_entry);
+    }
+    if (job->pipefd[0] >= 0) {
+        close(job->pipefd[0]);
+        close(job->pipefd[1]);
+    }
+    // Batched files that were never sent
+    for (uint32_t i = job->next_batched; i < job->num_batched; i++) {
+        if (job->batch[i].fd >= 0) {
+            close(job->batch[i].fd);
+        }
+        if (job->batch[i].cache_entry >= 0) {
+            cache_release(job->batch[i].cache_entry);
+        }
+    }
+    free(job->batch);
+    free(job->block);
+    stream_job_init(job);
+}
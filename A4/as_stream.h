@@ -0,0 +1,228 @@
+#ifndef AS_STREAM_H_
+#define AS_STREAM_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_readahead.h"
+
+/*
+** Design
+** ------
+** The blocking server (handle_client) reads a request and writes the whole
+** response before looking at the socket again. The event-driven engines
+** cannot block, so a response is instead described by a StreamJob that can be
+** advanced a little at a time whenever the client socket is writable.
+**
+** A request is parsed out of a connection's request buffer only once all of
+** its bytes have arrived (the request line and any binary arguments), so a
+** partially received request is simply left in the buffer.
+**
+** A response is made of two parts, sent in order:
+**   - head: bytes held in memory (the STREAM size header, a LIST or LISTSINCE
+**           payload, a HELLO reply)
+**   - body: a byte range of an open library file, or of its copy in the
+**           hot-file cache
+** With pacing on, a body goes no faster than its file's token bucket allows
+** (see as_pace.h), and stream_job_pace_delay tells when more may be sent.
+** A body sent from a library file is read ahead of the cursor (see
+** as_readahead.h).
+**
+** A STREAMIF whose copy is up to date is answered with a head alone, and a
+** STREAMTIER like a STREAM of the file's rendition (see as_tier.h).
+**
+** For a client that agreed to PROTOCOL_FEATURE_TRAILER, a body is followed
+** by a tail: its CRC32C, hashed as the body goes out (see as_trailer.h).
+**
+** For a client that agreed to PROTOCOL_FEATURE_PCM, the body of a whole WAV
+** file is sent in transport encoding instead (see as_pcm.h): the head holds
+** the encoded size marker and the file's size, and the body is read a block
+** at a time into memory, whatever the transfer mode, and encoded into a frame
+** that is sent before the next block is read. The bucket is charged for the
+** block, so the file is still paced at its own bitrate.
+**
+** A STREAMBATCH response is several of these in a row: every file is opened
+** when the request is parsed, and the job moves on to the next one (its size
+** header, then its body) when the current one has been sent.
+*/
+
+
+typedef enum request_type {
+    REQUEST_TYPE_LIST,
+    REQUEST_TYPE_LIST_SINCE,
+    REQUEST_TYPE_STREAM,
+    REQUEST_TYPE_STREAM_RANGE,
+    REQUEST_TYPE_STREAM_BATCH,
+    REQUEST_TYPE_STREAM_IF,
+    REQUEST_TYPE_STREAM_TIER,
+    REQUEST_TYPE_HELLO,
+    REQUEST_TYPE_UNKNOWN,
+} RequestType;
+
+
+/*
+** file_index: the file a stream request asks for, its ID if the client uses
+** PROTOCOL_FEATURE_IDS.
+** offset, length: the byte range of a REQUEST_TYPE_STREAM_RANGE, a plain
+** STREAM (or STREAMIF, STREAMTIER) asks for 0 and STREAM_RANGE_TO_END.
+** checksum: the CRC32C of the client's copy, for a REQUEST_TYPE_STREAM_IF.
+** tier: the tier a REQUEST_TYPE_STREAM_TIER asks for.
+** generation: the generation a REQUEST_TYPE_LIST_SINCE client knows.
+** num_files, batch: the files a REQUEST_TYPE_STREAM_BATCH asks for, like
+** file_index. num_files may be over STREAM_BATCH_MAX, the request is then
+** refused by prepare_response.
+** hello: the request line of a REQUEST_TYPE_HELLO, see negotiate_protocol.
+*/
+typedef struct request {
+    RequestType type;
+    uint32_t file_index;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t checksum;
+    uint32_t tier;
+    uint64_t generation;
+    uint32_t num_files;
+    uint32_t batch[STREAM_BATCH_MAX];
+    char hello[HELLO_MESSAGE_SIZE];
+} Request;
+
+
+#define STREAM_JOB_INLINE_HEAD HELLO_MESSAGE_SIZE
+
+/*
+** A file of a STREAMBATCH response waiting for its turn: its size header, and
+** the body to send after it (see StreamJob), then its trailer if trailer is
+** set. st is the file's status when it was opened. The body is sent in
+** transport encoding if encoded is set, pcm is the file's format then.
+*/
+typedef struct batch_file {
+    uint8_t head[2 * sizeof(uint64_t)];
+    size_t head_len;
+    int fd;
+    int cache_entry;
+    uint64_t size;
+    uint64_t rate;
+    struct stat st;
+    uint8_t trailer;
+    uint8_t encoded;
+    PcmFormat pcm;
+} BatchFile;
+
+/*
+** head: bytes to send before the body, in inline_head or payload.
+** payload: LIST payload referenced by head, or NULL.
+** head_len, head_sent: size of head and how much of it has been sent.
+** fd: library file the body is read from, -1 if there is no body.
+** cache_entry, cursor: hot-file cache entry the body is read from instead,
+** or -1, and where in it the body is.
+** offset: position in fd of the next body byte to send.
+** remaining: number of body bytes left to send.
+** mode: transfer mode for the body, downgraded if the kernel refuses it.
+** bucket: paces the body, its rate is 0 unless pacing is on.
+** ra: reads fd ahead of offset.
+** pipefd, in_pipe: pipe used by TRANSFER_SPLICE and the bytes still in it.
+** encoded, pcm: the body is sent in transport encoding, the file's format.
+** block: where a block of the body is read, and its frame (behind its length)
+** encoded, allocated with the first block.
+** frame_len, frame_sent: size of the frame and how much of it has been sent.
+** offset and remaining move on by a whole block once its frame is ready.
+** crc: follows the body for its trailer.
+** tail, tail_len, tail_sent: the trailer to send after the body (tail_len is
+** 0 without one), filled in once the body has gone, and how much of it has
+** been sent.
+** batch, num_batched, next_batched: the files of a STREAMBATCH, those from
+** next_batched on are still to be sent after the current one.
+*/
+typedef struct stream_job {
+    uint8_t *head;
+    size_t head_len;
+    size_t head_sent;
+    uint8_t inline_head[STREAM_JOB_INLINE_HEAD];
+    ListPayload *payload;
+
+    int fd;
+    int cache_entry;
+    CacheCursor cursor;
+    off_t offset;
+    uint64_t remaining;
+
+    TransferMode mode;
+    TokenBucket bucket;
+    Readahead ra;
+    int pipefd[2];
+    size_t in_pipe;
+
+    uint8_t encoded;
+    PcmFormat pcm;
+    uint8_t *block;
+    size_t frame_len;
+    size_t frame_sent;
+
+    BodyCrc crc;
+    uint8_t tail[TRAILER_SIZE];
+    size_t tail_len;
+    size_t tail_sent;
+
+    BatchFile *batch;
+    uint32_t num_batched;
+    uint32_t next_batched;
+} StreamJob;
+
+
+/*
+** Reset job to empty: nothing to send, nothing held.
+*/
+void stream_job_init(StreamJob *job);
+
+/*
+** Parse the first request in buf, which holds *inbuf bytes. If it is complete
+** its bytes are removed from buf, *inbuf is updated, and req is filled in.
+**
+** Unknown request lines are consumed and reported as REQUEST_TYPE_UNKNOWN.
+**
+** returns 1 if a request was parsed, 0 if more bytes are needed
+*/
+int parse_request(uint8_t *buf, int *inbuf, Request *req);
+
+/*
+** Build the StreamJob answering req from client, in the protocol version the
+** client negotiated, from the library. A HELLO request settles that version.
+** The job owns any file descriptor or memory it needs, and must be released
+** with stream_job_free.
+**
+** The event-driven engines always know the final size of a file when they
+** start sending it, so they never use chunked framing.
+**
+** returns 0 on success, -1 on error (job is left empty)
+*/
+int prepare_response(const Request *req, ClientSocket *client, const Library *library,
+                     StreamJob *job);
+
+/*
+** Send at most max_bytes of the job to sockfd without blocking, using
+** server_config.transfer_mode for the body, and no more of the body than its
+** token bucket allows. Partial progress is remembered in the job, so it can
+** be called again once the socket is writable (or pacing lets it go on).
+**
+** returns the number of bytes sent (0 if the socket would block), -1 on error
+*/
+ssize_t stream_job_send(StreamJob *job, int sockfd, size_t max_bytes);
+
+/*
+** returns the nanoseconds until the paced body of the job may go on, 0 if
+** it is not held back by pacing
+*/
+uint64_t stream_job_pace_delay(StreamJob *job);
+
+/*
+** returns 1 if every byte of the job has been sent, 0 otherwise
+*/
+int stream_job_done(const StreamJob *job);
+
+/*
+** Release everything held by the job and reset it to empty.
+*/
+void stream_job_free(StreamJob *job);
+
+#endif // AS_STREAM_H_
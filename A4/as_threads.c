@@ -0,0 +1,502 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_threads.h"
+
+#include <signal.h>
+#include <time.h>
+
+// Tags for the epoll entries that are not client connections
+static int listen_tag;
+static int stdin_tag;
+static int library_tag;
+static int pace_tag;
+
+
+typedef struct worker_args {
+    ThreadPool *pool;
+    int id;
+} WorkerArgs;
+
+
+static int _deque_init(JobDeque *deque) {
+    deque->jobs = (PoolJob *)malloc(JOB_DEQUE_INITIAL_CAPACITY * sizeof(PoolJob));
+    if (deque->jobs == NULL) {
+        perror("_deque_init");
+        return -1;
+    }
+    deque->head = 0;
+    deque->count = 0;
+    deque->capacity = JOB_DEQUE_INITIAL_CAPACITY;
+    pthread_mutex_init(&deque->lock, NULL);
+    return 0;
+}
+
+
+static void _deque_destroy(JobDeque *deque) {
+    free(deque->jobs);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+
+static int _deque_push_back(JobDeque *deque, PoolJob job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        // Unwrap the ring into a buffer twice the size
+        PoolJob *jobs = (PoolJob *)malloc(2 * deque->capacity * sizeof(PoolJob));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            perror("_deque_push_back");
+            return -1;
+        }
+        for (int i = 0; i < deque->count; i++) {
+            jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+    deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+
+static int _deque_pop_front(JobDeque *deque, PoolJob *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+
+static int _deque_pop_back(JobDeque *deque, PoolJob *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        *job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+
+/*
+** Queue a job on worker's deque and wake up a sleeping worker.
+** returns 0 on success, -1 on error
+*/
+static int _submit_job(ThreadPool *pool, int worker, PoolJob job) {
+    if (_deque_push_back(&pool->deques[worker], job) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+
+/*
+** Take the next job for worker id: from the front of its own deque, else
+** stolen from the back of another worker's deque, else wait for one.
+** returns 1 with a job, 0 when the pool is stopping
+*/
+static int _take_job(ThreadPool *pool, int id, PoolJob *job) {
+    while (1) {
+        int found = _deque_pop_front(&pool->deques[id], job);
+        for (int i = 1; !found && i < pool->num_workers; i++) {
+            found = _deque_pop_back(&pool->deques[(id + i) % pool->num_workers], job);
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        if (found) {
+            pool->pending--;
+            pthread_mutex_unlock(&pool->idle_lock);
+            return 1;
+        }
+        while (pool->pending == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work_available, &pool->idle_lock);
+        }
+        uint8_t stop = pool->stop;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (stop) {
+            return 0;
+        }
+    }
+}
+
+
+static int _watch(int epfd, int op, int fd, void *tag, uint32_t events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = tag;
+    return epoll_ctl(epfd, op, fd, &event);
+}
+
+
+/*
+** Hand the connection back to epoll, waiting for whichever event it needs.
+** returns 0 on success, -1 on error
+*/
+static int _rearm(ThreadPool *pool, Connection *conn) {
+    uint32_t events = EPOLLONESHOT | (conn->sending ? EPOLLOUT : EPOLLIN);
+    int result = _watch(pool->epfd, EPOLL_CTL_MOD, conn->client.socket, conn, events);
+    // Connections go to a worker before they are ever registered
+    if (result < 0 && errno == ENOENT) {
+        result = _watch(pool->epfd, EPOLL_CTL_ADD, conn->client.socket, conn, events);
+    }
+    if (result < 0) {
+        perror("run_thread_pool: epoll_ctl");
+    }
+    return result;
+}
+
+
+static void _forget_connection(ThreadPool *pool, Connection *conn) {
+    pthread_mutex_lock(&pool->connections_lock);
+    for (int i = 0; i < pool->num_connections; i++) {
+        if (pool->connections[i] == conn) {
+            for (int j = i; j < pool->num_connections - 1; j++) {
+                pool->connections[j] = pool->connections[j + 1];
+            }
+            pool->num_connections--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->connections_lock);
+}
+
+
+static void *_worker(void *arg) {
+    ThreadPool *pool = ((WorkerArgs *)arg)->pool;
+    int id = ((WorkerArgs *)arg)->id;
+    free(arg);
+
+    PoolJob job;
+    while (_take_job(pool, id, &job)) {
+        uint64_t budget = sched_grant(&job.conn->flow);
+        pthread_rwlock_rdlock(&pool->library_lock);
+        int result = connection_process(job.conn, job.events, pool->library, budget);
+        pthread_rwlock_unlock(&pool->library_lock);
+        if (result != 1) {
+            sched_idle(&job.conn->flow);
+        }
+
+        if (result == 1) {
+            // Deficit used up, let the jobs queued behind it have a turn
+            job.events = EPOLLOUT;
+            if (_submit_job(pool, id, job) == 0) {
+                continue;
+            }
+        } else if (result == 0 && _rearm(pool, job.conn) == 0) {
+            continue;
+        } else if (result == 2) {
+            // The main thread queues it again once it may resume
+            pthread_mutex_lock(&pool->connections_lock);
+            job.conn->paced = 1;
+            pthread_mutex_unlock(&pool->connections_lock);
+            uint64_t one = 1;
+            if (write(pool->pace_wake, &one, sizeof(one)) == sizeof(one)) {
+                continue;
+            }
+            perror("run_thread_pool: write");
+        }
+        _forget_connection(pool, job.conn);
+        connection_close(job.conn);
+    }
+    return NULL;
+}
+
+
+static int _pool_init(ThreadPool *pool, int listenfd, Library *library) {
+    memset(pool, 0, sizeof(*pool));
+    pool->library = library;
+    pool->num_workers = server_config.num_workers;
+    if (pool->num_workers <= 0) {
+        pool->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (pool->num_workers <= 0) {
+            pool->num_workers = 1;
+        }
+    }
+
+    pool->epfd = epoll_create1(0);
+    if (pool->epfd < 0) {
+        perror("run_thread_pool: epoll_create1");
+        return -1;
+    }
+    pool->pace_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    if (pool->pace_wake < 0 || flags < 0 ||
+        fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        _watch(pool->epfd, EPOLL_CTL_ADD, listenfd, &listen_tag, EPOLLIN) < 0 ||
+        // A stdin that cannot be polled (/dev/null, a regular file) is not
+        // watched, the server then only stops on a signal
+        (_watch(pool->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &stdin_tag, EPOLLIN) < 0 &&
+         errno != EPERM) ||
+        _watch(pool->epfd, EPOLL_CTL_ADD, pool->pace_wake, &pace_tag, EPOLLIN) < 0) {
+        perror("run_thread_pool");
+        if (pool->pace_wake >= 0) {
+            close(pool->pace_wake);
+        }
+        close(pool->epfd);
+        return -1;
+    }
+
+    pool->deques = (JobDeque *)calloc(pool->num_workers, sizeof(JobDeque));
+    pool->threads = (pthread_t *)calloc(pool->num_workers, sizeof(pthread_t));
+    if (pool->deques == NULL || pool->threads == NULL) {
+        perror("run_thread_pool: calloc");
+        goto pool_error;
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (_deque_init(&pool->deques[i]) < 0) {
+            goto pool_error;
+        }
+    }
+
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_rwlock_init(&pool->library_lock, NULL);
+    pthread_mutex_init(&pool->connections_lock, NULL);
+    return 0;
+
+pool_error:
+    if (pool->deques != NULL) {
+        for (int i = 0; i < pool->num_workers && pool->deques[i].jobs != NULL; i++) {
+            _deque_destroy(&pool->deques[i]);
+        }
+    }
+    free(pool->deques);
+    free(pool->threads);
+    close(pool->pace_wake);
+    close(pool->epfd);
+    return -1;
+}
+
+
+/*
+** Stop and join the first num_started workers, then close every connection.
+*/
+static void _pool_shutdown(ThreadPool *pool, int num_started) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i < pool->num_connections; i++) {
+        connection_close(pool->connections[i]);
+    }
+    free(pool->connections);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        _deque_destroy(&pool->deques[i]);
+    }
+    free(pool->deques);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_rwlock_destroy(&pool->library_lock);
+    pthread_mutex_destroy(&pool->connections_lock);
+    close(pool->pace_wake);
+    close(pool->epfd);
+}
+
+
+/*
+** Accept every pending client and queue it on the next worker's deque.
+** returns 0 on success, -1 on error
+*/
+static int _accept_clients(ThreadPool *pool, int listenfd) {
+    ClientSocket client;
+    int accepted;
+    while ((accepted = accept_nonblocking(listenfd, &client)) > 0) {
+        Connection *conn = connection_new(client);
+        if (conn == NULL) {
+            close(client.socket);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->connections_lock);
+        Connection **connections = (Connection **)realloc(pool->connections,
+                                                          (pool->num_connections + 1)
+                                                          * sizeof(Connection *));
+        if (connections != NULL) {
+            pool->connections = connections;
+            pool->connections[pool->num_connections++] = conn;
+        }
+        pthread_mutex_unlock(&pool->connections_lock);
+        if (connections == NULL) {
+            perror("run_thread_pool: realloc");
+            connection_close(conn);
+            return -1;
+        }
+
+        PoolJob job = {conn, EPOLLIN};
+        if (_submit_job(pool, pool->next_deque++ % pool->num_workers, job) < 0) {
+            return -1;
+        }
+    }
+    return accepted;
+}
+
+
+int run_thread_pool(int listenfd, Library *library) {
+    // A client disconnecting mid-stream must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    ThreadPool pool;
+    if (_pool_init(&pool, listenfd, library) < 0) {
+        return -1;
+    }
+    // Before the workers start, nobody else touches the library yet
+    int watch_fd = library_watch(library);
+    if (watch_fd >= 0 && _watch(pool.epfd, EPOLL_CTL_ADD, watch_fd, &library_tag, EPOLLIN) < 0) {
+        perror("run_thread_pool");
+        _pool_shutdown(&pool, 0);
+        return -1;
+    }
+
+    int num_started;
+    for (num_started = 0; num_started < pool.num_workers; num_started++) {
+        WorkerArgs *args = (WorkerArgs *)malloc(sizeof(WorkerArgs));
+        if (args == NULL) {
+            perror("run_thread_pool: malloc");
+            _pool_shutdown(&pool, num_started);
+            return -1;
+        }
+        args->pool = &pool;
+        args->id = num_started;
+        if (pthread_create(&pool.threads[num_started], NULL, _worker, args) != 0) {
+            ERR_PRINT("run_thread_pool: pthread_create failed\n");
+            free(args);
+            _pool_shutdown(&pool, num_started);
+            return -1;
+        }
+    }
+    printf("Started %d worker threads\n", pool.num_workers);
+
+    int result = 0;
+    time_t last_scan = time(NULL);
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        if (time(NULL) - last_scan >= LIBRARY_SCAN_INTERVAL * SELECT_TIMEOUT_SEC) {
+            pthread_rwlock_wrlock(&pool.library_lock);
+            int scanned = library_check(library);
+            pthread_rwlock_unlock(&pool.library_lock);
+            if (scanned < 0) {
+                ERR_PRINT("Error scanning library\n");
+                result = -1;
+                break;
+            }
+            last_scan = time(NULL);
+        }
+
+        // Wake up in time for the first paced connection to go on
+        int timeout_ms = SELECT_TIMEOUT_SEC * 1000;
+        uint64_t now = pace_clock_ns();
+        pthread_mutex_lock(&pool.connections_lock);
+        for (int i = 0; i < pool.num_connections; i++) {
+            timeout_ms = connection_pace_timeout(pool.connections[i], now, timeout_ms);
+        }
+        pthread_mutex_unlock(&pool.connections_lock);
+
+        int num_events = epoll_wait(pool.epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("run_thread_pool: epoll_wait");
+            result = -1;
+            break;
+        }
+
+        uint8_t quit = 0;
+        for (int i = 0; i < num_events; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag) {
+                if (_accept_clients(&pool, listenfd) < 0) {
+                    result = -1;
+                    quit = 1;
+                }
+            } else if (tag == &stdin_tag) {
+                int c = getchar();
+                if (c == 'q') {
+                    quit = 1;
+                } else if (c == 's') {
+                    // The counters are only approximate while workers send
+                    pthread_mutex_lock(&pool.connections_lock);
+                    printf("%d connections\n", pool.num_connections);
+                    for (int j = 0; j < pool.num_connections; j++) {
+                        sched_print_flow(&pool.connections[j]->flow,
+                                         &pool.connections[j]->client.addr);
+                    }
+                    pthread_mutex_unlock(&pool.connections_lock);
+                } else if (c == EOF) {
+                    epoll_ctl(pool.epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                }
+            } else if (tag == &pace_tag) {
+                // Only there to cut epoll_wait short, see below
+                uint64_t count;
+                if (read(pool.pace_wake, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("run_thread_pool: read");
+                }
+            } else if (tag == &library_tag) {
+                pthread_rwlock_wrlock(&pool.library_lock);
+                int updated = library_update(library);
+                pthread_rwlock_unlock(&pool.library_lock);
+                if (updated < 0) {
+                    ERR_PRINT("Error updating library\n");
+                    result = -1;
+                    quit = 1;
+                }
+            } else {
+                PoolJob job = {(Connection *)tag, events[i].events};
+                if (_submit_job(&pool, pool.next_deque++ % pool.num_workers, job) < 0) {
+                    result = -1;
+                    quit = 1;
+                }
+            }
+        }
+        if (quit) {
+            break;
+        }
+
+        // Hand paced connections whose time has come back to the workers
+        now = pace_clock_ns();
+        pthread_mutex_lock(&pool.connections_lock);
+        for (int i = 0; i < pool.num_connections && !quit; i++) {
+            Connection *conn = pool.connections[i];
+            if (connection_may_resume(conn, now)) {
+                conn->paced = 0;
+                PoolJob job = {conn, EPOLLOUT};
+                if (_submit_job(&pool, pool.next_deque++ % pool.num_workers, job) < 0) {
+                    result = -1;
+                    quit = 1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool.connections_lock);
+        if (quit) {
+            break;
+        }
+    }
+
+    _pool_shutdown(&pool, num_started);
+    return result;
+}
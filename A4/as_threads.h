@@ -0,0 +1,102 @@
+#ifndef AS_THREADS_H_
+#define AS_THREADS_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_reactor.h"
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/*
+** Design
+** ------
+** The main thread accepts clients and waits on every client socket with
+** epoll, but it never reads or writes them. Instead, whenever a socket is
+** ready, its Connection is pushed as a job onto the deque of one of the
+** worker threads (round robin), and the worker advances the connection with
+** connection_process (see as_reactor.h).
+**
+** Sockets are registered with EPOLLONESHOT, so a connection is owned either
+** by epoll or by exactly one job at any time.
+**
+** A job only sends what its connection's deficit allows (see as_sched.h)
+** before it is put back at the back of its worker's deque, so a huge file
+** cannot keep a worker from answering the LIST requests queued behind it,
+** and connections share the workers by their weights. The job resumes where it stopped
+** because all the progress (file, offset, remaining bytes) is kept in the
+** connection's StreamJob.
+**
+** Each worker takes jobs from the front of its own deque. A worker with an
+** empty deque steals from the back of another worker's deque before going to
+** sleep, so a burst of jobs on one worker is spread over the idle ones.
+**
+** A connection held back by pacing is not re-armed: the worker marks it
+** paced and pokes the main thread through pace_wake (an eventfd), and the
+** main thread queues it again once it may resume.
+**
+** s + enter on stdin prints the throughput of every connection.
+**
+** The library is shared by every thread. Workers hold library_lock for
+** reading while they process a job, and the main thread holds it for
+** writing while it rescans the library.
+*/
+
+#define JOB_DEQUE_INITIAL_CAPACITY 16
+
+
+typedef struct pool_job {
+    Connection *conn;
+    uint32_t events;
+} PoolJob;
+
+
+/*
+** Growable ring buffer of jobs, protected by its lock.
+** jobs[head] is the front, jobs[(head + count - 1) % capacity] the back.
+*/
+typedef struct job_deque {
+    PoolJob *jobs;
+    int head;
+    int count;
+    int capacity;
+    pthread_mutex_t lock;
+} JobDeque;
+
+
+typedef struct thread_pool {
+    int num_workers;
+    pthread_t *threads;
+    JobDeque *deques;
+    unsigned int next_deque;
+
+    // Idle workers sleep on work_available until pending > 0
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+    int pending;
+    uint8_t stop;
+
+    int epfd;
+    int pace_wake;
+    Library *library;
+    pthread_rwlock_t library_lock;
+
+    // Every open connection, so they can be closed on shutdown (and paced
+    // ones resumed), and their paced flags
+    Connection **connections;
+    int num_connections;
+    pthread_mutex_t connections_lock;
+} ThreadPool;
+
+
+/*
+** Serve library from listenfd with server_config.num_workers worker threads
+** (one per online CPU if 0) until q + enter is typed on stdin. The library is
+** rescanned every LIBRARY_SCAN_INTERVAL * SELECT_TIMEOUT_SEC seconds.
+**
+** returns 0 when asked to quit, -1 on error
+*/
+int run_thread_pool(int listenfd, Library *library);
+
+#endif // AS_THREADS_H_
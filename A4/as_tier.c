@@ -0,0 +1,777 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_tier.h"
+
+#include <math.h>
+#include <time.h>
+
+#define TIER_LANES 4
+// The TIER_SOURCE_CHUNK: the file's size, and its modification time in
+// seconds and nanoseconds, 64-bit each
+#define TIER_SOURCE_SIZE (3 * sizeof(uint64_t))
+// RIFF header, TIER_SOURCE_CHUNK, "fmt " chunk and "data" chunk header
+#define TIER_HEADER_SIZE (12 + 8 + TIER_SOURCE_SIZE + 8 + 16 + 8)
+
+typedef float TierVector __attribute__((vector_size(TIER_LANES * sizeof(float))));
+
+static const Tier tiers[TIER_COUNT] = TIER_TABLE;
+// Set by tier_init, NULL if renditions are off
+static char *tier_directory = NULL;
+
+
+/*
+** phases, step: out_rate / in_rate is phases / step (L / M).
+** taps: the number of filter taps per phase.
+** delay: of the filter, in upsampled samples, skipped so the rendition
+** starts with the file.
+** filter: phases x taps coefficients, each phase's reversed so it lines up
+** with the input samples it is applied to.
+*/
+typedef struct resampler {
+    uint32_t phases;
+    uint32_t step;
+    uint32_t taps;
+    uint64_t delay;
+    float *filter;
+} Resampler;
+
+
+/*
+** Helper for: tier_init, _render_job
+** Create the directory at tier_directory if there is none, and make sure
+** only this user can have put anything in it: no one else could otherwise
+** have renditions of their own sent for the library's files.
+** returns 0 on success, -1 if it is not to be used
+*/
+static int _check_directory(void) {
+    if (mkdir(tier_directory, 0700) < 0 && errno != EEXIST) {
+        perror("tier_init: mkdir");
+        return -1;
+    }
+    struct stat st;
+    if (lstat(tier_directory, &st) < 0) {
+        perror("tier_init: lstat");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 0777) != 0700) {
+        ERR_PRINT("%s must be a directory (not a link) of this user, with mode 0700\n",
+                  tier_directory);
+        return -1;
+    }
+    return 0;
+}
+
+
+int tier_init(const char *directory) {
+    char default_directory[MAX_PATH];
+    if (directory == NULL) {
+        snprintf(default_directory, sizeof(default_directory), TIER_DEFAULT_DIR "-%u",
+                 (unsigned)geteuid());
+        directory = default_directory;
+    }
+    tier_directory = strdup(directory);
+    if (tier_directory == NULL) {
+        perror("tier_init: strdup");
+        return -1;
+    }
+    if (_check_directory() < 0) {
+        ERR_PRINT("Not rendering tiers, files are sent as they are\n");
+        free(tier_directory);
+        tier_directory = NULL;
+        return -1;
+    }
+    printf("Keeping renditions in %s\n", tier_directory);
+    return 0;
+}
+
+
+int tier_list_line(char *buf, size_t size) {
+    int len = snprintf(buf, size, LIST_TIERS);
+    for (int i = 0; i < TIER_COUNT && len >= 0 && (size_t)len < size; i++) {
+        len += snprintf(buf + len, size - len, " %d:%u/%u/%u", i + 1, tiers[i].sample_rate,
+                        tiers[i].bits, tiers[i].channels);
+    }
+    return len >= 0 && (size_t)len < size ? len : -1;
+}
+
+
+static uint32_t _gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+
+/*
+** Helper for: _resampler_init
+** returns the modified Bessel function of the first kind of order 0 at x
+*/
+static double _bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+
+/*
+** Helper for: _render_job
+** Design the filter converting in_rate to out_rate.
+**
+** returns 0 on success, -1 on error
+*/
+static int _resampler_init(Resampler *rs, uint32_t in_rate, uint32_t out_rate) {
+    uint32_t gcd = _gcd(in_rate, out_rate);
+    rs->phases = out_rate / gcd;
+    rs->step = in_rate / gcd;
+    // The filter spans the same number of output samples whatever the ratio
+    rs->taps = TIER_TAPS * ((in_rate + out_rate - 1) / out_rate);
+    uint64_t length = (uint64_t)rs->phases * rs->taps;
+    rs->delay = (length - 1) / 2;
+    rs->filter = (float *)malloc(length * sizeof(float));
+    if (rs->filter == NULL) {
+        perror("tier_rendition: malloc");
+        return -1;
+    }
+
+    // Windowed sinc, in cycles per upsampled sample, with a gain of phases
+    // (all but one in phases upsampled samples are 0)
+    double cutoff = TIER_PASSBAND * MIN(in_rate, out_rate) / 2.0 / ((double)in_rate * rs->phases);
+    // Symmetric about the delay, so the rendition is not shifted by a fraction
+    // of a sample (the last tap is 0 if there is an even number of them)
+    double window_norm = _bessel_i0(TIER_KAISER_BETA);
+    for (uint64_t j = 0; j < length; j++) {
+        double x = (double)j - rs->delay;
+        double sinc = x == 0 ? 1.0 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+        double r = x / rs->delay;
+        double window = r > 1 ? 0 : _bessel_i0(TIER_KAISER_BETA * sqrt(1 - r * r)) / window_norm;
+        uint32_t phase = j % rs->phases;
+        uint64_t tap = j / rs->phases;
+        rs->filter[phase * rs->taps + (rs->taps - 1 - tap)] =
+            rs->phases * 2 * cutoff * sinc * window;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _render
+** returns the dot product of the n (a multiple of TIER_LANES) coefficients
+** with the samples
+*/
+static float _dot(const float *coefficients, const float *samples, uint32_t n) {
+    TierVector sum = {0};
+    for (uint32_t i = 0; i < n; i += TIER_LANES) {
+        TierVector c, x;
+        memcpy(&c, coefficients + i, sizeof(TierVector));
+        memcpy(&x, samples + i, sizeof(TierVector));
+        sum += c * x;
+    }
+    return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+
+/*
+** Helper for: _render
+** Read up to frames sample frames of the file from frame index first into
+** raw, then downmix them into the out_channels rows of samples (as floats
+** in [-1, 1)), stride apart. Past the end of the samples, they are 0.
+**
+** returns 0 on success, -1 on error
+*/
+static int _read_frames(int fd, const PcmFormat *format, uint64_t first, uint32_t frames,
+                        uint8_t *raw, float *samples, size_t stride, int out_channels) {
+    size_t frame_bytes = format->channels * format->bytes_per_sample;
+    uint64_t num_frames = (format->data_end - format->data_offset) / frame_bytes;
+    uint32_t available = first < num_frames ? MIN(frames, num_frames - first) : 0;
+    size_t len = available * frame_bytes;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes_read = pread(fd, raw + done, len - done,
+                                   format->data_offset + first * frame_bytes + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            ERR_PRINT("tier_rendition: file ended early\n");
+            return -1;
+        }
+        done += bytes_read;
+    }
+
+    // Each input channel goes to the output channel it falls to, as a mean
+    float scale = 1.0f / (1 << (8 * format->bytes_per_sample - 1));
+    float shares[PCM_MAX_CHANNELS];
+    for (int channel = 0; channel < format->channels; channel++) {
+        int count = (format->channels - channel % out_channels + out_channels - 1) / out_channels;
+        shares[channel] = scale / count;
+    }
+    for (int out = 0; out < out_channels; out++) {
+        memset(samples + out * stride, 0, frames * sizeof(float));
+    }
+    const uint8_t *p = raw;
+    for (uint32_t i = 0; i < available; i++) {
+        for (int channel = 0; channel < format->channels; channel++, p += format->bytes_per_sample) {
+            int32_t sample;
+            if (format->bytes_per_sample == 1) {
+                sample = (int32_t)p[0] - 128;
+            } else if (format->bytes_per_sample == 2) {
+                sample = (int16_t)(p[0] | p[1] << 8);
+            } else {
+                sample = (int32_t)((uint32_t)(p[0] | p[1] << 8 | p[2] << 16) << 8) >> 8;
+            }
+            samples[channel % out_channels * stride + i] += sample * shares[channel];
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _render
+** Write the header of a rendition of format in out, with frames sample
+** frames, rendered from the file whose stat is st.
+*/
+static void _rendition_header(const Tier *out, uint64_t frames, const struct stat *st,
+                              uint8_t *header) {
+    uint32_t block_align = out->channels * out->bits / 8;
+    uint32_t data_len = frames * block_align;
+    uint32_t values[] = {
+        htole32(TIER_HEADER_SIZE - 8 + data_len + (data_len & 1)),
+        htole32(TIER_SOURCE_SIZE),
+        htole32(16),
+        htole32(out->sample_rate),
+        htole32(out->sample_rate * block_align),
+        htole32(data_len),
+    };
+    uint64_t source[] = {htole64(st->st_size), htole64(st->st_mtim.tv_sec),
+                         htole64(st->st_mtim.tv_nsec)};
+    uint16_t format_tag = htole16(1), channels = htole16(out->channels);
+    uint16_t block_align_le = htole16(block_align), bits = htole16(out->bits);
+
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 4, &values[0], 4);
+    memcpy(header + 8, "WAVE" TIER_SOURCE_CHUNK, 8);
+    memcpy(header + 16, &values[1], 4);
+    memcpy(header + 20, source, TIER_SOURCE_SIZE);
+    uint8_t *fmt = header + 20 + TIER_SOURCE_SIZE;
+    memcpy(fmt, "fmt ", 4);
+    memcpy(fmt + 4, &values[2], 4);
+    memcpy(fmt + 8, &format_tag, 2);
+    memcpy(fmt + 10, &channels, 2);
+    memcpy(fmt + 12, &values[3], 4);
+    memcpy(fmt + 16, &values[4], 4);
+    memcpy(fmt + 20, &block_align_le, 2);
+    memcpy(fmt + 22, &bits, 2);
+    memcpy(fmt + 24, "data", 4);
+    memcpy(fmt + 28, &values[5], 4);
+}
+
+
+/*
+** Helper for: _render_job
+** Render the file open as in_fd, of format and stat st, into out_fd as the
+** tier out, converting its rate with rs unless rs is NULL.
+**
+** returns 0 on success, -1 on error
+*/
+static int _render(int in_fd, const PcmFormat *format, const struct stat *st, const Tier *out,
+                   const Resampler *rs, int out_fd) {
+    size_t frame_bytes = format->channels * format->bytes_per_sample;
+    uint64_t in_frames = (format->data_end - format->data_offset) / frame_bytes;
+    uint64_t out_frames = in_frames;
+    uint32_t history = 0;
+    if (rs != NULL) {
+        out_frames = (in_frames * rs->phases + rs->step - 1) / rs->step;
+        history = rs->taps;
+    }
+    size_t out_frame_bytes = out->channels * out->bits / 8;
+
+    uint8_t header[TIER_HEADER_SIZE];
+    _rendition_header(out, out_frames, st, header);
+    if (write_precisely(out_fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    // Rows of samples, one per output channel: the last history samples of
+    // the previous block, then the block. The row's first block sample is
+    // input frame base.
+    size_t stride = history + TIER_BLOCK_FRAMES;
+    float *samples = (float *)calloc(out->channels * stride, sizeof(float));
+    uint8_t *raw = (uint8_t *)malloc(TIER_BLOCK_FRAMES * frame_bytes);
+    uint8_t *block = (uint8_t *)malloc(TIER_BLOCK_FRAMES * out_frame_bytes + 1);
+    int result = -1;
+    if (samples == NULL || raw == NULL || block == NULL) {
+        perror("tier_rendition: malloc");
+        goto free_buffers;
+    }
+
+    uint64_t base = 0;
+    uint32_t filled = 0;
+    size_t block_len = 0;
+    uint32_t dither = 0x9E3779B9;
+    float scale = 1 << (out->bits - 1);
+    for (uint64_t n = 0; n < out_frames; n++) {
+        uint64_t i = n;
+        uint32_t phase = 0;
+        if (rs != NULL) {
+            uint64_t t = n * rs->step + rs->delay;
+            i = t / rs->phases;
+            phase = t % rs->phases;
+        }
+        while (i >= base + filled) {
+            for (int c = 0; c < out->channels; c++) {
+                memmove(samples + c * stride, samples + c * stride + filled,
+                        history * sizeof(float));
+            }
+            base += filled;
+            filled = TIER_BLOCK_FRAMES;
+            if (_read_frames(in_fd, format, base, filled, raw, samples + history, stride,
+                             out->channels) < 0) {
+                goto free_buffers;
+            }
+        }
+
+        for (int c = 0; c < out->channels; c++) {
+            const float *row = samples + c * stride + history + (i - base);
+            float y = rs == NULL ? row[0]
+                                 : _dot(rs->filter + phase * rs->taps, row - history + 1, rs->taps);
+
+            // TPDF dither: the difference of two uniform values in [0, 1)
+            dither ^= dither << 13, dither ^= dither >> 17, dither ^= dither << 5;
+            float r1 = (dither >> 8) * (1.0f / (1 << 24));
+            dither ^= dither << 13, dither ^= dither >> 17, dither ^= dither << 5;
+            float r2 = (dither >> 8) * (1.0f / (1 << 24));
+            float v = floorf(y * scale + r1 - r2 + 0.5f);
+            int32_t q = v < -scale ? -scale : v > scale - 1 ? scale - 1 : v;
+            if (out->bits == 8) {
+                block[block_len++] = q + 128;
+            } else {
+                block[block_len++] = q;
+                block[block_len++] = q >> 8;
+            }
+        }
+        if (block_len == TIER_BLOCK_FRAMES * out_frame_bytes || n + 1 == out_frames) {
+            // RIFF chunks are padded to an even size
+            if (n + 1 == out_frames && (out_frames * out_frame_bytes) % 2 == 1) {
+                block[block_len++] = 0;
+            }
+            if (write_precisely(out_fd, block, block_len) < 0) {
+                goto free_buffers;
+            }
+            block_len = 0;
+        }
+    }
+    result = 0;
+
+free_buffers:
+    free(samples);
+    free(raw);
+    free(block);
+    return result;
+}
+
+
+/*
+** Helper for: tier_rendition
+** returns 1 if the rendition at path was rendered from the file whose stat is
+** st, 0 otherwise
+*/
+static int _rendition_current(const char *path, const struct stat *st) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    uint8_t header[20 + TIER_SOURCE_SIZE];
+    ssize_t len = pread(fd, header, sizeof(header), 0);
+    close(fd);
+
+    uint64_t source[] = {htole64(st->st_size), htole64(st->st_mtim.tv_sec),
+                         htole64(st->st_mtim.tv_nsec)};
+    return len == sizeof(header) && memcmp(header, "RIFF", 4) == 0 &&
+           memcmp(header + 8, "WAVE" TIER_SOURCE_CHUNK, 8) == 0 &&
+           memcmp(header + 20, source, TIER_SOURCE_SIZE) == 0;
+}
+
+
+/*
+** Helper for: tier_rendition
+** Find what tier makes of the file of format: out, with each of its three
+** only lowered where the tier is below the file.
+** returns 0 on success, -1 if the tier does not reduce the file
+*/
+static int _tier_format(const PcmFormat *format, uint32_t tier, Tier *out) {
+    // Nothing goes up
+    *out = tiers[tier - 1];
+    out->sample_rate = MIN(out->sample_rate, format->sample_rate);
+    out->bits = MIN(out->bits, 8 * format->bytes_per_sample);
+    out->channels = MIN(out->channels, format->channels);
+    if (out->sample_rate / _gcd(format->sample_rate, out->sample_rate) > TIER_MAX_PHASES) {
+        out->sample_rate = format->sample_rate;
+    }
+    if (out->sample_rate == format->sample_rate && out->bits == 8 * format->bytes_per_sample &&
+        out->channels == format->channels) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** A rendition for the render thread to write.
+** fd, st, format: the file (a descriptor of its own), its stat and format.
+** tier, out: the tier, and what it makes of the file.
+** path: where the rendition goes.
+*/
+typedef struct tier_job {
+    int fd;
+    struct stat st;
+    PcmFormat format;
+    uint32_t tier;
+    Tier out;
+    char *path;
+    struct tier_job *next;
+} TierJob;
+
+
+// The render thread of this process (if renderer_pid is getpid()) and its
+// queue, whose head is the job being rendered
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_ready = PTHREAD_COND_INITIALIZER;
+static TierJob *render_queue = NULL;
+static uint8_t render_stopping = 0;
+static pid_t renderer_pid = 0;
+static pthread_t renderer;
+static uint8_t renderer_exit_hook = 0;
+
+
+/*
+** A file of the directory, for _trim_directory.
+*/
+typedef struct tier_file {
+    char name[NAME_MAX + 1];
+    off_t size;
+    time_t used;
+} TierFile;
+
+
+static int _compare_used(const void *a, const void *b) {
+    time_t x = ((const TierFile *)a)->used, y = ((const TierFile *)b)->used;
+    return (x > y) - (x < y);
+}
+
+
+/*
+** Helper for: _renderer_main
+** Remove the temporary files of renders that were cut short, and the least
+** recently sent renditions while the directory holds more than
+** TIER_DIRECTORY_BYTES. That includes, in time, those of files that have left
+** the library, or changed and been rendered again under another name.
+*/
+static void _trim_directory(void) {
+    DIR *dir = opendir(tier_directory);
+    if (dir == NULL) {
+        perror("tier_rendition: opendir");
+        return;
+    }
+    TierFile *files = NULL;
+    size_t num_files = 0, capacity = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (dirent->d_name[0] == '.') {
+            if (now - st.st_mtim.tv_sec > TIER_STALE_SEC) {
+                unlinkat(dirfd(dir), dirent->d_name, 0);
+            }
+            continue;
+        }
+        if (num_files == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            TierFile *grown = (TierFile *)realloc(files, capacity * sizeof(TierFile));
+            if (grown == NULL) {
+                perror("tier_rendition: realloc");
+                goto close_dir;
+            }
+            files = grown;
+        }
+        TierFile *file = &files[num_files++];
+        strncpy(file->name, dirent->d_name, NAME_MAX);
+        file->name[NAME_MAX] = '\0';
+        file->size = st.st_size;
+        file->used = st.st_atim.tv_sec;
+        total += st.st_size;
+    }
+
+    qsort(files, num_files, sizeof(TierFile), _compare_used);
+    for (size_t i = 0; i < num_files && total > TIER_DIRECTORY_BYTES; i++) {
+        #ifdef DEBUG
+        printf("Removing rendition %s\n", files[i].name);
+        #endif
+        if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+            total -= files[i].size;
+        }
+    }
+
+close_dir:
+    free(files);
+    closedir(dir);
+}
+
+
+/*
+** Helper for: _renderer_main
+** Write the rendition of job, through a temporary file renamed into place.
+** returns 0 on success, -1 on error
+*/
+static int _render_job(const TierJob *job) {
+    Resampler rs = {0};
+    int result = -1;
+    size_t temp_len = strlen(tier_directory) + 64;
+    char *temp = (char *)malloc(temp_len);
+    if (temp == NULL) {
+        perror("tier_rendition: malloc");
+        return -1;
+    }
+    // It may have been removed since, or replaced
+    if (_check_directory() < 0) {
+        goto free_temp;
+    }
+    if (job->out.sample_rate != job->format.sample_rate &&
+        _resampler_init(&rs, job->format.sample_rate, job->out.sample_rate) < 0) {
+        goto free_temp;
+    }
+    snprintf(temp, temp_len, "%s/.%lx-%lx-%u.XXXXXX", tier_directory,
+             (unsigned long)job->st.st_dev, (unsigned long)job->st.st_ino, job->tier);
+    int temp_fd = mkstemp(temp);
+    if (temp_fd < 0) {
+        perror("tier_rendition: mkstemp");
+        goto free_temp;
+    }
+    #ifdef DEBUG
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    #endif
+    int rendered = _render(job->fd, &job->format, &job->st, &job->out,
+                           rs.filter != NULL ? &rs : NULL, temp_fd);
+    if (close(temp_fd) < 0 || rendered < 0 || rename(temp, job->path) < 0) {
+        ERR_PRINT("tier_rendition: could not render tier %u of inode %lu\n", job->tier,
+                  (unsigned long)job->st.st_ino);
+        unlink(temp);
+        goto free_temp;
+    }
+    #ifdef DEBUG
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Rendered tier %u of inode %lu (%u Hz, %u-bit, %u channels) in %.0f ms\n",
+           job->tier, (unsigned long)job->st.st_ino, job->out.sample_rate, job->out.bits,
+           job->out.channels,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    #endif
+    result = 0;
+
+free_temp:
+    free(rs.filter);
+    free(temp);
+    return result;
+}
+
+
+static void *_renderer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&render_lock);
+    while (1) {
+        while (render_queue == NULL && !render_stopping) {
+            pthread_cond_wait(&render_ready, &render_lock);
+        }
+        if (render_queue == NULL) {
+            break;
+        }
+        // Left at the head while it renders, so it is not queued again
+        TierJob *job = render_queue;
+        pthread_mutex_unlock(&render_lock);
+
+        if (_render_job(job) == 0) {
+            _trim_directory();
+        }
+
+        pthread_mutex_lock(&render_lock);
+        render_queue = job->next;
+        close(job->fd);
+        free(job->path);
+        free(job);
+    }
+    pthread_mutex_unlock(&render_lock);
+    return NULL;
+}
+
+
+/*
+** Helper for: exit
+** Let this process's render thread finish the renditions queued so far, so
+** a handler that is done does not drop them.
+*/
+static void _stop_renderer(void) {
+    if (renderer_pid != getpid()) {
+        return;
+    }
+    pthread_mutex_lock(&render_lock);
+    render_stopping = 1;
+    pthread_cond_signal(&render_ready);
+    pthread_mutex_unlock(&render_lock);
+    pthread_join(renderer, NULL);
+    renderer_pid = 0;
+}
+
+
+/*
+** Helper for: _queue_render
+** Start the render thread of this process, unless it is running. A forked
+** process does not have its parent's, nor may it trust its queue's lock.
+** returns 0 on success, -1 on error
+*/
+static int _start_renderer(void) {
+    if (renderer_pid == getpid()) {
+        return 0;
+    }
+    pthread_mutex_init(&render_lock, NULL);
+    pthread_cond_init(&render_ready, NULL);
+    while (render_queue != NULL) {
+        TierJob *job = render_queue;
+        render_queue = job->next;
+        close(job->fd);
+        free(job->path);
+        free(job);
+    }
+    render_stopping = 0;
+
+    // Signals are for the thread serving clients
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int error = pthread_create(&renderer, NULL, _renderer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error != 0) {
+        ERR_PRINT("tier_rendition: pthread_create: %s\n", strerror(error));
+        return -1;
+    }
+    renderer_pid = getpid();
+    if (!renderer_exit_hook) {
+        atexit(_stop_renderer);
+        renderer_exit_hook = 1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: tier_rendition
+** Queue the rendition at path of job's file, unless it already is. Takes
+** over job->path.
+*/
+static void _queue_render(TierJob *job, int fd) {
+    // tier_open may run in several threads of a process at once
+    static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&start_lock);
+    int started = _start_renderer();
+    pthread_mutex_unlock(&start_lock);
+    if (started < 0) {
+        free(job->path);
+        return;
+    }
+
+    pthread_mutex_lock(&render_lock);
+    TierJob **link = &render_queue;
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->tier == job->tier && (*link)->st.st_dev == job->st.st_dev &&
+            (*link)->st.st_ino == job->st.st_ino) {
+            pthread_mutex_unlock(&render_lock);
+            free(job->path);
+            return;
+        }
+    }
+    TierJob *queued = (TierJob *)malloc(sizeof(TierJob));
+    job->fd = queued != NULL ? dup(fd) : -1;
+    if (job->fd < 0) {
+        perror("tier_rendition: dup");
+        pthread_mutex_unlock(&render_lock);
+        free(queued);
+        free(job->path);
+        return;
+    }
+    *queued = *job;
+    queued->next = NULL;
+    *link = queued;
+    pthread_cond_signal(&render_ready);
+    pthread_mutex_unlock(&render_lock);
+    #ifdef DEBUG
+    printf("Queued tier %u of inode %lu\n", job->tier, (unsigned long)job->st.st_ino);
+    #endif
+}
+
+
+char *tier_rendition(int fd, const struct stat *st, uint32_t tier) {
+    TierJob job = {.st = *st, .tier = tier};
+    if (tier_directory == NULL || tier == TIER_ORIGINAL || tier > TIER_COUNT ||
+        pcm_probe(fd, st->st_size, &job.format) < 0 || job.format.sample_rate == 0 ||
+        _tier_format(&job.format, tier, &job.out) < 0) {
+        return NULL;
+    }
+
+    size_t path_len = strlen(tier_directory) + 64;
+    job.path = (char *)malloc(path_len);
+    if (job.path == NULL) {
+        perror("tier_rendition: malloc");
+        return NULL;
+    }
+    snprintf(job.path, path_len, "%s/%lx-%lx-%u.wav", tier_directory, (unsigned long)st->st_dev,
+             (unsigned long)st->st_ino, tier);
+    if (_rendition_current(job.path, st)) {
+        return job.path;
+    }
+    _queue_render(&job, fd);
+    return NULL;
+}
+
+
+int tier_open(int fd, struct stat *st, char **path, uint32_t tier) {
+    if (tier == TIER_ORIGINAL) {
+        return -1;
+    }
+    char *rendition = tier_rendition(fd, st, tier);
+    if (rendition == NULL) {
+        return -1;
+    }
+    int rendition_fd = open(rendition, O_RDONLY);
+    struct stat rendition_st;
+    if (rendition_fd < 0 || fstat(rendition_fd, &rendition_st) < 0) {
+        perror("tier_open: open");
+        if (rendition_fd >= 0) {
+            close(rendition_fd);
+        }
+        free(rendition);
+        return -1;
+    }
+    #ifdef DEBUG
+    printf("Sending tier %u of %s from %s\n", tier, *path, rendition);
+    #endif
+    // Its access time orders the renditions for _trim_directory (the
+    // modification time is left alone, the hot-file cache keys on it)
+    struct timespec times[2] = {{.tv_nsec = UTIME_NOW}, {.tv_nsec = UTIME_OMIT}};
+    futimens(rendition_fd, times);
+    *st = rendition_st;
+    free(*path);
+    *path = rendition;
+    return rendition_fd;
+}
@@ -0,0 +1,132 @@
+#ifndef AS_TIER_H_
+#define AS_TIER_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_pcm.h"
+
+#include <pthread.h>
+
+/*
+** Design
+** ------
+** A listener on a thin link cannot take a 24-bit 96 kHz WAV file as fast as
+** it plays. A client that agreed to PROTOCOL_FEATURE_TIERS may instead ask
+** for a rendition of it at one of the TIER_TABLE tiers (see as_server.h),
+** which the server renders from the file after it is first asked for:
+**   - channels are downmixed to the tier's (each output channel is the mean
+**     of the input channels that fall to it, every other one for stereo),
+**   - the sample rate is converted to the tier's by a polyphase resampler:
+**     conceptually, the signal is upsampled by L, low-pass filtered below
+**     the lower of the two Nyquist frequencies, and every Mth sample kept
+**     (out / in = L / M). Only the samples that are kept are computed, each
+**     as the dot product of input samples with one of the L phases of a
+**     Kaiser-windowed sinc filter, four at a time with the compiler's vector
+**     extensions. A phase has TIER_TAPS taps per multiple of the output rate
+**     in the input rate (rounded up), so the filter is as sharp whatever the
+**     ratio and costs about TIER_TAPS multiplications per input sample,
+**   - samples are reduced to the tier's bits with TPDF dither (the sum of
+**     two random values of one step each), so the rounding error is noise
+**     instead of distortion.
+** A rendition never goes up: each of the three is only changed where the
+** tier is below the file, and a file that no tier reduces, or that is not
+** integer PCM (see pcm_probe), is sent as it is. So is a file whose rates
+** would need more than TIER_MAX_PHASES phases, with its rate left as is.
+**
+** Renditions are WAV files kept in a directory of their own (set up by
+** tier_init, which only takes one of this user's that no one else can
+** write to), one per
+** (file, tier), named after the file's device, inode and the tier: asking
+** for a rendition again costs only the opening of that file, and it is then
+** sent like any other file (from the hot-file cache, in transport encoding,
+** with its trailer...). Each rendition starts with a TIER_SOURCE_CHUNK
+** holding the size and modification time of the file it was rendered from,
+** so a rendition whose file has since changed is rendered again. A rendition
+** is written to a temporary file renamed into place, so a process never
+** sees half of one, and two processes rendering the same one at once only
+** do the work twice. Once the directory holds more than TIER_DIRECTORY_BYTES,
+** the renditions sent the longest ago are removed, which in time removes
+** those of files that have left the library.
+**
+** Rendering takes as long as reading the whole file, far too long to hold up
+** an event loop (or the library lock) for. A request that finds no current
+** rendition is sent the file itself, and queues the rendition for a render
+** thread of its process, started on first use, so a later request gets it.
+** A process that exits first finishes the renditions it queued.
+*/
+
+// Sample rate (Hz), bits per sample and channels of tiers 1, 2...
+#define TIER_TABLE {{44100, 16, 2}, {22050, 16, 2}, {22050, 16, 1}, {11025, 8, 1}}
+#define TIER_COUNT 4
+// Tier 0 is the file itself
+#define TIER_ORIGINAL 0
+// Followed by "-<uid>"
+#define TIER_DEFAULT_DIR "/tmp/as_tiers"
+#define TIER_DIRECTORY_BYTES (512UL * 1024 * 1024)
+// Age (seconds) past which a temporary file is one of a render cut short
+#define TIER_STALE_SEC 3600
+
+// Filter taps per phase per multiple of the output rate (a multiple of 4),
+// and most phases of a filter
+#define TIER_TAPS 64
+#define TIER_MAX_PHASES 2048
+// Cutoff of the filter, as a fraction of the lower Nyquist frequency
+#define TIER_PASSBAND 0.9
+// Kaiser window shape, about 90 dB of stopband attenuation
+#define TIER_KAISER_BETA 9.0
+// Sample frames read and written at a time
+#define TIER_BLOCK_FRAMES 4096
+#define TIER_SOURCE_CHUNK "asrc"
+
+
+/*
+** sample_rate, bits, channels: of a tier.
+*/
+typedef struct tier {
+    uint32_t sample_rate;
+    uint16_t bits;
+    uint16_t channels;
+} Tier;
+
+
+/*
+** Keep renditions in directory (or the default one, if it is NULL), creating
+** it if there is none. Must be called before anything forks.
+**
+** returns 0 on success, -1 if the directory is not safe to use: renditions
+** are off then, every file is sent as it is
+*/
+int tier_init(const char *directory);
+
+/*
+** Write the TIER_TABLE into buf, as LIST_TIERS then " <tier>:<rate>/<bits>/
+** <channels>" for each tier, e.g. "TIERS 1:44100/16/2 2:22050/16/2".
+**
+** returns the length of the line (without a newline), or -1 if it does not
+** fit in size bytes
+*/
+int tier_list_line(char *buf, size_t size);
+
+/*
+** Find the rendition at tier of the file open as fd, whose stat is st. If there is none or its file has changed, it is rendered in the
+** background (from a duplicate of fd).
+**
+** returns the path of the rendition (to be freed), or NULL if the file itself
+** is to be sent: it is not integer PCM, the tier does not reduce it, or its
+** rendition is not ready
+*/
+char *tier_rendition(int fd, const struct stat *st, uint32_t tier);
+
+/*
+** Open the rendition at tier (see tier_rendition) of the file open as fd,
+** whose stat is *st and whose path is *path (allocated), to be sent in its
+** place: *st and *path become the rendition's, the file's path is freed.
+**
+** returns the rendition's descriptor (fd is left to the caller to close), or
+** -1 if the file itself is to be sent, with *st and *path unchanged
+*/
+int tier_open(int fd, struct stat *st, char **path, uint32_t tier);
+
+#endif // AS_TIER_H_
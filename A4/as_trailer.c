@@ -0,0 +1,87 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_trailer.h"
+
+
+void body_crc_start(BodyCrc *body, int fd, int cache_entry, off_t offset, uint64_t count) {
+    memset(body, 0, sizeof(*body));
+    body->fd = fd;
+    body->cache_entry = cache_entry;
+    if (cache_entry >= 0) {
+        cache_cursor_start(&body->cursor, cache_entry);
+    }
+    body->offset = offset;
+    body->end = offset + count;
+}
+
+
+/*
+** Helper for: body_crc_advance
+** Hash [body->offset, cursor) of fd by reading it again.
+*/
+static void _hash_read(BodyCrc *body, off_t cursor) {
+    uint8_t buf[TRAILER_READ_SIZE];
+    while (body->offset < cursor) {
+        ssize_t num = pread(body->fd, buf, MIN(sizeof(buf), cursor - body->offset),
+                            body->offset);
+        if (num <= 0) {
+            if (num < 0 && errno == EINTR) {
+                continue;
+            }
+            // The trailer will not match, the client discards the body
+            ERR_PRINT("body_crc_advance: could not read the body back\n");
+            body->offset = cursor;
+            return;
+        }
+        body->crc = crc32c(body->crc, buf, num);
+        body->offset += num;
+    }
+}
+
+
+void body_crc_advance(BodyCrc *body, off_t cursor) {
+    cursor = MIN(cursor, body->end);
+    if (body->done || cursor <= body->offset) {
+        return;
+    }
+
+    if (body->cache_entry >= 0) {
+        while (body->offset < cursor) {
+            size_t len;
+            const uint8_t *data = cache_data(&body->cursor, body->offset, &len);
+            if (data == NULL) {
+                break;
+            }
+            len = MIN(len, cursor - body->offset);
+            body->crc = crc32c(body->crc, data, len);
+            body->offset += len;
+        }
+    } else if (body->fd >= 0) {
+        _hash_read(body, cursor);
+    }
+}
+
+
+void body_crc_update(BodyCrc *body, const void *data, size_t len) {
+    if (!body->done) {
+        body->crc = crc32c(body->crc, data, len);
+        body->offset += len;
+    }
+}
+
+
+void body_crc_finish(BodyCrc *body, uint8_t *trailer) {
+    body_crc_advance(body, body->end);
+    uint32_t crc_nbo = htonl(body->crc);
+    memcpy(trailer, &crc_nbo, TRAILER_SIZE);
+    body_crc_stop(body);
+}
+
+
+void body_crc_stop(BodyCrc *body) {
+    body->fd = -1;
+    body->cache_entry = -1;
+    body->done = 1;
+}
@@ -0,0 +1,85 @@
+#ifndef AS_TRAILER_H_
+#define AS_TRAILER_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_cache.h"
+#include "as_crc.h"
+
+/*
+** Design
+** ------
+** A client that agreed to PROTOCOL_FEATURE_TRAILER gets every STREAM body
+** followed by the CRC32C of its bytes (see as_server.h), so a download that
+** was cut short or damaged on the way is never taken for the file.
+**
+** The trailer is the checksum of the bytes that actually went out, never a
+** checksum of the file taken earlier: a file rewritten or truncated mid-send
+** then gets a trailer that does not match what it was, and the client
+** discards the body. A BodyCrc follows the body as it is sent:
+**   - a body sent from a buffer (the copy mode, chunked framing, transport
+**     encoding) is hashed from that buffer, through body_crc_update,
+**   - a body sent from the hot-file cache is hashed where it is, in the
+**     cache entry, each time the cursor moves,
+**   - the zero-copy transfer modes never bring the body into the server's
+**     memory, so what was just sent is read back with pread through a
+**     TRAILER_READ_SIZE buffer (it is still in the page cache). The file is
+**     never mapped: touching a mapping past the end of a file truncated
+**     meanwhile would kill the server with SIGBUS.
+*/
+
+#define TRAILER_SIZE sizeof(uint32_t)
+// Buffer the body is read back through
+#define TRAILER_READ_SIZE (64 * 1024)
+
+
+/*
+** fd, cache_entry: where the body is sent from, -1 for neither (the body is
+** passed to body_crc_update instead).
+** cursor: where in the cache entry the body is hashed up to.
+** done: nothing to follow, no trailer is sent or it has been.
+** offset, end: the body is hashed up to offset, and ends at end.
+*/
+typedef struct body_crc {
+    int fd;
+    int cache_entry;
+    CacheCursor cursor;
+    uint8_t done;
+    uint32_t crc;
+    off_t offset;
+    off_t end;
+} BodyCrc;
+
+
+/*
+** Start following a body of count bytes from offset of fd (or of its hot-file
+** cache entry, if cache_entry is not -1). fd and cache_entry may both be -1
+** for a body passed to body_crc_update.
+*/
+void body_crc_start(BodyCrc *body, int fd, int cache_entry, off_t offset, uint64_t count);
+
+/*
+** The body has been sent up to cursor: hash what was sent since the last
+** call that body_crc_update was not given.
+*/
+void body_crc_advance(BodyCrc *body, off_t cursor);
+
+/*
+** Hash len bytes of a body sent from data.
+*/
+void body_crc_update(BodyCrc *body, const void *data, size_t len);
+
+/*
+** The whole body has been sent: write its trailer into trailer (TRAILER_SIZE
+** bytes) and stop following it.
+*/
+void body_crc_finish(BodyCrc *body, uint8_t *trailer);
+
+/*
+** Stop following a body that will not be finished.
+*/
+void body_crc_stop(BodyCrc *body);
+
+#endif // AS_TRAILER_H_
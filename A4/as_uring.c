@@ -0,0 +1,351 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_uring.h"
+
+
+typedef enum uring_state {
+    URING_UNTRIED,
+    URING_READY,
+    URING_UNAVAILABLE,
+} UringState;
+
+
+typedef enum slot_state {
+    SLOT_FREE,
+    SLOT_READING,
+    SLOT_FILLED,
+    SLOT_WRITING,
+} SlotState;
+
+
+/*
+** One registered buffer and the part of the file it holds.
+** offset: file offset of the first byte, len: bytes it should hold,
+** filled: bytes read so far, written: bytes sent to the socket so far.
+*/
+typedef struct uring_slot {
+    SlotState state;
+    off_t offset;
+    size_t len;
+    size_t filled;
+    size_t written;
+} UringSlot;
+
+
+typedef struct uring {
+    int fd;
+
+    // Submission queue ring
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned to_submit;
+
+    // Completion queue ring, shares sq_ptr with IORING_FEAT_SINGLE_MMAP
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uint8_t *buffers;
+    UringSlot slots[URING_NUM_BUFFERS];
+} Uring;
+
+
+static UringState uring_state = URING_UNTRIED;
+static Uring ring;
+
+
+static int _io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int _io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int _io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static void _uring_teardown(Uring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r->buffers);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+
+/*
+** Create the ring, map its queues and register the buffer pool.
+** returns 0 on success, -1 if io_uring cannot be used
+*/
+static int _uring_setup(Uring *r) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    r->fd = _io_uring_setup(URING_QUEUE_DEPTH, &params);
+    if (r->fd < 0) {
+        #ifdef DEBUG
+        perror("_uring_setup: io_uring_setup");
+        #endif
+        r->fd = -1;
+        return -1;
+    }
+
+    r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        perror("_uring_setup: mmap");
+        goto setup_error;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            perror("_uring_setup: mmap");
+            goto setup_error;
+        }
+    }
+
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        perror("_uring_setup: mmap");
+        goto setup_error;
+    }
+
+    r->sq_head = (unsigned *)((uint8_t *)r->sq_ptr + params.sq_off.head);
+    r->sq_tail = (unsigned *)((uint8_t *)r->sq_ptr + params.sq_off.tail);
+    r->sq_mask = (unsigned *)((uint8_t *)r->sq_ptr + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((uint8_t *)r->sq_ptr + params.sq_off.array);
+    r->cq_head = (unsigned *)((uint8_t *)r->cq_ptr + params.cq_off.head);
+    r->cq_tail = (unsigned *)((uint8_t *)r->cq_ptr + params.cq_off.tail);
+    r->cq_mask = (unsigned *)((uint8_t *)r->cq_ptr + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((uint8_t *)r->cq_ptr + params.cq_off.cqes);
+
+    if (posix_memalign((void **)&r->buffers, sysconf(_SC_PAGESIZE),
+                       URING_NUM_BUFFERS * URING_BUFFER_SIZE) != 0) {
+        ERR_PRINT("_uring_setup: posix_memalign failed\n");
+        r->buffers = NULL;
+        goto setup_error;
+    }
+    struct iovec iovecs[URING_NUM_BUFFERS];
+    for (int i = 0; i < URING_NUM_BUFFERS; i++) {
+        iovecs[i].iov_base = r->buffers + i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iovecs, URING_NUM_BUFFERS) < 0) {
+        #ifdef DEBUG
+        perror("_uring_setup: io_uring_register");
+        #endif
+        goto setup_error;
+    }
+    return 0;
+
+setup_error:
+    _uring_teardown(r);
+    return -1;
+}
+
+
+/*
+** Queue a fixed-buffer read or write for slot. It is submitted with the next
+** call to _uring_submit_and_wait.
+*/
+static void _uring_queue(Uring *r, uint8_t opcode, int fd, int slot_index,
+                         size_t buf_offset, size_t len, off_t file_offset) {
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(r->buffers + slot_index * URING_BUFFER_SIZE
+                                      + buf_offset);
+    sqe->len = len;
+    sqe->off = file_offset;
+    sqe->buf_index = slot_index;
+    sqe->user_data = slot_index;
+
+    r->sq_array[index] = index;
+    // The kernel must see the entry before it sees the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+}
+
+
+static int _uring_submit_and_wait(Uring *r) {
+    while (_io_uring_enter(r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS) < 0) {
+        if (errno != EINTR) {
+            perror("uring_send_file: io_uring_enter");
+            return -1;
+        }
+    }
+    r->to_submit = 0;
+    return 0;
+}
+
+
+static int _slots_in_flight(const Uring *r) {
+    int in_flight = 0;
+    for (int i = 0; i < URING_NUM_BUFFERS; i++) {
+        if (r->slots[i].state == SLOT_READING || r->slots[i].state == SLOT_WRITING) {
+            in_flight++;
+        }
+    }
+    return in_flight;
+}
+
+
+ssize_t uring_send_file(int out_fd, int in_fd, off_t offset, size_t count) {
+    if (uring_state == URING_UNTRIED) {
+        uring_state = _uring_setup(&ring) == 0 ? URING_READY : URING_UNAVAILABLE;
+        #ifdef DEBUG
+        printf("io_uring %s\n", uring_state == URING_READY ? "ready" : "unavailable");
+        #endif
+    }
+    if (uring_state == URING_UNAVAILABLE) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    Uring *r = &ring;
+    memset(r->slots, 0, sizeof(r->slots));
+    off_t end = offset + count;
+    off_t next_read = offset;
+    off_t next_write = offset;
+    uint8_t writing = 0;
+    uint8_t failed = 0;
+
+    while (next_write < end && !failed) {
+        // Keep every free buffer reading ahead
+        for (int i = 0; i < URING_NUM_BUFFERS && next_read < end; i++) {
+            UringSlot *slot = &r->slots[i];
+            if (slot->state != SLOT_FREE) {
+                continue;
+            }
+            slot->state = SLOT_READING;
+            slot->offset = next_read;
+            slot->len = MIN(URING_BUFFER_SIZE, end - next_read);
+            slot->filled = slot->written = 0;
+            _uring_queue(r, IORING_OP_READ_FIXED, in_fd, i, 0, slot->len, slot->offset);
+            next_read += slot->len;
+        }
+
+        // Send the next part of the file as soon as it has been read
+        for (int i = 0; i < URING_NUM_BUFFERS && !writing; i++) {
+            UringSlot *slot = &r->slots[i];
+            if (slot->state == SLOT_FILLED && slot->offset == next_write) {
+                slot->state = SLOT_WRITING;
+                _uring_queue(r, IORING_OP_WRITE_FIXED, out_fd, i, 0, slot->filled, 0);
+                writing = 1;
+            }
+        }
+
+        if (_uring_submit_and_wait(r) < 0) {
+            failed = 1;
+            break;
+        }
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int i = cqe->user_data;
+            int res = cqe->res;
+            UringSlot *slot = &r->slots[i];
+            head++;
+
+            if (res < 0) {
+                errno = -res;
+                perror("uring_send_file");
+                slot->state = SLOT_FREE;
+                failed = 1;
+                continue;
+            }
+
+            if (slot->state == SLOT_READING) {
+                if (res == 0) {
+                    ERR_PRINT("uring_send_file: file ended early\n");
+                    slot->state = SLOT_FREE;
+                    failed = 1;
+                    continue;
+                }
+                slot->filled += res;
+                if (slot->filled < slot->len) {
+                    _uring_queue(r, IORING_OP_READ_FIXED, in_fd, i, slot->filled,
+                                 slot->len - slot->filled, slot->offset + slot->filled);
+                } else {
+                    slot->state = SLOT_FILLED;
+                }
+            } else if (slot->state == SLOT_WRITING) {
+                slot->written += res;
+                if (slot->written < slot->filled) {
+                    _uring_queue(r, IORING_OP_WRITE_FIXED, out_fd, i, slot->written,
+                                 slot->filled - slot->written, 0);
+                } else {
+                    next_write += slot->filled;
+                    slot->state = SLOT_FREE;
+                    writing = 0;
+                }
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // The buffers are reused by the next call, wait out anything still running
+    while (failed && (_slots_in_flight(r) > 0 || r->to_submit > 0)) {
+        if (_uring_submit_and_wait(r) < 0) {
+            // Cannot trust the ring any more, use something else from now on
+            _uring_teardown(r);
+            uring_state = URING_UNAVAILABLE;
+            break;
+        }
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            r->slots[r->cqes[head & *r->cq_mask].user_data].state = SLOT_FREE;
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    #ifdef DEBUG
+    printf("uring_send_file: sent %ld bytes\n", (long)(next_write - offset));
+    #endif
+    return failed && next_write == offset ? -1 : next_write - offset;
+}
@@ -0,0 +1,54 @@
+#ifndef AS_URING_H_
+#define AS_URING_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+** Design
+** ------
+** The copy loop in stream_request_response waits for every fread before it
+** writes, and for every write before it reads again, so the disk and the
+** network never work at the same time. With io_uring the kernel is given
+** several reads of the library file at once, and the socket writes are
+** queued as soon as the data is in:
+**   - URING_NUM_BUFFERS buffers of URING_BUFFER_SIZE bytes are registered
+**     with the kernel once (fixed buffers), so no pages are pinned per call.
+**   - Every free buffer gets a READ_FIXED for the next part of the file.
+**   - Buffers are written to the socket with WRITE_FIXED strictly in file
+**     order, one write in flight at a time, and go back to reading once
+**     their data has been sent.
+** Short reads and short writes are simply resubmitted for the rest.
+**
+** The ring is set up lazily, once per process, on the first transfer (each
+** forked client handler therefore gets its own). If the kernel has no
+** io_uring, or it is disabled, uring_send_file says so without sending
+** anything and the caller uses another transfer method.
+**
+** liburing is not required, the ring is driven with the raw system calls.
+*/
+
+#define URING_NUM_BUFFERS 8
+#define URING_BUFFER_SIZE (64 * 1024)
+// Reads for every buffer plus one write, with room to spare
+#define URING_QUEUE_DEPTH (2 * URING_NUM_BUFFERS)
+
+
+/*
+** Send exactly count bytes of in_fd, starting at offset, to out_fd through
+** io_uring. Blocks until everything has been sent or an error occurs.
+**
+** returns the number of bytes sent (less than count if in_fd ends early),
+**         -1 on error. If io_uring is unavailable -1 is returned with errno
+**         set to ENOSYS, and nothing has been sent.
+*/
+ssize_t uring_send_file(int out_fd, int in_fd, off_t offset, size_t count);
+
+#endif // AS_URING_H_
@@ -7,7 +7,8 @@
 
 void _free_library(Library *library){
     if (library == NULL) return;
-    for (int i = 0; i < library->num_files; i++) {
+    // Names in a store are freed with it
+    for (int i = 0; library->store == NULL && i < library->num_files; i++) {
         free(library->files[i]);
     }
     if (library->files != NULL) {
@@ -98,3 +99,123 @@ int write_precisely(int fd, const void *buf, size_t count) {
     #endif
     return bytes_written;
 }
+
+
+int send_precisely(int sockfd, const void *buf, size_t count, int flags) {
+    int bytes_sent = 0;
+    while (bytes_sent < count) {
+        int ret = send(sockfd, buf + bytes_sent, count - bytes_sent, flags);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_PRINT("send_precisely: send");
+            return -1;
+        }
+        bytes_sent += ret;
+    }
+    #ifdef DEBUG
+    printf("send_precisely: sent %d bytes\n", bytes_sent);
+    #endif
+    return bytes_sent;
+}
+
+
+/*
+** Helper for: sendfile_precisely, splice_precisely
+** Report a transfer that failed, so that its errno never reads as
+** "unsupported" (EINVAL, ENOSYS) once part of it has gone out: the caller
+** would send that part again another way.
+*/
+static void _transfer_failed(const char *what, uint8_t partial) {
+    perror(what);
+    if (partial && (errno == EINVAL || errno == ENOSYS)) {
+        errno = EIO;
+    }
+}
+
+
+ssize_t sendfile_precisely(int out_fd, int in_fd, off_t offset, size_t count) {
+    size_t bytes_sent = 0;
+    while (bytes_sent < count) {
+        ssize_t ret = sendfile(out_fd, in_fd, &offset, count - bytes_sent);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing sent yet, the caller can fall back to another method
+            if (bytes_sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return -1;
+            }
+            _transfer_failed("sendfile_precisely: sendfile", bytes_sent > 0);
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        bytes_sent += ret;
+    }
+    #ifdef DEBUG
+    printf("sendfile_precisely: sent %zu bytes\n", bytes_sent);
+    #endif
+    return bytes_sent;
+}
+
+
+ssize_t splice_precisely(int out_fd, int in_fd, off_t offset, size_t count) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("splice_precisely: pipe");
+        return -1;
+    }
+
+    size_t bytes_sent = 0;
+    while (bytes_sent < count) {
+        ssize_t in_pipe = splice(in_fd, &offset, pipefd[1], NULL,
+                                 count - bytes_sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (bytes_sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                goto splice_error;
+            }
+            _transfer_failed("splice_precisely: splice", bytes_sent > 0);
+            goto splice_error;
+        }
+        if (in_pipe == 0) {
+            break;
+        }
+
+        // Drain everything we just put in the pipe into the socket
+        while (in_pipe > 0) {
+            ssize_t ret = splice(pipefd[0], NULL, out_fd, NULL,
+                                 in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Bytes of the file are stuck in the pipe, never "unsupported"
+                _transfer_failed("splice_precisely: splice", 1);
+                goto splice_error;
+            }
+            in_pipe -= ret;
+            bytes_sent += ret;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    #ifdef DEBUG
+    printf("splice_precisely: sent %zu bytes\n", bytes_sent);
+    #endif
+    return bytes_sent;
+
+splice_error:
+    {
+        int saved_errno = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved_errno;
+    }
+    return -1;
+}
@@ -4,6 +4,10 @@
 /*                       CSC209-24s A4 Audio Stream                          */
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
+// splice, readahead and friends are GNU extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 
 // General stuff
@@ -15,8 +19,11 @@
 
 // Network stuff
 #include <arpa/inet.h>     /* inet_ntoa */
+#include <endian.h>        /* htobe64, be64toh */
 #include <netdb.h>         /* gethostname */
+#include <netinet/tcp.h>   /* TCP_NODELAY, TCP_NOTSENT_LOWAT */
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 
 // File and directory stuff
 #include <fcntl.h>
@@ -56,11 +63,55 @@
 
 #define REQUEST_BUFFER_SIZE 128
 #define REQUEST_LIST "LIST"
+#define REQUEST_LIST_SINCE "LISTSINCE"
+// LISTSINCE response lines
+#define LIST_DELTA "DELTA"
+#define LIST_RESYNC "RESYNC"
+#define LIST_DELTA_ADD "+"
+#define LIST_DELTA_REMOVE "-"
+#define LIST_END "."
+#define LIST_TIERS "TIERS"
 #define REQUEST_STREAM "STREAM"
+#define REQUEST_STREAM_RANGE "STREAMRANGE"
+// STREAMRANGE arguments: file index (32-bit), offset and length (64-bit)
+#define STREAM_RANGE_ARGS_SIZE (sizeof(uint32_t) + 2 * sizeof(uint64_t))
+#define REQUEST_STREAM_BATCH "STREAMBATCH"
+// STREAMBATCH arguments: number of files (32-bit), then each file index
+// (32-bit). Small enough for the whole request to fit in REQUEST_BUFFER_SIZE.
+#define STREAM_BATCH_MAX 16
+#define REQUEST_STREAM_IF "STREAMIF"
+// STREAMIF arguments: file index and the CRC32C of the client's copy (32-bit)
+#define STREAM_IF_ARGS_SIZE (2 * sizeof(uint32_t))
+#define STREAM_RANGE_TO_END UINT64_MAX
+#define REQUEST_STREAM_TIER "STREAMTIER"
+// STREAMTIER arguments: file index and tier (32-bit), see as_tier.h
+#define STREAM_TIER_ARGS_SIZE (2 * sizeof(uint32_t))
+#define REQUEST_HELLO "HELLO"
+
+// Protocol versions, negotiated with a HELLO request (see as_server.h)
+#define PROTOCOL_VERSION_1 1    // 32-bit stream sizes, what a silent client speaks
+#define PROTOCOL_VERSION_2 2    // 64-bit stream sizes, optional chunked framing
+#define PROTOCOL_VERSION PROTOCOL_VERSION_2
+#define PROTOCOL_FEATURE_CHUNKED "chunked"
+#define PROTOCOL_FEATURE_IDS "ids"
+#define PROTOCOL_FEATURE_PIPELINE "pipeline"
+#define PROTOCOL_FEATURE_BATCH "batch"
+#define PROTOCOL_FEATURE_CHECKSUM "crc32c"
+#define PROTOCOL_FEATURE_TRAILER "trailer"
+#define PROTOCOL_FEATURE_PCM "lpc"
+#define PROTOCOL_FEATURE_TIERS "tiers"
+#define HELLO_MESSAGE_SIZE 64
+// Stream size announcing chunked framing instead of a known length
+#define STREAM_SIZE_CHUNKED UINT64_MAX
+// Stream size answering a STREAMIF whose copy is up to date, no data follows
+#define STREAM_SIZE_NOT_MODIFIED (UINT64_MAX - 1)
+// Stream size announcing a WAV file in lossless transport encoding (see as_pcm.h)
+#define STREAM_SIZE_ENCODED (UINT64_MAX - 2)
 
 #define RESPONSE_BUFFER_SIZE 4 * MAX_FILE_NAME
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define END_OF_MESSAGE_TOKEN "\r\n"
 
@@ -76,12 +127,26 @@
 **        relative to the library's path without a leading slash (heap-allocated).
 **        (e.g. "file1.wav", "artist/file2.wav", "artist/album/file3.wav", etc)
 ** num_files: number of files in the library, and the size of the files array.
+** generation: (server) number of scans so far that changed the files.
+** list_payload: (server) the LIST response for this generation, see as_library.h.
+** id_payload: (server) the same for clients using stable file IDs.
+** changes: (server) log of the latest changes to files, see as_library.h.
+** watch: (server) directory watcher keeping files up to date, see as_library.h.
+** store: (server) where the file names live, with each file's stable ID and
+**        the tables to find files by name or ID, see as_library.h. If set,
+**        the names in files are not heap-allocated one by one.
  */
 typedef struct library {
     char *name;
     const char *path;
     char **files;
     uint32_t num_files;
+    uint64_t generation;
+    struct list_payload *list_payload;
+    struct list_payload *id_payload;
+    struct library_log *changes;
+    struct library_watch *watch;
+    struct library_store *store;
 } Library;
 
 
@@ -122,4 +187,38 @@ int read_precisely(int fd, void *buf, size_t count);
 */
 int write_precisely(int fd, const void *buf, size_t count);
 
+/*
+** Same as write_precisely, but for a socket, with send(2) flags. MSG_MORE
+** holds the bytes back so they leave in the same segment as the data sent
+** right after them (e.g. a size header and the start of the body).
+**
+** Returns the number of bytes actually sent, or -1 on error.
+*/
+int send_precisely(int sockfd, const void *buf, size_t count, int flags);
+
+/*
+** Blocking zero-copy transfer of *exactly* count bytes from in_fd, starting at
+** offset, to out_fd using sendfile. The data never leaves the kernel, so no
+** user-space buffer is involved. Only returns when count bytes have been sent,
+** in_fd reaches EOF, or an error occurs.
+**
+** If sendfile is not supported for this pair of descriptors, -1 is returned
+** with errno set to EINVAL or ENOSYS and nothing has been sent, so the caller
+** can fall back to another transfer method. Any other failure, in particular
+** one after some bytes were sent, never leaves errno at EINVAL or ENOSYS:
+** the stream cannot be resumed then.
+**
+** Returns the number of bytes actually sent, or -1 on error.
+*/
+ssize_t sendfile_precisely(int out_fd, int in_fd, off_t offset, size_t count);
+
+/*
+** Same as sendfile_precisely, but moves the data with splice through an
+** intermediate pipe. Slower than sendfile, but works for more descriptor types.
+** Fails the same way.
+**
+** Returns the number of bytes actually sent, or -1 on error.
+*/
+ssize_t splice_precisely(int out_fd, int in_fd, off_t offset, size_t count);
+
 #endif // LIBAS_H_